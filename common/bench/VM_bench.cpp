@@ -0,0 +1,146 @@
+#include "VM_bench.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+
+atomic<uint64_t> allocations(0);
+
+// names are the benchmarks' own, but a quote or backslash would still
+// break the JSON
+string escaped(string const &text)
+{
+    string result;
+    for (char c : text)
+    {
+        if ('"' == c || '\\' == c)
+        {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+} // namespace
+
+// Counting every allocation of the benchmark binary; the library is built
+// without this file, so nothing else pays for it.
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void *memory = malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+uint64_t VM_bench_allocations()
+{
+    return allocations.load(memory_order_relaxed);
+}
+
+VM_bench::VM_bench(string const &suite, int argc, char **argv)
+    : suite(suite), min_ns(0.2e9), json(false), bad_options(false)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--json"))
+        {
+            json = true;
+        }
+        else if (0 == strncmp(argv[i], "--filter=", 9))
+        {
+            filter = argv[i] + 9;
+        }
+        else if (0 == strncmp(argv[i], "--min-time=", 11) && atof(argv[i] + 11) > 0)
+        {
+            min_ns = atof(argv[i] + 11) * 1e9;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--filter=TEXT] [--min-time=SECONDS] [--json]\n", argv[0]);
+            bad_options = true;
+            filter = "\n";    // matches nothing
+        }
+    }
+
+    if (!json && !bad_options)
+    {
+        printf("%-36s %12s %14s %12s %12s\n", "benchmark", "ns/op", "instr/s", "allocs/op", "iterations");
+    }
+}
+
+bool VM_bench::wanted(string const &name) const
+{
+    return string::npos != name.find(filter);
+}
+
+uint64_t VM_bench::next_iterations(uint64_t iterations, double ns) const
+{
+    // aim a little past the minimum, but grow at most tenfold at a time
+    const double scale = ns > 0 ? min(10.0, min_ns * 1.4 / ns) : 10.0;
+    return min(MAX_ITERATIONS, max(iterations + 1, (uint64_t)(iterations * scale)));
+}
+
+void VM_bench::add(result const &r)
+{
+    results.push_back(r);
+    if (!json)
+    {
+        printf("%-36s %12.1f %14.4g %12.2f %12llu\n", r.name.c_str(), r.ns / r.iterations,
+               r.instructions / (r.ns * 1e-9), (double)r.allocations / r.iterations,
+               (unsigned long long)r.iterations);
+        fflush(stdout);
+    }
+}
+
+int VM_bench::finish()
+{
+    if (json && !bad_options)
+    {
+        char date[32];
+        time_t now = time(nullptr);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        printf("{\n");
+        printf("  \"context\": {\"suite\": \"%s\", \"date\": \"%s\", \"num_cpus\": %u, "
+               "\"compiler\": \"%s\", \"min_time\": %g},\n",
+               escaped(suite).c_str(), date, thread::hardware_concurrency(), escaped(__VERSION__).c_str(),
+               min_ns * 1e-9);
+        printf("  \"benchmarks\": [\n");
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            result const &r = results[i];
+            printf("    {\"name\": \"%s\", \"iterations\": %llu, \"real_time\": %.2f, \"time_unit\": \"ns\", "
+                   "\"instructions_per_second\": %.6g, \"allocations_per_iteration\": %.3f}%s\n",
+                   escaped(r.name).c_str(), (unsigned long long)r.iterations, r.ns / r.iterations,
+                   r.instructions / (r.ns * 1e-9), (double)r.allocations / r.iterations,
+                   i + 1 < results.size() ? "," : "");
+        }
+        printf("  ]\n");
+        printf("}\n");
+    }
+    return bad_options ? 2 : 0;
+}
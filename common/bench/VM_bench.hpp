@@ -0,0 +1,92 @@
+#if !defined(VM_BENCH_HPP)
+#define VM_BENCH_HPP 1
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The harness the dogs' benchmarks share, after Google Benchmark.  A case
+// is a callable that does one operation and returns the VM instructions it
+// executed, or built for the builder cases.  Each case runs ever more
+// iterations until a batch of them takes the minimum time, and that batch
+// is reported as time per operation, instructions per second and heap
+// allocations per operation.
+//
+// Options:
+//   --filter=TEXT      only the cases whose names contain TEXT
+//   --min-time=SECS    the minimum time per case, 0.2 by default
+//   --json             JSON on stdout instead of a table, with one case
+//                      per line so that the output of two commits diffs
+
+// calls to operator new so far, counted by the replacement in VM_bench.cpp
+uint64_t VM_bench_allocations();
+
+class VM_bench
+{
+public:
+    // suite names the machine in the JSON
+    VM_bench(std::string const &suite, int argc, char **argv);
+
+    template <typename F>
+    void run(std::string const &name, F body);
+
+    // Writes the JSON if it was asked for.  The exit status for main: not
+    // zero when the options made no sense.
+    int finish();
+
+private:
+    static constexpr uint64_t MAX_ITERATIONS = 1000000000;
+
+    struct result
+    {
+        std::string name;
+        uint64_t iterations;
+        double ns;
+        uint64_t instructions;
+        uint64_t allocations;
+    };
+
+    std::string suite;
+    std::string filter;
+    double min_ns;
+    bool json;
+    bool bad_options;
+    std::vector<result> results;
+
+    bool wanted(std::string const &name) const;
+    uint64_t next_iterations(uint64_t iterations, double ns) const;
+    void add(result const &r);
+};
+
+template <typename F>
+void VM_bench::run(std::string const &name, F body)
+{
+    if (!wanted(name))
+    {
+        return;
+    }
+
+    for (uint64_t iterations = 1;;)
+    {
+        uint64_t instructions = 0;
+        const uint64_t allocations = VM_bench_allocations();
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            instructions += body();
+        }
+        const auto stop = std::chrono::steady_clock::now();
+        const uint64_t allocated = VM_bench_allocations() - allocations;
+
+        const double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        if (ns >= min_ns || iterations >= MAX_ITERATIONS)
+        {
+            add({name, iterations, ns, instructions, allocated});
+            return;
+        }
+        iterations = next_iterations(iterations, ns);
+    }
+}
+
+#endif
@@ -3,20 +3,42 @@
 
 #include <string>
 
+// Reasons a program can fail.  Executors only record one of these (plus,
+// for some errors, the name of the operation involved); the readable
+// message is built when somebody asks for it.
+
+enum class VM_error : unsigned char
+{
+    OK,
+    INVALID_PROGRAM,
+    INVALID_OPCODE,
+    MAX_RUNTIME,
+    NO_VALUE,
+    DIVISION_BY_ZERO,
+    STACK_OVERFLOW,
+    STACK_UNDERFLOW,
+    INDEX_OUT_OF_RANGE,
+    UNDEFINED_LABEL,
+    BRANCH_OUT_OF_RANGE
+};
+
 class VM_exec_status
 {
 public:
-    explicit VM_exec_status(int value);
-    explicit VM_exec_status(std::string const & msg);
+    explicit VM_exec_status(int value, unsigned int ticks = 0);
+    explicit VM_exec_status(VM_error error, const char *detail = nullptr, unsigned int ticks = 0);
 
     bool is_status_ok() const;
     int get_program_value() const;
-    const std::string &get_message() const;
+    VM_error get_error() const;
+    std::string get_message() const;
+    unsigned int get_ticks() const;
 
 private:
-    const bool is_ok;
-    const int value;
-    const std::string msg;
+    VM_error error;
+    int value;
+    const char *detail;
+    unsigned int ticks;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,76 @@
+#if !defined(VM_IMAGE_HPP)
+#define VM_IMAGE_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// On disk program images shared by the dogs.  A file is a fixed header
+// (magic, format version, byte order, machine, size and a checksum of
+// everything after the header), a table of sections and the sections
+// themselves, each starting on a 16 byte boundary.  Images are written in
+// the host's byte order and refused by hosts with another one.
+//
+// Images are opened by mapping the file read only, so a machine can run
+// its code section where it lies; nothing is parsed beyond the header,
+// the section table and the checksum.
+
+constexpr uint32_t VM_IMAGE_VERSION = 1;
+
+enum class VM_image_machine : uint32_t
+{
+    WHITEDOG = 1,
+    YELLOWDOG = 2,
+    GREENDOG = 3,
+};
+
+enum class VM_image_section : uint32_t
+{
+    CODE = 1,     // the program as the machine executes it
+    LABELS = 2,   // label names, pcs and unpatched jumps (yellowdog)
+    HEAP = 3,     // initial heap cells from address 0 (greendog)
+};
+
+class VM_image_writer
+{
+public:
+    explicit VM_image_writer(VM_image_machine machine);
+
+    void add(VM_image_section kind, void const *data, size_t size);
+    bool write(std::string const &path) const;
+
+private:
+    VM_image_machine machine;
+    std::vector<std::pair<VM_image_section, std::vector<unsigned char>>> sections;
+};
+
+class VM_image
+{
+public:
+    VM_image();
+    ~VM_image();
+
+    VM_image(VM_image const &) = delete;
+    VM_image &operator=(VM_image const &) = delete;
+
+    // false, leaving the image closed, unless path holds an intact image
+    // of this format version for machine
+    bool open(std::string const &path, VM_image_machine machine);
+    void close();
+    bool is_open() const;
+
+    // nullptr (and size 0) when the image has no such section
+    void const *section(VM_image_section kind, size_t &size) const;
+
+private:
+    unsigned char const *base;
+    size_t length;
+    bool mapped;
+    std::vector<unsigned char> buffer;   // where files cannot be mapped
+
+    bool check(VM_image_machine machine) const;
+};
+
+#endif
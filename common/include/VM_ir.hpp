@@ -0,0 +1,138 @@
+#if !defined(VM_IR_HPP)
+#define VM_IR_HPP 1
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A yellowdog or greendog program in static single assignment form, for
+// VM_ir_optimizer to work on.  VM_ir_builder makes one from either dog's
+// code and VM_ir_lowering turns one back into either dog's code.
+//
+// A program is a control flow graph of blocks.  Block 0 is the entry and
+// has no predecessors.  Each block holds a list of values, phis first,
+// and ends in a jump, a conditional branch or the return of the program's
+// result, which at most one block does.  Every value is defined once and
+// its definition dominates its uses; a phi has one argument for each of
+// its block's predecessors, in the same order.
+//
+// The result is what is left on top of a yellowdog stack, or in r0 of a
+// greendog machine.  Heap cells are only reached through LOAD and STORE,
+// whose addresses are constants, so two of them touch the same cell
+// exactly when their addresses are the same.  Arithmetic wraps, and DIV
+// traps where the divisor is 0 as the machines do.
+
+enum class VM_ir_op : unsigned char
+{
+    CONST,    // operand
+    PHI,
+    COPY,     // its argument
+    LOAD,     // heap cell operand
+    STORE,    // its argument to heap cell operand; no value
+    ADD,      // first argument op second
+    SUB,
+    MUL,
+    DIV,
+    CMP,      // -1, 0 or +1
+};
+
+// what a branch tests its value against 0 for
+enum class VM_ir_test : unsigned char
+{
+    EQ,
+    NE,
+    LT,
+    LE,
+    GT,
+    GE,
+};
+
+struct VM_ir_value
+{
+    VM_ir_op op;
+    int operand;
+    unsigned int block;
+    std::vector<unsigned int> args;
+};
+
+struct VM_ir_block
+{
+    enum exit_type
+    {
+        JUMP,      // to next[0]
+        BRANCH,    // to next[0] if value passes test, else to next[1]
+        RETURN,    // value
+    };
+
+    std::vector<unsigned int> code;
+    std::vector<unsigned int> preds;
+    exit_type exit = RETURN;
+    VM_ir_test test = VM_ir_test::EQ;
+    unsigned int value = 0;
+    unsigned int next[2] = {0, 0};
+};
+
+// A greendog instruction as its images hold it (see VM_instruction); the
+// IR library cannot include the machine's own headers.  Fields an opcode
+// does not use are 0.
+struct VM_ir_register_instruction
+{
+    unsigned char op;
+    unsigned char r1;
+    unsigned char r2;
+    unsigned char r3;
+    unsigned int addr;
+    unsigned int loc;
+};
+
+static_assert(sizeof(VM_ir_register_instruction) == 12, "VM_ir_register_instruction is a greendog image record");
+
+class VM_ir
+{
+public:
+    std::vector<VM_ir_value> values;    // by id, including ones since dropped
+    std::vector<VM_ir_block> blocks;
+
+    // the initial heap cells of a program read from a greendog image
+    std::vector<int> heap;
+
+    void clear();
+
+    unsigned int add_block();
+    // a new value defined in block, not yet placed in its code
+    unsigned int add_value(unsigned int block, VM_ir_op op, int operand = 0,
+                           std::vector<unsigned int> const &args = std::vector<unsigned int>());
+
+    static bool defines(VM_ir_op op);
+    bool uses_heap() const;
+
+    // the values in blocks other than phis, and the branches
+    unsigned int size() const;
+
+    std::vector<unsigned int> successors(unsigned int block) const;
+    // point the edge from block to next at to instead, as the same
+    // predecessor of to as block was of next
+    void redirect(unsigned int block, unsigned int next, unsigned int to);
+    // drop pred from block's predecessors and its phis' arguments
+    void remove_pred(unsigned int block, unsigned int pred);
+    // a new block on the edge from block to next, which only jumps there
+    unsigned int split(unsigned int block, unsigned int next);
+
+    // blocks in reverse postorder from the entry, taken branches searched
+    // first so that a block is followed by its not taken successor
+    std::vector<unsigned int> order() const;
+    // each block's immediate dominator, the entry its own
+    std::vector<unsigned int> dominators() const;
+    static bool dominates(std::vector<unsigned int> const &idom, unsigned int a, unsigned int b);
+
+    // for each block, which values are live on the way out of it,
+    // counting the arguments its successors' phis take from it
+    std::vector<std::vector<bool>> live_out() const;
+
+    // Whether the program keeps to the rules above; why not, if not.
+    bool check(std::string &why) const;
+
+    void print(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#if !defined(VM_IR_BUILDER_HPP)
+#define VM_IR_BUILDER_HPP 1
+
+#include <string>
+#include <vector>
+
+#include "VM_ir.hpp"
+
+// Reads a finished yellowdog or greendog program into a VM_ir.  Blocks
+// start at pc 0, wherever a jump lands and after every jump; a block of
+// its own before them is the entry, and one after them returns the
+// result.  Code no path reaches is left out.
+//
+// Each block starts with a phi for every stack slot it is entered with,
+// or for every register, and trivial ones are left for the optimizer to
+// remove.  A yellowdog program must reach each pc with the same stack
+// depth every time and never end with an empty stack, as for
+// VM_stack_translator; a greendog one must keep its registers and jumps
+// in range, as its verifier wants.  Its registers all start as 0.
+
+class VM_ir_builder
+{
+public:
+    // yellowdog bytecode, its jumps' labels already patched
+    bool build_stack(unsigned char const *code, unsigned int length, VM_ir &ir);
+    // greendog instructions
+    bool build_registers(VM_ir_register_instruction const *code, unsigned int length, VM_ir &ir);
+    // the code of either machine's image, and a greendog image's heap
+    bool build(std::string const &path, VM_ir &ir);
+
+    // False and ir cleared when the program is not one the IR can hold,
+    // with error() saying why.
+    std::string const &error() const;
+
+private:
+    std::string message;
+    // whether the result is the top of a stack rather than r0
+    bool stack;
+
+    // by pc: the block starting there, -1 elsewhere
+    std::vector<int> block_at;
+    // each block's phis, by stack slot or register
+    std::vector<std::vector<unsigned int>> slots;
+
+    bool fail(std::string const &what, unsigned int pc, VM_ir &ir);
+    void start(std::vector<bool> const &leaders, std::vector<int> const &entered, bool reaches_end, VM_ir &ir);
+    // the edge from block to the one at pc, carrying the slots in state
+    void edge(unsigned int block, unsigned int pc, std::vector<unsigned int> const &state, VM_ir &ir);
+};
+
+#endif
@@ -0,0 +1,146 @@
+#if !defined(VM_IR_LOWERING_HPP)
+#define VM_IR_LOWERING_HPP 1
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "VM_image.hpp"
+#include "VM_ir.hpp"
+
+// Turns a VM_ir back into yellowdog bytecode or greendog instructions.
+// Blocks are laid out in reverse postorder, the returning block last, so
+// that it can fall off the end; a jump to the block that follows is left
+// out, and a branch whose taken block follows is turned round.
+//
+// On yellowdog each block is entered with its live values in a fixed
+// order on the stack, set by the first jump to it that is laid out.
+// Constants are pushed where they are used.  An operand is used where it
+// lies if it is on top and not needed again, and copied up with DUPN
+// otherwise; a value is dropped as soon as nothing needs it.  A jump
+// rearranges the stack into the order its target wants with DUPN, DROPN
+// or SWAP.  Branches never need that: an edge from a branch to a block
+// with another way in gets a block of its own.
+//
+// On greendog values get registers by colouring in dominator tree order,
+// which needs no more registers than are ever live at once.  r31 is kept
+// at 0 and never written, so 0 is always there and a copy is one ADD.
+// Other constants are loaded from heap cells from a base address given,
+// as are values that do not fit in r0 to r28 when too many are live;
+// r29 and r30 are then kept for moving those.  A phi's argument is
+// copied into place on the jump to its block, breaking any cycle of
+// copies through a free register or a heap cell.  The result is left in
+// r0.
+
+class VM_ir_lowering
+{
+public:
+    // yellowdog bytecode; false if the program uses the heap, which
+    // yellowdog does not have
+    bool lower_stack(VM_ir const &ir, std::vector<unsigned char> &code);
+    // greendog instructions, with heap cells from base on as above
+    bool lower_registers(VM_ir const &ir, std::vector<VM_ir_register_instruction> &code, unsigned int base = 0);
+    // either as an image for machine; a greendog image holds ir.heap with
+    // the cells for constants set
+    bool write(VM_ir const &ir, VM_image_machine machine, std::string const &path, unsigned int base = 0);
+
+    std::string const &error() const;
+
+    // of the last lower_registers: how many heap cells from base it uses,
+    // how many values live in them and the constants, by address
+    unsigned int cells() const;
+    unsigned int spilled() const;
+    std::vector<std::pair<unsigned int, int>> constants() const;
+
+private:
+    struct instruction
+    {
+        unsigned char op;
+        unsigned int r1;
+        unsigned int r2;
+        unsigned int r3;
+        unsigned int addr;
+        int label;    // jumps only: a block
+    };
+
+    // where a value is, or goes, on greendog
+    struct location
+    {
+        enum kind_type
+        {
+            REG,
+            CELL,
+        };
+
+        kind_type kind;
+        unsigned int index;
+
+        bool operator==(location const &other) const;
+    };
+
+    std::string message;
+
+    // the program being lowered, with its edges split, and its blocks in
+    // the order they are laid out
+    VM_ir ir;
+    std::vector<unsigned int> layout;
+    std::vector<std::vector<bool>> live_out;
+    std::vector<std::vector<bool>> live_in;
+
+    // yellowdog: the bytecode, each block's position and order of values
+    // on entry, jumps to patch and the stack as it is now
+    std::vector<unsigned char> bytes;
+    std::vector<int> position;
+    std::vector<std::vector<unsigned int>> entry;
+    std::vector<bool> entered;
+    std::vector<std::pair<unsigned int, unsigned int>> patches;
+    std::vector<unsigned int> stack;
+
+    // greendog: the registers given out, each value's register (-1 for
+    // none) and cell, and the code so far
+    unsigned int registers;
+    std::vector<int> colour;
+    std::vector<bool> spill;
+    unsigned int base;
+    unsigned int next_cell;
+    std::map<int, unsigned int> constant_cells;
+    std::map<unsigned int, unsigned int> spill_cells;
+    int swap_cell;
+    int spare;    // a register no value gets, -1 if there is none
+    std::vector<instruction> code;
+
+    bool prepare(VM_ir const &source, bool stack_machine);
+    void liveness();
+    // which arguments of each value in block are not needed after it, and
+    // whether the value itself is needed at all
+    void deaths(unsigned int block, std::vector<std::vector<unsigned int>> &dying, std::vector<bool> &unused) const;
+
+    // yellowdog
+    void emit_stack(unsigned char op);
+    void emit_stack(unsigned char op, int operand);
+    unsigned int depth(unsigned int v) const;
+    void drop(unsigned int v);
+    void fetch(unsigned int v, bool take);
+    void binary(VM_ir_op op, unsigned int a, unsigned int b, bool a_dies, bool b_dies);
+    void jump_stack(unsigned int block, unsigned int next);
+    void shuffle(std::vector<unsigned int> const &sources);
+
+    // greendog
+    bool allocatable(unsigned int v) const;
+    unsigned int pressure(std::vector<unsigned int> &worst) const;
+    bool colour_values();
+    unsigned int constant_cell(int value);
+    unsigned int spill_cell(unsigned int v);
+    unsigned int swap_space();
+    location where(unsigned int v);
+    void emit(unsigned char op, unsigned int r1, unsigned int r2 = 0, unsigned int r3 = 0, unsigned int addr = 0,
+              int label = -1);
+    unsigned int use(unsigned int v, unsigned int scratch);
+    unsigned int define(unsigned int v) const;
+    void defined(unsigned int v);
+    void move(location const &to, location const &from);
+    void jump_registers(unsigned int block, unsigned int next);
+};
+
+#endif
@@ -0,0 +1,80 @@
+#if !defined(VM_IR_OPTIMIZER_HPP)
+#define VM_IR_OPTIMIZER_HPP 1
+
+#include <ostream>
+#include <vector>
+
+#include "VM_ir.hpp"
+
+// What one VM_ir_optimizer::optimize did to a program.
+
+struct VM_ir_stats
+{
+    unsigned int instructions_before = 0;
+    unsigned int instructions_after = 0;
+
+    unsigned int dead_values = 0;       // values nothing needs
+    unsigned int dead_blocks = 0;       // blocks no path reaches, or merged
+    unsigned int copies = 0;            // copies and phis of one value
+    unsigned int common = 0;            // values computed before
+    unsigned int hoisted = 0;           // values moved out of loops
+    unsigned int reduced = 0;           // cheaper arithmetic, or constants
+
+    void report(std::ostream &out) const;
+};
+
+// Passes over a VM_ir.  optimize repeats them all until none changes the
+// program:
+//
+// - reduce_strength folds arithmetic on constants, wrapping as the
+//   machines do, and turns x + 0, x - 0, x * 1 and x / 1 into copies,
+//   x * 0, x - x and x CMP x into 0, x * 2 into x + x and x * -1 into
+//   0 - x; the dogs have no shifts, so a MUL by a larger power of two
+//   stays what it is
+// - propagate_copies replaces copies, and phis whose arguments are all
+//   one value, with that value
+// - eliminate_common_subexpressions replaces a value with an equal one
+//   that dominates it, and a LOAD with what its cell last held in the
+//   same block
+// - eliminate_dead_code decides branches on constants, drops blocks no
+//   path reaches, merges a block into the one that alone jumps to it,
+//   skips blocks that only jump on and drops values nothing needs
+// - hoist_loop_invariants moves values computed from values outside a
+//   loop to a block before it
+//
+// STOREs stay where they are.  A DIV that may trap, whose divisor is not a
+// constant other than 0 and -1, is never dropped or moved into a path
+// that did not run it, so a program traps where it did, with the same
+// heap; only how many ticks it takes changes.  Each pass returns whether
+// it changed the program.
+
+class VM_ir_optimizer
+{
+public:
+    void optimize(VM_ir &ir, VM_ir_stats *stats = nullptr);
+
+    bool reduce_strength(VM_ir &ir);
+    bool propagate_copies(VM_ir &ir);
+    bool eliminate_common_subexpressions(VM_ir &ir);
+    bool eliminate_dead_code(VM_ir &ir);
+    bool hoist_loop_invariants(VM_ir &ir);
+
+private:
+    VM_ir_stats counts;
+
+    // point every use of a value at forward[value], following chains, and
+    // drop the values that were forwarded from their blocks
+    void forward_uses(VM_ir &ir, std::vector<unsigned int> &forward);
+    bool fold_branches(VM_ir &ir);
+    bool drop_unreachable(VM_ir &ir);
+    bool merge_blocks(VM_ir &ir);
+    bool skip_jumps(VM_ir &ir);
+    bool drop_dead_values(VM_ir &ir);
+    // keep only the blocks marked, numbering them afresh
+    void renumber(VM_ir &ir, std::vector<bool> const &keep);
+    // a block outside the loop that only jumps to its header and is the
+    // header's one way in from outside, made if there is none
+    unsigned int preheader(VM_ir &ir, unsigned int header, std::vector<bool> const &loop);
+};
+
+#endif
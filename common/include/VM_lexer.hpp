@@ -0,0 +1,74 @@
+#if !defined(VM_LEXER_HPP)
+#define VM_LEXER_HPP 1
+
+#include <cstdint>
+#include <string_view>
+
+// The tokens of the dogs' assembly languages.  Every dog writes one
+// instruction or label per line; `;` and `#` start a comment that runs to
+// the end of the line.  The lexer walks a buffer it does not own and
+// hands out views into it, so it never allocates: a source can be lexed
+// whole, or a line at a time as it is read.
+
+enum class VM_token_kind
+{
+    WORD,      // a letter, `_` or `.` followed by letters, digits, `_` and `.`
+    NUMBER,    // decimal with an optional sign, or hex with a 0x prefix
+    COLON,
+    COMMA,
+    NEWLINE,
+    END,
+    BAD,       // anything else; text is the offending character
+};
+
+struct VM_token
+{
+    VM_token_kind kind;
+    std::string_view text;
+    uint64_t key;            // WORD: VM_word_key(text)
+    long long number;        // NUMBER: its value, or VM_lexer::HUGE_NUMBER
+    unsigned int line;
+};
+
+// Up to eight characters of a word upper-cased and packed into an integer,
+// so that mnemonics are matched with one comparison; 0 for longer words.
+constexpr uint64_t VM_word_key(std::string_view word)
+{
+    if (word.size() > 8)
+    {
+        return 0;
+    }
+
+    uint64_t key = 0;
+    for (char c : word)
+    {
+        if (c >= 'a' && c <= 'z')
+        {
+            c = c - 'a' + 'A';
+        }
+        key = (key << 8) | (unsigned char)c;
+    }
+    return key;
+}
+
+class VM_lexer
+{
+public:
+    // any number whose magnitude does not fit in 32 bits
+    static constexpr long long HUGE_NUMBER = 1ll << 40;
+
+    // line is the number of the first line of source
+    explicit VM_lexer(std::string_view source, unsigned int line = 1);
+
+    VM_token next();
+
+private:
+    char const *at;
+    char const *end;
+    unsigned int line;
+
+    VM_token token(VM_token_kind kind, char const *from);
+    VM_token number(char const *from);
+};
+
+#endif
@@ -0,0 +1,65 @@
+#if !defined(VM_PROFILE_HPP)
+#define VM_PROFILE_HPP 1
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// What the profiling interpreters of the dogs count.  One profile belongs
+// to one program; runs are added to it until it is cleared.
+//
+// Counts are exact: every instruction bumps its pc and its opcode, and
+// conditional jumps count the times they jump.  Time is sampled: about
+// one straight line run in SAMPLE_PERIOD, picked at random so samples do
+// not fall in step with a loop, is timed with the cycle counter (a
+// nanosecond clock where there is none) and charged as many times over as
+// the runs it stands for.  Reading the clock on every run would cost more
+// than everything else put together.
+
+struct VM_profile
+{
+    struct instruction
+    {
+        std::string text;    // as the disassembler writes it
+        bool jump;           // ends a straight line run
+        bool conditional;    // a jump that is not always taken
+    };
+
+    static constexpr unsigned int SAMPLE_PERIOD = 32;
+
+    uint64_t executions = 0;
+    uint64_t ops[256] = {};
+
+    // by pc; listing[pc].text is empty where no instruction starts
+    std::vector<instruction> listing;
+    std::vector<uint64_t> hits;
+    std::vector<uint64_t> taken;
+    std::vector<uint64_t> time;     // clock ticks in the run starting at pc
+    std::vector<std::string> names; // by opcode
+
+    // runs to go before the next sample; carried over between executions
+    unsigned int countdown = 1;
+    uint32_t seed = 2463534242u;
+
+    // runs until the sample after this one, 1 to 2 * SAMPLE_PERIOD - 1
+    unsigned int next_interval();
+    // whether the profile is set up for a program of length pcs
+    bool fits(unsigned int length) const;
+    void prepare(unsigned int length);
+    void clear();
+
+    static uint64_t clock();
+
+    // Totals by opcode, then the instructions by hits with their branch
+    // ratios, then the runs by time.
+    void report(std::ostream &out) const;
+
+    // Folded stacks for flamegraph.pl and compatible tools: one line per
+    // instruction of each run, `program;<first instruction>;<instruction>
+    // <ticks>`, with the run's time split evenly between its instructions
+    // (each runs once per entry to the run).
+    void folded(std::ostream &out, std::string const &program = "vm") const;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#if !defined(VM_THREAD_POOL_HPP)
+#define VM_THREAD_POOL_HPP 1
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that all run the same task together.
+// run() calls task(worker) once on every worker and returns when they
+// have all finished, so callers share out the work themselves (usually
+// by handing out indices from an atomic counter).  One run at a time.
+
+class VM_thread_pool
+{
+public:
+    // threads == 0 means one per hardware thread
+    explicit VM_thread_pool(unsigned int threads = 0);
+    ~VM_thread_pool();
+
+    VM_thread_pool(VM_thread_pool const &) = delete;
+    VM_thread_pool &operator=(VM_thread_pool const &) = delete;
+
+    static unsigned int hardware_threads();
+
+    unsigned int size() const;
+    void run(std::function<void(unsigned int)> const &task);
+
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable finished;
+    std::function<void(unsigned int)> const *task;
+    unsigned long generation;
+    unsigned int busy;
+    bool stopping;
+
+    void work(unsigned int worker);
+};
+
+#endif
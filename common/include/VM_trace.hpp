@@ -0,0 +1,76 @@
+#if !defined(VM_TRACE_HPP)
+#define VM_TRACE_HPP 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A flight recorder for the dogs' interpreters.  Each instruction is
+// recorded, before it runs, as a fixed size binary record in a ring that
+// keeps the last capacity() of them, so tracing can stay on for long runs
+// and the tail be written out when something goes wrong.  Turning records
+// into text is left to each dog's VM_write_trace, which needs nothing but
+// the records: no program, no machine.
+//
+// One thread records; any thread may take a snapshot while it does.  The
+// recorder publishes each record by bumping a counter, and a snapshot
+// drops whatever the recorder may have overwritten while it was copying.
+// The ring has one slot more than it keeps, for the record being written.
+
+struct VM_trace_record
+{
+    uint32_t pc;
+    uint32_t tick;         // counting this instruction, from 1
+    uint8_t op;
+    uint8_t registers[3];  // greendog: r1, r2 and r3
+    int32_t operand;       // yellowdog: the value after op; greendog: addr or loc
+    uint32_t depth;        // yellowdog: the stack pointer
+    int32_t values[3];     // yellowdog: the top of the stack, top first;
+                           // greendog: the values the instruction uses
+};
+
+static_assert(sizeof(VM_trace_record) == 32, "records are meant to pack two to a cache line");
+
+class VM_trace
+{
+public:
+    // keeps at least capacity records: the ring is the next power of two
+    explicit VM_trace(size_t capacity = 4095);
+
+    VM_trace(VM_trace const &) = delete;
+    VM_trace &operator=(VM_trace const &) = delete;
+
+    // The recorder fills in the claimed record where it lies, rather than
+    // building one and copying it, then publishes it.
+    VM_trace_record &claim()
+    {
+        return records[head.load(std::memory_order_relaxed) & mask];
+    }
+    void publish()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    void record(VM_trace_record const &r)
+    {
+        claim() = r;
+        publish();
+    }
+
+    // the most records a snapshot returns
+    size_t capacity() const;
+    // records ever made, including those overwritten since
+    uint64_t recorded() const;
+    void clear();
+
+    // up to the last count records, oldest first
+    std::vector<VM_trace_record> last(size_t count) const;
+
+private:
+    std::unique_ptr<VM_trace_record[]> records;
+    size_t mask;
+    std::atomic<uint64_t> head;
+};
+
+#endif
@@ -0,0 +1,488 @@
+#include "VM_ir.hpp"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+
+char const *const OP_NAMES[] = {"const", "phi", "copy", "load", "store", "add", "sub", "mul", "div", "cmp"};
+char const *const TEST_NAMES[] = {"eq", "ne", "lt", "le", "gt", "ge"};
+
+} // namespace
+
+void VM_ir::clear()
+{
+    values.clear();
+    blocks.clear();
+    heap.clear();
+}
+
+unsigned int VM_ir::add_block()
+{
+    blocks.push_back(VM_ir_block());
+    return (unsigned int)blocks.size() - 1;
+}
+
+unsigned int VM_ir::add_value(unsigned int block, VM_ir_op op, int operand, std::vector<unsigned int> const &args)
+{
+    values.push_back({op, operand, block, args});
+    return (unsigned int)values.size() - 1;
+}
+
+bool VM_ir::defines(VM_ir_op op)
+{
+    return VM_ir_op::STORE != op;
+}
+
+bool VM_ir::uses_heap() const
+{
+    for (VM_ir_block const &block : blocks)
+    {
+        for (unsigned int v : block.code)
+        {
+            if (VM_ir_op::LOAD == values[v].op || VM_ir_op::STORE == values[v].op)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+unsigned int VM_ir::size() const
+{
+    unsigned int count = 0;
+    for (VM_ir_block const &block : blocks)
+    {
+        for (unsigned int v : block.code)
+        {
+            count += VM_ir_op::PHI != values[v].op;
+        }
+        count += VM_ir_block::BRANCH == block.exit;
+    }
+    return count;
+}
+
+std::vector<unsigned int> VM_ir::successors(unsigned int block) const
+{
+    VM_ir_block const &b = blocks[block];
+    switch (b.exit)
+    {
+    case VM_ir_block::JUMP:
+        return {b.next[0]};
+    case VM_ir_block::BRANCH:
+        return {b.next[0], b.next[1]};
+    case VM_ir_block::RETURN:
+        break;
+    }
+    return {};
+}
+
+void VM_ir::redirect(unsigned int block, unsigned int next, unsigned int to)
+{
+    VM_ir_block &b = blocks[block];
+    for (unsigned int &n : b.next)
+    {
+        if (n == next)
+        {
+            n = to;
+        }
+    }
+    for (unsigned int &pred : blocks[next].preds)
+    {
+        if (pred == block)
+        {
+            // the phis of next keep their arguments for this edge
+            blocks[to].preds.push_back(block);
+            pred = to;
+            return;
+        }
+    }
+}
+
+void VM_ir::remove_pred(unsigned int block, unsigned int pred)
+{
+    VM_ir_block &b = blocks[block];
+    const size_t index = find(b.preds.begin(), b.preds.end(), pred) - b.preds.begin();
+    if (index == b.preds.size())
+    {
+        return;
+    }
+    b.preds.erase(b.preds.begin() + index);
+    for (unsigned int v : b.code)
+    {
+        if (VM_ir_op::PHI == values[v].op)
+        {
+            values[v].args.erase(values[v].args.begin() + index);
+        }
+    }
+}
+
+unsigned int VM_ir::split(unsigned int block, unsigned int next)
+{
+    const unsigned int middle = add_block();
+    blocks[middle].exit = VM_ir_block::JUMP;
+    blocks[middle].next[0] = next;
+    for (unsigned int &n : blocks[block].next)
+    {
+        if (n == next)
+        {
+            n = middle;
+        }
+    }
+    replace(blocks[next].preds.begin(), blocks[next].preds.end(), block, middle);
+    blocks[middle].preds.push_back(block);
+    return middle;
+}
+
+std::vector<unsigned int> VM_ir::order() const
+{
+    vector<unsigned int> post;
+    if (blocks.empty())
+    {
+        return post;
+    }
+
+    vector<bool> seen(blocks.size(), false);
+    vector<pair<unsigned int, unsigned int>> path = {{0, 0}};
+    seen[0] = true;
+    while (!path.empty())
+    {
+        const unsigned int block = path.back().first;
+        const vector<unsigned int> next = successors(block);
+        if (path.back().second < next.size())
+        {
+            const unsigned int to = next[path.back().second++];
+            if (!seen[to])
+            {
+                seen[to] = true;
+                path.push_back({to, 0});
+            }
+        }
+        else
+        {
+            post.push_back(block);
+            path.pop_back();
+        }
+    }
+
+    reverse(post.begin(), post.end());
+    return post;
+}
+
+// Cooper, Harvey and Kennedy's iteration over reverse postorder
+std::vector<unsigned int> VM_ir::dominators() const
+{
+    const vector<unsigned int> rpo = order();
+    vector<unsigned int> index(blocks.size(), 0);
+    for (unsigned int i = 0; i < rpo.size(); ++i)
+    {
+        index[rpo[i]] = i;
+    }
+
+    vector<int> idom(blocks.size(), -1);
+    if (blocks.empty())
+    {
+        return vector<unsigned int>();
+    }
+    idom[0] = 0;
+
+    auto intersect = [&](unsigned int a, unsigned int b) {
+        while (a != b)
+        {
+            while (index[a] > index[b])
+            {
+                a = (unsigned int)idom[a];
+            }
+            while (index[b] > index[a])
+            {
+                b = (unsigned int)idom[b];
+            }
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (unsigned int i = 1; i < rpo.size(); ++i)
+        {
+            int dom = -1;
+            for (unsigned int pred : blocks[rpo[i]].preds)
+            {
+                if (idom[pred] >= 0)
+                {
+                    dom = dom < 0 ? (int)pred : (int)intersect(pred, (unsigned int)dom);
+                }
+            }
+            if (idom[rpo[i]] != dom)
+            {
+                idom[rpo[i]] = dom;
+                changed = true;
+            }
+        }
+    }
+
+    vector<unsigned int> result(blocks.size(), 0);
+    for (unsigned int block = 0; block < blocks.size(); ++block)
+    {
+        result[block] = idom[block] < 0 ? 0 : (unsigned int)idom[block];
+    }
+    return result;
+}
+
+bool VM_ir::dominates(std::vector<unsigned int> const &idom, unsigned int a, unsigned int b)
+{
+    while (b != a && b != idom[b])
+    {
+        b = idom[b];
+    }
+    return b == a;
+}
+
+std::vector<std::vector<bool>> VM_ir::live_out() const
+{
+    const size_t count = values.size();
+    vector<vector<bool>> out(blocks.size(), vector<bool>(count, false));
+    vector<vector<bool>> in(blocks.size(), vector<bool>(count, false));
+
+    vector<unsigned int> post = order();
+    reverse(post.begin(), post.end());
+
+    bool changed = true;
+    bool first = true;
+    while (changed)
+    {
+        changed = false;
+        for (unsigned int block : post)
+        {
+            VM_ir_block const &b = blocks[block];
+            vector<bool> live(count, false);
+            for (unsigned int next : successors(block))
+            {
+                VM_ir_block const &n = blocks[next];
+                const size_t index = find(n.preds.begin(), n.preds.end(), block) - n.preds.begin();
+                for (size_t v = 0; v < count; ++v)
+                {
+                    live[v] = live[v] || in[next][v];
+                }
+                for (unsigned int v : n.code)
+                {
+                    if (VM_ir_op::PHI == values[v].op)
+                    {
+                        live[values[v].args[index]] = true;
+                    }
+                }
+            }
+            if (!first && live == out[block])
+            {
+                continue;
+            }
+            out[block] = live;
+
+            if (VM_ir_block::RETURN == b.exit || VM_ir_block::BRANCH == b.exit)
+            {
+                live[b.value] = true;
+            }
+            for (size_t i = b.code.size(); i-- > 0;)
+            {
+                VM_ir_value const &value = values[b.code[i]];
+                live[b.code[i]] = false;
+                if (VM_ir_op::PHI != value.op)
+                {
+                    for (unsigned int arg : value.args)
+                    {
+                        live[arg] = true;
+                    }
+                }
+            }
+            in[block] = live;
+            changed = true;
+        }
+        first = false;
+    }
+
+    return out;
+}
+
+bool VM_ir::check(std::string &why) const
+{
+    auto fail = [&why](std::string const &what) {
+        why = what;
+        return false;
+    };
+
+    if (blocks.empty())
+    {
+        return fail("No blocks");
+    }
+    if (!blocks[0].preds.empty())
+    {
+        return fail("The entry block has predecessors");
+    }
+    if (order().size() != blocks.size())
+    {
+        return fail("Unreachable blocks");
+    }
+
+    // where each value is placed
+    vector<int> placed(values.size(), -1);
+    vector<unsigned int> position(values.size(), 0);
+    unsigned int returns = 0;
+    for (unsigned int block = 0; block < blocks.size(); ++block)
+    {
+        VM_ir_block const &b = blocks[block];
+        const string name = "b" + to_string(block);
+
+        for (unsigned int next : successors(block))
+        {
+            if (next >= blocks.size())
+            {
+                return fail(name + " goes to a block that is not there");
+            }
+            if (1 != count(blocks[next].preds.begin(), blocks[next].preds.end(), block))
+            {
+                return fail(name + " is not a predecessor of b" + to_string(next) + " once");
+            }
+        }
+        for (unsigned int pred : b.preds)
+        {
+            const vector<unsigned int> next = successors(pred);
+            if (find(next.begin(), next.end(), block) == next.end())
+            {
+                return fail("b" + to_string(pred) + " is not a predecessor of " + name);
+            }
+        }
+        if (VM_ir_block::BRANCH == b.exit && b.next[0] == b.next[1])
+        {
+            return fail(name + " branches both ways to one block");
+        }
+        returns += VM_ir_block::RETURN == b.exit;
+
+        bool phis = true;
+        for (unsigned int i = 0; i < b.code.size(); ++i)
+        {
+            const unsigned int v = b.code[i];
+            if (v >= values.size() || placed[v] >= 0)
+            {
+                return fail(name + " holds a value twice or one that is not there");
+            }
+            if (values[v].block != block)
+            {
+                return fail("v" + to_string(v) + " is not in its own block");
+            }
+            placed[v] = (int)block;
+            position[v] = i;
+
+            const bool phi = VM_ir_op::PHI == values[v].op;
+            if (phi && !phis)
+            {
+                return fail("v" + to_string(v) + " is a phi after other values");
+            }
+            phis = phis && phi;
+            if (phi && values[v].args.size() != b.preds.size())
+            {
+                return fail("v" + to_string(v) + " has the wrong number of arguments");
+            }
+        }
+    }
+    if (returns > 1)
+    {
+        return fail("More than one block returns");
+    }
+
+    const vector<unsigned int> idom = dominators();
+    auto available = [&](unsigned int arg, unsigned int block, unsigned int at) {
+        if (arg >= values.size() || placed[arg] < 0 || !defines(values[arg].op))
+        {
+            return false;
+        }
+        const unsigned int from = (unsigned int)placed[arg];
+        return from == block ? position[arg] < at : dominates(idom, from, block);
+    };
+
+    for (unsigned int block = 0; block < blocks.size(); ++block)
+    {
+        VM_ir_block const &b = blocks[block];
+        for (unsigned int i = 0; i < b.code.size(); ++i)
+        {
+            VM_ir_value const &value = values[b.code[i]];
+            for (unsigned int k = 0; k < value.args.size(); ++k)
+            {
+                const bool ok = VM_ir_op::PHI == value.op
+                                    ? available(value.args[k], b.preds[k], (unsigned int)blocks[b.preds[k]].code.size())
+                                    : available(value.args[k], block, i);
+                if (!ok)
+                {
+                    return fail("v" + to_string(b.code[i]) + " uses a value that does not reach it");
+                }
+            }
+        }
+        if (VM_ir_block::JUMP != b.exit && !available(b.value, block, (unsigned int)b.code.size()))
+        {
+            return fail("b" + to_string(block) + " exits on a value that does not reach it");
+        }
+    }
+
+    return true;
+}
+
+void VM_ir::print(std::ostream &out) const
+{
+    for (unsigned int block = 0; block < blocks.size(); ++block)
+    {
+        VM_ir_block const &b = blocks[block];
+        out << "b" << block << ":";
+        if (!b.preds.empty())
+        {
+            out << "\t\t; from";
+            for (unsigned int pred : b.preds)
+            {
+                out << " b" << pred;
+            }
+        }
+        out << "\n";
+
+        for (unsigned int v : b.code)
+        {
+            VM_ir_value const &value = values[v];
+            out << "    ";
+            if (defines(value.op))
+            {
+                out << "v" << v << " = ";
+            }
+            out << OP_NAMES[(int)value.op];
+            for (unsigned int arg : value.args)
+            {
+                out << " v" << arg;
+            }
+            if (VM_ir_op::CONST == value.op)
+            {
+                out << " " << value.operand;
+            }
+            else if (VM_ir_op::LOAD == value.op || VM_ir_op::STORE == value.op)
+            {
+                out << " @" << value.operand;
+            }
+            out << "\n";
+        }
+
+        switch (b.exit)
+        {
+        case VM_ir_block::JUMP:
+            out << "    jump b" << b.next[0] << "\n";
+            break;
+        case VM_ir_block::BRANCH:
+            out << "    branch " << TEST_NAMES[(int)b.test] << " v" << b.value << " b" << b.next[0] << " b" << b.next[1]
+                << "\n";
+            break;
+        case VM_ir_block::RETURN:
+            out << "    return v" << b.value << "\n";
+            break;
+        }
+    }
+}
@@ -0,0 +1,535 @@
+#include "VM_ir_builder.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "VM_image.hpp"
+
+using namespace std;
+
+namespace
+{
+
+// The dogs' opcodes.  Arithmetic, CMP and the jumps have the same numbers
+// on both; yellowdog has the stack operations and greendog LOAD and
+// STORE in the numbers below them.
+constexpr unsigned char PUSH = 1;
+constexpr unsigned char POP = 2;
+constexpr unsigned char DUP = 3;
+constexpr unsigned char DUPN = 4;
+constexpr unsigned char SWAP = 5;
+constexpr unsigned char DROPN = 18;
+
+constexpr unsigned char LOAD = 1;
+constexpr unsigned char STORE = 2;
+
+constexpr unsigned char ADD = 6;
+constexpr unsigned char CMP = 10;
+constexpr unsigned char JMP = 11;
+constexpr unsigned char JEQ = 12;
+constexpr unsigned char JGE = 17;
+
+constexpr unsigned int STACK_LIMIT = 1024;
+constexpr unsigned int REGISTERS = 32;
+
+bool is_jump(unsigned char op)
+{
+    return op >= JMP && op <= JGE;
+}
+
+bool has_operand(unsigned char op)
+{
+    return PUSH == op || DUPN == op || DROPN == op || is_jump(op);
+}
+
+unsigned int size_of(unsigned char op)
+{
+    return has_operand(op) ? 1 + sizeof(int) : 1;
+}
+
+VM_ir_op arithmetic(unsigned char op)
+{
+    return (VM_ir_op)((int)VM_ir_op::ADD + (op - ADD));
+}
+
+VM_ir_test test(unsigned char op)
+{
+    return (VM_ir_test)(op - JEQ);
+}
+
+} // namespace
+
+std::string const &VM_ir_builder::error() const
+{
+    return message;
+}
+
+bool VM_ir_builder::fail(std::string const &what, unsigned int pc, VM_ir &ir)
+{
+    message = what + " at " + to_string(pc);
+    ir.clear();
+    return false;
+}
+
+// The entry block, a block for each leader entered with entered[pc] slots
+// and the exit, each with its phis.
+void VM_ir_builder::start(std::vector<bool> const &leaders, std::vector<int> const &entered, bool reaches_end,
+                          VM_ir &ir)
+{
+    const unsigned int length = (unsigned int)leaders.size() - 1;
+    block_at.assign(length + 1, -1);
+    slots.clear();
+
+    ir.add_block();
+    ir.blocks[0].exit = VM_ir_block::JUMP;
+    slots.emplace_back();
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        if (leaders[pc] && entered[pc] >= 0)
+        {
+            block_at[pc] = (int)ir.add_block();
+            slots.emplace_back();
+        }
+    }
+    if (reaches_end)
+    {
+        block_at[length] = (int)ir.add_block();
+        slots.emplace_back();
+    }
+
+    for (unsigned int pc = 0; pc <= length; ++pc)
+    {
+        if (block_at[pc] < 0)
+        {
+            continue;
+        }
+        const unsigned int block = (unsigned int)block_at[pc];
+        const int count = pc == length ? 1 : entered[pc];
+        for (int slot = 0; slot < count; ++slot)
+        {
+            const unsigned int phi = ir.add_value(block, VM_ir_op::PHI);
+            ir.blocks[block].code.push_back(phi);
+            slots[block].push_back(phi);
+        }
+        if (pc == length)
+        {
+            ir.blocks[block].value = slots[block][0];
+        }
+    }
+}
+
+void VM_ir_builder::edge(unsigned int block, unsigned int pc, std::vector<unsigned int> const &state, VM_ir &ir)
+{
+    const unsigned int next = (unsigned int)block_at[pc];
+    ir.blocks[next].preds.push_back(block);
+
+    // the exit only takes the result
+    if (pc + 1 == block_at.size())
+    {
+        ir.values[slots[next][0]].args.push_back(stack ? state.back() : state[0]);
+    }
+    else
+    {
+        for (unsigned int slot = 0; slot < slots[next].size(); ++slot)
+        {
+            ir.values[slots[next][slot]].args.push_back(state[slot]);
+        }
+    }
+
+    VM_ir_block &b = ir.blocks[block];
+    b.next[VM_ir_block::BRANCH == b.exit && b.next[0] != next ? 1 : 0] = next;
+}
+
+bool VM_ir_builder::build_stack(unsigned char const *code, unsigned int length, VM_ir &ir)
+{
+    message.clear();
+    ir.clear();
+    stack = true;
+
+    vector<bool> starts(length + 1, false);
+    for (unsigned int pc = 0; pc < length; pc += size_of(code[pc]))
+    {
+        if (code[pc] < PUSH || code[pc] > DROPN)
+        {
+            return fail("Invalid opcode", pc, ir);
+        }
+        if (has_operand(code[pc]) && length - pc - 1 < sizeof(int))
+        {
+            return fail("Missing operand", pc, ir);
+        }
+        starts[pc] = true;
+    }
+    starts[length] = true;
+
+    auto operand_at = [code](unsigned int pc) {
+        int operand;
+        memcpy((void *)&operand, (void *)&code[pc + 1], sizeof(int));
+        return operand;
+    };
+
+    // Follow every path from pc 0, giving each pc its depth.
+    vector<int> depth(length, -1);
+    vector<bool> leaders(length + 1, false);
+    leaders[0] = true;
+    bool reaches_end = false;
+    vector<unsigned int> pending;
+    auto reach = [&](unsigned int pc, int depth_there, unsigned int from) -> bool {
+        if (depth_there > (int)STACK_LIMIT)
+        {
+            return fail("Stack overflow", from, ir);
+        }
+        if (pc == length)
+        {
+            reaches_end = true;
+            return 0 == depth_there ? fail("Program ends with an empty stack", from, ir) : true;
+        }
+        if (depth[pc] < 0)
+        {
+            depth[pc] = depth_there;
+            pending.push_back(pc);
+            return true;
+        }
+        return depth[pc] == depth_there || fail("Stack depth differs", pc, ir);
+    };
+
+    if (!reach(0, 0, 0))
+    {
+        return false;
+    }
+    while (!pending.empty())
+    {
+        const unsigned int pc = pending.back();
+        pending.pop_back();
+
+        const unsigned char op = code[pc];
+        const unsigned int next = pc + size_of(op);
+        const int d = depth[pc];
+        const int operand = has_operand(op) ? operand_at(pc) : 0;
+
+        int needed = 0;
+        if (POP == op || DUP == op || (op >= JEQ && op <= JGE))
+        {
+            needed = 1;
+        }
+        else if (SWAP == op || (op >= ADD && op <= CMP))
+        {
+            needed = 2;
+        }
+        if (d < needed)
+        {
+            return fail("Stack underflow", pc, ir);
+        }
+        if ((DUPN == op || DROPN == op) && (operand < 1 || operand > d))
+        {
+            return fail("Stack index out of range", pc, ir);
+        }
+        if (is_jump(op))
+        {
+            if (-1 == operand)
+            {
+                return fail("Undefined label", pc, ir);
+            }
+            if (operand < 0 || (unsigned int)operand > length || !starts[operand])
+            {
+                return fail("Jump out of the program", pc, ir);
+            }
+            leaders[operand] = true;
+            leaders[next] = true;
+        }
+
+        bool reached = true;
+        switch (op)
+        {
+        case PUSH:
+        case DUP:
+        case DUPN:
+            reached = reach(next, d + 1, pc);
+            break;
+
+        case SWAP:
+            reached = reach(next, d, pc);
+            break;
+
+        case JMP:
+            reached = reach((unsigned int)operand, d, pc);
+            break;
+
+        case POP:
+        case DROPN:
+            reached = reach(next, d - 1, pc);
+            break;
+
+        default:
+            if (is_jump(op))
+            {
+                reached = reach((unsigned int)operand, d - 1, pc) && reach(next, d - 1, pc);
+            }
+            else
+            {
+                reached = reach(next, d - 1, pc);
+            }
+            break;
+        }
+        if (!reached)
+        {
+            return false;
+        }
+    }
+
+    start(leaders, depth, reaches_end, ir);
+    edge(0, 0, vector<unsigned int>(), ir);
+
+    for (unsigned int first = 0; first < length; ++first)
+    {
+        if (block_at[first] < 0)
+        {
+            continue;
+        }
+        const unsigned int block = (unsigned int)block_at[first];
+        vector<unsigned int> state = slots[block];
+        ir.blocks[block].exit = VM_ir_block::JUMP;
+
+        for (unsigned int pc = first;; pc += size_of(code[pc]))
+        {
+            if (pc == length || (pc != first && leaders[pc]))
+            {
+                edge(block, pc, state, ir);
+                break;
+            }
+
+            const unsigned char op = code[pc];
+            const unsigned int next = pc + size_of(op);
+            const int operand = has_operand(op) ? operand_at(pc) : 0;
+            if (JMP == op)
+            {
+                edge(block, (unsigned int)operand, state, ir);
+                break;
+            }
+            if (is_jump(op))
+            {
+                const unsigned int condition = state.back();
+                state.pop_back();
+                if (block_at[operand] != block_at[next])
+                {
+                    VM_ir_block &b = ir.blocks[block];
+                    b.exit = VM_ir_block::BRANCH;
+                    b.test = test(op);
+                    b.value = condition;
+                    b.next[0] = (unsigned int)block_at[operand];
+                    edge(block, next, state, ir);
+                }
+                edge(block, (unsigned int)operand, state, ir);
+                break;
+            }
+
+            unsigned int value;
+            switch (op)
+            {
+            case PUSH:
+                value = ir.add_value(block, VM_ir_op::CONST, operand);
+                ir.blocks[block].code.push_back(value);
+                state.push_back(value);
+                break;
+
+            case POP:
+                state.pop_back();
+                break;
+
+            case DUP:
+                state.push_back(state.back());
+                break;
+
+            case DUPN:
+                state.push_back(state[state.size() - operand]);
+                break;
+
+            case SWAP:
+                swap(state[state.size() - 1], state[state.size() - 2]);
+                break;
+
+            case DROPN:
+                state.erase(state.end() - operand);
+                break;
+
+            default:
+                value = ir.add_value(block, arithmetic(op), 0, {state[state.size() - 2], state.back()});
+                ir.blocks[block].code.push_back(value);
+                state.pop_back();
+                state.back() = value;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool VM_ir_builder::build_registers(VM_ir_register_instruction const *code, unsigned int length, VM_ir &ir)
+{
+    message.clear();
+    ir.clear();
+    stack = false;
+
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        VM_ir_register_instruction const &instr = code[pc];
+        if (!(LOAD == instr.op || STORE == instr.op || (instr.op >= ADD && instr.op <= JGE)))
+        {
+            return fail("Invalid opcode", pc, ir);
+        }
+        if (instr.r1 >= REGISTERS || instr.r2 >= REGISTERS || instr.r3 >= REGISTERS)
+        {
+            return fail("Invalid register", pc, ir);
+        }
+        if (is_jump(instr.op) && instr.loc >= length)
+        {
+            return fail("Jump out of the program", pc, ir);
+        }
+    }
+
+    vector<int> entered(length, -1);
+    vector<bool> leaders(length + 1, false);
+    leaders[0] = true;
+    bool reaches_end = 0 == length;
+    vector<unsigned int> pending;
+    auto reach = [&](unsigned int pc) {
+        if (pc == length)
+        {
+            reaches_end = true;
+        }
+        else if (entered[pc] < 0)
+        {
+            entered[pc] = (int)REGISTERS;
+            pending.push_back(pc);
+        }
+    };
+
+    if (length > 0)
+    {
+        reach(0);
+    }
+    while (!pending.empty())
+    {
+        const unsigned int pc = pending.back();
+        pending.pop_back();
+
+        VM_ir_register_instruction const &instr = code[pc];
+        if (is_jump(instr.op))
+        {
+            leaders[instr.loc] = true;
+            leaders[pc + 1] = true;
+            reach(instr.loc);
+        }
+        if (JMP != instr.op)
+        {
+            reach(pc + 1);
+        }
+    }
+
+    start(leaders, entered, reaches_end, ir);
+    const unsigned int zero = ir.add_value(0, VM_ir_op::CONST, 0);
+    ir.blocks[0].code.push_back(zero);
+    edge(0, 0, vector<unsigned int>(REGISTERS, zero), ir);
+
+    for (unsigned int first = 0; first < length; ++first)
+    {
+        if (block_at[first] < 0)
+        {
+            continue;
+        }
+        const unsigned int block = (unsigned int)block_at[first];
+        vector<unsigned int> state = slots[block];
+        ir.blocks[block].exit = VM_ir_block::JUMP;
+
+        for (unsigned int pc = first;; ++pc)
+        {
+            if (pc == length || (pc != first && leaders[pc]))
+            {
+                edge(block, pc, state, ir);
+                break;
+            }
+
+            VM_ir_register_instruction const &instr = code[pc];
+            if (JMP == instr.op)
+            {
+                edge(block, instr.loc, state, ir);
+                break;
+            }
+            if (is_jump(instr.op))
+            {
+                if (block_at[instr.loc] != block_at[pc + 1])
+                {
+                    VM_ir_block &b = ir.blocks[block];
+                    b.exit = VM_ir_block::BRANCH;
+                    b.test = test(instr.op);
+                    b.value = state[instr.r1];
+                    b.next[0] = (unsigned int)block_at[instr.loc];
+                    edge(block, pc + 1, state, ir);
+                }
+                edge(block, instr.loc, state, ir);
+                break;
+            }
+
+            unsigned int value;
+            switch (instr.op)
+            {
+            case LOAD:
+                value = ir.add_value(block, VM_ir_op::LOAD, (int)instr.addr);
+                state[instr.r1] = value;
+                break;
+
+            case STORE:
+                value = ir.add_value(block, VM_ir_op::STORE, (int)instr.addr, {state[instr.r1]});
+                break;
+
+            default:
+                value = ir.add_value(block, arithmetic(instr.op), 0, {state[instr.r1], state[instr.r2]});
+                state[instr.r3] = value;
+                break;
+            }
+            ir.blocks[block].code.push_back(value);
+        }
+    }
+
+    return true;
+}
+
+bool VM_ir_builder::build(std::string const &path, VM_ir &ir)
+{
+    size_t size = 0;
+    VM_image stack_image;
+    if (stack_image.open(path, VM_image_machine::YELLOWDOG))
+    {
+        unsigned char const *code =
+            static_cast<unsigned char const *>(stack_image.section(VM_image_section::CODE, size));
+        return build_stack(code, (unsigned int)size, ir);
+    }
+
+    VM_image register_image;
+    if (register_image.open(path, VM_image_machine::GREENDOG))
+    {
+        VM_ir_register_instruction const *code = static_cast<VM_ir_register_instruction const *>(
+            register_image.section(VM_image_section::CODE, size));
+        if (0 != size % sizeof(VM_ir_register_instruction))
+        {
+            message = "Not a whole number of instructions: " + path;
+            ir.clear();
+            return false;
+        }
+        if (!build_registers(code, (unsigned int)(size / sizeof(VM_ir_register_instruction)), ir))
+        {
+            return false;
+        }
+
+        int const *cells = static_cast<int const *>(register_image.section(VM_image_section::HEAP, size));
+        if (nullptr != cells)
+        {
+            ir.heap.assign(cells, cells + size / sizeof(int));
+        }
+        return true;
+    }
+
+    message = "Not a yellowdog or greendog image: " + path;
+    ir.clear();
+    return false;
+}
@@ -0,0 +1,1257 @@
+#include "VM_ir_lowering.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+
+// The dogs' opcodes, as for VM_ir_builder.
+constexpr unsigned char PUSH = 1;
+constexpr unsigned char POP = 2;
+constexpr unsigned char DUP = 3;
+constexpr unsigned char DUPN = 4;
+constexpr unsigned char SWAP = 5;
+constexpr unsigned char DROPN = 18;
+
+constexpr unsigned char LOAD = 1;
+constexpr unsigned char STORE = 2;
+
+constexpr unsigned char ADD = 6;
+constexpr unsigned char JMP = 11;
+constexpr unsigned char JEQ = 12;
+
+// r31 holds 0 throughout; r29 and r30 move values kept in cells when
+// r0 to r28 are all that values get
+constexpr unsigned int ZERO = 31;
+constexpr unsigned int SCRATCH = 29;
+constexpr unsigned int ALL_REGISTERS = 31;
+constexpr unsigned int SPILL_REGISTERS = 29;
+
+unsigned char arithmetic(VM_ir_op op)
+{
+    return (unsigned char)(ADD + ((int)op - (int)VM_ir_op::ADD));
+}
+
+unsigned char jump(VM_ir_test test)
+{
+    return (unsigned char)(JEQ + (int)test);
+}
+
+bool commutative(VM_ir_op op)
+{
+    return VM_ir_op::ADD == op || VM_ir_op::MUL == op;
+}
+
+VM_ir_test inverse(VM_ir_test test)
+{
+    switch (test)
+    {
+    case VM_ir_test::EQ:
+        return VM_ir_test::NE;
+    case VM_ir_test::NE:
+        return VM_ir_test::EQ;
+    case VM_ir_test::LT:
+        return VM_ir_test::GE;
+    case VM_ir_test::LE:
+        return VM_ir_test::GT;
+    case VM_ir_test::GT:
+        return VM_ir_test::LE;
+    case VM_ir_test::GE:
+        break;
+    }
+    return VM_ir_test::LT;
+}
+
+bool contains(std::vector<unsigned int> const &values, unsigned int v)
+{
+    return find(values.begin(), values.end(), v) != values.end();
+}
+
+} // namespace
+
+bool VM_ir_lowering::location::operator==(location const &other) const
+{
+    return kind == other.kind && index == other.index;
+}
+
+std::string const &VM_ir_lowering::error() const
+{
+    return message;
+}
+
+unsigned int VM_ir_lowering::cells() const
+{
+    return next_cell;
+}
+
+unsigned int VM_ir_lowering::spilled() const
+{
+    return (unsigned int)spill_cells.size();
+}
+
+std::vector<std::pair<unsigned int, int>> VM_ir_lowering::constants() const
+{
+    vector<pair<unsigned int, int>> result;
+    for (auto const &cell : constant_cells)
+    {
+        result.push_back({cell.second, cell.first});
+    }
+    sort(result.begin(), result.end());
+    return result;
+}
+
+// A working copy of source in which phis of blocks with one way in are
+// replaced by their arguments, and the edges from branches that cannot
+// carry code of their own are split; then the layout.
+bool VM_ir_lowering::prepare(VM_ir const &source, bool stack_machine)
+{
+    string why;
+    if (!source.check(why))
+    {
+        message = "Not a valid program: " + why;
+        return false;
+    }
+    ir = source;
+
+    const vector<unsigned int> reachable = ir.order();
+    vector<unsigned int> forward(ir.values.size());
+    for (unsigned int v = 0; v < forward.size(); ++v)
+    {
+        forward[v] = v;
+    }
+    for (unsigned int block : reachable)
+    {
+        VM_ir_block &b = ir.blocks[block];
+        if (1 != b.preds.size())
+        {
+            continue;
+        }
+        vector<unsigned int> code;
+        for (unsigned int v : b.code)
+        {
+            if (VM_ir_op::PHI == ir.values[v].op)
+            {
+                forward[v] = ir.values[v].args[0];
+            }
+            else
+            {
+                code.push_back(v);
+            }
+        }
+        b.code = code;
+    }
+    auto resolve = [&forward](unsigned int v) {
+        while (forward[v] != v)
+        {
+            v = forward[v];
+        }
+        return v;
+    };
+    for (unsigned int block : reachable)
+    {
+        VM_ir_block &b = ir.blocks[block];
+        for (unsigned int v : b.code)
+        {
+            for (unsigned int &arg : ir.values[v].args)
+            {
+                arg = resolve(arg);
+            }
+        }
+        b.value = resolve(b.value);
+    }
+
+    for (unsigned int block : reachable)
+    {
+        if (VM_ir_block::BRANCH != ir.blocks[block].exit)
+        {
+            continue;
+        }
+        for (unsigned int k = 0; k < 2; ++k)
+        {
+            const unsigned int next = ir.blocks[block].next[k];
+            VM_ir_block const &n = ir.blocks[next];
+            const bool split = stack_machine ? n.preds.size() > 1
+                                             : !n.code.empty() && VM_ir_op::PHI == ir.values[n.code[0]].op;
+            if (split)
+            {
+                ir.split(block, next);
+            }
+        }
+    }
+
+    layout = ir.order();
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        if (VM_ir_block::RETURN == ir.blocks[layout[i]].exit)
+        {
+            rotate(layout.begin() + i, layout.begin() + i + 1, layout.end());
+            break;
+        }
+    }
+    liveness();
+    return true;
+}
+
+void VM_ir_lowering::liveness()
+{
+    live_out = ir.live_out();
+    live_in.assign(ir.blocks.size(), vector<bool>());
+    for (unsigned int block : layout)
+    {
+        VM_ir_block const &b = ir.blocks[block];
+        vector<bool> live = live_out[block];
+        if (VM_ir_block::JUMP != b.exit)
+        {
+            live[b.value] = true;
+        }
+        for (size_t i = b.code.size(); i-- > 0;)
+        {
+            live[b.code[i]] = false;
+            if (VM_ir_op::PHI != ir.values[b.code[i]].op)
+            {
+                for (unsigned int arg : ir.values[b.code[i]].args)
+                {
+                    live[arg] = true;
+                }
+            }
+        }
+        live_in[block] = live;
+    }
+}
+
+void VM_ir_lowering::deaths(unsigned int block, std::vector<std::vector<unsigned int>> &dying,
+                            std::vector<bool> &unused) const
+{
+    VM_ir_block const &b = ir.blocks[block];
+    vector<bool> live = live_out[block];
+    if (VM_ir_block::JUMP != b.exit)
+    {
+        live[b.value] = true;
+    }
+
+    dying.assign(b.code.size(), vector<unsigned int>());
+    unused.assign(b.code.size(), false);
+    for (size_t i = b.code.size(); i-- > 0;)
+    {
+        const unsigned int v = b.code[i];
+        unused[i] = !live[v];
+        live[v] = false;
+        if (VM_ir_op::PHI == ir.values[v].op)
+        {
+            continue;
+        }
+        for (unsigned int arg : ir.values[v].args)
+        {
+            if (!live[arg] && !contains(dying[i], arg))
+            {
+                dying[i].push_back(arg);
+            }
+        }
+        for (unsigned int arg : ir.values[v].args)
+        {
+            live[arg] = true;
+        }
+    }
+}
+
+bool VM_ir_lowering::lower_stack(VM_ir const &source, std::vector<unsigned char> &out)
+{
+    message.clear();
+    out.clear();
+    if (source.uses_heap())
+    {
+        message = "Yellowdog has no heap";
+        return false;
+    }
+    if (!prepare(source, true))
+    {
+        return false;
+    }
+
+    bytes.clear();
+    patches.clear();
+    position.assign(ir.blocks.size(), -1);
+    entry.assign(ir.blocks.size(), vector<unsigned int>());
+    entered.assign(ir.blocks.size(), false);
+    entered[0] = true;
+
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        const unsigned int block = layout[i];
+        const unsigned int next = i + 1 < layout.size() ? layout[i + 1] : (unsigned int)ir.blocks.size();
+        VM_ir_block const &b = ir.blocks[block];
+        position[block] = (int)bytes.size();
+        stack = entry[block];
+
+        vector<vector<unsigned int>> dying;
+        vector<bool> unused;
+        deaths(block, dying, unused);
+
+        // what the block is entered with and nothing needs
+        vector<bool> wanted = live_in[block];
+        for (size_t k = 0; k < b.code.size(); ++k)
+        {
+            if (VM_ir_op::PHI == ir.values[b.code[k]].op && !unused[k])
+            {
+                wanted[b.code[k]] = true;
+            }
+        }
+        for (size_t j = stack.size(); j-- > 0;)
+        {
+            if (!wanted[stack[j]])
+            {
+                drop(stack[j]);
+            }
+        }
+
+        for (size_t k = 0; k < b.code.size(); ++k)
+        {
+            const unsigned int v = b.code[k];
+            VM_ir_value const &value = ir.values[v];
+            if (VM_ir_op::PHI == value.op || VM_ir_op::CONST == value.op)
+            {
+                continue;
+            }
+            if (VM_ir_op::COPY == value.op)
+            {
+                fetch(value.args[0], contains(dying[k], value.args[0]));
+            }
+            else
+            {
+                binary(value.op, value.args[0], value.args[1], contains(dying[k], value.args[0]),
+                       contains(dying[k], value.args[1]));
+            }
+            stack.back() = v;
+            for (unsigned int arg : dying[k])
+            {
+                drop(arg);
+            }
+            if (unused[k])
+            {
+                emit_stack(POP);
+                stack.pop_back();
+            }
+        }
+
+        switch (b.exit)
+        {
+        case VM_ir_block::JUMP:
+            jump_stack(block, next);
+            break;
+
+        case VM_ir_block::BRANCH:
+        {
+            fetch(b.value, !live_out[block][b.value]);
+            stack.pop_back();
+
+            unsigned int taken = b.next[0];
+            unsigned int other = b.next[1];
+            VM_ir_test test = b.test;
+            if (taken == next)
+            {
+                swap(taken, other);
+                test = inverse(test);
+            }
+            emit_stack(jump(test), 0);
+            patches.push_back({(unsigned int)bytes.size() - sizeof(int), taken});
+            for (unsigned int to : b.next)
+            {
+                entry[to] = stack;
+                entered[to] = true;
+            }
+            if (other != next)
+            {
+                emit_stack(JMP, 0);
+                patches.push_back({(unsigned int)bytes.size() - sizeof(int), other});
+            }
+            break;
+        }
+
+        case VM_ir_block::RETURN:
+            fetch(b.value, true);
+            break;
+        }
+    }
+
+    for (auto const &patch : patches)
+    {
+        const int pc = position[patch.second];
+        memcpy(&bytes[patch.first], &pc, sizeof(int));
+    }
+    out = bytes;
+    return true;
+}
+
+void VM_ir_lowering::emit_stack(unsigned char op)
+{
+    bytes.push_back(op);
+}
+
+void VM_ir_lowering::emit_stack(unsigned char op, int operand)
+{
+    bytes.push_back(op);
+    unsigned char raw[sizeof(int)];
+    memcpy(raw, &operand, sizeof(int));
+    bytes.insert(bytes.end(), raw, raw + sizeof(int));
+}
+
+// from the top, 1 for the top itself
+unsigned int VM_ir_lowering::depth(unsigned int v) const
+{
+    for (size_t j = stack.size(); j-- > 0;)
+    {
+        if (stack[j] == v)
+        {
+            return (unsigned int)(stack.size() - j);
+        }
+    }
+    return 0;
+}
+
+void VM_ir_lowering::drop(unsigned int v)
+{
+    const unsigned int at = depth(v);
+    if (0 == at)
+    {
+        return;
+    }
+    emit_stack(DROPN, (int)at);
+    stack.erase(stack.end() - at);
+}
+
+// v on top of the stack: where it is if take and it is on top already,
+// else pushed or copied there
+void VM_ir_lowering::fetch(unsigned int v, bool take)
+{
+    if (VM_ir_op::CONST == ir.values[v].op)
+    {
+        emit_stack(PUSH, ir.values[v].operand);
+    }
+    else if (take && !stack.empty() && stack.back() == v)
+    {
+        return;
+    }
+    else if (1 == depth(v))
+    {
+        emit_stack(DUP);
+    }
+    else
+    {
+        emit_stack(DUPN, (int)depth(v));
+    }
+    stack.push_back(v);
+}
+
+// a op b, using up the operands on top of the stack where they are not
+// needed again, and leaving its result there
+void VM_ir_lowering::binary(VM_ir_op op, unsigned int a, unsigned int b, bool a_dies, bool b_dies)
+{
+    const size_t n = stack.size();
+    if (a == b)
+    {
+        fetch(a, a_dies);
+        emit_stack(DUP);
+        stack.push_back(a);
+    }
+    else if (a_dies && b_dies && n >= 2 && stack[n - 2] == a && stack[n - 1] == b)
+    {
+    }
+    else if (a_dies && b_dies && n >= 2 && stack[n - 2] == b && stack[n - 1] == a)
+    {
+        if (!commutative(op))
+        {
+            emit_stack(SWAP);
+        }
+    }
+    else if (a_dies && n >= 1 && stack[n - 1] == a)
+    {
+        fetch(b, false);
+    }
+    else if (a_dies && n >= 2 && stack[n - 2] == a)
+    {
+        emit_stack(SWAP);
+        swap(stack[n - 2], stack[n - 1]);
+        fetch(b, false);
+    }
+    else if (b_dies && n >= 1 && stack[n - 1] == b)
+    {
+        fetch(a, false);
+        if (!commutative(op))
+        {
+            emit_stack(SWAP);
+        }
+    }
+    else
+    {
+        fetch(a, false);
+        fetch(b, false);
+    }
+
+    emit_stack(arithmetic(op));
+    stack.pop_back();
+    stack.back() = a;
+}
+
+// Fixes the order the block's successor is entered with if the layout has
+// not yet, and rearranges the stack into it.
+void VM_ir_lowering::jump_stack(unsigned int block, unsigned int next)
+{
+    const unsigned int to = ir.blocks[block].next[0];
+    VM_ir_block const &target = ir.blocks[to];
+    const size_t index = find(target.preds.begin(), target.preds.end(), block) - target.preds.begin();
+
+    if (!entered[to])
+    {
+        // values stay where they are, and a phi takes its argument's place
+        vector<unsigned int> order;
+        vector<bool> placed(ir.values.size(), false);
+        for (unsigned int v : stack)
+        {
+            if (live_in[to][v])
+            {
+                order.push_back(v);
+                continue;
+            }
+            for (unsigned int phi : target.code)
+            {
+                if (VM_ir_op::PHI == ir.values[phi].op && !placed[phi] && ir.values[phi].args[index] == v)
+                {
+                    order.push_back(phi);
+                    placed[phi] = true;
+                    break;
+                }
+            }
+        }
+        for (unsigned int phi : target.code)
+        {
+            if (VM_ir_op::PHI == ir.values[phi].op && !placed[phi])
+            {
+                order.push_back(phi);
+            }
+        }
+        entry[to] = order;
+        entered[to] = true;
+    }
+
+    vector<unsigned int> sources;
+    for (unsigned int v : entry[to])
+    {
+        const bool phi = VM_ir_op::PHI == ir.values[v].op && to == ir.values[v].block;
+        sources.push_back(phi ? ir.values[v].args[index] : v);
+    }
+    shuffle(sources);
+    stack = entry[to];
+
+    if (to != next)
+    {
+        emit_stack(JMP, 0);
+        patches.push_back({(unsigned int)bytes.size() - sizeof(int), to});
+    }
+}
+
+// Leaves sources on the stack, bottom first, and nothing else: those
+// from the bottom that lie in order already stay, the rest are copied up
+// after them and what is left over is dropped, unless the only way
+// sources are out of order is the top two swapped.
+void VM_ir_lowering::shuffle(std::vector<unsigned int> const &sources)
+{
+    auto in_order = [this](vector<unsigned int> const &wanted, vector<bool> &keep) {
+        keep.assign(stack.size(), false);
+        size_t k = 0;
+        for (size_t j = 0; j < stack.size() && k < wanted.size(); ++j)
+        {
+            if (stack[j] == wanted[k])
+            {
+                keep[j] = true;
+                ++k;
+            }
+        }
+        return k;
+    };
+
+    const size_t n = sources.size();
+    vector<bool> keep;
+    const size_t kept = in_order(sources, keep);
+    if (n >= 2 && sources[n - 1] != sources[n - 2])
+    {
+        vector<unsigned int> swapped = sources;
+        swap(swapped[n - 1], swapped[n - 2]);
+        vector<bool> keep_swapped;
+        if (n == in_order(swapped, keep_swapped) && stack.size() - n + 1 < (n - kept) + (stack.size() - kept))
+        {
+            keep = keep_swapped;
+            for (size_t j = stack.size(); j-- > 0;)
+            {
+                if (!keep[j])
+                {
+                    emit_stack(DROPN, (int)(stack.size() - j));
+                    stack.erase(stack.begin() + j);
+                }
+            }
+            emit_stack(SWAP);
+            swap(stack[n - 1], stack[n - 2]);
+            return;
+        }
+    }
+
+    const size_t old = stack.size();
+    for (size_t i = kept; i < n; ++i)
+    {
+        fetch(sources[i], false);
+    }
+    for (size_t j = old; j-- > 0;)
+    {
+        if (!keep[j])
+        {
+            emit_stack(DROPN, (int)(stack.size() - j));
+            stack.erase(stack.begin() + j);
+        }
+    }
+}
+
+bool VM_ir_lowering::lower_registers(VM_ir const &source, std::vector<VM_ir_register_instruction> &out,
+                                     unsigned int first)
+{
+    message.clear();
+    out.clear();
+    base = first;
+    next_cell = 0;
+    constant_cells.clear();
+    spill_cells.clear();
+    swap_cell = -1;
+    code.clear();
+    if (!prepare(source, false))
+    {
+        return false;
+    }
+
+    // values go to cells, constants first and then those used least, until
+    // no more are live anywhere than r0 to r28 can hold
+    spill.assign(ir.values.size(), false);
+    registers = ALL_REGISTERS;
+    vector<unsigned int> worst;
+    if (pressure(worst) > ALL_REGISTERS)
+    {
+        registers = SPILL_REGISTERS;
+        vector<unsigned int> uses(ir.values.size(), 0);
+        for (unsigned int block : layout)
+        {
+            for (unsigned int v : ir.blocks[block].code)
+            {
+                for (unsigned int arg : ir.values[v].args)
+                {
+                    ++uses[arg];
+                }
+            }
+            if (VM_ir_block::JUMP != ir.blocks[block].exit)
+            {
+                ++uses[ir.blocks[block].value];
+            }
+        }
+        while (pressure(worst) > registers)
+        {
+            unsigned int pick = worst[0];
+            for (unsigned int v : worst)
+            {
+                const bool constant = VM_ir_op::CONST == ir.values[v].op;
+                const bool pick_constant = VM_ir_op::CONST == ir.values[pick].op;
+                if (constant != pick_constant ? constant
+                                              : uses[v] < uses[pick] || (uses[v] == uses[pick] && v > pick))
+                {
+                    pick = v;
+                }
+            }
+            spill[pick] = true;
+        }
+    }
+    if (!colour_values())
+    {
+        message = "Out of registers";
+        return false;
+    }
+    spare = registers == SPILL_REGISTERS ? (int)SCRATCH + 1 : -1;
+    if (registers == ALL_REGISTERS && find(colour.begin(), colour.end(), (int)ALL_REGISTERS - 1) == colour.end())
+    {
+        spare = (int)ALL_REGISTERS - 1;
+    }
+
+    vector<int> start(ir.blocks.size(), -1);
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        const unsigned int block = layout[i];
+        const unsigned int next = i + 1 < layout.size() ? layout[i + 1] : (unsigned int)ir.blocks.size();
+        VM_ir_block const &b = ir.blocks[block];
+        start[block] = (int)code.size();
+
+        for (unsigned int v : b.code)
+        {
+            VM_ir_value const &value = ir.values[v];
+            switch (value.op)
+            {
+            case VM_ir_op::PHI:
+                break;
+
+            case VM_ir_op::CONST:
+                if (allocatable(v) && !spill[v])
+                {
+                    emit(LOAD, (unsigned int)colour[v], 0, 0, constant_cell(value.operand));
+                }
+                break;
+
+            case VM_ir_op::COPY:
+            {
+                const unsigned int from = use(value.args[0], SCRATCH);
+                const unsigned int to = define(v);
+                if (from != to)
+                {
+                    emit(ADD, from, ZERO, to);
+                }
+                defined(v);
+                break;
+            }
+
+            case VM_ir_op::LOAD:
+                emit(LOAD, define(v), 0, 0, (unsigned int)value.operand);
+                defined(v);
+                break;
+
+            case VM_ir_op::STORE:
+                emit(STORE, use(value.args[0], SCRATCH), 0, 0, (unsigned int)value.operand);
+                break;
+
+            default:
+            {
+                const unsigned int r1 = use(value.args[0], SCRATCH);
+                const unsigned int r2 = value.args[1] == value.args[0] ? r1 : use(value.args[1], SCRATCH + 1);
+                emit(arithmetic(value.op), r1, r2, define(v));
+                defined(v);
+                break;
+            }
+            }
+        }
+
+        switch (b.exit)
+        {
+        case VM_ir_block::JUMP:
+            jump_registers(block, next);
+            break;
+
+        case VM_ir_block::BRANCH:
+        {
+            unsigned int taken = b.next[0];
+            unsigned int other = b.next[1];
+            VM_ir_test test = b.test;
+            if (taken == next)
+            {
+                swap(taken, other);
+                test = inverse(test);
+            }
+            emit(jump(test), use(b.value, SCRATCH), 0, 0, 0, (int)taken);
+            if (other != next)
+            {
+                emit(JMP, 0, 0, 0, 0, (int)other);
+            }
+            break;
+        }
+
+        case VM_ir_block::RETURN:
+        {
+            const unsigned int result = use(b.value, SCRATCH);
+            if (0 != result)
+            {
+                emit(ADD, result, ZERO, 0);
+            }
+            break;
+        }
+        }
+    }
+
+    // a jump may not land past the last instruction, so one to the end
+    // lands on one that does nothing
+    for (instruction const &instr : code)
+    {
+        if (instr.label >= 0 && start[instr.label] == (int)code.size())
+        {
+            emit(ADD, 0, ZERO, 0);
+            break;
+        }
+    }
+
+    for (instruction const &instr : code)
+    {
+        VM_ir_register_instruction record;
+        record.op = instr.op;
+        record.r1 = (unsigned char)instr.r1;
+        record.r2 = (unsigned char)instr.r2;
+        record.r3 = (unsigned char)instr.r3;
+        record.addr = instr.addr;
+        record.loc = instr.label >= 0 ? (unsigned int)start[instr.label] : 0;
+        out.push_back(record);
+    }
+    return true;
+}
+
+// 0 is r31's
+bool VM_ir_lowering::allocatable(unsigned int v) const
+{
+    VM_ir_value const &value = ir.values[v];
+    return VM_ir::defines(value.op) && !(VM_ir_op::CONST == value.op && 0 == value.operand);
+}
+
+// The most values needing registers live at once, and which they are.
+unsigned int VM_ir_lowering::pressure(std::vector<unsigned int> &worst) const
+{
+    unsigned int most = 0;
+    worst.clear();
+
+    vector<bool> live;
+    unsigned int count = 0;
+    auto wants = [this](unsigned int v) { return allocatable(v) && !spill[v]; };
+    auto add = [&](unsigned int v) {
+        if (wants(v) && !live[v])
+        {
+            live[v] = true;
+            ++count;
+        }
+    };
+    auto remove = [&](unsigned int v) {
+        if (live[v])
+        {
+            live[v] = false;
+            --count;
+        }
+    };
+    auto note = [&]() {
+        if (count > most)
+        {
+            most = count;
+            worst.clear();
+            for (unsigned int v = 0; v < live.size(); ++v)
+            {
+                if (live[v])
+                {
+                    worst.push_back(v);
+                }
+            }
+        }
+    };
+
+    for (unsigned int block : layout)
+    {
+        VM_ir_block const &b = ir.blocks[block];
+        live.assign(ir.values.size(), false);
+        count = 0;
+        for (unsigned int v = 0; v < live.size(); ++v)
+        {
+            if (live_out[block][v])
+            {
+                add(v);
+            }
+        }
+        if (VM_ir_block::JUMP != b.exit)
+        {
+            add(b.value);
+        }
+        note();
+
+        for (size_t i = b.code.size(); i-- > 0;)
+        {
+            const unsigned int v = b.code[i];
+            if (VM_ir_op::PHI == ir.values[v].op)
+            {
+                // all the phis are live together on the way in
+                add(v);
+                continue;
+            }
+            add(v);
+            note();
+            remove(v);
+            for (unsigned int arg : ir.values[v].args)
+            {
+                add(arg);
+            }
+            note();
+        }
+        note();
+    }
+    return most;
+}
+
+// Registers given in dominator tree order, a value's when it is defined
+// and freed after its last use.
+bool VM_ir_lowering::colour_values()
+{
+    colour.assign(ir.values.size(), -1);
+    const vector<unsigned int> idom = ir.dominators();
+    vector<vector<unsigned int>> children(ir.blocks.size());
+    for (unsigned int block : layout)
+    {
+        if (0 != block)
+        {
+            children[idom[block]].push_back(block);
+        }
+    }
+
+    // a value a phi takes had best be where the phi is, saving a copy
+    vector<int> feeds(ir.values.size(), -1);
+    for (unsigned int block : layout)
+    {
+        for (unsigned int v : ir.blocks[block].code)
+        {
+            if (VM_ir_op::PHI != ir.values[v].op)
+            {
+                continue;
+            }
+            for (unsigned int arg : ir.values[v].args)
+            {
+                if (feeds[arg] < 0)
+                {
+                    feeds[arg] = (int)v;
+                }
+            }
+        }
+    }
+
+    vector<unsigned int> pending = {0};
+    while (!pending.empty())
+    {
+        const unsigned int block = pending.back();
+        pending.pop_back();
+        pending.insert(pending.end(), children[block].rbegin(), children[block].rend());
+
+        VM_ir_block const &b = ir.blocks[block];
+        vector<bool> busy(ALL_REGISTERS, false);
+        for (unsigned int v = 0; v < ir.values.size(); ++v)
+        {
+            if (live_in[block][v] && colour[v] >= 0)
+            {
+                busy[colour[v]] = true;
+            }
+        }
+
+        vector<vector<unsigned int>> dying;
+        vector<bool> unused;
+        deaths(block, dying, unused);
+
+        // else not where another of that phi's block's phis is, which
+        // copying the phis' arguments would go round in a cycle
+        auto take = [&](unsigned int v, int prefer) {
+            vector<bool> avoid(ALL_REGISTERS, false);
+            if (feeds[v] >= 0)
+            {
+                for (unsigned int phi : ir.blocks[ir.values[feeds[v]].block].code)
+                {
+                    if (VM_ir_op::PHI == ir.values[phi].op && colour[phi] >= 0)
+                    {
+                        avoid[colour[phi]] = true;
+                    }
+                }
+            }
+            if (prefer >= 0 && prefer < (int)registers && !busy[prefer])
+            {
+                colour[v] = prefer;
+            }
+            for (unsigned int r = 0; r < registers && colour[v] < 0; ++r)
+            {
+                if (!busy[r] && !avoid[r])
+                {
+                    colour[v] = (int)r;
+                }
+            }
+            for (unsigned int r = 0; r < registers && colour[v] < 0; ++r)
+            {
+                if (!busy[r])
+                {
+                    colour[v] = (int)r;
+                }
+            }
+            if (colour[v] < 0)
+            {
+                return false;
+            }
+            busy[colour[v]] = true;
+            return true;
+        };
+
+        for (unsigned int v : b.code)
+        {
+            if (VM_ir_op::PHI != ir.values[v].op || spill[v])
+            {
+                continue;
+            }
+            int prefer = -1;
+            for (unsigned int arg : ir.values[v].args)
+            {
+                if (colour[arg] >= 0 && prefer < 0)
+                {
+                    prefer = colour[arg];
+                }
+            }
+            if (!take(v, prefer))
+            {
+                return false;
+            }
+        }
+        for (size_t k = 0; k < b.code.size(); ++k)
+        {
+            const unsigned int v = b.code[k];
+            if (VM_ir_op::PHI == ir.values[v].op)
+            {
+                if (unused[k] && colour[v] >= 0)
+                {
+                    busy[colour[v]] = false;
+                }
+                continue;
+            }
+            for (unsigned int arg : dying[k])
+            {
+                if (colour[arg] >= 0)
+                {
+                    busy[colour[arg]] = false;
+                }
+            }
+            if (allocatable(v) && !spill[v])
+            {
+                int prefer = -1;
+                if (feeds[v] >= 0)
+                {
+                    // or, until the phi has one, where its other arguments are
+                    prefer = colour[feeds[v]];
+                    for (unsigned int arg : ir.values[feeds[v]].args)
+                    {
+                        prefer = prefer < 0 ? colour[arg] : prefer;
+                    }
+                }
+                if (prefer < 0 && VM_ir_op::COPY == ir.values[v].op)
+                {
+                    prefer = colour[ir.values[v].args[0]];
+                }
+                if (!take(v, prefer))
+                {
+                    return false;
+                }
+                if (unused[k])
+                {
+                    busy[colour[v]] = false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+unsigned int VM_ir_lowering::constant_cell(int value)
+{
+    auto at = constant_cells.find(value);
+    if (at == constant_cells.end())
+    {
+        at = constant_cells.insert({value, base + next_cell++}).first;
+    }
+    return at->second;
+}
+
+unsigned int VM_ir_lowering::spill_cell(unsigned int v)
+{
+    auto at = spill_cells.find(v);
+    if (at == spill_cells.end())
+    {
+        at = spill_cells.insert({v, base + next_cell++}).first;
+    }
+    return at->second;
+}
+
+unsigned int VM_ir_lowering::swap_space()
+{
+    if (swap_cell < 0)
+    {
+        swap_cell = (int)(base + next_cell++);
+    }
+    return (unsigned int)swap_cell;
+}
+
+VM_ir_lowering::location VM_ir_lowering::where(unsigned int v)
+{
+    if (!allocatable(v))
+    {
+        return {location::REG, ZERO};
+    }
+    if (!spill[v])
+    {
+        return {location::REG, (unsigned int)colour[v]};
+    }
+    if (VM_ir_op::CONST == ir.values[v].op)
+    {
+        return {location::CELL, constant_cell(ir.values[v].operand)};
+    }
+    return {location::CELL, spill_cell(v)};
+}
+
+void VM_ir_lowering::emit(unsigned char op, unsigned int r1, unsigned int r2, unsigned int r3, unsigned int addr,
+                          int label)
+{
+    code.push_back({op, r1, r2, r3, addr, label});
+}
+
+// the register v is in, loaded into scratch if it lives in a cell
+unsigned int VM_ir_lowering::use(unsigned int v, unsigned int scratch)
+{
+    const location at = where(v);
+    if (location::REG == at.kind)
+    {
+        return at.index;
+    }
+    emit(LOAD, scratch, 0, 0, at.index);
+    return scratch;
+}
+
+unsigned int VM_ir_lowering::define(unsigned int v) const
+{
+    return spill[v] ? SCRATCH : (unsigned int)colour[v];
+}
+
+void VM_ir_lowering::defined(unsigned int v)
+{
+    if (spill[v])
+    {
+        emit(STORE, SCRATCH, 0, 0, spill_cell(v));
+    }
+}
+
+void VM_ir_lowering::move(location const &to, location const &from)
+{
+    if (location::REG == to.kind)
+    {
+        if (location::REG == from.kind)
+        {
+            emit(ADD, from.index, ZERO, to.index);
+        }
+        else
+        {
+            emit(LOAD, to.index, 0, 0, from.index);
+        }
+    }
+    else if (location::REG == from.kind)
+    {
+        emit(STORE, from.index, 0, 0, to.index);
+    }
+    else
+    {
+        emit(LOAD, SCRATCH, 0, 0, from.index);
+        emit(STORE, SCRATCH, 0, 0, to.index);
+    }
+}
+
+// Copies the phis' arguments into place all at once: a copy is made once
+// nothing still to be copied needs what it overwrites, and where every one
+// does, one of them is saved in a spare register or cell first.
+void VM_ir_lowering::jump_registers(unsigned int block, unsigned int next)
+{
+    const unsigned int to = ir.blocks[block].next[0];
+    VM_ir_block const &target = ir.blocks[to];
+    const size_t index = find(target.preds.begin(), target.preds.end(), block) - target.preds.begin();
+
+    vector<pair<location, location>> moves;
+    for (unsigned int phi : target.code)
+    {
+        if (VM_ir_op::PHI != ir.values[phi].op)
+        {
+            continue;
+        }
+        const location into = where(phi);
+        const location from = where(ir.values[phi].args[index]);
+        if (!(into == from))
+        {
+            moves.push_back({into, from});
+        }
+    }
+
+    while (!moves.empty())
+    {
+        bool done = false;
+        for (size_t i = 0; i < moves.size() && !done; ++i)
+        {
+            bool needed = false;
+            for (size_t j = 0; j < moves.size(); ++j)
+            {
+                needed = needed || (j != i && moves[j].second == moves[i].first);
+            }
+            if (!needed)
+            {
+                move(moves[i].first, moves[i].second);
+                moves.erase(moves.begin() + i);
+                done = true;
+            }
+        }
+        if (!done)
+        {
+            const location saved = moves[0].first;
+            const location temp =
+                spare >= 0 ? location{location::REG, (unsigned int)spare} : location{location::CELL, swap_space()};
+            move(temp, saved);
+            for (auto &m : moves)
+            {
+                if (m.second == saved)
+                {
+                    m.second = temp;
+                }
+            }
+        }
+    }
+
+    if (to != next)
+    {
+        emit(JMP, 0, 0, 0, 0, (int)to);
+    }
+}
+
+bool VM_ir_lowering::write(VM_ir const &source, VM_image_machine machine, std::string const &path,
+                           unsigned int first)
+{
+    VM_image_writer writer(machine);
+    if (VM_image_machine::YELLOWDOG == machine)
+    {
+        vector<unsigned char> program;
+        if (!lower_stack(source, program))
+        {
+            return false;
+        }
+        writer.add(VM_image_section::CODE, program.data(), program.size());
+    }
+    else if (VM_image_machine::GREENDOG == machine)
+    {
+        vector<VM_ir_register_instruction> program;
+        if (!lower_registers(source, program, first))
+        {
+            return false;
+        }
+        vector<int> heap = source.heap;
+        if (next_cell > 0 && heap.size() < base + next_cell)
+        {
+            heap.resize(base + next_cell, 0);
+        }
+        for (auto const &cell : constant_cells)
+        {
+            heap[cell.second] = cell.first;
+        }
+        writer.add(VM_image_section::CODE, program.data(), program.size() * sizeof(VM_ir_register_instruction));
+        if (!heap.empty())
+        {
+            writer.add(VM_image_section::HEAP, heap.data(), heap.size() * sizeof(int));
+        }
+    }
+    else
+    {
+        message = "Cannot lower to that machine";
+        return false;
+    }
+
+    if (!writer.write(path))
+    {
+        message = "Cannot write " + path;
+        return false;
+    }
+    return true;
+}
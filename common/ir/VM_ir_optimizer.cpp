@@ -0,0 +1,840 @@
+#include "VM_ir_optimizer.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+
+bool arithmetic(VM_ir_op op)
+{
+    return op >= VM_ir_op::ADD && op <= VM_ir_op::CMP;
+}
+
+bool commutative(VM_ir_op op)
+{
+    return VM_ir_op::ADD == op || VM_ir_op::MUL == op;
+}
+
+bool constant(VM_ir const &ir, unsigned int v, int &value)
+{
+    value = ir.values[v].operand;
+    return VM_ir_op::CONST == ir.values[v].op;
+}
+
+// a DIV whose divisor may be 0, or -1 with INT_MIN to divide
+bool may_trap(VM_ir const &ir, unsigned int v)
+{
+    int divisor;
+    return VM_ir_op::DIV == ir.values[v].op &&
+           !(constant(ir, ir.values[v].args[1], divisor) && 0 != divisor && -1 != divisor);
+}
+
+bool side_effect(VM_ir const &ir, unsigned int v)
+{
+    return VM_ir_op::STORE == ir.values[v].op || may_trap(ir, v);
+}
+
+// what y op x leaves, or false where the op must be left to run (and
+// trap)
+bool fold(VM_ir_op op, int y, int x, int &result)
+{
+    const unsigned int a = (unsigned int)y;
+    const unsigned int b = (unsigned int)x;
+    switch (op)
+    {
+    case VM_ir_op::ADD:
+        result = (int)(a + b);
+        return true;
+
+    case VM_ir_op::SUB:
+        result = (int)(a - b);
+        return true;
+
+    case VM_ir_op::MUL:
+        result = (int)(a * b);
+        return true;
+
+    case VM_ir_op::DIV:
+        if (0 == x || (INT_MIN == y && -1 == x))
+        {
+            return false;
+        }
+        result = y / x;
+        return true;
+
+    case VM_ir_op::CMP:
+        result = (y < x) ? -1 : ((y > x) ? +1 : 0);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool passes(VM_ir_test test, int value)
+{
+    switch (test)
+    {
+    case VM_ir_test::EQ:
+        return 0 == value;
+    case VM_ir_test::NE:
+        return 0 != value;
+    case VM_ir_test::LT:
+        return value < 0;
+    case VM_ir_test::LE:
+        return value <= 0;
+    case VM_ir_test::GT:
+        return value > 0;
+    case VM_ir_test::GE:
+        return value >= 0;
+    }
+    return true;
+}
+
+std::vector<unsigned int> identity(VM_ir const &ir)
+{
+    vector<unsigned int> forward(ir.values.size());
+    for (unsigned int v = 0; v < forward.size(); ++v)
+    {
+        forward[v] = v;
+    }
+    return forward;
+}
+
+unsigned int resolve(std::vector<unsigned int> const &forward, unsigned int v)
+{
+    while (forward[v] != v)
+    {
+        v = forward[v];
+    }
+    return v;
+}
+
+} // namespace
+
+void VM_ir_stats::report(std::ostream &out) const
+{
+    out << "IR: " << instructions_before << " -> " << instructions_after << " instructions\n";
+    out << "\tdead values\t" << dead_values << "\n";
+    out << "\tdead blocks\t" << dead_blocks << "\n";
+    out << "\tcopies\t\t" << copies << "\n";
+    out << "\tcommon\t\t" << common << "\n";
+    out << "\thoisted\t\t" << hoisted << "\n";
+    out << "\treduced\t\t" << reduced << "\n";
+}
+
+void VM_ir_optimizer::optimize(VM_ir &ir, VM_ir_stats *stats)
+{
+    counts = VM_ir_stats();
+    counts.instructions_before = ir.size();
+
+    // nothing to do for a program the builder refused
+    bool changed = !ir.blocks.empty();
+    while (changed)
+    {
+        changed = reduce_strength(ir);
+        changed |= propagate_copies(ir);
+        changed |= eliminate_common_subexpressions(ir);
+        changed |= eliminate_dead_code(ir);
+        changed |= hoist_loop_invariants(ir);
+    }
+
+    counts.instructions_after = ir.size();
+    if (nullptr != stats)
+    {
+        *stats = counts;
+    }
+}
+
+void VM_ir_optimizer::forward_uses(VM_ir &ir, std::vector<unsigned int> &forward)
+{
+    for (VM_ir_block &block : ir.blocks)
+    {
+        block.code.erase(remove_if(block.code.begin(), block.code.end(),
+                                   [&forward](unsigned int v) { return forward[v] != v; }),
+                         block.code.end());
+        for (unsigned int v : block.code)
+        {
+            for (unsigned int &arg : ir.values[v].args)
+            {
+                arg = resolve(forward, arg);
+            }
+        }
+        if (VM_ir_block::JUMP != block.exit)
+        {
+            block.value = resolve(forward, block.value);
+        }
+    }
+}
+
+bool VM_ir_optimizer::reduce_strength(VM_ir &ir)
+{
+    bool changed = false;
+    for (unsigned int block = 0; block < ir.blocks.size(); ++block)
+    {
+        for (unsigned int i = 0; i < ir.blocks[block].code.size(); ++i)
+        {
+            const unsigned int v = ir.blocks[block].code[i];
+            const VM_ir_op op = ir.values[v].op;
+            if (!arithmetic(op))
+            {
+                continue;
+            }
+
+            const unsigned int y = ir.values[v].args[0];
+            const unsigned int x = ir.values[v].args[1];
+            int cy, cx, result;
+            const bool ky = constant(ir, y, cy);
+            const bool kx = constant(ir, x, cx);
+
+            auto become = [&ir, v](VM_ir_op to, int operand, std::vector<unsigned int> const &args) {
+                ir.values[v].op = to;
+                ir.values[v].operand = operand;
+                ir.values[v].args = args;
+            };
+            // 0 - arg, with a 0 of its own just before
+            auto negate = [&](unsigned int arg) {
+                const unsigned int zero = ir.add_value(block, VM_ir_op::CONST, 0);
+                ir.blocks[block].code.insert(ir.blocks[block].code.begin() + i, zero);
+                ++i;
+                become(VM_ir_op::SUB, 0, {zero, arg});
+            };
+
+            if (ky && kx && fold(op, cy, cx, result))
+            {
+                become(VM_ir_op::CONST, result, {});
+            }
+            else if (VM_ir_op::ADD == op && kx && 0 == cx)
+            {
+                become(VM_ir_op::COPY, 0, {y});
+            }
+            else if (VM_ir_op::ADD == op && ky && 0 == cy)
+            {
+                become(VM_ir_op::COPY, 0, {x});
+            }
+            else if (VM_ir_op::SUB == op && kx && 0 == cx)
+            {
+                become(VM_ir_op::COPY, 0, {y});
+            }
+            else if ((VM_ir_op::SUB == op || VM_ir_op::CMP == op) && x == y)
+            {
+                become(VM_ir_op::CONST, 0, {});
+            }
+            else if (VM_ir_op::MUL == op && ((kx && 0 == cx) || (ky && 0 == cy)))
+            {
+                become(VM_ir_op::CONST, 0, {});
+            }
+            else if (VM_ir_op::MUL == op && (kx || ky) && 1 == (kx ? cx : cy))
+            {
+                become(VM_ir_op::COPY, 0, {kx ? y : x});
+            }
+            else if (VM_ir_op::MUL == op && (kx || ky) && 2 == (kx ? cx : cy))
+            {
+                become(VM_ir_op::ADD, 0, {kx ? y : x, kx ? y : x});
+            }
+            else if (VM_ir_op::MUL == op && (kx || ky) && -1 == (kx ? cx : cy))
+            {
+                negate(kx ? y : x);
+            }
+            else if (VM_ir_op::DIV == op && kx && 1 == cx)
+            {
+                become(VM_ir_op::COPY, 0, {y});
+            }
+            else
+            {
+                continue;
+            }
+            ++counts.reduced;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool VM_ir_optimizer::propagate_copies(VM_ir &ir)
+{
+    vector<unsigned int> forward = identity(ir);
+    bool changed = false;
+    bool again = true;
+    while (again)
+    {
+        again = false;
+        for (VM_ir_block const &block : ir.blocks)
+        {
+            for (unsigned int v : block.code)
+            {
+                VM_ir_value const &value = ir.values[v];
+                if (forward[v] != v || (VM_ir_op::COPY != value.op && VM_ir_op::PHI != value.op))
+                {
+                    continue;
+                }
+
+                // the one value other than itself that a phi takes
+                unsigned int only = UINT_MAX;
+                for (unsigned int arg : value.args)
+                {
+                    arg = resolve(forward, arg);
+                    if (arg == v || arg == only)
+                    {
+                        continue;
+                    }
+                    if (UINT_MAX != only)
+                    {
+                        only = UINT_MAX;
+                        break;
+                    }
+                    only = arg;
+                }
+                if (UINT_MAX == only)
+                {
+                    continue;
+                }
+
+                forward[v] = only;
+                ++counts.copies;
+                again = changed = true;
+            }
+        }
+    }
+
+    if (changed)
+    {
+        forward_uses(ir, forward);
+    }
+    return changed;
+}
+
+// Walk the dominator tree, keeping the values computed on the way down
+// to each block in table.
+bool VM_ir_optimizer::eliminate_common_subexpressions(VM_ir &ir)
+{
+    const vector<unsigned int> idom = ir.dominators();
+    vector<vector<unsigned int>> children(ir.blocks.size());
+    for (unsigned int block = 1; block < ir.blocks.size(); ++block)
+    {
+        children[idom[block]].push_back(block);
+    }
+
+    vector<unsigned int> forward = identity(ir);
+    map<vector<int>, unsigned int> table;
+    vector<vector<vector<int>>> added(ir.blocks.size());
+    bool changed = false;
+
+    // each block twice: on the way down, then on the way back up
+    vector<pair<unsigned int, bool>> pending = {{0, false}};
+    while (!pending.empty())
+    {
+        const unsigned int block = pending.back().first;
+        const bool done = pending.back().second;
+        pending.pop_back();
+        if (done)
+        {
+            for (vector<int> const &key : added[block])
+            {
+                table.erase(key);
+            }
+            continue;
+        }
+        pending.push_back({block, true});
+        for (unsigned int child : children[block])
+        {
+            pending.push_back({child, false});
+        }
+
+        // what each heap cell holds since the block started
+        map<int, unsigned int> cells;
+        for (unsigned int v : ir.blocks[block].code)
+        {
+            VM_ir_value &value = ir.values[v];
+            for (unsigned int &arg : value.args)
+            {
+                arg = resolve(forward, arg);
+            }
+
+            unsigned int same = v;
+            if (VM_ir_op::LOAD == value.op)
+            {
+                auto held = cells.find(value.operand);
+                if (held != cells.end())
+                {
+                    same = held->second;
+                }
+                else
+                {
+                    cells[value.operand] = v;
+                }
+            }
+            else if (VM_ir_op::STORE == value.op)
+            {
+                cells[value.operand] = value.args[0];
+            }
+            else if (VM_ir_op::COPY != value.op)
+            {
+                vector<int> key = {(int)value.op, VM_ir_op::CONST == value.op ? value.operand : 0,
+                                   VM_ir_op::PHI == value.op ? (int)block : -1};
+                vector<unsigned int> args = value.args;
+                if (commutative(value.op))
+                {
+                    sort(args.begin(), args.end());
+                }
+                key.insert(key.end(), args.begin(), args.end());
+
+                auto found = table.find(key);
+                if (found != table.end())
+                {
+                    same = found->second;
+                }
+                else
+                {
+                    table[key] = v;
+                    added[block].push_back(key);
+                }
+            }
+
+            if (same != v)
+            {
+                forward[v] = same;
+                ++counts.common;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed)
+    {
+        forward_uses(ir, forward);
+    }
+    return changed;
+}
+
+bool VM_ir_optimizer::eliminate_dead_code(VM_ir &ir)
+{
+    bool changed = false;
+    bool again = true;
+    while (again)
+    {
+        again = fold_branches(ir);
+        again |= drop_unreachable(ir);
+        again |= merge_blocks(ir);
+        again |= skip_jumps(ir);
+        changed |= again;
+    }
+    changed |= drop_dead_values(ir);
+    return changed;
+}
+
+bool VM_ir_optimizer::fold_branches(VM_ir &ir)
+{
+    bool changed = false;
+    for (unsigned int block = 0; block < ir.blocks.size(); ++block)
+    {
+        VM_ir_block &b = ir.blocks[block];
+        int value;
+        if (VM_ir_block::BRANCH != b.exit || !constant(ir, b.value, value))
+        {
+            continue;
+        }
+
+        const unsigned int keep = passes(b.test, value) ? b.next[0] : b.next[1];
+        const unsigned int drop = passes(b.test, value) ? b.next[1] : b.next[0];
+        b.exit = VM_ir_block::JUMP;
+        b.next[0] = keep;
+        b.next[1] = 0;
+        ir.remove_pred(drop, block);
+        changed = true;
+    }
+    return changed;
+}
+
+bool VM_ir_optimizer::drop_unreachable(VM_ir &ir)
+{
+    const vector<unsigned int> reached = ir.order();
+    if (reached.size() == ir.blocks.size())
+    {
+        return false;
+    }
+
+    vector<bool> keep(ir.blocks.size(), false);
+    for (unsigned int block : reached)
+    {
+        keep[block] = true;
+    }
+    for (unsigned int block : reached)
+    {
+        const vector<unsigned int> preds = ir.blocks[block].preds;
+        for (unsigned int pred : preds)
+        {
+            if (!keep[pred])
+            {
+                ir.remove_pred(block, pred);
+            }
+        }
+    }
+
+    counts.dead_blocks += (unsigned int)(ir.blocks.size() - reached.size());
+    renumber(ir, keep);
+    return true;
+}
+
+bool VM_ir_optimizer::merge_blocks(VM_ir &ir)
+{
+    vector<bool> keep(ir.blocks.size(), true);
+    vector<unsigned int> forward = identity(ir);
+    bool changed = false;
+    for (unsigned int block = 0; block < ir.blocks.size(); ++block)
+    {
+        while (keep[block] && VM_ir_block::JUMP == ir.blocks[block].exit)
+        {
+            const unsigned int next = ir.blocks[block].next[0];
+            if (next == block || 0 == next || 1 != ir.blocks[next].preds.size())
+            {
+                break;
+            }
+
+            VM_ir_block &b = ir.blocks[block];
+            VM_ir_block &n = ir.blocks[next];
+            for (unsigned int v : n.code)
+            {
+                if (VM_ir_op::PHI == ir.values[v].op)
+                {
+                    forward[v] = ir.values[v].args[0];
+                }
+                else
+                {
+                    ir.values[v].block = block;
+                    b.code.push_back(v);
+                }
+            }
+            n.code.clear();
+
+            b.exit = n.exit;
+            b.test = n.test;
+            b.value = n.value;
+            b.next[0] = n.next[0];
+            b.next[1] = n.next[1];
+            for (unsigned int after : ir.successors(block))
+            {
+                replace(ir.blocks[after].preds.begin(), ir.blocks[after].preds.end(), next, block);
+            }
+            n.preds.clear();
+            n.exit = VM_ir_block::RETURN;
+            keep[next] = false;
+            ++counts.dead_blocks;
+            changed = true;
+        }
+    }
+
+    if (changed)
+    {
+        forward_uses(ir, forward);
+        renumber(ir, keep);
+    }
+    return changed;
+}
+
+// Send the predecessors of a block that only jumps on straight to where
+// it goes, where that does not make them predecessors twice.
+bool VM_ir_optimizer::skip_jumps(VM_ir &ir)
+{
+    bool changed = false;
+    for (unsigned int block = 1; block < ir.blocks.size(); ++block)
+    {
+        VM_ir_block const &b = ir.blocks[block];
+        const unsigned int to = b.next[0];
+        if (VM_ir_block::JUMP != b.exit || !b.code.empty() || to == block)
+        {
+            continue;
+        }
+
+        const size_t index = find(ir.blocks[to].preds.begin(), ir.blocks[to].preds.end(), block) -
+                             ir.blocks[to].preds.begin();
+        const vector<unsigned int> preds = b.preds;
+        for (unsigned int pred : preds)
+        {
+            vector<unsigned int> &into = ir.blocks[to].preds;
+            if (find(into.begin(), into.end(), pred) != into.end())
+            {
+                continue;
+            }
+
+            for (unsigned int &n : ir.blocks[pred].next)
+            {
+                if (n == block)
+                {
+                    n = to;
+                }
+            }
+            into.push_back(pred);
+            for (unsigned int v : ir.blocks[to].code)
+            {
+                if (VM_ir_op::PHI == ir.values[v].op)
+                {
+                    ir.values[v].args.push_back(ir.values[v].args[index]);
+                }
+            }
+            ir.remove_pred(block, pred);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool VM_ir_optimizer::drop_dead_values(VM_ir &ir)
+{
+    vector<bool> live(ir.values.size(), false);
+    vector<unsigned int> pending;
+    auto mark = [&](unsigned int v) {
+        if (!live[v])
+        {
+            live[v] = true;
+            pending.push_back(v);
+        }
+    };
+
+    for (VM_ir_block const &block : ir.blocks)
+    {
+        for (unsigned int v : block.code)
+        {
+            if (side_effect(ir, v))
+            {
+                mark(v);
+            }
+        }
+        if (VM_ir_block::JUMP != block.exit)
+        {
+            mark(block.value);
+        }
+    }
+    while (!pending.empty())
+    {
+        const unsigned int v = pending.back();
+        pending.pop_back();
+        for (unsigned int arg : ir.values[v].args)
+        {
+            mark(arg);
+        }
+    }
+
+    bool changed = false;
+    for (VM_ir_block &block : ir.blocks)
+    {
+        const size_t before = block.code.size();
+        block.code.erase(remove_if(block.code.begin(), block.code.end(), [&live](unsigned int v) { return !live[v]; }),
+                         block.code.end());
+        counts.dead_values += (unsigned int)(before - block.code.size());
+        changed |= before != block.code.size();
+    }
+    return changed;
+}
+
+void VM_ir_optimizer::renumber(VM_ir &ir, std::vector<bool> const &keep)
+{
+    vector<unsigned int> index(ir.blocks.size(), 0);
+    vector<VM_ir_block> kept;
+    for (unsigned int block = 0; block < ir.blocks.size(); ++block)
+    {
+        if (keep[block])
+        {
+            index[block] = (unsigned int)kept.size();
+            kept.push_back(ir.blocks[block]);
+        }
+    }
+
+    for (unsigned int block = 0; block < kept.size(); ++block)
+    {
+        VM_ir_block &b = kept[block];
+        for (unsigned int &pred : b.preds)
+        {
+            pred = index[pred];
+        }
+        for (unsigned int &next : b.next)
+        {
+            next = index[next];
+        }
+        for (unsigned int v : b.code)
+        {
+            ir.values[v].block = block;
+        }
+    }
+    ir.blocks.swap(kept);
+}
+
+bool VM_ir_optimizer::hoist_loop_invariants(VM_ir &ir)
+{
+    bool changed = false;
+    bool moved = true;
+    while (moved)
+    {
+        moved = false;
+        const vector<unsigned int> idom = ir.dominators();
+        const vector<unsigned int> rpo = ir.order();
+
+        for (unsigned int header : rpo)
+        {
+            // the blocks that reach a jump back to header without passing it
+            vector<bool> loop(ir.blocks.size(), false);
+            vector<unsigned int> pending;
+            bool back = false;
+            loop[header] = true;
+            for (unsigned int pred : ir.blocks[header].preds)
+            {
+                back = back || VM_ir::dominates(idom, header, pred);
+                if (VM_ir::dominates(idom, header, pred) && !loop[pred])
+                {
+                    loop[pred] = true;
+                    pending.push_back(pred);
+                }
+            }
+            if (!back)
+            {
+                continue;
+            }
+            while (!pending.empty())
+            {
+                const unsigned int block = pending.back();
+                pending.pop_back();
+                for (unsigned int pred : ir.blocks[block].preds)
+                {
+                    if (!loop[pred])
+                    {
+                        loop[pred] = true;
+                        pending.push_back(pred);
+                    }
+                }
+            }
+
+            set<int> stored;
+            for (unsigned int block : rpo)
+            {
+                if (!loop[block])
+                {
+                    continue;
+                }
+                for (unsigned int v : ir.blocks[block].code)
+                {
+                    if (VM_ir_op::STORE == ir.values[v].op)
+                    {
+                        stored.insert(ir.values[v].operand);
+                    }
+                }
+            }
+
+            // in the order they are computed, so each one's arguments go first
+            vector<bool> invariant(ir.values.size(), false);
+            vector<unsigned int> hoist;
+            for (unsigned int block : rpo)
+            {
+                if (!loop[block])
+                {
+                    continue;
+                }
+                for (unsigned int v : ir.blocks[block].code)
+                {
+                    VM_ir_value const &value = ir.values[v];
+                    bool movable = VM_ir_op::CONST == value.op || (arithmetic(value.op) && !may_trap(ir, v)) ||
+                                   (VM_ir_op::LOAD == value.op && 0 == stored.count(value.operand));
+                    for (unsigned int arg : value.args)
+                    {
+                        movable = movable && (!loop[ir.values[arg].block] || invariant[arg]);
+                    }
+                    if (movable)
+                    {
+                        invariant[v] = true;
+                        hoist.push_back(v);
+                    }
+                }
+            }
+            if (hoist.empty())
+            {
+                continue;
+            }
+
+            const unsigned int before = preheader(ir, header, loop);
+            for (VM_ir_block &block : ir.blocks)
+            {
+                block.code.erase(remove_if(block.code.begin(), block.code.end(),
+                                           [&invariant](unsigned int v) { return invariant[v]; }),
+                                 block.code.end());
+            }
+            for (unsigned int v : hoist)
+            {
+                ir.values[v].block = before;
+                ir.blocks[before].code.push_back(v);
+            }
+            counts.hoisted += (unsigned int)hoist.size();
+            moved = changed = true;
+            break;
+        }
+    }
+    return changed;
+}
+
+unsigned int VM_ir_optimizer::preheader(VM_ir &ir, unsigned int header, std::vector<bool> const &loop)
+{
+    vector<unsigned int> inside, outside, from_inside, from_outside;
+    for (unsigned int k = 0; k < ir.blocks[header].preds.size(); ++k)
+    {
+        const unsigned int pred = ir.blocks[header].preds[k];
+        (loop[pred] ? inside : outside).push_back(pred);
+        (loop[pred] ? from_inside : from_outside).push_back(k);
+    }
+    if (1 == outside.size() && VM_ir_block::JUMP == ir.blocks[outside[0]].exit)
+    {
+        return outside[0];
+    }
+
+    const unsigned int before = ir.add_block();
+    ir.blocks[before].exit = VM_ir_block::JUMP;
+    ir.blocks[before].next[0] = header;
+    ir.blocks[before].preds = outside;
+    for (unsigned int pred : outside)
+    {
+        for (unsigned int &n : ir.blocks[pred].next)
+        {
+            if (n == header)
+            {
+                n = before;
+            }
+        }
+    }
+
+    // the header's phis take what came from outside from the new block,
+    // through phis of its own if it has more than one way in
+    for (unsigned int v : ir.blocks[header].code)
+    {
+        if (VM_ir_op::PHI != ir.values[v].op)
+        {
+            continue;
+        }
+        vector<unsigned int> args, outer;
+        for (unsigned int k : from_inside)
+        {
+            args.push_back(ir.values[v].args[k]);
+        }
+        for (unsigned int k : from_outside)
+        {
+            outer.push_back(ir.values[v].args[k]);
+        }
+        if (1 == outer.size())
+        {
+            args.push_back(outer[0]);
+        }
+        else
+        {
+            const unsigned int phi = ir.add_value(before, VM_ir_op::PHI, 0, outer);
+            ir.blocks[before].code.push_back(phi);
+            args.push_back(phi);
+        }
+        ir.values[v].args = args;
+    }
+
+    inside.push_back(before);
+    ir.blocks[header].preds = inside;
+    return before;
+}
@@ -2,19 +2,19 @@
 
 using namespace std;
 
-VM_exec_status::VM_exec_status(int value)
-    : is_ok(true), value(value), msg("Execution OK")
+VM_exec_status::VM_exec_status(int value, unsigned int ticks)
+    : error(VM_error::OK), value(value), detail(nullptr), ticks(ticks)
 {
 }
 
-VM_exec_status::VM_exec_status(const string & msg)
-    : is_ok(false), value(-1), msg(msg)
+VM_exec_status::VM_exec_status(VM_error error, const char *detail, unsigned int ticks)
+    : error(error), value(-1), detail(detail), ticks(ticks)
 {
 }
 
 bool VM_exec_status::is_status_ok() const
 {
-    return is_ok;
+    return VM_error::OK == error;
 }
 
 int VM_exec_status::get_program_value() const
@@ -22,7 +22,45 @@ int VM_exec_status::get_program_value() const
     return value;
 }
 
-const string &VM_exec_status::get_message() const
+VM_error VM_exec_status::get_error() const
 {
-    return msg;
+    return error;
+}
+
+string VM_exec_status::get_message() const
+{
+    const string what(detail ? detail : "???");
+
+    switch (error)
+    {
+    case VM_error::OK:
+        return "Execution OK";
+    case VM_error::INVALID_PROGRAM:
+        return "Cannot execute invalid program";
+    case VM_error::INVALID_OPCODE:
+        return "Internal Error: Invalid OPCODE detected";
+    case VM_error::MAX_RUNTIME:
+        return "Max Runtime Exceeded";
+    case VM_error::NO_VALUE:
+        return "Program produced no value";
+    case VM_error::DIVISION_BY_ZERO:
+        return "Division by zero not allowed";
+    case VM_error::STACK_OVERFLOW:
+        return "Stack overflow on " + what;
+    case VM_error::STACK_UNDERFLOW:
+        return "Not enough arguments on stack for " + what;
+    case VM_error::INDEX_OUT_OF_RANGE:
+        return what + " index out of range";
+    case VM_error::UNDEFINED_LABEL:
+        return "Label was never defined";
+    case VM_error::BRANCH_OUT_OF_RANGE:
+        return "branch beyond end of program";
+    }
+
+    return "Unknown error";
+}
+
+unsigned int VM_exec_status::get_ticks() const
+{
+    return ticks;
 }
@@ -0,0 +1,235 @@
+#include "VM_image.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VM_IMAGE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define VM_IMAGE_MMAP 0
+#endif
+
+using namespace std;
+
+namespace
+{
+
+const char MAGIC[4] = {'K', '9', 'I', 'M'};
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr size_t ALIGNMENT = 16;
+
+struct image_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t machine;
+    uint32_t sections;
+    uint32_t reserved;
+    uint64_t size;       // of the whole file
+    uint64_t checksum;   // of everything after the header
+};
+
+struct image_section
+{
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t offset;     // from the start of the file
+    uint64_t size;
+};
+
+static_assert(sizeof(image_header) == 40, "header layout is part of the format");
+static_assert(sizeof(image_section) == 24, "section layout is part of the format");
+
+// FNV-1a, 64 bit
+uint64_t checksum(unsigned char const *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+size_t aligned(size_t size)
+{
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+} // namespace
+
+VM_image_writer::VM_image_writer(VM_image_machine machine)
+    : machine(machine)
+{
+}
+
+void VM_image_writer::add(VM_image_section kind, void const *data, size_t size)
+{
+    unsigned char const *bytes = static_cast<unsigned char const *>(data);
+    sections.push_back(make_pair(kind, vector<unsigned char>(bytes, bytes + size)));
+}
+
+bool VM_image_writer::write(string const &path) const
+{
+    size_t offset = aligned(sizeof(image_header) + sections.size() * sizeof(image_section));
+    vector<image_section> table;
+    for (auto const &section : sections)
+    {
+        table.push_back({(uint32_t)section.first, 0, offset, section.second.size()});
+        offset = aligned(offset + section.second.size());
+    }
+
+    vector<unsigned char> file(offset, 0);
+    if (!table.empty())
+    {
+        memcpy(&file[sizeof(image_header)], table.data(), table.size() * sizeof(image_section));
+    }
+    for (size_t i = 0; i < sections.size(); ++i)
+    {
+        copy(sections[i].second.begin(), sections[i].second.end(), file.begin() + table[i].offset);
+    }
+
+    image_header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VM_IMAGE_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.machine = (uint32_t)machine;
+    header.sections = (uint32_t)sections.size();
+    header.size = file.size();
+    header.checksum = checksum(file.data() + sizeof(header), file.size() - sizeof(header));
+    memcpy(file.data(), &header, sizeof(header));
+
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<char const *>(file.data()), file.size());
+    return (bool)out;
+}
+
+VM_image::VM_image()
+    : base(nullptr), length(0), mapped(false)
+{
+}
+
+VM_image::~VM_image()
+{
+    close();
+}
+
+bool VM_image::open(string const &path, VM_image_machine machine)
+{
+    close();
+
+#if VM_IMAGE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (0 == fstat(fd, &info) && info.st_size > 0)
+    {
+        void *memory = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != memory)
+        {
+            base = static_cast<unsigned char const *>(memory);
+            length = (size_t)info.st_size;
+            mapped = true;
+        }
+    }
+    ::close(fd);
+#else
+    ifstream in(path, ios::binary);
+    buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    base = buffer.data();
+    length = buffer.size();
+#endif
+
+    if (!check(machine))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void VM_image::close()
+{
+#if VM_IMAGE_MMAP
+    if (mapped)
+    {
+        munmap(const_cast<unsigned char *>(base), length);
+    }
+#endif
+    buffer.clear();
+    base = nullptr;
+    length = 0;
+    mapped = false;
+}
+
+bool VM_image::is_open() const
+{
+    return nullptr != base;
+}
+
+bool VM_image::check(VM_image_machine machine) const
+{
+    image_header header;
+    if (nullptr == base || length < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, base, sizeof(header));
+
+    if (0 != memcmp(header.magic, MAGIC, sizeof(MAGIC)) ||
+        BYTE_ORDER_MARK != header.byte_order ||
+        VM_IMAGE_VERSION != header.version ||
+        (uint32_t)machine != header.machine ||
+        length != header.size)
+    {
+        return false;
+    }
+
+    if (header.sections > (length - sizeof(header)) / sizeof(image_section))
+    {
+        return false;
+    }
+    image_section const *table = reinterpret_cast<image_section const *>(base + sizeof(header));
+    for (uint32_t i = 0; i < header.sections; ++i)
+    {
+        if (table[i].offset % ALIGNMENT != 0 || table[i].offset > length ||
+            table[i].size > length - table[i].offset)
+        {
+            return false;
+        }
+    }
+
+    return checksum(base + sizeof(header), length - sizeof(header)) == header.checksum;
+}
+
+void const *VM_image::section(VM_image_section kind, size_t &size) const
+{
+    size = 0;
+    if (!is_open())
+    {
+        return nullptr;
+    }
+
+    image_header header;
+    memcpy(&header, base, sizeof(header));
+    image_section const *table = reinterpret_cast<image_section const *>(base + sizeof(header));
+    for (uint32_t i = 0; i < header.sections; ++i)
+    {
+        if ((uint32_t)kind == table[i].kind)
+        {
+            size = table[i].size;
+            return base + table[i].offset;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,193 @@
+#include "VM_lexer.hpp"
+
+namespace
+{
+
+// character classes, looked up rather than compared in the inner loops
+enum : unsigned char
+{
+    DIGIT = 1,
+    WORD_START = 2,
+    BLANK = 4,
+};
+
+struct classes
+{
+    unsigned char of[256];
+
+    constexpr classes()
+        : of()
+    {
+        for (int c = '0'; c <= '9'; ++c)
+        {
+            of[c] = DIGIT;
+        }
+        for (int c = 'a'; c <= 'z'; ++c)
+        {
+            of[c] = WORD_START;
+            of[c - 'a' + 'A'] = WORD_START;
+        }
+        of[(unsigned char)'_'] = WORD_START;
+        of[(unsigned char)'.'] = WORD_START;
+        of[(unsigned char)' '] = BLANK;
+        of[(unsigned char)'\t'] = BLANK;
+        of[(unsigned char)'\r'] = BLANK;
+    }
+};
+
+constexpr classes table;
+
+bool is_digit(char c)
+{
+    return table.of[(unsigned char)c] & DIGIT;
+}
+
+bool is_word_start(char c)
+{
+    return table.of[(unsigned char)c] & WORD_START;
+}
+
+bool is_word(char c)
+{
+    return table.of[(unsigned char)c] & (DIGIT | WORD_START);
+}
+
+bool is_blank(char c)
+{
+    return table.of[(unsigned char)c] & BLANK;
+}
+
+int hex_digit(char c)
+{
+    if (is_digit(c))
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+} // namespace
+
+VM_lexer::VM_lexer(std::string_view source, unsigned int line)
+    : at(source.data()), end(source.data() + source.size()), line(line)
+{
+}
+
+VM_token VM_lexer::next()
+{
+    for (;;)
+    {
+        while (at < end && is_blank(*at))
+        {
+            ++at;
+        }
+        if (at < end && (';' == *at || '#' == *at))
+        {
+            while (at < end && '\n' != *at)
+            {
+                ++at;
+            }
+        }
+        if (at >= end)
+        {
+            return token(VM_token_kind::END, at);
+        }
+
+        char const *from = at++;
+        switch (*from)
+        {
+        case '\n':
+        {
+            VM_token newline = token(VM_token_kind::NEWLINE, from);
+            ++line;
+            return newline;
+        }
+
+        case ':':
+            return token(VM_token_kind::COLON, from);
+
+        case ',':
+            return token(VM_token_kind::COMMA, from);
+
+        case '-':
+        case '+':
+            if (at < end && is_digit(*at))
+            {
+                return number(from);
+            }
+            return token(VM_token_kind::BAD, from);
+
+        default:
+            if (is_digit(*from))
+            {
+                return number(from);
+            }
+            if (is_word_start(*from))
+            {
+                while (at < end && is_word(*at))
+                {
+                    ++at;
+                }
+                VM_token word = token(VM_token_kind::WORD, from);
+                word.key = VM_word_key(word.text);
+                return word;
+            }
+            return token(VM_token_kind::BAD, from);
+        }
+    }
+}
+
+VM_token VM_lexer::token(VM_token_kind kind, char const *from)
+{
+    return VM_token{kind, std::string_view(from, at - from), 0, 0, line};
+}
+
+VM_token VM_lexer::number(char const *from)
+{
+    const bool negative = '-' == *from;
+    char const *digits = is_digit(*from) ? from : from + 1;
+    at = digits;
+
+    // past HUGE_NUMBER the value no longer matters, only that it is too big
+    long long value = 0;
+    bool any = false;
+    if ('0' == *at && at + 1 < end && ('x' == at[1] || 'X' == at[1]))
+    {
+        at += 2;
+        for (int digit; at < end && (digit = hex_digit(*at)) >= 0; ++at)
+        {
+            value = value < HUGE_NUMBER ? value * 16 + digit : HUGE_NUMBER;
+            any = true;
+        }
+    }
+    else
+    {
+        for (; at < end && is_digit(*at); ++at)
+        {
+            value = value < HUGE_NUMBER ? value * 10 + (*at - '0') : HUGE_NUMBER;
+            any = true;
+        }
+    }
+
+    // a number runs into nothing else: 12ab is not 12 then ab
+    if (!any || (at < end && is_word(*at)))
+    {
+        while (at < end && is_word(*at))
+        {
+            ++at;
+        }
+        return token(VM_token_kind::BAD, from);
+    }
+
+    VM_token result = token(VM_token_kind::NUMBER, from);
+    result.number = value >= HUGE_NUMBER ? HUGE_NUMBER : (negative ? -value : value);
+    return result;
+}
@@ -0,0 +1,179 @@
+#include "VM_profile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define VM_PROFILE_RDTSC 1
+#else
+#define VM_PROFILE_RDTSC 0
+#endif
+
+using namespace std;
+
+namespace
+{
+
+string line(char const *format, ...) __attribute__((format(printf, 1, 2)));
+
+string line(char const *format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return buffer;
+}
+
+double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+} // namespace
+
+bool VM_profile::fits(unsigned int length) const
+{
+    return listing.size() == length;
+}
+
+void VM_profile::prepare(unsigned int length)
+{
+    listing.assign(length, instruction{"", false, false});
+    names.assign(256, "");
+    clear();
+}
+
+void VM_profile::clear()
+{
+    executions = 0;
+    fill(begin(ops), end(ops), 0);
+    hits.assign(listing.size(), 0);
+    taken.assign(listing.size(), 0);
+    time.assign(listing.size(), 0);
+}
+
+unsigned int VM_profile::next_interval()
+{
+    // xorshift32
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return 1 + seed % (2 * SAMPLE_PERIOD - 1);
+}
+
+uint64_t VM_profile::clock()
+{
+#if VM_PROFILE_RDTSC
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void VM_profile::report(std::ostream &out) const
+{
+    uint64_t instructions = 0;
+    uint64_t ticks = 0;
+    for (unsigned int op = 0; op < 256; ++op)
+    {
+        instructions += ops[op];
+    }
+    for (uint64_t t : time)
+    {
+        ticks += t;
+    }
+
+    out << line("%llu executions, %llu instructions, %llu clock ticks\n",
+                (unsigned long long)executions, (unsigned long long)instructions, (unsigned long long)ticks);
+
+    out << "\nopcode              count      share\n";
+    for (unsigned int op = 0; op < 256; ++op)
+    {
+        if (ops[op] > 0)
+        {
+            out << line("%-8s %16llu %9.2f%%\n", names[op].c_str(), (unsigned long long)ops[op],
+                        percent(ops[op], instructions));
+        }
+    }
+
+    vector<unsigned int> pcs;
+    for (unsigned int pc = 0; pc < hits.size(); ++pc)
+    {
+        if (hits[pc] > 0)
+        {
+            pcs.push_back(pc);
+        }
+    }
+    stable_sort(pcs.begin(), pcs.end(), [this](unsigned int a, unsigned int b) { return hits[a] > hits[b]; });
+
+    out << "\n    pc             hits      share     taken  instruction\n";
+    for (unsigned int pc : pcs)
+    {
+        string ratio = listing[pc].conditional ? line("%8.2f%%", percent(taken[pc], hits[pc])) : "         ";
+        out << line("%6u %16llu %9.2f%% %s  %s\n", pc, (unsigned long long)hits[pc],
+                    percent(hits[pc], instructions), ratio.c_str(), listing[pc].text.c_str());
+    }
+
+    pcs.clear();
+    for (unsigned int pc = 0; pc < time.size(); ++pc)
+    {
+        if (time[pc] > 0)
+        {
+            pcs.push_back(pc);
+        }
+    }
+    stable_sort(pcs.begin(), pcs.end(), [this](unsigned int a, unsigned int b) { return time[a] > time[b]; });
+
+    out << "\n   run            ticks      share  first instruction\n";
+    for (unsigned int pc : pcs)
+    {
+        out << line("%6u %16llu %9.2f%%  %s\n", pc, (unsigned long long)time[pc], percent(time[pc], ticks),
+                    listing[pc].text.c_str());
+    }
+}
+
+void VM_profile::folded(std::ostream &out, std::string const &program) const
+{
+    auto frame = [this](unsigned int pc) {
+        string text = to_string(pc) + " " + listing[pc].text;
+        replace(text.begin(), text.end(), ';', ':');
+        return text;
+    };
+
+    for (unsigned int start = 0; start < time.size(); ++start)
+    {
+        if (0 == time[start])
+        {
+            continue;
+        }
+
+        // the run goes on to the first jump
+        vector<unsigned int> run;
+        for (unsigned int pc = start; pc < listing.size(); ++pc)
+        {
+            if (listing[pc].text.empty())
+            {
+                continue;
+            }
+            run.push_back(pc);
+            if (listing[pc].jump)
+            {
+                break;
+            }
+        }
+
+        const uint64_t share = run.empty() ? 0 : time[start] / run.size();
+        for (unsigned int pc : run)
+        {
+            if (share > 0)
+            {
+                out << program << ";" << frame(start) << ";" << frame(pc) << " " << share << "\n";
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#include "VM_thread_pool.hpp"
+
+using namespace std;
+
+VM_thread_pool::VM_thread_pool(unsigned int threads)
+    : task(nullptr), generation(0), busy(0), stopping(false)
+{
+    if (0 == threads)
+    {
+        threads = hardware_threads();
+    }
+
+    for (unsigned int i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(&VM_thread_pool::work, this, i);
+    }
+}
+
+VM_thread_pool::~VM_thread_pool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    start.notify_all();
+
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+unsigned int VM_thread_pool::hardware_threads()
+{
+    unsigned int threads = thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
+
+unsigned int VM_thread_pool::size() const
+{
+    return (unsigned int)workers.size();
+}
+
+void VM_thread_pool::run(function<void(unsigned int)> const &task)
+{
+    unique_lock<mutex> guard(lock);
+    this->task = &task;
+    busy = (unsigned int)workers.size();
+    ++generation;
+    start.notify_all();
+
+    finished.wait(guard, [this]() { return 0 == busy; });
+    this->task = nullptr;
+}
+
+void VM_thread_pool::work(unsigned int worker)
+{
+    unsigned long seen = 0;
+    for (;;)
+    {
+        function<void(unsigned int)> const *job;
+        {
+            unique_lock<mutex> guard(lock);
+            start.wait(guard, [this, seen]() { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+            job = task;
+        }
+
+        (*job)(worker);
+
+        {
+            lock_guard<mutex> guard(lock);
+            if (0 == --busy)
+            {
+                finished.notify_one();
+            }
+        }
+    }
+}
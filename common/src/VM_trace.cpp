@@ -0,0 +1,56 @@
+#include "VM_trace.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+VM_trace::VM_trace(size_t capacity)
+    : head(0)
+{
+    size_t size = 1;
+    while (size < capacity + 1)
+    {
+        size <<= 1;
+    }
+    records.reset(new VM_trace_record[size]());
+    mask = size - 1;
+}
+
+size_t VM_trace::capacity() const
+{
+    return mask;
+}
+
+uint64_t VM_trace::recorded() const
+{
+    return head.load(memory_order_acquire);
+}
+
+void VM_trace::clear()
+{
+    head.store(0, memory_order_release);
+}
+
+vector<VM_trace_record> VM_trace::last(size_t count) const
+{
+    const uint64_t end = head.load(memory_order_acquire);
+    const uint64_t begin = end - min<uint64_t>({(uint64_t)count, (uint64_t)capacity(), end});
+
+    vector<VM_trace_record> copy;
+    copy.reserve(end - begin);
+    for (uint64_t i = begin; i < end; ++i)
+    {
+        copy.push_back(records[i & mask]);
+    }
+
+    // the recorder may have overwritten records while we copied, and may
+    // be halfway through the next one
+    atomic_thread_fence(memory_order_acquire);
+    const uint64_t now = head.load(memory_order_relaxed) + 1;
+    const uint64_t overwritten = now > mask + 1 ? now - (mask + 1) : 0;
+    if (overwritten > begin)
+    {
+        copy.erase(copy.begin(), copy.begin() + min<uint64_t>(overwritten - begin, copy.size()));
+    }
+    return copy;
+}
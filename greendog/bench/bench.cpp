@@ -0,0 +1,339 @@
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "VM_bench.hpp"
+#include "VM_stack_program.hpp"
+#include "VM_stack_translator.hpp"
+#include "vm.hpp"
+
+using namespace std;
+
+// Loop kernels, the first two taken from the test suite, scaled up so the
+// runs are long enough to time.  All read their argument from heap[0] and
+// leave the result in heap[3].
+
+void factorial_program(VM &vm, int arg)
+{
+    vm.set_heap(0, arg);
+    vm.set_heap(1, 1);
+    vm.set_heap(2, 0);
+    vm.set_heap(3, -1);
+
+    vm.load(1, 0);
+    vm.jlt(1, 10);
+    vm.load(2, 1);
+    vm.load(3, 1);
+    vm.jmp(7);
+    vm.mul(2, 1, 2);
+    vm.sub(1, 3, 1);
+    vm.jle(1, 9);
+    vm.jmp(5);
+    vm.store(2, 3);
+    vm.cmp(1, 1, 1);
+}
+
+void fibonacci_program(VM &vm, int arg)
+{
+    vm.set_heap(0, arg);
+    vm.set_heap(1, 1);
+    vm.set_heap(3, -1);
+
+    vm.load(1, 0);
+    vm.jle(1, 12);
+    vm.load(2, 1);
+    vm.load(3, 1);
+    vm.load(4, 1);
+    vm.jmp(9);
+    vm.store(3, 2);
+    vm.add(2, 3, 3);
+    vm.load(2, 2);
+    vm.sub(1, 4, 1);
+    vm.jle(1, 13);
+    vm.jmp(6);
+    vm.load(2, 3);
+    vm.store(2, 3);
+}
+
+// 1 + 2 + ... + arg
+void summation_program(VM &vm, int arg)
+{
+    vm.set_heap(0, arg);
+    vm.set_heap(1, 1);
+    vm.set_heap(2, 0);
+    vm.set_heap(3, -1);
+
+    vm.load(1, 0);
+    vm.load(3, 1);
+    vm.load(2, 2);
+    vm.jle(1, 7);
+    vm.add(2, 1, 2);
+    vm.sub(1, 3, 1);
+    vm.jmp(3);
+    vm.store(2, 3);
+}
+
+// counts outer * inner trips through the inner loop; inner is in heap[4]
+void nested_loops_program(VM &vm, int outer, int inner)
+{
+    vm.set_heap(0, outer);
+    vm.set_heap(1, 1);
+    vm.set_heap(2, 0);
+    vm.set_heap(3, -1);
+    vm.set_heap(4, inner);
+
+    vm.load(1, 0);
+    vm.load(3, 1);
+    vm.load(2, 2);
+    vm.jle(1, 11);
+    vm.load(4, 4);
+    vm.jle(4, 9);
+    vm.add(2, 3, 2);
+    vm.sub(4, 3, 4);
+    vm.jmp(5);
+    vm.sub(1, 3, 1);
+    vm.jmp(3);
+    vm.store(2, 3);
+}
+
+// Enough repetitions of an opcode that the cost of starting exec
+// disappears.  r1 holds 1 and r2 holds 2, so nothing divides by zero.
+constexpr unsigned int REPEATS = 256;
+
+void opcode(VM_bench &bench, const char *name, function<void(VM &, unsigned int)> step)
+{
+    VM vm;
+    vm.set_heap(1, 1);
+    vm.set_heap(2, 2);
+    vm.load(1, 1);
+    vm.load(2, 2);
+    for (unsigned int i = 0; i < REPEATS; ++i)
+    {
+        step(vm, i);
+    }
+    // somewhere for the last jump to land
+    vm.load(3, 1);
+
+    bench.run(string("op/") + name, [&vm]() { return vm.exec_trusted().get_ticks(); });
+}
+
+void opcodes(VM_bench &bench)
+{
+    opcode(bench, "LOAD", [](VM &vm, unsigned int) { vm.load(3, 1); });
+    opcode(bench, "STORE", [](VM &vm, unsigned int) { vm.store(1, 3); });
+    opcode(bench, "ADD", [](VM &vm, unsigned int) { vm.add(1, 2, 3); });
+    opcode(bench, "SUB", [](VM &vm, unsigned int) { vm.sub(1, 2, 3); });
+    opcode(bench, "MUL", [](VM &vm, unsigned int) { vm.mul(1, 2, 3); });
+    opcode(bench, "DIV", [](VM &vm, unsigned int) { vm.div(1, 2, 3); });
+    opcode(bench, "CMP", [](VM &vm, unsigned int) { vm.cmp(1, 2, 3); });
+
+    // every jump lands on the next instruction, two on from the loads
+    opcode(bench, "JMP", [](VM &vm, unsigned int i) { vm.jmp(i + 3); });
+    opcode(bench, "JGT", [](VM &vm, unsigned int i) { vm.jgt(1, i + 3); });
+}
+
+void kernel(VM_bench &bench, const char *name, function<void(VM &)> build)
+{
+    VM vm;
+    build(vm);
+
+    const string prefix = string("kernel/") + name + "/";
+    bench.run(prefix + "interp", [&vm]() { return vm.exec().get_ticks(); });
+    bench.run(prefix + "trusted", [&vm]() { return vm.exec_trusted().get_ticks(); });
+    VM_executor executor;
+    vm.bind(executor);
+    bench.run(prefix + "bound", [&executor]() { return executor.exec(false).get_ticks(); });
+    VM_profile profile;
+    bench.run(prefix + "profiled", [&vm, &profile]() { return vm.exec_profiled(profile).get_ticks(); });
+    VM_trace trace;
+    bench.run(prefix + "traced", [&vm, &trace]() { return vm.exec_traced(trace).get_ticks(); });
+    bench.run(prefix + "jit", [&vm]() { return vm.exec_jit().get_ticks(); });
+}
+
+// yellowdog's kernels, translated to register code and run on a bound
+// executor and natively.  Ticks count greendog instructions; compare the
+// times with yellowdog's kernel/<name>/bound and /threaded.
+void translated(VM_bench &bench, const char *name, function<void(VM_stack_program &)> build)
+{
+    VM_stack_program program;
+    build(program);
+    vector<unsigned char> code = program.bytes();
+
+    const string prefix = string("translated/") + name + "/";
+    bench.run(prefix + "translate", [&code]() {
+        VM vm;
+        VM_stack_translator translator;
+        translator.translate(code.data(), (unsigned int)code.size(), vm);
+        return (unsigned long long)code.size();
+    });
+
+    VM vm;
+    VM_stack_translator translator;
+    translator.translate(code.data(), (unsigned int)code.size(), vm);
+    VM_executor executor;
+    vm.bind(executor);
+    bench.run(prefix + "bound", [&executor]() { return executor.exec(false).get_ticks(); });
+    bench.run(prefix + "jit", [&vm]() { return vm.exec_jit().get_ticks(); });
+}
+
+using batch_engine = function<vector<VM_exec_status>(VM &, vector<vector<int>> &)>;
+
+// A batch of factorials, one per heap image, across threads workers (0
+// for all of them).
+void batch(VM_bench &bench, string const &engine, unsigned int threads, batch_engine exec)
+{
+    VM vm;
+    factorial_program(vm, 12);
+
+    vector<vector<int>> heaps(1000, vector<int>{12, 1, 0, -1});
+    const string name = "batch/" + engine + "/" + (threads ? to_string(threads) : string("all")) + "_threads";
+    bench.run(name, [&vm, &heaps, exec]() {
+        unsigned long long ticks = 0;
+        for (VM_exec_status const &status : exec(vm, heaps))
+        {
+            ticks += status.get_ticks();
+        }
+        return ticks;
+    });
+}
+
+void batches(VM_bench &bench, unsigned int threads)
+{
+    batch(bench, "pool", threads, [threads](VM &vm, vector<vector<int>> &heaps) {
+        return vm.exec_batch(heaps, threads);
+    });
+
+    const char *names[] = {"lockstep_x1", "lockstep_x4", "lockstep_x8", "lockstep_x16"};
+    for (VM_lockstep_isa isa : {VM_lockstep_isa::NONE, VM_lockstep_isa::SSE2,
+                                VM_lockstep_isa::AVX2, VM_lockstep_isa::AVX512})
+    {
+        if (isa <= VM_lockstep::best())
+        {
+            batch(bench, names[(int)isa], threads, [threads, isa](VM &vm, vector<vector<int>> &heaps) {
+                return vm.exec_lockstep(heaps, threads, MAX_TICKS, isa);
+            });
+        }
+    }
+}
+
+// A batch of factorials over a full 8192 cell base heap that differs
+// between runs in one input cell: whole heap images against overlays on a
+// shared snapshot, each made afresh per batch.
+void overlays(VM_bench &bench, unsigned int threads)
+{
+    VM vm;
+    factorial_program(vm, 12);
+    for (unsigned int addr = 4; addr < MAX_HEAP_SIZE; ++addr)
+    {
+        vm.set_heap(addr, addr);
+    }
+    vm.set_heap(1, 1);
+    vm.set_heap(3, -1);
+
+    vector<int> image(MAX_HEAP_SIZE);
+    for (unsigned int addr = 0; addr < MAX_HEAP_SIZE; ++addr)
+    {
+        image[addr] = vm.get_heap(addr);
+    }
+
+    const string suffix = "/" + (threads ? to_string(threads) : string("all")) + "_threads";
+    bench.run("overlay/images" + suffix, [&vm, &image, threads]() {
+        vector<vector<int>> heaps(1000, image);
+        for (size_t i = 0; i < heaps.size(); ++i)
+        {
+            heaps[i][0] = 1 + i % 12;
+        }
+        unsigned long long ticks = 0;
+        for (VM_exec_status const &status : vm.exec_batch(heaps, threads))
+        {
+            ticks += status.get_ticks();
+        }
+        return ticks;
+    });
+
+    shared_ptr<VM_snapshot const> base = vm.snapshot();
+    bench.run("overlay/overlays" + suffix, [&vm, &base, threads]() {
+        vector<VM_heap> heaps(1000, VM_heap(base));
+        for (size_t i = 0; i < heaps.size(); ++i)
+        {
+            heaps[i].set_heap(0, 1 + i % 12);
+        }
+        unsigned long long ticks = 0;
+        for (VM_exec_status const &status : vm.exec_batch(heaps, threads))
+        {
+            ticks += status.get_ticks();
+        }
+        return ticks;
+    });
+}
+
+// The factorial kernel on a machine with a 16 MB heap, against the
+// default sized one above.
+void wide(VM_bench &bench)
+{
+    VM vm(1u << 22);
+    factorial_program(vm, 12);
+    bench.run("wide/factorial/trusted", [&vm]() { return vm.exec_trusted().get_ticks(); });
+    bench.run("wide/factorial/jit", [&vm]() { return vm.exec_jit().get_ticks(); });
+}
+
+// Programs built into a fresh machine; instructions per second counts
+// the instructions built.
+void builds(VM_bench &bench)
+{
+    bench.run("build/arithmetic", []() {
+        VM vm;
+        for (unsigned int i = 0; i < REPEATS; ++i)
+        {
+            vm.add(1, 2, 3);
+        }
+        return REPEATS;
+    });
+
+    bench.run("build/jumps", []() {
+        VM vm;
+        for (unsigned int i = 0; i < REPEATS; ++i)
+        {
+            vm.jle(1, i + 1);
+        }
+        return REPEATS;
+    });
+}
+
+// What each engine costs around a one instruction program.
+void setup(VM_bench &bench)
+{
+    VM vm;
+    vm.load(0, 0);
+    bench.run("setup/exec", [&vm]() { return vm.exec().get_ticks(); });
+    bench.run("setup/trusted", [&vm]() { return vm.exec_trusted().get_ticks(); });
+    bench.run("setup/jit", [&vm]() { return vm.exec_jit().get_ticks(); });
+    VM_executor executor;
+    vm.bind(executor);
+    bench.run("setup/bound", [&executor]() { return executor.exec(false).get_ticks(); });
+}
+
+int main(int argc, char **argv)
+{
+    VM_bench bench("greendog", argc, argv);
+
+    opcodes(bench);
+    kernel(bench, "factorial", [](VM &vm) { factorial_program(vm, 12); });
+    kernel(bench, "fibonacci", [](VM &vm) { fibonacci_program(vm, 40); });
+    kernel(bench, "summation", [](VM &vm) { summation_program(vm, 1000); });
+    kernel(bench, "nested_loops", [](VM &vm) { nested_loops_program(vm, 30, 30); });
+    translated(bench, "factorial", [](VM_stack_program &vm) { stack_factorial_program(vm, 12); });
+    translated(bench, "fibonacci", [](VM_stack_program &vm) { stack_fibonacci_program(vm, 40); });
+    translated(bench, "summation", [](VM_stack_program &vm) { stack_summation_program(vm, 1000); });
+    translated(bench, "nested_loops", [](VM_stack_program &vm) { stack_nested_loops_program(vm, 30, 30); });
+    batches(bench, 1);
+    batches(bench, 0);
+    overlays(bench, 1);
+    overlays(bench, 0);
+    wide(bench);
+    builds(bench);
+    setup(bench);
+
+    return bench.finish();
+}
@@ -0,0 +1,37 @@
+#if !defined(VM_ARENA_HPP)
+#define VM_ARENA_HPP 1
+
+#include <cstddef>
+
+// Zeroed memory for a heap of a size picked at run time.  Small heaps come
+// from the allocator.  Large ones are mapped from the kernel, which hands
+// out zero pages as they are first touched, so cells a program never
+// reaches cost nothing.  Heaps of a huge page or more are asked to be
+// backed by huge pages where the host has them: reserved ones first, then
+// transparent ones.  Either way the cells start at zero.  Throws
+// std::bad_alloc, as new would, if the memory cannot be had at all.
+
+class VM_arena
+{
+public:
+    explicit VM_arena(size_t cells = 0, bool huge_pages = true);
+    ~VM_arena();
+
+    VM_arena(VM_arena const &) = delete;
+    VM_arena &operator=(VM_arena const &) = delete;
+
+    int *data();
+    int const *data() const;
+    size_t size() const;
+
+    // whether the cells were mapped rather than allocated
+    bool is_mapped() const;
+
+private:
+    int *cells;
+    size_t count;
+    size_t bytes;    // mapped, rounded up to whole pages
+    bool mapped;
+};
+
+#endif
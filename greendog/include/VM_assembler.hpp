@@ -0,0 +1,45 @@
+#if !defined(VM_ASSEMBLER_HPP)
+#define VM_ASSEMBLER_HPP 1
+
+#include <istream>
+#include <string>
+#include <string_view>
+
+#include "VM_lexer.hpp"
+
+class VM;
+
+// Assembly source, one instruction per line, written as in the README:
+//
+//     LOAD r1 0       ; a comment
+//     JLT r1 10
+//     ADD r1, r2, r3  # operands may be separated by commas
+//
+// Mnemonics may be written in any case; registers are r0 to r31 (r00 and
+// so on also work), addresses and locations are numbers.  Each line is
+// handed to the VM's builder calls as it is read, with nothing built in
+// between.
+
+class VM_assembler
+{
+public:
+    // Append the program in source to vm.  false at the first line that
+    // does not parse, which error() describes; vm keeps what came before.
+    bool assemble(std::string_view source, VM &vm);
+
+    // the same, reading a line at a time
+    bool assemble(std::istream &in, VM &vm);
+
+    std::string const &error() const;
+
+private:
+    std::string message;
+    std::string line;
+
+    bool statements(VM_lexer &lexer, VM &vm);
+    bool reg(VM_token const &token, unsigned int &number);
+    bool value(VM_token const &token, unsigned int limit, unsigned int &number);
+    bool fail(VM_token const &token, char const *what);
+};
+
+#endif
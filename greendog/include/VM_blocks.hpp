@@ -0,0 +1,27 @@
+#if !defined(VM_BLOCKS_HPP)
+#define VM_BLOCKS_HPP 1
+
+#include <vector>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+
+// Straight line run lengths used to charge the tick budget once per block
+// instead of once per instruction.  run_at(pc) is the number of
+// instructions executed when control arrives at pc: everything up to and
+// including the next jump (or the end of the program, which has a run of
+// nothing).
+
+class VM_blocks
+{
+public:
+    VM_blocks();
+
+    void analyse(VM_instruction const *program, unsigned int length);
+    unsigned int const *runs() const;
+
+private:
+    std::vector<unsigned int> run_at;
+};
+
+#endif
@@ -1,55 +1,81 @@
 #if !defined(VM_EXECUTOR_HPP)
 #define VM_EXECUTOR_HPP 1
 
-#include <functional>
-
 #include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+#include "VM_jit.hpp"
 #include "VM_exec_status.hpp"
+#include "VM_profile.hpp"
+#include "VM_trace.hpp"
 
 class VM_executor
 {
-private:
-
 public:
-    VM_executor(unsigned int const *program, unsigned int length, int * heap);
-    VM_exec_status exec(bool verbose);
+    // An executor can be bound to one program after another and run any
+    // number of times in between; each run puts back only what the last
+    // one changed.  written has a bit for each register the program can
+    // write (see VM_verifier).  Unbound, an executor runs the empty
+    // program.
+    VM_executor();
+    VM_executor(VM_instruction const *program, unsigned int length, unsigned int const *runs, int * heap, bool trusted = false, uint32_t written = ~0u);
+    void bind(VM_instruction const *program, unsigned int length, unsigned int const *runs, int * heap, bool trusted = false, uint32_t written = ~0u);
+
+    VM_exec_status exec(bool verbose, unsigned int max_ticks = MAX_TICKS);
+    VM_exec_status exec_jit(VM_jit const &jit, unsigned int max_ticks = MAX_TICKS);
+
+    // exec without tracing, adding to profile, which must be prepared
+    // for this program
+    VM_exec_status exec_profiled(VM_profile &profile, unsigned int max_ticks = MAX_TICKS);
+
+    // exec without tracing to cerr, recording every instruction in trace
+    VM_exec_status exec_traced(VM_trace &trace, unsigned int max_ticks = MAX_TICKS);
 
 private:
-    unsigned int const *program;
+    VM_instruction const *program;
     unsigned int program_size;
+    unsigned int const *runs;
     int * heap;
+    bool trusted;
+    uint32_t written;
     int registers[MAX_REGISTERS];
 
     unsigned int pc;
     unsigned ticks;
+    unsigned int max_ticks;
+    bool precise;
+
+    VM_error status;
 
-    std::string status;
+    // while profiling: the run being timed, when it started and how many
+    // runs it stands for
+    VM_profile *profile;
+    bool timing;
+    unsigned int run_start;
+    uint64_t run_clock;
+    unsigned int run_weight;
+
+    // while recording into a VM_trace
+    VM_trace *tracer;
 
     void reset();
+    VM_exec_status result() const;
+
+    // CHECKED is false only for programs VM_verifier has accepted.
+    // PROFILE builds the interpreter that fills in profile; the one
+    // without it has no profiling code at all.
+    template <bool CHECKED, bool PROFILE = false>
+    void run(bool verbose);
+    template <bool CHECKED, bool PROFILE = false>
+    void interpret(bool verbose);
+    template <bool PROFILE = false>
+    void enter();
+    template <bool CHECKED, typename F>
+    void do_instructions(F instr, const char *name);
+    template <bool CHECKED, bool PROFILE, typename F>
+    void do_jump(VM_instruction const & instr, F test, const char *name);
 
-    struct Instruction
-    {
-        Instruction(unsigned int code, bool verbose = false);
-
-        OPCODE op;
-        unsigned int r1;
-        unsigned int r2;
-        unsigned int r3;
-        unsigned int addr;
-        unsigned int loc;
-
-    private:
-    
-        void decode_RA(unsigned int code);
-        void decode_RRR(unsigned int code);
-        void decode_L(unsigned int code);
-        void decode_RL(unsigned int code);
-    };
-
-    void do_instructions(std::function<void(void)> instr, const char *name);
-    void do_jump(Instruction const & instr, std::function<bool()> test, const char *name);
-
-    void trace(Instruction const & instr) const;
+    // the instruction at pc, about to run
+    void capture(VM_trace_record &record) const;
 };
 
 #endif
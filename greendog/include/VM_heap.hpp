@@ -0,0 +1,101 @@
+#if !defined(VM_HEAP_HPP)
+#define VM_HEAP_HPP 1
+
+#include <memory>
+#include <vector>
+
+#include "VM_arena.hpp"
+#include "vm_defs.hpp"
+
+// Copy-on-write heaps.  A VM_snapshot is a heap that is never written
+// again, so any number of runs on any number of threads can share one.  A
+// VM_heap is a private overlay on a snapshot: it reads through to the
+// snapshot until a page is written, by set_heap or by a run that stores
+// to it, and only from then on holds its own copy of that page.
+//
+// Programs still run on a flat heap (see VM_heap_frame).  STORE addresses
+// are immediates, so the pages a run can change are known before it
+// starts, and only those it did change are copied out to the overlay
+// afterwards.
+
+const constexpr unsigned int HEAP_PAGE_SIZE = 256u;
+
+// pages in a heap of size cells, the last one perhaps partly past its end
+constexpr unsigned int VM_heap_pages(unsigned int size)
+{
+    return (size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+}
+
+class VM_snapshot
+{
+public:
+    // a heap of size cells, cells from address 0 and zeroes after them
+    explicit VM_snapshot(std::vector<int> cells, unsigned int size = MAX_HEAP_SIZE);
+    VM_snapshot(int const *cells, unsigned int count, unsigned int size = MAX_HEAP_SIZE);
+
+    unsigned int size() const;
+    unsigned int pages() const;
+
+    int get_heap(unsigned int addr) const;
+    int const *page(unsigned int n) const;
+
+private:
+    unsigned int cell_count;
+    std::vector<int> cells;    // whole pages
+};
+
+class VM_heap
+{
+public:
+    explicit VM_heap(std::shared_ptr<VM_snapshot const> base);
+
+    std::shared_ptr<VM_snapshot const> const &base() const;
+
+    void set_heap(unsigned int addr, int value);
+    int get_heap(unsigned int addr) const;
+
+    // the pages this overlay has copied, in the order it copied them
+    std::vector<unsigned int> const &private_pages() const;
+    int const *page(unsigned int n) const;
+    // page n, copied from the snapshot first if it is still shared
+    int *page(unsigned int n);
+
+    // back to reading everything from the snapshot
+    void clear();
+
+private:
+    std::shared_ptr<VM_snapshot const> snapshot;
+    std::vector<int> slot;              // by page: index in owned, -1 if shared
+    std::vector<unsigned int> owned;    // page numbers
+    std::vector<int> cells;             // owned.size() pages, back to back
+};
+
+// A flat heap to run programs on overlays.  It holds one snapshot at a
+// time, cut or padded with zeroes to its own size as exec_batch treats
+// heap images, and is only ever changed where an overlay differs from it:
+// enter copies in the overlay's private pages, leave copies out to the
+// overlay those pages the program can store to that now differ from it,
+// and puts the snapshot back in every page either of them touched.  A run
+// costs its pages, not the heap, once the frame holds the right snapshot.
+class VM_heap_frame
+{
+public:
+    explicit VM_heap_frame(unsigned int size = MAX_HEAP_SIZE);
+
+    int *data();
+
+    void enter(VM_heap const &heap);
+    // stored: the pages the program that ran can STORE to
+    void leave(VM_heap &heap, std::vector<unsigned int> const &stored);
+
+private:
+    VM_arena cells;    // zero until first entered
+    std::shared_ptr<VM_snapshot const> holds;
+    std::vector<unsigned int> dirty;    // pages that differ from holds
+
+    int *at(unsigned int n);
+    // page n as holds has it
+    void restore(unsigned int n);
+};
+
+#endif
@@ -0,0 +1,43 @@
+#if !defined(VM_INSTRUCTION_HPP)
+#define VM_INSTRUCTION_HPP 1
+
+#include "vm_defs.hpp"
+
+// A fully decoded instruction.  Programs are translated into an array of
+// these once, as they are built, so that the executor never has to unpack
+// the 32-bit instruction words while running.
+//
+// An address or location too wide for the 16 bits a word has for it is
+// split: the word holds its low 16 bits and an EXT word before it the
+// rest.  The decoded form always holds the whole value.
+
+struct VM_instruction
+{
+    VM_instruction();
+    // prefix is the EXT word before code, if there is one
+    explicit VM_instruction(unsigned int code, unsigned int prefix = 0);
+
+    // the instruction word this decodes from, and the EXT word it needs
+    // first (0 if it needs none)
+    unsigned int encode() const;
+    unsigned int prefix() const;
+    bool operator==(VM_instruction const &other) const;
+
+    OPCODE op;
+    unsigned char r1;
+    unsigned char r2;
+    unsigned char r3;
+    unsigned int addr;
+    unsigned int loc;
+
+private:
+    void decode_RA(unsigned int code);
+    void decode_RRR(unsigned int code);
+    void decode_L(unsigned int code);
+    void decode_RL(unsigned int code);
+};
+
+// images hold these records as they are, to be run in place
+static_assert(sizeof(VM_instruction) == 12, "VM_instruction layout is part of the image format");
+
+#endif
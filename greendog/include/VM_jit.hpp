@@ -0,0 +1,62 @@
+#if !defined(VM_JIT_HPP)
+#define VM_JIT_HPP 1
+
+#include <cstddef>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+
+// The native code generator targets the System V x86-64 calling
+// convention; anywhere else supported() is false and nothing compiles.
+#if defined(__x86_64__) && !defined(_WIN32)
+#define VM_JIT_X86_64 1
+#else
+#define VM_JIT_X86_64 0
+#endif
+
+enum class VM_jit_exit : int
+{
+    FINISHED = 0,
+    OUT_OF_BUDGET = 1,     // the run starting at pc was not charged
+    DIVISION_BY_ZERO = 2,  // at pc, after its run was charged
+};
+
+struct VM_jit_state
+{
+    unsigned int budget;   // ticks left, updated on exit
+    unsigned int pc;
+};
+
+// A verified program compiled to x86-64.  The register file and heap
+// base live in callee saved registers, branches are native jumps and the
+// tick budget is charged once per straight line run, as the interpreter
+// does.  When the budget will not cover a run the code exits and the
+// interpreter finishes one instruction at a time.
+
+class VM_jit
+{
+public:
+    VM_jit();
+    ~VM_jit();
+
+    VM_jit(VM_jit const &) = delete;
+    VM_jit &operator=(VM_jit const &) = delete;
+
+    static bool supported();
+
+    // program must have passed VM_verifier
+    bool compile(VM_instruction const *program, unsigned int length, unsigned int const *runs);
+    bool is_compiled() const;
+    void clear();
+
+    VM_jit_exit run(int *registers, int *heap, VM_jit_state &state) const;
+
+private:
+    using entry_point = int (*)(int *registers, int *heap, VM_jit_state *state);
+
+    void *code;
+    size_t code_size;
+    entry_point entry;
+};
+
+#endif
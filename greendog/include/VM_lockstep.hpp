@@ -0,0 +1,83 @@
+#if !defined(VM_LOCKSTEP_HPP)
+#define VM_LOCKSTEP_HPP 1
+
+#include <cstddef>
+#include <vector>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+#include "VM_blocks.hpp"
+#include "VM_exec_status.hpp"
+
+// The lockstep engine is written with GCC vector extensions.  The 128 bit
+// form is plain SSE2 on x86-64 and is lowered to whatever the target has
+// elsewhere; the wider forms are only built for x86-64.
+#if defined(__GNUC__) && !defined(__clang__)
+#define VM_LOCKSTEP_VECTORS 1
+#else
+#define VM_LOCKSTEP_VECTORS 0
+#endif
+
+#if VM_LOCKSTEP_VECTORS && defined(__x86_64__)
+#define VM_LOCKSTEP_X86_64 1
+#else
+#define VM_LOCKSTEP_X86_64 0
+#endif
+
+enum class VM_lockstep_isa
+{
+    NONE,      // no vector build: one instance at a time on VM_executor
+    SSE2,      // 4 lanes
+    AVX2,      // 8 lanes
+    AVX512,    // 16 lanes
+};
+
+// A verified program run over several heaps at once, one heap per SIMD
+// lane.  Registers are held register-major (one vector per register, one
+// lane per instance) and all lanes at the lowest pc step together; lanes
+// a Jxx sent further on are masked off until the others reach them, and
+// lanes that fail are masked off for good.  Ticks, DIV by zero and the
+// budget are kept per lane, so every instance ends exactly as
+// VM_executor::exec leaves it.
+//
+// The heaps of a group are interleaved cell by cell in one buffer, which
+// makes LOAD a vector load and STORE a masked vector store rather than a
+// gather and scatter over separate heaps.
+
+class VM_lockstep
+{
+public:
+    // program must have passed VM_verifier for heaps of heap_size cells
+    VM_lockstep(VM_instruction const *program, unsigned int length, VM_lockstep_isa isa = best(),
+                unsigned int heap_size = MAX_HEAP_SIZE);
+
+    // the widest form this build and host CPU both support
+    static VM_lockstep_isa best();
+    static unsigned int lanes(VM_lockstep_isa isa);
+    unsigned int lanes() const;
+
+    // Run heaps[0 .. count) together, count <= lanes().  Heaps are copied
+    // in and out as VM::exec_batch does.
+    void exec(std::vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results);
+
+private:
+    using entry_point = void (VM_lockstep::*)(std::vector<int> *, unsigned int, unsigned int, VM_exec_status *);
+
+    VM_instruction const *program;
+    unsigned int program_size;
+    unsigned int heap_size;
+    VM_lockstep_isa isa;
+    entry_point entry;
+    VM_blocks blocks;
+
+    // cells of every lane interleaved, aligned for the widest vector
+    std::vector<int> buffer;
+    int *cells;
+    std::vector<unsigned int> stored;
+
+    void exec_sse2(std::vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results);
+    void exec_avx2(std::vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results);
+    void exec_avx512(std::vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results);
+};
+
+#endif
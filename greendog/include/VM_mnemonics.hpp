@@ -0,0 +1,43 @@
+#if !defined(VM_MNEMONICS_HPP)
+#define VM_MNEMONICS_HPP 1
+
+#include <cstdint>
+#include <ostream>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+#include "VM_trace.hpp"
+
+// The assembly language names of the opcodes and the operands each takes,
+// as in the README: `LOAD rNN addr`, `ADD rN1 rN2 rN3`, `JEQ rNN loc`.
+// The assembler, VM::disassemble and the executor's trace all work from
+// this one table.
+
+enum class VM_operands
+{
+    RA,     // rNN addr
+    RRR,    // rN1 rN2 rN3
+    L,      // loc
+    RL,     // rNN loc
+};
+
+struct VM_mnemonic
+{
+    OPCODE op;
+    char const *name;
+    VM_operands operands;
+    uint64_t key;    // VM_word_key(name)
+};
+
+// nullptr when there is no such opcode or name
+VM_mnemonic const *VM_mnemonic_of(OPCODE op);
+VM_mnemonic const *VM_find_mnemonic(uint64_t key);
+
+// instr as the assembler reads it, without a newline
+std::ostream &operator<<(std::ostream &out, VM_instruction const &instr);
+
+// record as the verbose trace writes it: the pc, the opcode, then the
+// instruction with the values it is about to use
+void VM_write_trace(std::ostream &out, VM_trace_record const &record);
+
+#endif
@@ -0,0 +1,208 @@
+#if !defined(VM_STACK_PROGRAM_HPP)
+#define VM_STACK_PROGRAM_HPP 1
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vm_defs.hpp"
+
+// Yellowdog bytecode laid out as yellowdog's own builder lays it out, for
+// VM_stack_translator: an opcode byte, then an int operand for PUSH, DUPN,
+// DROPN and the jumps, which hold the pc of their label, or -1 when it is
+// never placed.  Shared by the tests and the bench.
+class VM_stack_program
+{
+public:
+    void push(int value) { op(1, value); }
+    void pop() { op(2); }
+    void dup() { op(3); }
+    void dupn(int which) { op(4, which); }
+    void swap() { op(5); }
+    void add() { op(ADD); }
+    void sub() { op(SUB); }
+    void mul() { op(MUL); }
+    void div() { op(DIV); }
+    void cmp() { op(CMP); }
+    void dropn(int which) { op(18, which); }
+    void jmp(std::string const &target) { jump(JMP, target); }
+    void jeq(std::string const &target) { jump(JEQ, target); }
+    void jne(std::string const &target) { jump(JNE, target); }
+    void jlt(std::string const &target) { jump(JLT, target); }
+    void jle(std::string const &target) { jump(JLE, target); }
+    void jgt(std::string const &target) { jump(JGT, target); }
+    void jge(std::string const &target) { jump(JGE, target); }
+    void label(std::string const &name) { labels[name] = (int)code.size(); }
+
+    std::vector<unsigned char> bytes() const
+    {
+        std::vector<unsigned char> patched(code);
+        for (auto const &jump : jumps)
+        {
+            auto found = labels.find(jump.second);
+            const int pc = labels.end() == found ? -1 : found->second;
+            memcpy(&patched[jump.first], &pc, sizeof(int));
+        }
+        return patched;
+    }
+
+private:
+    std::vector<unsigned char> code;
+    std::map<std::string, int> labels;
+    std::vector<std::pair<size_t, std::string>> jumps;
+
+    void op(unsigned char opcode)
+    {
+        code.push_back(opcode);
+    }
+
+    void op(unsigned char opcode, int operand)
+    {
+        code.push_back(opcode);
+        code.resize(code.size() + sizeof(int));
+        memcpy(&code[code.size() - sizeof(int)], &operand, sizeof(int));
+    }
+
+    void jump(unsigned char opcode, std::string const &target)
+    {
+        op(opcode, -1);
+        jumps.push_back(std::make_pair(code.size() - sizeof(int), target));
+    }
+};
+
+// yellowdog's loop kernels, as its tests and bench run them
+
+inline void stack_factorial_program(VM_stack_program &vm, int arg)
+{
+    vm.push(arg);
+    vm.dup();
+    vm.jlt("ERROR_CASE");
+
+    vm.push(1);
+
+    vm.label("LOOP");
+    vm.dupn(2);
+    vm.jle("LOOP_EXIT");
+
+    vm.dupn(2);
+    vm.mul();
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("LOOP");
+
+    vm.label("LOOP_EXIT");
+    vm.swap();
+    vm.pop();
+    vm.jmp("EXIT");
+
+    vm.label("ERROR_CASE");
+    vm.push(-1);
+    vm.jmp("EXIT");
+
+    vm.label("EXIT");
+}
+
+inline void stack_fibonacci_program(VM_stack_program &vm, int arg)
+{
+    vm.push(arg);
+
+    vm.dup();
+    vm.push(0);
+    vm.cmp();
+    vm.jle("ERROR");
+
+    vm.push(1);
+    vm.push(1);
+    vm.jmp("LOOP_TEST");
+
+    vm.label("TOP_OF_LOOP");
+    vm.dupn(3);
+    vm.dupn(3);
+    vm.dupn(2);
+    vm.add();
+    vm.swap();
+    vm.dropn(5);
+    vm.dropn(4);
+
+    vm.label("LOOP_TEST");
+    vm.dupn(3);
+    vm.push(1);
+    vm.sub();
+    vm.dup();
+    vm.jeq("DONE");
+    vm.dropn(4);
+    vm.jmp("TOP_OF_LOOP");
+
+    vm.label("ERROR");
+    vm.push(-1);
+    vm.jmp("EXIT");
+
+    vm.label("DONE");
+    vm.pop();
+
+    vm.label("EXIT");
+}
+
+// 1 + 2 + ... + arg
+inline void stack_summation_program(VM_stack_program &vm, int arg)
+{
+    vm.push(arg);
+    vm.push(0);
+
+    vm.label("LOOP");
+    vm.dupn(2);
+    vm.jle("DONE");
+
+    vm.dupn(2);
+    vm.add();
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("LOOP");
+
+    vm.label("DONE");
+    vm.swap();
+    vm.pop();
+}
+
+// counts outer * inner trips through the inner loop, keeping the count on
+// top of the stack and the loop counters under it
+inline void stack_nested_loops_program(VM_stack_program &vm, int outer, int inner)
+{
+    vm.push(outer);
+    vm.push(0);
+
+    vm.label("OUTER");
+    vm.dupn(2);
+    vm.jle("DONE");
+    vm.push(inner);
+    vm.swap();
+
+    vm.label("INNER");
+    vm.dupn(2);
+    vm.jle("INNER_DONE");
+    vm.push(1);
+    vm.add();
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("INNER");
+
+    vm.label("INNER_DONE");
+    vm.dropn(2);
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("OUTER");
+
+    vm.label("DONE");
+}
+
+#endif
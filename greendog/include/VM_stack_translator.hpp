@@ -0,0 +1,138 @@
+#if !defined(VM_STACK_TRANSLATOR_HPP)
+#define VM_STACK_TRANSLATOR_HPP 1
+
+#include <string>
+#include <vector>
+
+#include "vm_defs.hpp"
+
+class VM;
+
+// Turns a yellowdog stack program into greendog register code.  The
+// stack must have the same depth every time a pc is reached, so that each
+// slot can live in a fixed place: slot k in rk, or when the program needs
+// more than 32 slots, slots 0 to 28 in r00 to r28 and the rest in heap
+// cells, with r29 and r30 kept for moving them.
+//
+// Within a straight line run the translation only tracks where each slot's
+// value is: PUSH remembers a constant, DUP, DUPN and SWAP rename registers
+// and arithmetic writes wherever is free.  Values are put back in their
+// own slots before a jump and wherever one lands.  Constants come from
+// heap cells.  Greendog has no move, so r31 is kept at 0 and a copy is an
+// ADD of it; only a program that needs exactly 32 slots copies with a SUB
+// and an ADD instead.
+//
+// The result is left in r00, which is what a greendog run returns, and
+// stored to result_address().  A translated program divides by zero where
+// the stack program would, and gives the same result otherwise; ticks
+// count greendog instructions.
+
+class VM_stack_translator
+{
+public:
+    // Append the translation of the yellowdog bytecode code[0 .. length)
+    // to vm, which must have no program yet, using heap cells from base on
+    // and setting those that hold constants.  False, leaving vm alone and
+    // error() saying why, if the program is not one the translation can
+    // take: it must be valid, verify, have a known depth at each pc and
+    // never end with an empty stack, and its translation must fit vm.
+    // A vm that already has a program is refused, as the jumps would land
+    // in it.
+    bool translate(unsigned char const *code, unsigned int length, VM &vm, unsigned int base = 0);
+
+    // the same for the code of a yellowdog image (see VM_image)
+    bool translate(std::string const &path, VM &vm, unsigned int base = 0);
+
+    std::string const &error() const;
+
+    // of the last translation: how deep the stack gets, how many slots live
+    // in the heap, how many heap cells it uses from base and which one
+    // gets the result
+    unsigned int max_depth() const;
+    unsigned int spilled() const;
+    unsigned int cells() const;
+    unsigned int result_address() const;
+
+private:
+    struct location
+    {
+        enum kind_type
+        {
+            REG,
+            CONST,
+            MEM
+        };
+
+        kind_type kind;
+        int value;    // register, constant or heap address
+
+        bool operator==(location const &other) const;
+    };
+
+    struct instruction
+    {
+        OPCODE op;
+        unsigned int r1;
+        unsigned int r2;
+        unsigned int r3;
+        unsigned int addr;
+        int label;    // jumps only
+    };
+
+    std::string message;
+
+    // the program being translated, its depth at each pc (-1 where it is
+    // not reached) and the pcs jumps land on
+    unsigned char const *program;
+    unsigned int length;
+    std::vector<int> depth;
+    std::vector<bool> landed;
+    unsigned int deepest;
+
+    // slots below registers are kept in registers; once they spill,
+    // scratch and the one after it are free for moving values about
+    unsigned int registers;
+    unsigned int scratch;
+    unsigned int base;
+    std::vector<int> constants;
+
+    // where each slot is now, the code so far and where each label is:
+    // pcs, then the exit at length, then the exit stubs by depth
+    std::vector<location> stack;
+    std::vector<instruction> code;
+    std::vector<int> position;
+    std::vector<unsigned int> stubs;
+
+    bool analyse();
+    bool fail(std::string const &what, unsigned int pc);
+    void generate();
+
+    // heap cells: the result, two for moving values about, the spilled
+    // slots and the constants
+    unsigned int result_cell() const;
+    unsigned int swap_cell() const;
+    unsigned int test_cell() const;
+    unsigned int spill_cell(unsigned int slot) const;
+    unsigned int constant_cell(int value);
+
+    void emit(OPCODE op, unsigned int r1, unsigned int r2 = 0, unsigned int r3 = 0, unsigned int addr = 0,
+              int label = -1);
+    void move(unsigned int from, unsigned int to);
+    void load(location const &from, unsigned int to);
+
+    location home(unsigned int slot) const;
+    bool used(unsigned int reg, unsigned int below) const;
+    int free_register(unsigned int below, int avoid = -1) const;
+    unsigned int operand(location const &from, unsigned int below, int avoid, unsigned int prefer);
+    void settle(unsigned int slot);
+
+    void binary(OPCODE op);
+    void swap();
+    void dropn(unsigned int n);
+    bool branch(OPCODE op, unsigned int target);
+    void flush();
+    void finish();
+    void reset(unsigned int slots);
+};
+
+#endif
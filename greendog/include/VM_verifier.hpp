@@ -0,0 +1,34 @@
+#if !defined(VM_VERIFIER_HPP)
+#define VM_VERIFIER_HPP 1
+
+#include <cstdint>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+
+// Checks a finished program once so that it can be run as a trusted
+// program: every opcode is known, every register and heap operand is in
+// range and every branch lands inside the program.  Only division by zero
+// and the tick budget are left to be checked at run time.
+
+class VM_verifier
+{
+public:
+    VM_verifier();
+
+    // heap_size is that of the machine the program is to run on
+    bool verify(VM_instruction const *program, unsigned int length, unsigned int heap_size = MAX_HEAP_SIZE);
+    bool is_verified() const;
+
+    // a bit for each register the program can write; all of them unless
+    // it verified
+    uint32_t written_registers() const;
+
+private:
+    bool verified;
+    uint32_t written;
+
+    bool check(VM_instruction const &instr, unsigned int length, unsigned int heap_size) const;
+};
+
+#endif
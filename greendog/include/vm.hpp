@@ -1,13 +1,39 @@
 #if !defined(VM_HPP)
 #define VM_HPP 1
 
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
 #include "VM_exec_status.hpp"
+#include "VM_thread_pool.hpp"
 #include "VM_defs.hpp"
+#include "VM_arena.hpp"
+#include "VM_image.hpp"
+#include "VM_instruction.hpp"
+#include "VM_blocks.hpp"
+#include "VM_executor.hpp"
+#include "VM_heap.hpp"
+#include "VM_jit.hpp"
+#include "VM_lockstep.hpp"
+#include "VM_profile.hpp"
+#include "VM_trace.hpp"
+#include "VM_verifier.hpp"
 
 class VM
 {
 public:
-    VM();
+    // A heap of heap_size cells, all zero, and room for programs of up to
+    // program_limit instructions; each is cut to its MAX_WIDE_ limit.
+    // Programs only take the memory they need as they grow.  Heaps past
+    // MAX_HEAP_SIZE are mapped (see VM_arena).
+    explicit VM(unsigned int heap_size = MAX_HEAP_SIZE, unsigned int program_limit = MAX_PROGRAM_SIZE);
+
+    unsigned int heap_size() const;
+    unsigned int program_limit() const;
+    // instructions added or loaded so far
+    unsigned int program_length() const;
 
     void load(unsigned int reg, unsigned int addr);
     void store(unsigned int reg, unsigned int addr);
@@ -27,23 +53,129 @@ public:
     void jge(unsigned int reg, unsigned int loc);
 
 
-    VM_exec_status exec(bool verbose = false);
+    // max_ticks is the instruction budget for this one execution.
+    VM_exec_status exec(bool verbose = false, unsigned int max_ticks = MAX_TICKS);
+
+    // Opt in to running without register, address and branch checks.
+    // Programs that do not pass verify() run on the checked path instead.
+    VM_exec_status exec_trusted(bool verbose = false, unsigned int max_ticks = MAX_TICKS);
+
+    // Compile the program to native code on first use and run that.  Falls
+    // back to exec_trusted when tracing, when the host has no JIT or when
+    // the program does not verify.
+    VM_exec_status exec_jit(bool verbose = false, unsigned int max_ticks = MAX_TICKS);
+
+    // exec_trusted on an interpreter that also counts into profile (see
+    // VM_profile).  A profile that is not yet for this program is set up
+    // for it first; otherwise the run is added to what it holds.
+    VM_exec_status exec_profiled(VM_profile &profile, unsigned int max_ticks = MAX_TICKS);
+
+    // exec_trusted, recording each instruction in trace as it is about to
+    // run (see VM_trace).  VM_write_trace turns the records into the text
+    // a verbose run writes, say for the last few thousand after an error.
+    VM_exec_status exec_traced(VM_trace &trace, unsigned int max_ticks = MAX_TICKS);
+
+    // Bind executor to the program, trusted if it verifies, to run it on
+    // this machine's heap as often as needed without the setup exec does
+    // on every call (see VM_executor).  False, leaving executor alone, if
+    // the program is invalid.  Bind again after changing or loading the
+    // program.
+    bool bind(VM_executor &executor);
+
+    // Run the program once per heap image, spread over threads workers
+    // (0 means one per hardware thread).  Each image is copied into an
+    // otherwise zero heap before its run and overwritten with the same
+    // cells afterwards.  The VM's own heap is not touched.
+    std::vector<VM_exec_status> exec_batch(std::vector<std::vector<int>> &heaps,
+                                           unsigned int threads = 0,
+                                           unsigned int max_ticks = MAX_TICKS);
+
+    // exec_batch with several runs per worker stepped together in SIMD
+    // lanes (see VM_lockstep).  Statuses and heaps come out exactly as
+    // exec_batch leaves them; programs that do not verify go to exec_batch.
+    std::vector<VM_exec_status> exec_lockstep(std::vector<std::vector<int>> &heaps,
+                                              unsigned int threads = 0,
+                                              unsigned int max_ticks = MAX_TICKS,
+                                              VM_lockstep_isa isa = VM_lockstep::best());
+
+    // The heap as it is now, to share between overlays (see VM_heap).
+    std::shared_ptr<VM_snapshot const> snapshot() const;
+
+    // Run the program on an overlay instead of this machine's heap, as
+    // exec_batch would (natively where it can), copying in only the pages
+    // the overlay owns and out only those the run changed.
+    VM_exec_status exec(VM_heap &heap, unsigned int max_ticks = MAX_TICKS);
+
+    // exec_batch over overlays, which may share snapshots or not.  Each
+    // worker keeps the last snapshot it ran on in a VM_heap_frame, from
+    // one call to the next, so runs on a shared one copy pages rather
+    // than heaps.
+    std::vector<VM_exec_status> exec_batch(std::vector<VM_heap> &heaps,
+                                           unsigned int threads = 0,
+                                           unsigned int max_ticks = MAX_TICKS);
+
+    bool verify();
 
     void set_heap(unsigned int addr, int value);
     int get_heap(unsigned int addr) const;
     void dump_heap(unsigned int from, unsigned int to) const;
 
+    // Write the program and heap to an image file, or replace both with
+    // those read from an image.  A loaded program runs from the mapped
+    // file until more instructions are added to it.
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+    // Write the program as source VM_assembler reads back, each line
+    // followed by a comment with its location; nothing if it is invalid.
+    void disassemble(std::ostream &out) const;
+
 private:
     unsigned int program_size;
+    unsigned int max_program_size;
     bool valid_program;
-    unsigned int program[MAX_PROGRAM_SIZE];
-    int heap[MAX_HEAP_SIZE];
+    // one decoded instruction per pc
+    std::vector<VM_instruction> decoded;
+
+    VM_verifier verifier;
+    VM_blocks blocks;
+    bool analysis_current;
+    VM_jit jit;
+    std::unique_ptr<VM_thread_pool> pool;
+    VM_arena arena;
+    int *heap;
+    unsigned int heap_cells;
+
+    // the cells from 0 that LOADs and STOREs reach and the pages STOREs
+    // can change, found by analyse(); and the frames
+    // overlays run in, one per worker of exec_batch, the first also for
+    // exec(VM_heap &), each made on first use
+    unsigned int addressed;
+    std::vector<unsigned int> stored_pages;
+    std::vector<std::unique_ptr<VM_heap_frame>> frames;
+
+    std::shared_ptr<VM_image const> image;
+    VM_instruction const *image_code;
 
     bool check_program_size();
     bool check_register(unsigned int reg);
     bool check_address(unsigned int addr);
     bool check_location(unsigned int loc);
 
+    VM_instruction const *code() const;
+    void detach();
+
+    void analyse();
+    VM_thread_pool &thread_pool(unsigned int threads);
+    VM_heap_frame &heap_frame(unsigned int worker);
+    // cells a scratch heap needs for the runs of a batch: those the
+    // program reaches and the largest image, but no more than the heap
+    size_t scratch_cells(std::vector<std::vector<int>> const &heaps) const;
+    // verified and compiled, compiling it if need be
+    bool native();
+    VM_exec_status run(bool verbose, bool trusted, unsigned int max_ticks);
+    void append(unsigned int instr, unsigned int prefix);
+
     void maybe_add_op_RA(OPCODE op, unsigned int reg, unsigned int addr);
     void maybe_add_op_RRR(OPCODE op, unsigned int r1, unsigned int r2, unsigned int r3);
     void maybe_add_op_L(OPCODE op, unsigned int loc);
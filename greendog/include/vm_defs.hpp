@@ -6,6 +6,12 @@ const constexpr unsigned int MAX_PROGRAM_SIZE = 1024u;
 const constexpr unsigned int MAX_REGISTERS    = 32u;
 const constexpr unsigned int MAX_HEAP_SIZE    = 8192u;
 
+// MAX_PROGRAM_SIZE and MAX_HEAP_SIZE are what a VM gets by default; one
+// can be given up to these.  Addresses and locations past 16 bits take an
+// EXT prefix word holding their high bits.
+const constexpr unsigned int MAX_WIDE_PROGRAM_SIZE = 1u << 24;
+const constexpr unsigned int MAX_WIDE_HEAP_SIZE    = 1u << 28;
+
 using OPCODE = unsigned char;
 
 const constexpr OPCODE LOAD = 1;
@@ -24,4 +30,6 @@ const constexpr OPCODE JLE = 15;
 const constexpr OPCODE JGT = 16;
 const constexpr OPCODE JGE = 17;
 
+const constexpr OPCODE EXT = 31;
+
 #endif
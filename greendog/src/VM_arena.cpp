@@ -0,0 +1,107 @@
+#include "VM_arena.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VM_ARENA_MMAP 1
+#include <sys/mman.h>
+#else
+#define VM_ARENA_MMAP 0
+#endif
+
+namespace
+{
+
+// below this the allocator is as quick and wastes less
+constexpr size_t MAP_THRESHOLD = 256 * 1024;
+constexpr size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+size_t rounded(size_t bytes, size_t page)
+{
+    return (bytes + page - 1) / page * page;
+}
+
+} // namespace
+
+VM_arena::VM_arena(size_t cells, bool huge_pages)
+    : cells(nullptr), count(cells), bytes(0), mapped(false)
+{
+    if (cells > SIZE_MAX / sizeof(int))
+    {
+        throw std::bad_alloc();
+    }
+    const size_t size = cells * sizeof(int);
+
+#if VM_ARENA_MMAP
+    if (size >= MAP_THRESHOLD)
+    {
+        void *memory = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+        if (huge_pages && size >= HUGE_PAGE)
+        {
+            bytes = rounded(size, HUGE_PAGE);
+            memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        if (MAP_FAILED == memory)
+        {
+            bytes = rounded(size, HUGE_PAGE);
+            memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#if defined(MADV_HUGEPAGE)
+            if (MAP_FAILED != memory && huge_pages && size >= HUGE_PAGE)
+            {
+                madvise(memory, bytes, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (MAP_FAILED != memory)
+        {
+            this->cells = static_cast<int *>(memory);
+            mapped = true;
+            return;
+        }
+        bytes = 0;
+    }
+#endif
+
+    // calloc rather than new int[](), which would touch every page
+    this->cells = static_cast<int *>(calloc(cells > 0 ? cells : 1, sizeof(int)));
+    if (nullptr == this->cells)
+    {
+        throw std::bad_alloc();
+    }
+}
+
+VM_arena::~VM_arena()
+{
+#if VM_ARENA_MMAP
+    if (mapped)
+    {
+        munmap(cells, bytes);
+        return;
+    }
+#endif
+    free(cells);
+}
+
+int *VM_arena::data()
+{
+    return cells;
+}
+
+int const *VM_arena::data() const
+{
+    return cells;
+}
+
+size_t VM_arena::size() const
+{
+    return count;
+}
+
+bool VM_arena::is_mapped() const
+{
+    return mapped;
+}
@@ -0,0 +1,179 @@
+#include "VM_assembler.hpp"
+
+#include "vm.hpp"
+#include "VM_mnemonics.hpp"
+
+using namespace std;
+
+bool VM_assembler::assemble(std::string_view source, VM &vm)
+{
+    message.clear();
+    VM_lexer lexer(source);
+    return statements(lexer, vm);
+}
+
+bool VM_assembler::assemble(std::istream &in, VM &vm)
+{
+    message.clear();
+    for (unsigned int number = 1; getline(in, line); ++number)
+    {
+        VM_lexer lexer(line, number);
+        if (!statements(lexer, vm))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string const &VM_assembler::error() const
+{
+    return message;
+}
+
+bool VM_assembler::statements(VM_lexer &lexer, VM &vm)
+{
+    for (VM_token token = lexer.next(); VM_token_kind::END != token.kind; token = lexer.next())
+    {
+        if (VM_token_kind::NEWLINE == token.kind)
+        {
+            continue;
+        }
+        if (VM_token_kind::WORD != token.kind)
+        {
+            return fail(token, "expected an instruction");
+        }
+
+        VM_mnemonic const *mnemonic = VM_find_mnemonic(token.key);
+        if (nullptr == mnemonic)
+        {
+            return fail(token, "unknown instruction");
+        }
+
+        // operands, each but the first after an optional comma
+        unsigned int count = 0;
+        auto operand = [&lexer, &count]() {
+            VM_token next = lexer.next();
+            if (count++ > 0 && VM_token_kind::COMMA == next.kind)
+            {
+                next = lexer.next();
+            }
+            return next;
+        };
+
+        unsigned int r1 = 0, r2 = 0, r3 = 0, addr = 0, loc = 0;
+        switch (mnemonic->operands)
+        {
+        case VM_operands::RA:
+            if (!reg(operand(), r1) || !value(operand(), vm.heap_size(), addr))
+            {
+                return false;
+            }
+            break;
+
+        case VM_operands::RRR:
+            if (!reg(operand(), r1) || !reg(operand(), r2) || !reg(operand(), r3))
+            {
+                return false;
+            }
+            break;
+
+        case VM_operands::L:
+            if (!value(operand(), vm.program_limit(), loc))
+            {
+                return false;
+            }
+            break;
+
+        case VM_operands::RL:
+            if (!reg(operand(), r1) || !value(operand(), vm.program_limit(), loc))
+            {
+                return false;
+            }
+            break;
+        }
+
+        VM_token after = lexer.next();
+        if (VM_token_kind::NEWLINE != after.kind && VM_token_kind::END != after.kind)
+        {
+            return fail(after, "expected the end of the line");
+        }
+
+        switch (mnemonic->op)
+        {
+        case LOAD:  vm.load(r1, addr); break;
+        case STORE: vm.store(r1, addr); break;
+        case ADD:   vm.add(r1, r2, r3); break;
+        case SUB:   vm.sub(r1, r2, r3); break;
+        case MUL:   vm.mul(r1, r2, r3); break;
+        case DIV:   vm.div(r1, r2, r3); break;
+        case CMP:   vm.cmp(r1, r2, r3); break;
+        case JMP:   vm.jmp(loc); break;
+        case JEQ:   vm.jeq(r1, loc); break;
+        case JNE:   vm.jne(r1, loc); break;
+        case JLT:   vm.jlt(r1, loc); break;
+        case JLE:   vm.jle(r1, loc); break;
+        case JGT:   vm.jgt(r1, loc); break;
+        case JGE:   vm.jge(r1, loc); break;
+        }
+
+        if (VM_token_kind::END == after.kind)
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+bool VM_assembler::reg(VM_token const &token, unsigned int &number)
+{
+    std::string_view text = token.text;
+    if (VM_token_kind::WORD != token.kind || text.size() < 2 || text.size() > 3 ||
+        ('r' != text[0] && 'R' != text[0]))
+    {
+        return fail(token, "expected a register");
+    }
+
+    number = 0;
+    for (char digit : text.substr(1))
+    {
+        if (digit < '0' || digit > '9')
+        {
+            return fail(token, "expected a register");
+        }
+        number = number * 10 + (digit - '0');
+    }
+    if (number >= MAX_REGISTERS)
+    {
+        return fail(token, "no such register");
+    }
+    return true;
+}
+
+bool VM_assembler::value(VM_token const &token, unsigned int limit, unsigned int &number)
+{
+    if (VM_token_kind::NUMBER != token.kind)
+    {
+        return fail(token, "expected a number");
+    }
+    if (token.number < 0 || token.number >= limit)
+    {
+        return fail(token, "number out of range");
+    }
+    number = (unsigned int)token.number;
+    return true;
+}
+
+bool VM_assembler::fail(VM_token const &token, char const *what)
+{
+    message = "line " + to_string(token.line) + ": " + what;
+    if (VM_token_kind::NEWLINE == token.kind || VM_token_kind::END == token.kind)
+    {
+        message += " at the end of the line";
+    }
+    else
+    {
+        message += " at '" + string(token.text) + "'";
+    }
+    return false;
+}
@@ -0,0 +1,28 @@
+#include "VM_blocks.hpp"
+
+VM_blocks::VM_blocks()
+    : run_at(1, 0)
+{
+}
+
+void VM_blocks::analyse(VM_instruction const *program, unsigned int length)
+{
+    run_at.resize(length + 1);
+    run_at[length] = 0;
+
+    unsigned int run = 0;
+    for (unsigned int pc = length; pc-- > 0;)
+    {
+        OPCODE op = program[pc].op;
+        if ((op >= JMP && op <= JGE) || 0 == op)
+        {
+            run = 0;
+        }
+        run_at[pc] = ++run;
+    }
+}
+
+unsigned int const *VM_blocks::runs() const
+{
+    return run_at.data();
+}
@@ -2,48 +2,243 @@
 
 #include <iostream>
 
+#include "VM_mnemonics.hpp"
+
 using namespace std;
 
-VM_executor::VM_executor(unsigned int const *program, unsigned int length, int * heap)
-    : program(program), program_size(length), heap(heap)
+namespace
 {
-    reset();
+
+// the runs of the empty program
+const unsigned int no_runs[1] = {0};
+
+} // namespace
+
+VM_executor::VM_executor()
+{
+    bind(nullptr, 0, no_runs, nullptr);
 }
 
-VM_exec_status VM_executor::exec(bool verbose)
+VM_executor::VM_executor(VM_instruction const *program, unsigned int length, unsigned int const *runs, int * heap, bool trusted, uint32_t written)
 {
+    bind(program, length, runs, heap, trusted, written);
+}
+
+void VM_executor::bind(VM_instruction const *program, unsigned int length, unsigned int const *runs, int * heap, bool trusted, uint32_t written)
+{
+    this->program = program;
+    program_size = length;
+    this->runs = runs;
+    this->heap = heap;
+    this->trusted = trusted;
+    this->written = written;
+
+    // the last program may have written any of them
+    for (int &r : registers)
+    {
+        r = 0;
+    }
     reset();
+}
 
-    while (status.empty() && pc < program_size)
+template <bool CHECKED, typename F>
+inline void VM_executor::do_instructions(F instr, const char *name)
+{
+    if (!CHECKED || VM_error::OK == status)
     {
-        if (verbose && (ticks % 1000) == 0)
+        instr();
+    }
+}
+
+template <bool CHECKED, bool PROFILE, typename F>
+inline void VM_executor::do_jump(VM_instruction const & instr, F test, const char *name)
+{
+    do_instructions<CHECKED>([this, &instr, test]() {
+        if (CHECKED && instr.loc >= program_size)
         {
-            cerr << ticks << " ticks\n";
+            status = VM_error::BRANCH_OUT_OF_RANGE;
+            return;
         }
-        if (++ticks > MAX_TICKS)
+        if ( test() )
         {
-            status = "Max Runtime Exceeded";
-            break;
+            if (PROFILE)
+            {
+                ++profile->taken[pc - 1];
+            }
+            pc = instr.loc;
         }
+    }, name);
+
+    if (VM_error::OK == status)
+    {
+        enter<PROFILE>();
+    }
+}
+
+VM_exec_status VM_executor::exec(bool verbose, unsigned int max_ticks)
+{
+    reset();
+    this->max_ticks = max_ticks;
+
+    if (trusted)
+    {
+        run<false>(verbose);
+    }
+    else
+    {
+        run<true>(verbose);
+    }
+
+    return result();
+}
+
+VM_exec_status VM_executor::exec_profiled(VM_profile &profile, unsigned int max_ticks)
+{
+    reset();
+    this->max_ticks = max_ticks;
+    this->profile = &profile;
+
+    if (trusted)
+    {
+        run<false, true>(false);
+    }
+    else
+    {
+        run<true, true>(false);
+    }
 
-       Instruction instr(program[pc++], verbose);
-        
-        if (verbose)
+    ++profile.executions;
+    this->profile = nullptr;
+    return result();
+}
+
+VM_exec_status VM_executor::exec_traced(VM_trace &trace, unsigned int max_ticks)
+{
+    reset();
+    this->max_ticks = max_ticks;
+    tracer = &trace;
+
+    if (trusted)
+    {
+        run<false>(false);
+    }
+    else
+    {
+        run<true>(false);
+    }
+
+    tracer = nullptr;
+    return result();
+}
+
+VM_exec_status VM_executor::exec_jit(VM_jit const &jit, unsigned int max_ticks)
+{
+    reset();
+    this->max_ticks = max_ticks;
+
+    VM_jit_state state = {max_ticks, 0};
+    VM_jit_exit exit = jit.run(registers, heap, state);
+    ticks = max_ticks - state.budget;
+    pc = state.pc;
+
+    switch (exit)
+    {
+    case VM_jit_exit::OUT_OF_BUDGET:
+        // the native code stops short of a run it cannot pay for in full
+        precise = true;
+        interpret<false>(false);
+        break;
+
+    case VM_jit_exit::DIVISION_BY_ZERO:
+        status = VM_error::DIVISION_BY_ZERO;
+        ticks -= runs[pc] - 1;
+        break;
+
+    case VM_jit_exit::FINISHED:
+        break;
+    }
+
+    return result();
+}
+
+VM_exec_status VM_executor::result() const
+{
+    if (VM_error::OK != status)
+    {
+        return VM_exec_status(status, nullptr, ticks);
+    }
+
+    return VM_exec_status(registers[0], ticks);
+}
+
+template <bool CHECKED, bool PROFILE>
+void VM_executor::run(bool verbose)
+{
+    // Tracing counts every instruction, so start out precise.
+    precise = verbose || nullptr != tracer;
+    if (PROFILE)
+    {
+        timing = false;
+    }
+    enter<PROFILE>();
+    interpret<CHECKED, PROFILE>(verbose);
+
+    // charge the last run
+    if (PROFILE && timing)
+    {
+        profile->time[run_start] += (VM_profile::clock() - run_clock) * run_weight;
+    }
+}
+
+template <bool CHECKED, bool PROFILE>
+void VM_executor::interpret(bool verbose)
+{
+    unsigned int at = pc;
+    while (VM_error::OK == status && pc < program_size)
+    {
+        if (precise)
         {
-            trace(instr);
+            if (verbose && (ticks % 1000) == 0)
+            {
+                cerr << ticks << " ticks\n";
+            }
+            if (++ticks > max_ticks)
+            {
+                status = VM_error::MAX_RUNTIME;
+                break;
+            }
+
+            if (nullptr != tracer)
+            {
+                capture(tracer->claim());
+                tracer->publish();
+            }
+            if (verbose)
+            {
+                VM_trace_record record;
+                capture(record);
+                VM_write_trace(cerr, record);
+            }
         }
 
+        at = pc;
+        VM_instruction const &instr = program[pc++];
+        if (PROFILE)
+        {
+            ++profile->hits[at];
+            ++profile->ops[instr.op];
+        }
         switch (instr.op)
         {
         case LOAD:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     registers[instr.r1] = heap[instr.addr];
                 }, "LOAD");
             break;
 
         case STORE:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     heap[instr.addr] = registers[instr.r1];
                 },
@@ -51,7 +246,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case ADD:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     registers[instr.r3] = registers[instr.r1] + registers[instr.r2];
                 },
@@ -59,7 +254,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case SUB:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     registers[instr.r3] = registers[instr.r1] - registers[instr.r2];
                 },
@@ -67,7 +262,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case MUL:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     registers[instr.r3] = registers[instr.r1] * registers[instr.r2];
                 },
@@ -75,12 +270,12 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case DIV:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     int divisor = registers[instr.r2];
                     if (divisor == 0)
                     {
-                        status = "Division by Zero";
+                        status = VM_error::DIVISION_BY_ZERO;
                     }
                     else
                     {
@@ -91,7 +286,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case CMP:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this, &instr]() {
                     const int l = registers[instr.r1];
                     const int r = registers[instr.r2];
@@ -112,241 +307,159 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JMP:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return true; },
                 "JMP");
             break;
 
         case JEQ:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return registers[instr.r1] == 0; },
                 "JEQ");
             break;
 
         case JNE:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return registers[instr.r1] != 0; },
                 "JNE");
             break;
 
         case JLT:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return registers[instr.r1] < 0; },
                 "JLT");
             break;
 
         case JLE:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return registers[instr.r1] <= 0; },
                 "JLE");
             break;
 
         case JGT:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return registers[instr.r1] > 0; },
                 "JGT");
             break;
 
         case JGE:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 instr,
                 [this, &instr]() -> bool { return registers[instr.r1] >= 0; },
                 "JGE");
             break;
 
         default:
-            status = "Internal Error: Invalid OPCODE detected";
+            status = VM_error::INVALID_OPCODE;
             break;
         }
     }
 
-    if (!status.empty())
+    // the whole run was charged on entry, only count what actually ran
+    if (VM_error::OK != status && !precise)
     {
-        return VM_exec_status(status);
+        ticks -= runs[at] - 1;
     }
-
-    return VM_exec_status(registers[0]);
-}
-
-void VM_executor::reset()
-{
-    pc = ticks = 0;
-    status = "";
 }
 
-void VM_executor::do_instructions(std::function<void(void)> instr, const char *name)
+// Charge the straight line run starting at pc in one go.  Once the budget
+// will not cover it, drop to counting one instruction at a time so the
+// limit is hit on the same instruction as always.
+template <bool PROFILE>
+inline void VM_executor::enter()
 {
-    if (status.empty())
+    if (PROFILE)
     {
-        instr();
+        if (timing)
+        {
+            profile->time[run_start] += (VM_profile::clock() - run_clock) * run_weight;
+            timing = false;
+        }
+        if (0 == --profile->countdown)
+        {
+            run_weight = profile->countdown = profile->next_interval();
+            if (pc < program_size)
+            {
+                timing = true;
+                run_start = pc;
+                run_clock = VM_profile::clock();
+            }
+        }
     }
-}
 
-void VM_executor::do_jump(Instruction const & instr, std::function<bool()> test, const char *name)
-{
-    do_instructions([this, &instr, test]() {
-        if (instr.loc >= program_size)
+    if (!precise)
+    {
+        unsigned int length = runs[pc];
+        if (max_ticks - ticks < length)
         {
-            status = "branch beyond end of program";
-            return;
+            precise = true;
         }
-        if ( test() )
+        else
         {
-            pc = instr.loc;
+            ticks += length;
         }
-    }, name);
+    }
 }
 
-void VM_executor::trace(Instruction const & instr) const
+void VM_executor::reset()
 {
-    cerr << "---------------------\n";
-
-    // by the time we get here PC has already been incremented from the
-    // instruction location.
-    cerr << "PC: " << (pc-1) << "\n";
+    pc = ticks = 0;
+    precise = false;
+    status = VM_error::OK;
+    profile = nullptr;
+    tracer = nullptr;
+
+    // only the registers the program writes can have changed since they
+    // were last zeroed
+    for (uint32_t dirty = written; 0 != dirty; dirty &= dirty - 1)
+    {
+        registers[__builtin_ctz(dirty)] = 0;
+    }
+}
 
-    OPCODE op = instr.op;
-    cerr << "op: " << (unsigned int)op << "\n";
-    switch (op)
+void VM_executor::capture(VM_trace_record &record) const
+{
+    VM_instruction const &instr = program[pc];
+
+    record = VM_trace_record();
+    record.pc = pc;
+    record.tick = ticks;
+    record.op = instr.op;
+    record.registers[0] = instr.r1;
+    record.registers[1] = instr.r2;
+    record.registers[2] = instr.r3;
+    record.operand = (int)(instr.op >= JMP ? instr.loc : instr.addr);
+
+    // the values the instruction is about to use
+    switch (instr.op)
     {
     case LOAD:
-        cerr << "LOAD r" << instr.r1 << " " << instr.addr << " (" << heap[instr.addr] <<")\n";
-    break;
+        record.values[0] = heap[instr.addr];
+        break;
 
     case STORE:
-        cerr << "STORE r" << instr.r1 << " " << instr.addr << " (" << registers[instr.r1] <<")\n";
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JLE:
+    case JGT:
+    case JGE:
+        record.values[0] = registers[instr.r1];
         break;
 
     case ADD:
-        cerr << "ADD r" << instr.r1 << " r" << instr.r2 << " r" << instr.r3 << " (" << registers[instr.r1]
-        << " + " << registers[instr.r2] << ")\n"; 
-        break;
-
     case SUB:
-        cerr << "SUB r" << instr.r1 << " r" << instr.r2 << " r" << instr.r3 << " (" << registers[instr.r1]
-        << " - " << registers[instr.r2] << ")\n"; 
-        break;
-
     case MUL:
-        cerr << "MUL r" << instr.r1 << " r" << instr.r2 << " r" << instr.r3 << " (" << registers[instr.r1]
-        << " * " << registers[instr.r2] << ")\n"; 
-        break;
-
     case DIV:
-        cerr << "DIV r" << instr.r1 << " r" << instr.r2 << " r" << instr.r3 << " (" << registers[instr.r1]
-        << " / " << registers[instr.r2] << ")\n"; 
-        break;
-
     case CMP:
-        cerr << "CMP r" << instr.r1 << " r" << instr.r2 << " r" << instr.r3 << " (" << registers[instr.r1]
-        << " <=> " << registers[instr.r2] << ")\n"; 
+        record.values[0] = registers[instr.r1];
+        record.values[1] = registers[instr.r2];
         break;
-
-    case JMP:
-        cerr << "JMP " << instr.loc << "\n";
-        break; 
-
-    case JEQ:
-        cerr << "JEQ r" << instr.r1 << " " << instr.loc  << " (" << registers[instr.r1] << ")\n";
-        break; 
-
-    case JNE:
-        cerr << "JNE r" << instr.r1 << " " << instr.loc << " (" << registers[instr.r1] << ")\n";
-        break; 
-
-    case JLT:
-        cerr << "JLT r" << instr.r1 << " " << instr.loc << " (" << registers[instr.r1] << ")\n";
-        break; 
-
-    case JLE:
-        cerr << "JLE r" << instr.r1 << " " << instr.loc << " (" << registers[instr.r1] << ")\n";
-        break; 
-
-    case JGT:
-        cerr << "JGT r" << instr.r1 << " " << instr.loc << " (" << registers[instr.r1] << ")\n";
-        break; 
-
-    case JGE:
-        cerr << "JGE r" << instr.r1 << " " << instr.loc << " (" << registers[instr.r1] << ")\n";
-        break; 
-
-    default:
-        cerr << "unknown op code: " << op << "\n";
     }
 }
-
-VM_executor::Instruction::Instruction(unsigned int code, bool verbose)
-{
-    if ( verbose )
-    {
-        std::ios_base::fmtflags f( cerr.flags() );
-        cerr << "decoding instruction " << hex << code << "\n";
-        cerr.flags( f );
-    }
-
-    op = code >> 24;
-    switch (op) {
-        case LOAD:
-        case STORE:
-            decode_RA(code);
-            break;
-
-        case ADD:
-        case SUB:
-        case MUL:
-        case DIV:
-        case CMP:
-            decode_RRR(code);
-            break;
-
-        case JMP:
-            decode_L(code);
-            break;
-
-        case JEQ:
-        case JNE:
-        case JLT:
-        case JLE:
-        case JGT:
-        case JGE:
-            decode_RL(code);
-            break;
-
-        default:
-            op = 0;
-            break;
-    }
-}
-
-void VM_executor::Instruction::decode_RA(unsigned int code)
-{
-    r1 = (code >> 16) & 0xFF;
-    addr = code & 0xFFFF;
-}
-
-void VM_executor::Instruction::decode_RRR(unsigned int code)
-{
-    r1 = (code >> 16) & 0xFF;
-    r2 = (code >> 8) & 0xFF;
-    r3 = code & 0xFF;
-}
-
-void VM_executor::Instruction::decode_L(unsigned int code)
-{
-    loc = code & 0xFFFF;
-}
-
-void VM_executor::Instruction::decode_RL(unsigned int code)
-{
-    r1 = (code >> 16) & 0xFF;
-    loc = code & 0xFFFF;
-}
-
-
-
@@ -0,0 +1,182 @@
+#include "VM_heap.hpp"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+VM_snapshot::VM_snapshot(vector<int> cells, unsigned int size)
+    : cell_count(size), cells(move(cells))
+{
+    this->cells.resize((size_t)pages() * HEAP_PAGE_SIZE, 0);
+    fill(this->cells.begin() + size, this->cells.end(), 0);
+}
+
+VM_snapshot::VM_snapshot(int const *cells, unsigned int count, unsigned int size)
+    : cell_count(size), cells(cells, cells + min(count, size))
+{
+    this->cells.resize((size_t)pages() * HEAP_PAGE_SIZE, 0);
+}
+
+unsigned int VM_snapshot::size() const
+{
+    return cell_count;
+}
+
+unsigned int VM_snapshot::pages() const
+{
+    return VM_heap_pages(cell_count);
+}
+
+int VM_snapshot::get_heap(unsigned int addr) const
+{
+    if (addr < cell_count)
+    {
+        return cells[addr];
+    }
+
+    return 0xdeadbeef;
+}
+
+int const *VM_snapshot::page(unsigned int n) const
+{
+    return &cells[(size_t)n * HEAP_PAGE_SIZE];
+}
+
+VM_heap::VM_heap(shared_ptr<VM_snapshot const> base)
+    : snapshot(move(base)), slot(snapshot->pages(), -1)
+{
+}
+
+shared_ptr<VM_snapshot const> const &VM_heap::base() const
+{
+    return snapshot;
+}
+
+void VM_heap::set_heap(unsigned int addr, int value)
+{
+    if (addr < snapshot->size())
+    {
+        page(addr / HEAP_PAGE_SIZE)[addr % HEAP_PAGE_SIZE] = value;
+    }
+}
+
+int VM_heap::get_heap(unsigned int addr) const
+{
+    if (addr < snapshot->size())
+    {
+        return page(addr / HEAP_PAGE_SIZE)[addr % HEAP_PAGE_SIZE];
+    }
+
+    return 0xdeadbeef;
+}
+
+vector<unsigned int> const &VM_heap::private_pages() const
+{
+    return owned;
+}
+
+int const *VM_heap::page(unsigned int n) const
+{
+    return slot[n] < 0 ? snapshot->page(n) : &cells[(size_t)slot[n] * HEAP_PAGE_SIZE];
+}
+
+int *VM_heap::page(unsigned int n)
+{
+    if (slot[n] < 0)
+    {
+        int const *shared = snapshot->page(n);
+        slot[n] = (int)owned.size();
+        owned.push_back(n);
+        cells.insert(cells.end(), shared, shared + HEAP_PAGE_SIZE);
+    }
+    return &cells[(size_t)slot[n] * HEAP_PAGE_SIZE];
+}
+
+void VM_heap::clear()
+{
+    for (unsigned int n : owned)
+    {
+        slot[n] = -1;
+    }
+    owned.clear();
+    cells.clear();
+}
+
+VM_heap_frame::VM_heap_frame(unsigned int size)
+    : cells((size_t)VM_heap_pages(size) * HEAP_PAGE_SIZE)
+{
+}
+
+int *VM_heap_frame::data()
+{
+    return cells.data();
+}
+
+void VM_heap_frame::enter(VM_heap const &heap)
+{
+    const size_t pages = cells.size() / HEAP_PAGE_SIZE;
+    if (holds != heap.base())
+    {
+        // pages past both the last snapshot and this one are zero already,
+        // as the arena started or as leave left them
+        const unsigned int was = holds ? holds->pages() : 0;
+        holds = heap.base();
+        const size_t reach = min(pages, (size_t)max(was, holds->pages()));
+        for (size_t n = 0; n < reach; ++n)
+        {
+            restore((unsigned int)n);
+        }
+    }
+
+    for (unsigned int n : heap.private_pages())
+    {
+        if (n < pages)
+        {
+            copy(heap.page(n), heap.page(n) + HEAP_PAGE_SIZE, at(n));
+            dirty.push_back(n);
+        }
+    }
+}
+
+void VM_heap_frame::leave(VM_heap &heap, vector<unsigned int> const &stored)
+{
+    // a page stored to but left as it was stays shared; one past the
+    // snapshot is only zeroed again
+    VM_heap const &was = heap;
+    for (unsigned int n : stored)
+    {
+        if (n >= holds->pages())
+        {
+            dirty.push_back(n);
+        }
+        else if (!equal(at(n), at(n) + HEAP_PAGE_SIZE, was.page(n)))
+        {
+            copy(at(n), at(n) + HEAP_PAGE_SIZE, heap.page(n));
+            dirty.push_back(n);
+        }
+    }
+
+    for (unsigned int n : dirty)
+    {
+        restore(n);
+    }
+    dirty.clear();
+}
+
+int *VM_heap_frame::at(unsigned int n)
+{
+    return cells.data() + (size_t)n * HEAP_PAGE_SIZE;
+}
+
+void VM_heap_frame::restore(unsigned int n)
+{
+    if (n < holds->pages())
+    {
+        copy(holds->page(n), holds->page(n) + HEAP_PAGE_SIZE, at(n));
+    }
+    else
+    {
+        fill(at(n), at(n) + HEAP_PAGE_SIZE, 0);
+    }
+}
@@ -0,0 +1,97 @@
+#include "VM_instruction.hpp"
+
+VM_instruction::VM_instruction()
+    : op(0), r1(0), r2(0), r3(0), addr(0), loc(0)
+{
+}
+
+VM_instruction::VM_instruction(unsigned int code, unsigned int prefix)
+    : VM_instruction()
+{
+    op = code >> 24;
+    switch (op) {
+        case LOAD:
+        case STORE:
+            decode_RA(code);
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case CMP:
+            decode_RRR(code);
+            break;
+
+        case JMP:
+            decode_L(code);
+            break;
+
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JLE:
+        case JGT:
+        case JGE:
+            decode_RL(code);
+            break;
+
+        default:
+            op = 0;
+            break;
+    }
+
+    if (EXT == prefix >> 24)
+    {
+        const unsigned int high = (prefix & 0xFFFFFF) << 16;
+        if (LOAD == op || STORE == op)
+        {
+            addr |= high;
+        }
+        else if (op >= JMP)
+        {
+            loc |= high;
+        }
+    }
+}
+
+unsigned int VM_instruction::encode() const
+{
+    return ((unsigned int)op << 24) | (r1 << 16) | (r2 << 8) | r3 | (addr & 0xFFFF) | (loc & 0xFFFF);
+}
+
+unsigned int VM_instruction::prefix() const
+{
+    const unsigned int high = (addr | loc) >> 16;
+    return high ? ((unsigned int)EXT << 24) | high : 0;
+}
+
+bool VM_instruction::operator==(VM_instruction const &other) const
+{
+    return op == other.op && r1 == other.r1 && r2 == other.r2 && r3 == other.r3 &&
+           addr == other.addr && loc == other.loc;
+}
+
+void VM_instruction::decode_RA(unsigned int code)
+{
+    r1 = (code >> 16) & 0xFF;
+    addr = code & 0xFFFF;
+}
+
+void VM_instruction::decode_RRR(unsigned int code)
+{
+    r1 = (code >> 16) & 0xFF;
+    r2 = (code >> 8) & 0xFF;
+    r3 = code & 0xFF;
+}
+
+void VM_instruction::decode_L(unsigned int code)
+{
+    loc = code & 0xFFFF;
+}
+
+void VM_instruction::decode_RL(unsigned int code)
+{
+    r1 = (code >> 16) & 0xFF;
+    loc = code & 0xFFFF;
+}
@@ -0,0 +1,330 @@
+#include "VM_jit.hpp"
+
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#if VM_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+#if VM_JIT_X86_64
+namespace
+{
+
+// Register use in the generated code:
+//   rbx   VM registers         r12   heap
+//   r13d  ticks left           r14   VM_jit_state *
+//   eax, ecx, edx scratch
+constexpr unsigned char EAX = 0;
+constexpr unsigned char ECX = 1;
+
+static_assert(offsetof(VM_jit_state, budget) == 0, "budget is read through [r14]");
+static_assert(offsetof(VM_jit_state, pc) == 4, "pc is written through [r14 + 4]");
+
+// Byte buffer with forward references.  Labels are plain indices; rel32
+// displacements are patched once every label is bound.
+
+class VM_jit_assembler
+{
+public:
+    explicit VM_jit_assembler(size_t labels)
+        : offsets(labels, 0)
+    {
+    }
+
+    void emit(initializer_list<unsigned char> code)
+    {
+        bytes.insert(bytes.end(), code);
+    }
+
+    void dword(unsigned int value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            bytes.push_back((unsigned char)(value >> (8 * i)));
+        }
+    }
+
+    void rel32(size_t label)
+    {
+        fixups.push_back(make_pair(bytes.size(), label));
+        dword(0);
+    }
+
+    void bind(size_t label)
+    {
+        offsets[label] = bytes.size();
+    }
+
+    // op reg, [rbx + disp32]
+    void registers(initializer_list<unsigned char> op, unsigned char reg, unsigned int disp)
+    {
+        emit(op);
+        emit({(unsigned char)(0x80 | (reg << 3) | 3)});
+        dword(disp);
+    }
+
+    // op reg, [r12 + disp32]
+    void heap(unsigned char op, unsigned char reg, unsigned int disp)
+    {
+        emit({0x41, op, (unsigned char)(0x80 | (reg << 3) | 4), 0x24});
+        dword(disp);
+    }
+
+    vector<unsigned char> const &link()
+    {
+        for (auto const &fixup : fixups)
+        {
+            unsigned int rel = (unsigned int)(offsets[fixup.second] - (fixup.first + 4));
+            memcpy(&bytes[fixup.first], &rel, sizeof(rel));
+        }
+        return bytes;
+    }
+
+private:
+    vector<unsigned char> bytes;
+    vector<size_t> offsets;
+    vector<pair<size_t, size_t>> fixups;
+};
+
+bool is_jump(OPCODE op)
+{
+    return op >= JMP && op <= JGE;
+}
+
+unsigned char condition(OPCODE op)
+{
+    switch (op)
+    {
+    case JEQ: return 0x84;
+    case JNE: return 0x85;
+    case JLT: return 0x8C;
+    case JLE: return 0x8E;
+    case JGT: return 0x8F;
+    default:  return 0x8D; // JGE
+    }
+}
+
+} // namespace
+#endif
+
+VM_jit::VM_jit()
+    : code(nullptr), code_size(0), entry(nullptr)
+{
+}
+
+VM_jit::~VM_jit()
+{
+    clear();
+}
+
+bool VM_jit::supported()
+{
+    return VM_JIT_X86_64;
+}
+
+bool VM_jit::is_compiled() const
+{
+    return nullptr != entry;
+}
+
+void VM_jit::clear()
+{
+#if VM_JIT_X86_64
+    if (code)
+    {
+        munmap(code, code_size);
+    }
+#endif
+    code = nullptr;
+    code_size = 0;
+    entry = nullptr;
+}
+
+bool VM_jit::compile(VM_instruction const *program, unsigned int length, unsigned int const *runs)
+{
+    clear();
+
+#if VM_JIT_X86_64
+    // Labels: the charged entry of each pc (length is the end), the
+    // uncharged code of each pc, the out of budget and division by zero
+    // exits of each pc, and the common epilogue.
+    const size_t ENTRY = 0;
+    const size_t CODE = length + 1;
+    const size_t BUDGET = 2 * (length + 1);
+    const size_t DIVIDE = 3 * (length + 1);
+    const size_t EXIT = 4 * (length + 1);
+    VM_jit_assembler a(EXIT + 1);
+
+    // runs are charged where the interpreter charges them: at the start
+    // and wherever a jump, taken or not, leads
+    vector<bool> entered(length + 1, false);
+    entered[0] = true;
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        if (is_jump(program[pc].op))
+        {
+            entered[program[pc].loc] = true;
+            entered[pc + 1] = true;
+        }
+    }
+
+    // push rbx, r12, r13, r14; mov rbx, rdi; mov r12, rsi; mov r14, rdx;
+    // mov r13d, [r14]
+    a.emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56});
+    a.emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD6});
+    a.emit({0x45, 0x8B, 0x2E});
+
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        VM_instruction const &instr = program[pc];
+
+        if (entered[pc])
+        {
+            // falling in from the middle of a run is already paid for
+            if (pc > 0 && !is_jump(program[pc - 1].op))
+            {
+                a.emit({0xE9});
+                a.rel32(CODE + pc);
+            }
+
+            // cmp r13d, run; jb out_of_budget; sub r13d, run
+            a.bind(ENTRY + pc);
+            a.emit({0x41, 0x81, 0xFD});
+            a.dword(runs[pc]);
+            a.emit({0x0F, 0x82});
+            a.rel32(BUDGET + pc);
+            a.emit({0x41, 0x81, 0xED});
+            a.dword(runs[pc]);
+        }
+        a.bind(CODE + pc);
+
+        switch (instr.op)
+        {
+        case LOAD:
+            a.heap(0x8B, EAX, 4 * instr.addr);
+            a.registers({0x89}, EAX, 4 * instr.r1);
+            break;
+
+        case STORE:
+            a.registers({0x8B}, EAX, 4 * instr.r1);
+            a.heap(0x89, EAX, 4 * instr.addr);
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+            a.registers({0x8B}, EAX, 4 * instr.r1);
+            if (ADD == instr.op)
+            {
+                a.registers({0x03}, EAX, 4 * instr.r2);
+            }
+            else if (SUB == instr.op)
+            {
+                a.registers({0x2B}, EAX, 4 * instr.r2);
+            }
+            else
+            {
+                a.registers({0x0F, 0xAF}, EAX, 4 * instr.r2);
+            }
+            a.registers({0x89}, EAX, 4 * instr.r3);
+            break;
+
+        case DIV:
+            // mov ecx, r2; test ecx, ecx; jz divide_by_zero; mov eax, r1;
+            // cdq; idiv ecx; mov r3, eax
+            a.registers({0x8B}, ECX, 4 * instr.r2);
+            a.emit({0x85, 0xC9, 0x0F, 0x84});
+            a.rel32(DIVIDE + pc);
+            a.registers({0x8B}, EAX, 4 * instr.r1);
+            a.emit({0x99, 0xF7, 0xF9});
+            a.registers({0x89}, EAX, 4 * instr.r3);
+            break;
+
+        case CMP:
+            // r3 = (r1 > r2) - (r1 < r2)
+            a.registers({0x8B}, EAX, 4 * instr.r1);
+            a.registers({0x3B}, EAX, 4 * instr.r2);
+            a.emit({0x0F, 0x9F, 0xC0, 0x0F, 0x9C, 0xC1});
+            a.emit({0x0F, 0xB6, 0xC0, 0x0F, 0xB6, 0xC9, 0x29, 0xC8});
+            a.registers({0x89}, EAX, 4 * instr.r3);
+            break;
+
+        case JMP:
+            a.emit({0xE9});
+            a.rel32(ENTRY + instr.loc);
+            break;
+
+        default:
+            // cmp dword r1, 0; jcc loc
+            a.registers({0x83}, 7, 4 * instr.r1);
+            a.emit({0x00, 0x0F, condition(instr.op)});
+            a.rel32(ENTRY + instr.loc);
+            break;
+        }
+    }
+
+    // end of program: xor eax, eax; then mov [r14], r13d; pop r14, r13,
+    // r12, rbx; ret
+    a.bind(ENTRY + length);
+    a.emit({0x31, 0xC0});
+    a.bind(EXIT);
+    a.emit({0x45, 0x89, 0x2E});
+    a.emit({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+
+    // mov dword [r14 + 4], pc; mov eax, reason; jmp exit
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        if (entered[pc])
+        {
+            a.bind(BUDGET + pc);
+            a.emit({0x41, 0xC7, 0x46, 0x04});
+            a.dword(pc);
+            a.emit({0xB8});
+            a.dword((unsigned int)VM_jit_exit::OUT_OF_BUDGET);
+            a.emit({0xE9});
+            a.rel32(EXIT);
+        }
+        if (DIV == program[pc].op)
+        {
+            a.bind(DIVIDE + pc);
+            a.emit({0x41, 0xC7, 0x46, 0x04});
+            a.dword(pc);
+            a.emit({0xB8});
+            a.dword((unsigned int)VM_jit_exit::DIVISION_BY_ZERO);
+            a.emit({0xE9});
+            a.rel32(EXIT);
+        }
+    }
+
+    vector<unsigned char> const &bytes = a.link();
+
+    void *memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == memory)
+    {
+        return false;
+    }
+    memcpy(memory, bytes.data(), bytes.size());
+    if (0 != mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC))
+    {
+        munmap(memory, bytes.size());
+        return false;
+    }
+
+    code = memory;
+    code_size = bytes.size();
+    entry = reinterpret_cast<entry_point>(memory);
+    return true;
+#else
+    return false;
+#endif
+}
+
+VM_jit_exit VM_jit::run(int *registers, int *heap, VM_jit_state &state) const
+{
+    return static_cast<VM_jit_exit>(entry(registers, heap, &state));
+}
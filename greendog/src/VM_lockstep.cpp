@@ -0,0 +1,113 @@
+#include "VM_lockstep.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "VM_executor.hpp"
+
+using namespace std;
+
+VM_lockstep::VM_lockstep(VM_instruction const *program, unsigned int length, VM_lockstep_isa isa,
+                         unsigned int heap_size)
+    : program(program), program_size(length), heap_size(heap_size), isa(min(isa, best())), entry(nullptr),
+      cells(nullptr)
+{
+    switch (this->isa)
+    {
+#if VM_LOCKSTEP_X86_64
+    case VM_lockstep_isa::AVX512:
+        entry = &VM_lockstep::exec_avx512;
+        break;
+
+    case VM_lockstep_isa::AVX2:
+        entry = &VM_lockstep::exec_avx2;
+        break;
+#endif
+#if VM_LOCKSTEP_VECTORS
+    case VM_lockstep_isa::SSE2:
+        entry = &VM_lockstep::exec_sse2;
+        break;
+#endif
+    default:
+        this->isa = VM_lockstep_isa::NONE;
+        blocks.analyse(program, length);
+        break;
+    }
+
+    // one heap per lane, plus room to start on a 64 byte boundary
+    buffer.assign((size_t)heap_size * lanes() + 16, 0);
+    const size_t misaligned = (reinterpret_cast<uintptr_t>(buffer.data()) % 64) / sizeof(int);
+    cells = buffer.data() + (16 - misaligned) % 16;
+
+    // beyond its image a run can only change the cells it stores to
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        if (STORE == program[pc].op)
+        {
+            stored.push_back(program[pc].addr);
+        }
+    }
+}
+
+VM_lockstep_isa VM_lockstep::best()
+{
+#if VM_LOCKSTEP_X86_64
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return VM_lockstep_isa::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return VM_lockstep_isa::AVX2;
+    }
+#endif
+#if VM_LOCKSTEP_VECTORS
+    return VM_lockstep_isa::SSE2;
+#else
+    return VM_lockstep_isa::NONE;
+#endif
+}
+
+unsigned int VM_lockstep::lanes(VM_lockstep_isa isa)
+{
+    switch (isa)
+    {
+    case VM_lockstep_isa::AVX512: return 16;
+    case VM_lockstep_isa::AVX2:   return 8;
+    case VM_lockstep_isa::SSE2:   return 4;
+    default:                      return 1;
+    }
+}
+
+unsigned int VM_lockstep::lanes() const
+{
+    return lanes(isa);
+}
+
+void VM_lockstep::exec(vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results)
+{
+    if (entry)
+    {
+        (this->*entry)(heaps, count, max_ticks, results);
+        return;
+    }
+
+    // a single lane is an ordinary heap
+    VM_executor executor(program, program_size, blocks.runs(), cells, true);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        vector<int> &image = heaps[i];
+        const size_t size = min<size_t>(image.size(), heap_size);
+
+        copy(image.begin(), image.begin() + size, cells);
+        results[i] = executor.exec(false, max_ticks);
+        copy(cells, cells + size, image.begin());
+
+        fill(cells, cells + size, 0);
+        for (unsigned int addr : stored)
+        {
+            cells[addr] = 0;
+        }
+    }
+}
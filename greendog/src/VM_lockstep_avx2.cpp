@@ -0,0 +1,26 @@
+#include "VM_lockstep.hpp"
+
+#include <cstddef>
+#include <vector>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+#include "VM_exec_status.hpp"
+
+#if VM_LOCKSTEP_X86_64
+#pragma GCC target("avx2")
+
+#include "VM_lockstep_impl.hpp"
+
+namespace
+{
+typedef int lanes_8 __attribute__((vector_size(32)));
+typedef unsigned int ulanes_8 __attribute__((vector_size(32)));
+}
+
+void VM_lockstep::exec_avx2(std::vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results)
+{
+    lockstep<lanes_8, ulanes_8, 8>(program, program_size, reinterpret_cast<lanes_8 *>(cells), heap_size, stored,
+                                    heaps, count, max_ticks, results);
+}
+#endif
@@ -0,0 +1,295 @@
+#if !defined(VM_LOCKSTEP_IMPL_HPP)
+#define VM_LOCKSTEP_IMPL_HPP 1
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+#include "VM_exec_status.hpp"
+
+// The lockstep interpreter, written once over a vector type and built
+// once per instruction set.  Each VM_lockstep_<isa>.cpp includes this
+// after its `#pragma GCC target`, so everything here has internal linkage
+// and is compiled for that target only; the headers above must already
+// have been included before the pragma.
+
+namespace
+{
+
+template <typename T, typename M>
+inline T select(M mask, T a, T b)
+{
+    const T m = (T)mask;
+    return (a & m) | (b & ~m);
+}
+
+// Lane i of the result is lane i + HALF of v, wrapping around.
+template <unsigned int HALF, typename T, size_t... LANE>
+inline T rotate(T v, std::index_sequence<LANE...>)
+{
+    return __builtin_shuffle(v, T{(LANE + HALF) % sizeof...(LANE)...});
+}
+
+// Reductions fold the upper half of the lanes onto the lower half until
+// lane 0 holds the answer.
+template <unsigned int W, typename U, unsigned int HALF = W / 2>
+inline U lowest(U v)
+{
+    if constexpr (HALF > 0)
+    {
+        const U upper = rotate<HALF>(v, std::make_index_sequence<W>());
+        return lowest<W, U, HALF / 2>(select(upper < v, upper, v));
+    }
+    return v;
+}
+
+template <unsigned int W, typename V, unsigned int HALF = W / 2>
+inline bool any(V mask)
+{
+    if constexpr (HALF > 0)
+    {
+        return any<W, V, HALF / 2>(mask | rotate<HALF>(mask, std::make_index_sequence<W>()));
+    }
+    return 0 != mask[0];
+}
+
+// V is a vector of W ints and U the matching vector of unsigned ints.
+// heap points to size vectors, zero except where noted in
+// stored, and is left that way.
+template <typename V, typename U, unsigned int W>
+void lockstep(VM_instruction const *program, unsigned int length, V *heap, size_t size,
+              std::vector<unsigned int> const &stored,
+              std::vector<int> *heaps, unsigned int count, unsigned int max_ticks,
+              VM_exec_status *results)
+{
+    V registers[MAX_REGISTERS] = {};
+    U pc = {};
+    U ticks = {};
+    V running = {};
+    VM_error status[W];
+
+    size_t used = 0;
+    for (unsigned int lane = 0; lane < W; ++lane)
+    {
+        status[lane] = VM_error::OK;
+        if (lane < count)
+        {
+            running[lane] = -1;
+
+            std::vector<int> const &image = heaps[lane];
+            const size_t cells = image.size() < size ? image.size() : size;
+            for (size_t addr = 0; addr < cells; ++addr)
+            {
+                heap[addr][lane] = image[addr];
+            }
+            used = cells > used ? cells : used;
+        }
+    }
+
+    // While every running lane is at the same pc, at alone says where they
+    // are and pc is left stale; it is written out when a jump splits them.
+    bool together = true;
+    unsigned int at = 0;
+
+    // no lane can have more ticks than there have been steps, so the
+    // budget only needs checking once the steps reach it
+    const U limit = U{} + max_ticks;
+    unsigned int steps = 0;
+
+    auto fail = [&](V mask, VM_error error) {
+        for (unsigned int lane = 0; lane < W; ++lane)
+        {
+            if (mask[lane])
+            {
+                status[lane] = error;
+            }
+        }
+        running &= ~mask;
+        if (!any<W>(running))
+        {
+            at = length;   // nothing left to run
+        }
+    };
+
+    for (;;)
+    {
+        // Otherwise lanes at the lowest pc step together and the rest wait
+        // for them.  A lane at the end of the program has finished.
+        V on = running;
+        if (!together)
+        {
+            at = lowest<W>(select(running, pc, U{} + length))[0];
+            on = running & (V)(pc == at);
+            together = !any<W>(running & ~on);
+        }
+        if (at >= length)
+        {
+            break;
+        }
+
+        ticks -= (U)on;
+        if (steps < max_ticks)
+        {
+            ++steps;
+        }
+        else
+        {
+            const V over = on & (V)(ticks > limit);
+            if (any<W>(over))
+            {
+                fail(over, VM_error::MAX_RUNTIME);
+                on &= ~over;
+                if (at >= length)
+                {
+                    break;
+                }
+            }
+        }
+
+        VM_instruction const &instr = program[at];
+        V taken = {};
+        switch (instr.op)
+        {
+        case LOAD:
+            registers[instr.r1] = select(on, heap[instr.addr], registers[instr.r1]);
+            break;
+
+        case STORE:
+            heap[instr.addr] = select(on, registers[instr.r1], heap[instr.addr]);
+            break;
+
+        // arithmetic wraps, so do it unsigned
+        case ADD:
+            registers[instr.r3] = select(on, (V)((U)registers[instr.r1] + (U)registers[instr.r2]),
+                                         registers[instr.r3]);
+            break;
+
+        case SUB:
+            registers[instr.r3] = select(on, (V)((U)registers[instr.r1] - (U)registers[instr.r2]),
+                                         registers[instr.r3]);
+            break;
+
+        case MUL:
+            registers[instr.r3] = select(on, (V)((U)registers[instr.r1] * (U)registers[instr.r2]),
+                                         registers[instr.r3]);
+            break;
+
+        case DIV:
+        {
+            // no vector integer divide; lanes divide one at a time
+            const V zero = on & (V)(registers[instr.r2] == 0);
+            if (any<W>(zero))
+            {
+                fail(zero, VM_error::DIVISION_BY_ZERO);
+                on &= ~zero;
+            }
+            V quotient = registers[instr.r3];
+            for (unsigned int lane = 0; lane < W; ++lane)
+            {
+                if (on[lane])
+                {
+                    quotient[lane] = registers[instr.r1][lane] / registers[instr.r2][lane];
+                }
+            }
+            registers[instr.r3] = quotient;
+            break;
+        }
+
+        case CMP:
+        {
+            // comparisons give -1 for true
+            const V l = registers[instr.r1];
+            const V r = registers[instr.r2];
+            registers[instr.r3] = select(on, (V)(l < r) - (V)(l > r), registers[instr.r3]);
+            break;
+        }
+
+        case JMP:
+            taken = on;
+            break;
+
+        case JEQ:
+            taken = on & (V)(registers[instr.r1] == 0);
+            break;
+
+        case JNE:
+            taken = on & (V)(registers[instr.r1] != 0);
+            break;
+
+        case JLT:
+            taken = on & (V)(registers[instr.r1] < 0);
+            break;
+
+        case JLE:
+            taken = on & (V)(registers[instr.r1] <= 0);
+            break;
+
+        case JGT:
+            taken = on & (V)(registers[instr.r1] > 0);
+            break;
+
+        case JGE:
+            taken = on & (V)(registers[instr.r1] >= 0);
+            break;
+        }
+
+        if (instr.op < JMP)
+        {
+            if (together)
+            {
+                ++at;
+                continue;
+            }
+            pc = select(on, U{} + (at + 1), pc);
+        }
+        else
+        {
+            const bool jumped = any<W>(taken);
+            if (together && (!jumped || !any<W>(on & ~taken)))
+            {
+                at = jumped ? instr.loc : at + 1;
+                continue;
+            }
+            if (together)
+            {
+                pc = U{} + at;
+                together = false;
+            }
+            pc = select(on, select(taken, U{} + instr.loc, U{} + (at + 1)), pc);
+        }
+    }
+
+    for (unsigned int lane = 0; lane < count; ++lane)
+    {
+        if (VM_error::OK != status[lane])
+        {
+            results[lane] = VM_exec_status(status[lane], nullptr, ticks[lane]);
+        }
+        else
+        {
+            results[lane] = VM_exec_status(registers[0][lane], ticks[lane]);
+        }
+
+        std::vector<int> &image = heaps[lane];
+        const size_t cells = image.size() < size ? image.size() : size;
+        for (size_t addr = 0; addr < cells; ++addr)
+        {
+            image[addr] = heap[addr][lane];
+        }
+    }
+
+    for (size_t addr = 0; addr < used; ++addr)
+    {
+        heap[addr] = V{};
+    }
+    for (unsigned int addr : stored)
+    {
+        heap[addr] = V{};
+    }
+}
+
+} // namespace
+
+#endif
@@ -0,0 +1,27 @@
+#include "VM_lockstep.hpp"
+
+#include <cstddef>
+#include <vector>
+
+#include "vm_defs.hpp"
+#include "VM_instruction.hpp"
+#include "VM_exec_status.hpp"
+
+#if VM_LOCKSTEP_VECTORS
+// SSE2 is part of x86-64 itself, so no target is needed; other hosts get
+// whatever their compiler makes of 128 bit vectors.
+
+#include "VM_lockstep_impl.hpp"
+
+namespace
+{
+typedef int lanes_4 __attribute__((vector_size(16)));
+typedef unsigned int ulanes_4 __attribute__((vector_size(16)));
+}
+
+void VM_lockstep::exec_sse2(std::vector<int> *heaps, unsigned int count, unsigned int max_ticks, VM_exec_status *results)
+{
+    lockstep<lanes_4, ulanes_4, 4>(program, program_size, reinterpret_cast<lanes_4 *>(cells), heap_size, stored,
+                                    heaps, count, max_ticks, results);
+}
+#endif
@@ -0,0 +1,143 @@
+#include "VM_mnemonics.hpp"
+
+#include "VM_lexer.hpp"
+
+namespace
+{
+
+constexpr VM_mnemonic mnemonic(OPCODE op, char const *name, VM_operands operands)
+{
+    return VM_mnemonic{op, name, operands, VM_word_key(name)};
+}
+
+// in opcode order, so that an opcode indexes its entry; 3 to 5 are unused
+constexpr VM_mnemonic mnemonics[] = {
+    mnemonic(0, "", VM_operands::L),
+    mnemonic(LOAD, "LOAD", VM_operands::RA),
+    mnemonic(STORE, "STORE", VM_operands::RA),
+    mnemonic(3, "", VM_operands::L),
+    mnemonic(4, "", VM_operands::L),
+    mnemonic(5, "", VM_operands::L),
+    mnemonic(ADD, "ADD", VM_operands::RRR),
+    mnemonic(SUB, "SUB", VM_operands::RRR),
+    mnemonic(MUL, "MUL", VM_operands::RRR),
+    mnemonic(DIV, "DIV", VM_operands::RRR),
+    mnemonic(CMP, "CMP", VM_operands::RRR),
+    mnemonic(JMP, "JMP", VM_operands::L),
+    mnemonic(JEQ, "JEQ", VM_operands::RL),
+    mnemonic(JNE, "JNE", VM_operands::RL),
+    mnemonic(JLT, "JLT", VM_operands::RL),
+    mnemonic(JLE, "JLE", VM_operands::RL),
+    mnemonic(JGT, "JGT", VM_operands::RL),
+    mnemonic(JGE, "JGE", VM_operands::RL),
+};
+
+constexpr unsigned int count = sizeof(mnemonics) / sizeof(mnemonics[0]);
+
+constexpr bool in_opcode_order()
+{
+    for (unsigned int op = 0; op < count; ++op)
+    {
+        if (mnemonics[op].op != op)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(in_opcode_order(), "mnemonics must be indexed by opcode");
+
+} // namespace
+
+VM_mnemonic const *VM_mnemonic_of(OPCODE op)
+{
+    if (op < count && 0 != mnemonics[op].key)
+    {
+        return &mnemonics[op];
+    }
+    return nullptr;
+}
+
+VM_mnemonic const *VM_find_mnemonic(uint64_t key)
+{
+    for (unsigned int op = 1; op < count; ++op)
+    {
+        if (0 != key && mnemonics[op].key == key)
+        {
+            return &mnemonics[op];
+        }
+    }
+    return nullptr;
+}
+
+std::ostream &operator<<(std::ostream &out, VM_instruction const &instr)
+{
+    VM_mnemonic const *mnemonic = VM_mnemonic_of(instr.op);
+    if (nullptr == mnemonic)
+    {
+        return out << "unknown op code: " << (unsigned int)instr.op;
+    }
+
+    // widen the register numbers so they print as numbers, not characters
+    const unsigned int r1 = instr.r1;
+    const unsigned int r2 = instr.r2;
+    const unsigned int r3 = instr.r3;
+
+    out << mnemonic->name;
+    switch (mnemonic->operands)
+    {
+    case VM_operands::RA:
+        return out << " r" << r1 << " " << instr.addr;
+
+    case VM_operands::RRR:
+        return out << " r" << r1 << " r" << r2 << " r" << r3;
+
+    case VM_operands::L:
+        return out << " " << instr.loc;
+
+    case VM_operands::RL:
+        return out << " r" << r1 << " " << instr.loc;
+    }
+    return out;
+}
+
+void VM_write_trace(std::ostream &out, VM_trace_record const &record)
+{
+    out << "---------------------\n";
+    out << "PC: " << record.pc << "\n";
+    out << "op: " << (unsigned int)record.op << "\n";
+
+    VM_instruction instr;
+    instr.op = record.op;
+    instr.r1 = record.registers[0];
+    instr.r2 = record.registers[1];
+    instr.r3 = record.registers[2];
+    instr.addr = instr.loc = (unsigned int)record.operand;
+    out << instr;
+
+    switch (record.op)
+    {
+    case LOAD:
+    case STORE:
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JLE:
+    case JGT:
+    case JGE:
+        out << " (" << record.values[0] << ")";
+        break;
+
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case CMP:
+    {
+        static char const *const symbols[] = {"+", "-", "*", "/", "<=>"};
+        out << " (" << record.values[0] << " " << symbols[record.op - ADD] << " " << record.values[1] << ")";
+        break;
+    }
+    }
+    out << "\n";
+}
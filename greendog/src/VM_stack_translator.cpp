@@ -0,0 +1,895 @@
+#include "VM_stack_translator.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include "VM_image.hpp"
+#include "vm.hpp"
+
+using namespace std;
+
+namespace
+{
+
+// yellowdog's own opcodes; its arithmetic, CMP and jumps have the same
+// numbers as greendog's
+constexpr OPCODE PUSH = 1;
+constexpr OPCODE POP = 2;
+constexpr OPCODE DUP = 3;
+constexpr OPCODE DUPN = 4;
+constexpr OPCODE SWAP = 5;
+constexpr OPCODE DROPN = 18;
+
+// yellowdog's stack holds this many values
+constexpr unsigned int STACK_LIMIT = 1024;
+
+// r31 holds 0 so that a copy is one ADD, unless the stack needs all 32
+// registers; once slots spill, the two under it are kept for moving them
+constexpr unsigned int ZERO = MAX_REGISTERS - 1;
+constexpr unsigned int SPILLING_REGISTERS = MAX_REGISTERS - 3;
+
+// the result, swap and test cells come before the spilled slots
+constexpr unsigned int FIXED_CELLS = 3;
+
+bool is_jump(OPCODE op)
+{
+    return op >= JMP && op <= JGE;
+}
+
+bool has_operand(OPCODE op)
+{
+    return PUSH == op || DUPN == op || DROPN == op || is_jump(op);
+}
+
+unsigned int size_of(OPCODE op)
+{
+    return has_operand(op) ? 1 + sizeof(int) : 1;
+}
+
+// what y op x leaves, or false where the op must be left to run (and
+// fail, or trap)
+bool fold(OPCODE op, int y, int x, int &result)
+{
+    const unsigned int a = (unsigned int)y;
+    const unsigned int b = (unsigned int)x;
+    switch (op)
+    {
+    case ADD:
+        result = (int)(a + b);
+        return true;
+
+    case SUB:
+        result = (int)(a - b);
+        return true;
+
+    case MUL:
+        result = (int)(a * b);
+        return true;
+
+    case DIV:
+        if (0 == x || (INT_MIN == y && -1 == x))
+        {
+            return false;
+        }
+        result = y / x;
+        return true;
+
+    case CMP:
+        result = (y < x) ? -1 : ((y > x) ? +1 : 0);
+        return true;
+    }
+
+    return false;
+}
+
+bool taken(OPCODE op, int value)
+{
+    switch (op)
+    {
+    case JEQ:
+        return 0 == value;
+    case JNE:
+        return 0 != value;
+    case JLT:
+        return value < 0;
+    case JLE:
+        return value <= 0;
+    case JGT:
+        return value > 0;
+    case JGE:
+        return value >= 0;
+    }
+    return true;
+}
+
+} // namespace
+
+bool VM_stack_translator::location::operator==(location const &other) const
+{
+    return kind == other.kind && value == other.value;
+}
+
+bool VM_stack_translator::translate(unsigned char const *code, unsigned int length, VM &vm, unsigned int base)
+{
+    message.clear();
+    program = code;
+    this->length = length;
+    this->base = base;
+    constants.clear();
+    this->code.clear();
+
+    if (0 != vm.program_length())
+    {
+        message = "Machine already has a program";
+        return false;
+    }
+    if (!analyse())
+    {
+        return false;
+    }
+
+    registers = MAX_REGISTERS == deepest ? MAX_REGISTERS : (deepest < MAX_REGISTERS ? ZERO : SPILLING_REGISTERS);
+    scratch = registers;
+    generate();
+
+    if (this->code.size() > vm.program_limit())
+    {
+        message = "Translation of " + to_string(this->code.size()) + " instructions does not fit the program";
+        return false;
+    }
+    if (cells() > vm.heap_size() || base > vm.heap_size() - cells())
+    {
+        message = "Translation needs " + to_string(cells()) + " heap cells from " + to_string(base);
+        return false;
+    }
+
+    for (instruction const &instr : this->code)
+    {
+        const unsigned int loc = instr.label < 0 ? 0 : (unsigned int)position[instr.label];
+        switch (instr.op)
+        {
+        case LOAD:
+            vm.load(instr.r1, instr.addr);
+            break;
+        case STORE:
+            vm.store(instr.r1, instr.addr);
+            break;
+        case ADD:
+            vm.add(instr.r1, instr.r2, instr.r3);
+            break;
+        case SUB:
+            vm.sub(instr.r1, instr.r2, instr.r3);
+            break;
+        case MUL:
+            vm.mul(instr.r1, instr.r2, instr.r3);
+            break;
+        case DIV:
+            vm.div(instr.r1, instr.r2, instr.r3);
+            break;
+        case CMP:
+            vm.cmp(instr.r1, instr.r2, instr.r3);
+            break;
+        case JMP:
+            vm.jmp(loc);
+            break;
+        case JEQ:
+            vm.jeq(instr.r1, loc);
+            break;
+        case JNE:
+            vm.jne(instr.r1, loc);
+            break;
+        case JLT:
+            vm.jlt(instr.r1, loc);
+            break;
+        case JLE:
+            vm.jle(instr.r1, loc);
+            break;
+        case JGT:
+            vm.jgt(instr.r1, loc);
+            break;
+        case JGE:
+            vm.jge(instr.r1, loc);
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < constants.size(); ++i)
+    {
+        vm.set_heap(base + FIXED_CELLS + spilled() + i, constants[i]);
+    }
+    return true;
+}
+
+bool VM_stack_translator::translate(std::string const &path, VM &vm, unsigned int base)
+{
+    VM_image image;
+    if (!image.open(path, VM_image_machine::YELLOWDOG))
+    {
+        message = "Not a yellowdog image: " + path;
+        return false;
+    }
+
+    size_t size = 0;
+    unsigned char const *code = static_cast<unsigned char const *>(image.section(VM_image_section::CODE, size));
+    return translate(code, (unsigned int)size, vm, base);
+}
+
+std::string const &VM_stack_translator::error() const
+{
+    return message;
+}
+
+unsigned int VM_stack_translator::max_depth() const
+{
+    return deepest;
+}
+
+unsigned int VM_stack_translator::spilled() const
+{
+    return deepest > registers ? deepest - registers : 0;
+}
+
+unsigned int VM_stack_translator::cells() const
+{
+    return FIXED_CELLS + spilled() + (unsigned int)constants.size();
+}
+
+unsigned int VM_stack_translator::result_address() const
+{
+    return result_cell();
+}
+
+bool VM_stack_translator::fail(std::string const &what, unsigned int pc)
+{
+    message = what + " at " + to_string(pc);
+    return false;
+}
+
+// Follow every path through the program from pc 0, giving each pc the
+// depth it is reached with, as the yellowdog verifier does with ranges.
+bool VM_stack_translator::analyse()
+{
+    deepest = 0;
+    depth.assign(length, -1);
+    landed.assign(length, false);
+
+    vector<bool> starts(length + 1, false);
+    for (unsigned int pc = 0; pc < length; pc += size_of(program[pc]))
+    {
+        if (program[pc] < PUSH || program[pc] > DROPN)
+        {
+            return fail("Invalid opcode", pc);
+        }
+        if (has_operand(program[pc]) && length - pc - 1 < sizeof(int))
+        {
+            return fail("Missing operand", pc);
+        }
+        starts[pc] = true;
+    }
+    starts[length] = true;
+
+    vector<unsigned int> pending;
+    auto reach = [&](unsigned int pc, int depth_there, unsigned int from) -> bool {
+        if (depth_there > (int)STACK_LIMIT)
+        {
+            return fail("Stack overflow", from);
+        }
+        deepest = max(deepest, (unsigned int)depth_there);
+        if (pc == length)
+        {
+            return 0 == depth_there ? fail("Program ends with an empty stack", from) : true;
+        }
+        if (depth[pc] < 0)
+        {
+            depth[pc] = depth_there;
+            pending.push_back(pc);
+            return true;
+        }
+        return depth[pc] == depth_there || fail("Stack depth differs", pc);
+    };
+
+    if (!reach(0, 0, 0))
+    {
+        return false;
+    }
+
+    while (!pending.empty())
+    {
+        const unsigned int pc = pending.back();
+        pending.pop_back();
+
+        const OPCODE op = program[pc];
+        const unsigned int next = pc + size_of(op);
+        const int d = depth[pc];
+        int operand = 0;
+        if (has_operand(op))
+        {
+            memcpy((void *)&operand, (void *)&program[pc + 1], sizeof(int));
+        }
+
+        int needed = 0;
+        if (POP == op || DUP == op || (op >= JEQ && op <= JGE))
+        {
+            needed = 1;
+        }
+        else if (SWAP == op || (op >= ADD && op <= CMP))
+        {
+            needed = 2;
+        }
+        if (d < needed)
+        {
+            return fail("Stack underflow", pc);
+        }
+        if ((DUPN == op || DROPN == op) && (operand < 1 || operand > d))
+        {
+            return fail("Stack index out of range", pc);
+        }
+        if (is_jump(op))
+        {
+            if (-1 == operand)
+            {
+                return fail("Undefined label", pc);
+            }
+            if (operand < 0 || (unsigned int)operand > length || !starts[operand])
+            {
+                return fail("Jump out of the program", pc);
+            }
+            if ((unsigned int)operand < length)
+            {
+                landed[operand] = true;
+            }
+        }
+
+        bool reached = true;
+        switch (op)
+        {
+        case PUSH:
+        case DUP:
+        case DUPN:
+            reached = reach(next, d + 1, pc);
+            break;
+
+        case SWAP:
+            reached = reach(next, d, pc);
+            break;
+
+        case JMP:
+            reached = reach((unsigned int)operand, d, pc);
+            break;
+
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JLE:
+        case JGT:
+        case JGE:
+            reached = reach((unsigned int)operand, d - 1, pc) && reach(next, d - 1, pc);
+            break;
+
+        default:
+            // POP, DROPN and the arithmetic
+            reached = reach(next, d - 1, pc);
+            break;
+        }
+        if (!reached)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Translate the reachable instructions in order, then the stubs that
+// conditional jumps to the end of the program go to, then the exit.
+void VM_stack_translator::generate()
+{
+    code.clear();
+    stubs.clear();
+    position.assign(length + 2 + deepest, -1);
+
+    if (registers < MAX_REGISTERS)
+    {
+        emit(SUB, ZERO, ZERO, ZERO);
+    }
+
+    bool live = false;    // the last instruction falls through
+    for (unsigned int pc = 0; pc < length; pc += size_of(program[pc]))
+    {
+        if (depth[pc] < 0)
+        {
+            live = false;
+            continue;
+        }
+        if (!live || landed[pc])
+        {
+            if (live)
+            {
+                flush();
+            }
+            reset((unsigned int)depth[pc]);
+            position[pc] = (int)code.size();
+            live = true;
+        }
+
+        const OPCODE op = program[pc];
+        int operand = 0;
+        if (has_operand(op))
+        {
+            memcpy((void *)&operand, (void *)&program[pc + 1], sizeof(int));
+        }
+
+        switch (op)
+        {
+        case PUSH:
+            stack.push_back({location::CONST, operand});
+            settle((unsigned int)stack.size() - 1);
+            break;
+
+        case POP:
+            stack.pop_back();
+            break;
+
+        case DUP:
+        case DUPN:
+        {
+            const location copied = stack[stack.size() - (DUP == op ? 1 : operand)];
+            stack.push_back(copied);
+            settle((unsigned int)stack.size() - 1);
+        }
+        break;
+
+        case SWAP:
+            swap();
+            break;
+
+        case DROPN:
+            dropn((unsigned int)operand);
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case CMP:
+            binary(op);
+            break;
+
+        case JMP:
+            if ((unsigned int)operand == length)
+            {
+                finish();
+                emit(JMP, 0, 0, 0, 0, (int)length);
+            }
+            else
+            {
+                flush();
+                emit(JMP, 0, 0, 0, 0, operand);
+            }
+            live = false;
+            break;
+
+        default:
+            live = branch(op, (unsigned int)operand);
+            break;
+        }
+    }
+
+    if (live)
+    {
+        finish();
+        if (!stubs.empty())
+        {
+            emit(JMP, 0, 0, 0, 0, (int)length);
+        }
+    }
+
+    for (unsigned int i = 0; i < stubs.size(); ++i)
+    {
+        position[length + 1 + stubs[i]] = (int)code.size();
+        reset(stubs[i]);
+        finish();
+        if (i + 1 < stubs.size())
+        {
+            emit(JMP, 0, 0, 0, 0, (int)length);
+        }
+    }
+
+    position[length] = (int)code.size();
+    emit(STORE, 0, 0, 0, result_cell());
+}
+
+unsigned int VM_stack_translator::result_cell() const
+{
+    return base;
+}
+
+unsigned int VM_stack_translator::swap_cell() const
+{
+    return base + 1;
+}
+
+unsigned int VM_stack_translator::test_cell() const
+{
+    return base + 2;
+}
+
+unsigned int VM_stack_translator::spill_cell(unsigned int slot) const
+{
+    return base + FIXED_CELLS + slot - registers;
+}
+
+unsigned int VM_stack_translator::constant_cell(int value)
+{
+    auto found = find(constants.begin(), constants.end(), value);
+    if (constants.end() == found)
+    {
+        found = constants.insert(found, value);
+    }
+    return base + FIXED_CELLS + spilled() + (unsigned int)(found - constants.begin());
+}
+
+void VM_stack_translator::emit(OPCODE op, unsigned int r1, unsigned int r2, unsigned int r3, unsigned int addr,
+                               int label)
+{
+    code.push_back({op, r1, r2, r3, addr, label});
+}
+
+void VM_stack_translator::move(unsigned int from, unsigned int to)
+{
+    if (from != to && registers < MAX_REGISTERS)
+    {
+        emit(ADD, from, ZERO, to);
+    }
+    else if (from != to)
+    {
+        emit(SUB, from, from, to);
+        emit(ADD, from, to, to);
+    }
+}
+
+void VM_stack_translator::load(location const &from, unsigned int to)
+{
+    switch (from.kind)
+    {
+    case location::REG:
+        move((unsigned int)from.value, to);
+        break;
+    case location::CONST:
+        emit(LOAD, to, 0, 0, constant_cell(from.value));
+        break;
+    case location::MEM:
+        emit(LOAD, to, 0, 0, (unsigned int)from.value);
+        break;
+    }
+}
+
+VM_stack_translator::location VM_stack_translator::home(unsigned int slot) const
+{
+    if (slot < registers)
+    {
+        return {location::REG, (int)slot};
+    }
+    return {location::MEM, (int)spill_cell(slot)};
+}
+
+bool VM_stack_translator::used(unsigned int reg, unsigned int below) const
+{
+    const location held = {location::REG, (int)reg};
+    for (unsigned int slot = 0; slot < below; ++slot)
+    {
+        if (stack[slot] == held)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a register that no slot under below is in, or -1
+int VM_stack_translator::free_register(unsigned int below, int avoid) const
+{
+    for (unsigned int reg = 0; reg < registers; ++reg)
+    {
+        if ((int)reg != avoid && !used(reg, below))
+        {
+            return (int)reg;
+        }
+    }
+    return -1;
+}
+
+// The register from is in, or one it has been loaded into: prefer if that
+// is free, or another that no slot under below is in, or a scratch one.
+unsigned int VM_stack_translator::operand(location const &from, unsigned int below, int avoid, unsigned int prefer)
+{
+    if (location::REG == from.kind)
+    {
+        return (unsigned int)from.value;
+    }
+
+    int reg = prefer < registers && (int)prefer != avoid && !used(prefer, below) ? (int)prefer
+                                                                                  : free_register(below, avoid);
+    if (reg < 0)
+    {
+        reg = (int)scratch == avoid ? scratch + 1 : scratch;
+    }
+    load(from, (unsigned int)reg);
+    return (unsigned int)reg;
+}
+
+// Bring slot back to a place it may stay between instructions: a spilled
+// slot holds a constant or is in its own cell, any other a constant or a
+// register below registers.
+void VM_stack_translator::settle(unsigned int slot)
+{
+    location &here = stack[slot];
+    if (slot >= registers)
+    {
+        const unsigned int cell = spill_cell(slot);
+        if (location::REG == here.kind)
+        {
+            emit(STORE, (unsigned int)here.value, 0, 0, cell);
+            here = home(slot);
+        }
+        else if (location::MEM == here.kind && (unsigned int)here.value != cell)
+        {
+            emit(LOAD, scratch, 0, 0, (unsigned int)here.value);
+            emit(STORE, scratch, 0, 0, cell);
+            here = home(slot);
+        }
+    }
+    else if (location::MEM == here.kind || (location::REG == here.kind && (unsigned int)here.value >= registers))
+    {
+        const location from = here;
+        const unsigned int reg = (unsigned int)free_register((unsigned int)stack.size());
+        load(from, reg);
+        stack[slot] = {location::REG, (int)reg};
+    }
+}
+
+void VM_stack_translator::binary(OPCODE op)
+{
+    const unsigned int slot = (unsigned int)stack.size() - 2;
+    const location x = stack[slot + 1];
+    const location y = stack[slot];
+    stack.resize(slot);
+
+    int folded;
+    if (location::CONST == x.kind && location::CONST == y.kind && fold(op, y.value, x.value, folded))
+    {
+        stack.push_back({location::CONST, folded});
+        return;
+    }
+
+    if (slot >= registers)
+    {
+        load(y, scratch);
+        load(x, scratch + 1);
+        emit(op, scratch, scratch + 1, scratch);
+        emit(STORE, scratch, 0, 0, spill_cell(slot));
+        stack.push_back(home(slot));
+        return;
+    }
+
+    // neither operand may be loaded over the register the other is in
+    const unsigned int ry = operand(y, slot, location::REG == x.kind ? x.value : -1, slot);
+    const unsigned int rx = operand(x, slot, (int)ry, slot + 1);
+
+    // the result goes to its own register if it can, else over an operand,
+    // which is read before it is written; never to scratch
+    int result = -1;
+    for (unsigned int reg : {slot, ry, rx})
+    {
+        if (reg < registers && !used(reg, slot))
+        {
+            result = (int)reg;
+            break;
+        }
+    }
+    if (result < 0)
+    {
+        result = free_register(slot);
+    }
+
+    emit(op, ry, rx, (unsigned int)result);
+    stack.push_back({location::REG, result});
+}
+
+void VM_stack_translator::swap()
+{
+    const unsigned int top = (unsigned int)stack.size() - 1;
+    if (top < registers)
+    {
+        std::swap(stack[top - 1], stack[top]);
+        return;
+    }
+
+    // each cell is about to be written with the other's value
+    unsigned int reg = scratch;
+    for (unsigned int slot : {top - 1, top})
+    {
+        if (location::MEM == stack[slot].kind)
+        {
+            load(stack[slot], reg);
+            stack[slot] = {location::REG, (int)reg++};
+        }
+    }
+    std::swap(stack[top - 1], stack[top]);
+    settle(top);
+    settle(top - 1);
+}
+
+void VM_stack_translator::dropn(unsigned int n)
+{
+    // the slots above the one dropped each move down one, lowest first so
+    // no spilled one is overwritten before it has moved
+    const unsigned int dropped = (unsigned int)stack.size() - n;
+    stack.erase(stack.begin() + dropped);
+    for (unsigned int slot = dropped; slot < stack.size(); ++slot)
+    {
+        settle(slot);
+    }
+}
+
+// A conditional jump to target, or to the exit stub for the depth it
+// leaves; false if it is always taken.
+bool VM_stack_translator::branch(OPCODE op, unsigned int target)
+{
+    const location test = stack.back();
+    stack.pop_back();
+    const unsigned int slots = (unsigned int)stack.size();
+
+    int label = (int)target;
+    if (target == length)
+    {
+        label = (int)(length + 1 + slots);
+        if (find(stubs.begin(), stubs.end(), slots) == stubs.end())
+        {
+            stubs.push_back(slots);
+        }
+    }
+
+    if (location::CONST == test.kind)
+    {
+        if (!taken(op, test.value))
+        {
+            return true;
+        }
+        if (target == length)
+        {
+            finish();
+            emit(JMP, 0, 0, 0, 0, (int)length);
+        }
+        else
+        {
+            flush();
+            emit(JMP, 0, 0, 0, 0, label);
+        }
+        return false;
+    }
+
+    if (location::MEM == test.kind)
+    {
+        // a spilled slot's own cell, which flush leaves alone
+        flush();
+        emit(LOAD, scratch + 1, 0, 0, (unsigned int)test.value);
+        emit(op, scratch + 1, 0, 0, 0, label);
+        return true;
+    }
+
+    // flush writes the registers of the slots not yet in them
+    unsigned int reg = (unsigned int)test.value;
+    if (reg < min(slots, registers) && !(stack[reg] == home(reg)))
+    {
+        int spare = -1;
+        for (unsigned int r = slots; r < registers && spare < 0; ++r)
+        {
+            spare = used(r, slots) ? -1 : (int)r;
+        }
+        if (spare < 0 && spilled() > 0)
+        {
+            spare = (int)scratch + 1;
+        }
+
+        if (spare < 0)
+        {
+            // every register is taken until flush is done, when the one
+            // the test came from is free again
+            emit(STORE, reg, 0, 0, test_cell());
+            flush();
+            emit(LOAD, slots, 0, 0, test_cell());
+            emit(op, slots, 0, 0, 0, label);
+            return true;
+        }
+        move(reg, (unsigned int)spare);
+        reg = (unsigned int)spare;
+    }
+
+    flush();
+    emit(op, reg, 0, 0, 0, label);
+    return true;
+}
+
+// Put every slot in its own place, as at a jump or where one lands.
+void VM_stack_translator::flush()
+{
+    const unsigned int slots = (unsigned int)stack.size();
+    for (unsigned int slot = registers; slot < slots; ++slot)
+    {
+        if (location::CONST == stack[slot].kind)
+        {
+            load(stack[slot], scratch);
+            emit(STORE, scratch, 0, 0, spill_cell(slot));
+            stack[slot] = home(slot);
+        }
+    }
+
+    // The register slots are a parallel move: a register may only be
+    // written once no slot still waiting is to be copied from it.  When
+    // all that wait are in a cycle, one register is parked in the swap
+    // cell to break it; its slots then load from there.
+    const unsigned int in_registers = min(slots, registers);
+    for (;;)
+    {
+        bool waiting = false;
+        bool moved = false;
+        for (unsigned int slot = 0; slot < in_registers; ++slot)
+        {
+            if (stack[slot] == home(slot))
+            {
+                continue;
+            }
+            waiting = true;
+
+            bool needed = false;
+            for (unsigned int other = 0; other < in_registers && !needed; ++other)
+            {
+                needed = !(stack[other] == home(other)) && stack[other] == home(slot);
+            }
+            if (!needed)
+            {
+                load(stack[slot], slot);
+                stack[slot] = home(slot);
+                moved = true;
+            }
+        }
+
+        if (!waiting)
+        {
+            break;
+        }
+        if (!moved)
+        {
+            unsigned int parked = 0;
+            while (stack[parked] == home(parked))
+            {
+                ++parked;
+            }
+            emit(STORE, parked, 0, 0, swap_cell());
+            for (unsigned int slot = 0; slot < in_registers; ++slot)
+            {
+                if (stack[slot] == home(parked))
+                {
+                    stack[slot] = {location::MEM, (int)swap_cell()};
+                }
+            }
+        }
+    }
+}
+
+// Copy the top of the stack to r00 to end the program.
+void VM_stack_translator::finish()
+{
+    load(stack.back(), 0);
+}
+
+void VM_stack_translator::reset(unsigned int slots)
+{
+    stack.clear();
+    for (unsigned int slot = 0; slot < slots; ++slot)
+    {
+        stack.push_back(home(slot));
+    }
+}
@@ -0,0 +1,75 @@
+#include "VM_verifier.hpp"
+
+VM_verifier::VM_verifier()
+    : verified(false), written(~0u)
+{
+}
+
+bool VM_verifier::verify(VM_instruction const *program, unsigned int length, unsigned int heap_size)
+{
+    verified = false;
+    written = ~0u;
+
+    uint32_t registers = 0;
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        if (!check(program[pc], length, heap_size))
+        {
+            return false;
+        }
+
+        if (LOAD == program[pc].op)
+        {
+            registers |= 1u << program[pc].r1;
+        }
+        else if (program[pc].op >= ADD && program[pc].op <= CMP)
+        {
+            registers |= 1u << program[pc].r3;
+        }
+    }
+
+    verified = true;
+    written = registers;
+    return verified;
+}
+
+bool VM_verifier::is_verified() const
+{
+    return verified;
+}
+
+uint32_t VM_verifier::written_registers() const
+{
+    return written;
+}
+
+bool VM_verifier::check(VM_instruction const &instr, unsigned int length, unsigned int heap_size) const
+{
+    switch (instr.op)
+    {
+    case LOAD:
+    case STORE:
+        return instr.r1 < MAX_REGISTERS && instr.addr < heap_size;
+
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case CMP:
+        return instr.r1 < MAX_REGISTERS && instr.r2 < MAX_REGISTERS && instr.r3 < MAX_REGISTERS;
+
+    case JMP:
+        return instr.loc < length;
+
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JLE:
+    case JGT:
+    case JGE:
+        return instr.r1 < MAX_REGISTERS && instr.loc < length;
+
+    default:
+        return false;
+    }
+}
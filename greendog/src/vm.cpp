@@ -1,14 +1,56 @@
 #include "vm.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
 #include <iostream>
+#include <sstream>
 
 #include "VM_executor.hpp"
+#include "VM_mnemonics.hpp"
 
 using namespace std;
 
-VM::VM()
-    : program_size(0u), valid_program(true)
+namespace
+{
+
+// the low 16 bits of an address or location go in the instruction word
+unsigned int low(unsigned int value)
+{
+    return value & 0xFFFF;
+}
+
+// and the rest, if there is any, in an EXT word before it
+unsigned int prefix(unsigned int value)
+{
+    return value > 0xFFFF ? ((unsigned int)EXT << 24) | (value >> 16) : 0;
+}
+
+} // namespace
+
+VM::VM(unsigned int heap_size, unsigned int program_limit)
+    : program_size(0u), max_program_size(min(program_limit, MAX_WIDE_PROGRAM_SIZE)), valid_program(true),
+      analysis_current(false), arena(min(heap_size, MAX_WIDE_HEAP_SIZE)), heap(arena.data()),
+      heap_cells((unsigned int)arena.size()), addressed(0), image_code(nullptr)
 {
+    // room for a default sized program up front; larger ones grow
+    decoded.reserve(min(max_program_size, MAX_PROGRAM_SIZE));
+}
+
+unsigned int VM::heap_size() const
+{
+    return heap_cells;
+}
+
+unsigned int VM::program_limit() const
+{
+    return max_program_size;
+}
+
+unsigned int VM::program_length() const
+{
+    return program_size;
 }
 
 void VM::load(unsigned int reg, unsigned int addr)
@@ -81,11 +123,338 @@ void VM::jge(unsigned int reg, unsigned int loc)
     maybe_add_op_RL(JGE, reg, loc);
 }
     
-VM_exec_status VM::exec(bool verbose)
+VM_exec_status VM::exec(bool verbose, unsigned int max_ticks)
+{
+    return run(verbose, false, max_ticks);
+}
+
+VM_exec_status VM::exec_trusted(bool verbose, unsigned int max_ticks)
+{
+    return run(verbose, verify(), max_ticks);
+}
+
+VM_exec_status VM::exec_jit(bool verbose, unsigned int max_ticks)
+{
+    if (verbose || !VM_jit::supported() || !verify())
+    {
+        return exec_trusted(verbose, max_ticks);
+    }
+
+    if (!jit.is_compiled() && !jit.compile(code(), program_size, blocks.runs()))
+    {
+        return exec_trusted(verbose, max_ticks);
+    }
+
+    VM_executor executor(code(), program_size, blocks.runs(), heap, true);
+    return executor.exec_jit(jit, max_ticks);
+}
+
+VM_exec_status VM::exec_profiled(VM_profile &profile, unsigned int max_ticks)
+{
+    if (!valid_program)
+    {
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
+    }
+
+    if (!profile.fits(program_size))
+    {
+        profile.prepare(program_size);
+        for (unsigned int op = 0; op < 256; ++op)
+        {
+            VM_mnemonic const *mnemonic = VM_mnemonic_of(op);
+            if (nullptr != mnemonic)
+            {
+                profile.names[op] = mnemonic->name;
+            }
+        }
+        for (unsigned int pc = 0; pc < program_size; ++pc)
+        {
+            ostringstream text;
+            text << code()[pc];
+            profile.listing[pc] = {text.str(), code()[pc].op >= JMP, code()[pc].op > JMP};
+        }
+    }
+
+    const bool trusted = verify();
+    VM_executor executor(code(), program_size, blocks.runs(), heap, trusted);
+    return executor.exec_profiled(profile, max_ticks);
+}
+
+VM_exec_status VM::exec_traced(VM_trace &trace, unsigned int max_ticks)
+{
+    if (!valid_program)
+    {
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
+    }
+
+    const bool trusted = verify();
+    VM_executor executor(code(), program_size, blocks.runs(), heap, trusted);
+    return executor.exec_traced(trace, max_ticks);
+}
+
+bool VM::bind(VM_executor &executor)
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    const bool trusted = verify();
+    executor.bind(code(), program_size, blocks.runs(), heap, trusted, verifier.written_registers());
+    return true;
+}
+
+vector<VM_exec_status> VM::exec_batch(vector<vector<int>> &heaps, unsigned int threads, unsigned int max_ticks)
+{
+    vector<VM_exec_status> results(heaps.size(), VM_exec_status(VM_error::INVALID_PROGRAM));
+    if (!valid_program || heaps.empty())
+    {
+        return results;
+    }
+
+    const bool trusted = verify();
+    const bool native = this->native();
+    const size_t size = scratch_cells(heaps);
+
+    // beyond its image a run can only change the cells it stores to
+    vector<unsigned int> stored;
+    for (unsigned int pc = 0; pc < program_size; ++pc)
+    {
+        if (STORE == code()[pc].op && code()[pc].addr < heap_cells)
+        {
+            stored.push_back(code()[pc].addr);
+        }
+    }
+
+    VM_thread_pool &workers = thread_pool(threads);
+
+    // hand out a few runs at a time so workers rarely touch the counter
+    const size_t count = heaps.size();
+    const size_t chunk = max<size_t>(1, count / (workers.size() * 16));
+    atomic<size_t> next(0);
+
+    workers.run([&](unsigned int) {
+        // per worker: one heap and one executor, reset by each exec
+        VM_arena scratch(size);
+        int *heap = scratch.data();
+        VM_executor executor(code(), program_size, blocks.runs(), heap, trusted);
+
+        for (size_t first = next.fetch_add(chunk); first < count; first = next.fetch_add(chunk))
+        {
+            for (size_t i = first; i < min(first + chunk, count); ++i)
+            {
+                vector<int> &image = heaps[i];
+                const size_t cells = min(image.size(), size);
+
+                copy(image.begin(), image.begin() + cells, heap);
+                results[i] = native ? executor.exec_jit(jit, max_ticks) : executor.exec(false, max_ticks);
+                copy(heap, heap + cells, image.begin());
+
+                fill(heap, heap + cells, 0);
+                for (unsigned int addr : stored)
+                {
+                    heap[addr] = 0;
+                }
+            }
+        }
+    });
+
+    return results;
+}
+
+shared_ptr<VM_snapshot const> VM::snapshot() const
+{
+    return make_shared<VM_snapshot const>(heap, heap_cells, heap_cells);
+}
+
+VM_exec_status VM::exec(VM_heap &heap, unsigned int max_ticks)
+{
+    if (!valid_program)
+    {
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
+    }
+
+    const bool trusted = verify();
+    const bool native = this->native();
+    if (frames.empty())
+    {
+        frames.resize(1);
+    }
+
+    VM_heap_frame &frame = heap_frame(0);
+    frame.enter(heap);
+    VM_executor executor(code(), program_size, blocks.runs(), frame.data(), trusted);
+    VM_exec_status status = native ? executor.exec_jit(jit, max_ticks) : executor.exec(false, max_ticks);
+    frame.leave(heap, stored_pages);
+    return status;
+}
+
+vector<VM_exec_status> VM::exec_batch(vector<VM_heap> &heaps, unsigned int threads, unsigned int max_ticks)
+{
+    vector<VM_exec_status> results(heaps.size(), VM_exec_status(VM_error::INVALID_PROGRAM));
+    if (!valid_program || heaps.empty())
+    {
+        return results;
+    }
+
+    const bool trusted = verify();
+    const bool native = this->native();
+
+    VM_thread_pool &workers = thread_pool(threads);
+    if (frames.size() < workers.size())
+    {
+        frames.resize(workers.size());
+    }
+
+    const size_t count = heaps.size();
+    const size_t chunk = max<size_t>(1, count / (workers.size() * 16));
+    atomic<size_t> next(0);
+
+    workers.run([&](unsigned int worker) {
+        VM_heap_frame &frame = heap_frame(worker);
+        VM_executor executor(code(), program_size, blocks.runs(), frame.data(), trusted);
+
+        for (size_t first = next.fetch_add(chunk); first < count; first = next.fetch_add(chunk))
+        {
+            for (size_t i = first; i < min(first + chunk, count); ++i)
+            {
+                frame.enter(heaps[i]);
+                results[i] = native ? executor.exec_jit(jit, max_ticks) : executor.exec(false, max_ticks);
+                frame.leave(heaps[i], stored_pages);
+            }
+        }
+    });
+
+    return results;
+}
+
+vector<VM_exec_status> VM::exec_lockstep(vector<vector<int>> &heaps, unsigned int threads, unsigned int max_ticks,
+                                         VM_lockstep_isa isa)
+{
+    if (!verify())
+    {
+        return exec_batch(heaps, threads, max_ticks);
+    }
+
+    vector<VM_exec_status> results(heaps.size(), VM_exec_status(VM_error::INVALID_PROGRAM));
+    if (heaps.empty())
+    {
+        return results;
+    }
+
+    VM_thread_pool &workers = thread_pool(threads);
+    const size_t size = scratch_cells(heaps);
+
+    // as exec_batch, but the unit of work is a group of lanes
+    const size_t count = heaps.size();
+    const size_t lanes = VM_lockstep::lanes(min(isa, VM_lockstep::best()));
+    const size_t groups = (count + lanes - 1) / lanes;
+    const size_t chunk = max<size_t>(1, groups / (workers.size() * 16));
+    atomic<size_t> next(0);
+
+    workers.run([&](unsigned int) {
+        VM_lockstep lockstep(code(), program_size, isa, (unsigned int)size);
+
+        for (size_t first = next.fetch_add(chunk); first < groups; first = next.fetch_add(chunk))
+        {
+            for (size_t group = first; group < min(first + chunk, groups); ++group)
+            {
+                const size_t i = group * lanes;
+                lockstep.exec(&heaps[i], (unsigned int)min(lanes, count - i), max_ticks, &results[i]);
+            }
+        }
+    });
+
+    return results;
+}
+
+bool VM::verify()
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    analyse();
+    return verifier.is_verified();
+}
+
+void VM::analyse()
+{
+    if (!analysis_current)
+    {
+        verifier.verify(code(), program_size, heap_cells);
+        blocks.analyse(code(), program_size);
+        jit.clear();
+
+        vector<bool> stored(VM_heap_pages(heap_cells), false);
+        stored_pages.clear();
+        addressed = 0;
+        for (unsigned int pc = 0; pc < program_size; ++pc)
+        {
+            if (LOAD == code()[pc].op || STORE == code()[pc].op)
+            {
+                addressed = max(addressed, code()[pc].addr + 1);
+            }
+            unsigned int page = code()[pc].addr / HEAP_PAGE_SIZE;
+            if (STORE == code()[pc].op && page < stored.size() && !stored[page])
+            {
+                stored[page] = true;
+                stored_pages.push_back(page);
+            }
+        }
+
+        analysis_current = true;
+    }
+}
+
+VM_thread_pool &VM::thread_pool(unsigned int threads)
+{
+    if (0 == threads)
+    {
+        threads = VM_thread_pool::hardware_threads();
+    }
+    if (!pool || pool->size() != threads)
+    {
+        pool.reset(new VM_thread_pool(threads));
+    }
+    return *pool;
+}
+
+// Runs never reach past the highest address the program names, so the
+// heap beyond that and the images need not be there.
+size_t VM::scratch_cells(vector<vector<int>> const &heaps) const
+{
+    size_t size = addressed;
+    for (vector<int> const &image : heaps)
+    {
+        size = max(size, image.size());
+    }
+    return min<size_t>(size, heap_cells);
+}
+
+// Made by the worker that uses it, so that its pages are first touched
+// there; frames is already long enough.
+VM_heap_frame &VM::heap_frame(unsigned int worker)
+{
+    if (!frames[worker])
+    {
+        frames[worker].reset(new VM_heap_frame(heap_cells));
+    }
+    return *frames[worker];
+}
+
+bool VM::native()
+{
+    return verify() && VM_jit::supported() &&
+           (jit.is_compiled() || jit.compile(code(), program_size, blocks.runs()));
+}
+
+VM_exec_status VM::run(bool verbose, bool trusted, unsigned int max_ticks)
 {
     if (!valid_program)
     {
-        return VM_exec_status("Cannot execute invalid program");
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
     }
 
     if (verbose)
@@ -95,8 +464,9 @@ VM_exec_status VM::exec(bool verbose)
         cerr << "program_size = " << program_size << "\n";
     }
 
-    VM_executor executor(program, program_size, heap);
-    VM_exec_status rv = executor.exec(verbose);
+    analyse();
+    VM_executor executor(code(), program_size, blocks.runs(), heap, trusted);
+    VM_exec_status rv = executor.exec(verbose, max_ticks);
     if ( verbose ) 
     {
         dump_heap(0, 4);
@@ -106,7 +476,7 @@ VM_exec_status VM::exec(bool verbose)
 
 void VM::set_heap(unsigned int addr, int value)
 {
-    if (addr < MAX_HEAP_SIZE)
+    if (addr < heap_cells)
     {
         heap[addr] = value;
     }
@@ -114,7 +484,7 @@ void VM::set_heap(unsigned int addr, int value)
 
 int VM::get_heap(unsigned int addr) const
 {
-    if (addr < MAX_HEAP_SIZE)
+    if (addr < heap_cells)
     {
         return heap[addr];
     }
@@ -132,11 +502,117 @@ void VM::dump_heap(unsigned int from, unsigned int to) const
     }
 }
 
+bool VM::save(const std::string &path) const
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    // trailing zero cells are left for load to fill in
+    unsigned int cells = heap_cells;
+    while (cells > 0 && 0 == heap[cells - 1])
+    {
+        --cells;
+    }
+
+    VM_image_writer writer(VM_image_machine::GREENDOG);
+    writer.add(VM_image_section::CODE, code(), program_size * sizeof(VM_instruction));
+    writer.add(VM_image_section::HEAP, heap, cells * sizeof(int));
+    return writer.write(path);
+}
+
+bool VM::load(const std::string &path)
+{
+    shared_ptr<VM_image> loaded(new VM_image);
+    if (!loaded->open(path, VM_image_machine::GREENDOG))
+    {
+        return false;
+    }
+
+    size_t size;
+    VM_instruction const *loaded_code =
+        static_cast<VM_instruction const *>(loaded->section(VM_image_section::CODE, size));
+    if (nullptr == loaded_code || 0 != size % sizeof(VM_instruction) ||
+        size / sizeof(VM_instruction) > max_program_size)
+    {
+        return false;
+    }
+    const unsigned int length = (unsigned int)(size / sizeof(VM_instruction));
+
+    // Only what the builder could have produced: records must decode from
+    // their own instruction word and have operands in range, since the
+    // trusted engines do not check them.
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        VM_instruction const &instr = loaded_code[pc];
+        if (0 == instr.op || !(VM_instruction(instr.encode(), instr.prefix()) == instr) ||
+            instr.r1 >= MAX_REGISTERS || instr.r2 >= MAX_REGISTERS || instr.r3 >= MAX_REGISTERS ||
+            instr.addr >= heap_cells || instr.loc >= max_program_size)
+        {
+            return false;
+        }
+    }
+
+    void const *cells = loaded->section(VM_image_section::HEAP, size);
+    if (0 != size % sizeof(int) || size / sizeof(int) > heap_cells)
+    {
+        return false;
+    }
+
+    fill(heap, heap + heap_cells, 0);
+    if (nullptr != cells)
+    {
+        memcpy(heap, cells, size);
+    }
+
+    image = loaded;
+    image_code = loaded_code;
+    program_size = length;
+    valid_program = true;
+    analysis_current = false;
+    return true;
+}
+
+void VM::disassemble(std::ostream &out) const
+{
+    if (!valid_program)
+    {
+        return;
+    }
+
+    for (unsigned int pc = 0; pc < program_size; ++pc)
+    {
+        ostringstream text;
+        text << code()[pc];
+        string line = text.str();
+        line.resize(max<size_t>(line.size(), 20), ' ');
+        out << "    " << line << "; " << pc << "\n";
+    }
+}
+
+VM_instruction const *VM::code() const
+{
+    return image ? image_code : decoded.data();
+}
+
+void VM::detach()
+{
+    // copy a loaded program out of the image before changing it
+    if (image)
+    {
+        decoded.assign(image_code, image_code + program_size);
+
+        image.reset();
+        image_code = nullptr;
+    }
+}
+
 bool VM::check_program_size()
 {
     if (valid_program)
     {
-        if (program_size >= MAX_PROGRAM_SIZE)
+        if (program_size >= max_program_size)
         {
             valid_program = false;
         }
@@ -160,7 +636,7 @@ bool VM::check_address(unsigned int addr)
 {
     if (valid_program)
     {
-        if (addr >= MAX_HEAP_SIZE)
+        if (addr >= heap_cells)
         {
             valid_program = false;
         }
@@ -172,7 +648,7 @@ bool VM::check_location(unsigned int loc)
 {
     if (valid_program)
     {
-        if (loc >= MAX_PROGRAM_SIZE)
+        if (loc >= max_program_size)
         {
             valid_program = false;
         }
@@ -180,14 +656,23 @@ bool VM::check_location(unsigned int loc)
     return valid_program;
 }
 
+void VM::append(unsigned int instr, unsigned int prefix)
+{
+    // decode once here so the executor can walk the decoded form directly
+    detach();
+    analysis_current = false;
+    decoded.push_back(VM_instruction(instr, prefix));
+    ++program_size;
+}
+
 void VM::maybe_add_op_RA(OPCODE op, unsigned int reg, unsigned int addr)
 {
     if (valid_program)
     {
         if (check_program_size() && check_register(reg) && check_address(addr))
         {
-            unsigned int instr = (((unsigned int)op) << 24) | (reg << 16) | addr;
-            program[program_size++] = instr;
+            unsigned int instr = (((unsigned int)op) << 24) | (reg << 16) | low(addr);
+            append(instr, prefix(addr));
         }
     }
 }
@@ -202,7 +687,7 @@ void VM::maybe_add_op_RRR(OPCODE op, unsigned int r1, unsigned int r2, unsigned
                                   (r1 << 16) | 
                                   (r2 << 8) |
                                   r3;
-            program[program_size++] = instr;
+            append(instr, 0);
         }
     }
 }
@@ -213,8 +698,8 @@ void VM::maybe_add_op_L(OPCODE op, unsigned int loc)
     {
         if (check_program_size() && check_location(loc))
         {
-            unsigned int instr = (((unsigned int)op) << 24) | loc;
-            program[program_size++] = instr;
+            unsigned int instr = (((unsigned int)op) << 24) | low(loc);
+            append(instr, prefix(loc));
         }
     }
 
@@ -226,8 +711,8 @@ void VM::maybe_add_op_RL(OPCODE op, unsigned int reg, unsigned int loc)
     {
         if (check_program_size() && check_register(reg) && check_location(loc))
         {
-            unsigned int instr = (((unsigned int)op) << 24) | (reg << 16) | loc;
-            program[program_size++] = instr;
+            unsigned int instr = (((unsigned int)op) << 24) | (reg << 16) | low(loc);
+            append(instr, prefix(loc));
         }
     }
 }
@@ -1,10 +1,27 @@
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <new>
+#include <sstream>
+#include <random>
 #include <string>
+#include <vector>
 
 #include "vm.hpp"
 #include "Runner.hpp"
+#include "VM_assembler.hpp"
+#include "VM_ir_builder.hpp"
+#include "VM_ir_lowering.hpp"
+#include "VM_ir_optimizer.hpp"
+#include "VM_mnemonics.hpp"
+#include "VM_stack_program.hpp"
+#include "VM_stack_translator.hpp"
 
 using namespace std;
 
@@ -113,21 +130,21 @@ void math_tests(Runner & runner, void (VM::*op)(unsigned int, unsigned int, unsi
         (vm.*op)(32, 1, 2);
         char buf[128];
         sprintf(buf, "%s Bad Register 1", name);
-        EXPECT_ERROR(vm, buf);
+        return EXPECT_ERROR(vm, buf);
     });
     runner([op, name]()->bool {
         VM vm;
         (vm.*op)(0, 32, 2);
         char buf[128];
         sprintf(buf, "%s Bad Register 2", name);
-        EXPECT_ERROR(vm, buf);
+        return EXPECT_ERROR(vm, buf);
     });
     runner([op, name]()->bool {
         VM vm;
         (vm.*op)(0, 1, 32);
         char buf[128];
         sprintf(buf, "%s Bad Register 3", name);
-        EXPECT_ERROR(vm, buf);
+        return EXPECT_ERROR(vm, buf);
     });
 
     binop_test(runner, 12, 4, op, fn, name);}
@@ -141,7 +158,21 @@ bool divide_by_zero()
     vm.store(2, 2);
     vm.set_heap(0, 1);
     vm.set_heap(1, 0);
-    EXPECT_ERROR(vm, "Divide By Zero");
+    return EXPECT_ERROR(vm, "Divide By Zero");
+}
+
+bool divide_by_zero_code()
+{
+    VM vm;
+    vm.load(0, 0);
+    vm.load(1, 1);
+    vm.div(0, 1, 2);
+    vm.set_heap(0, 1);
+    vm.set_heap(1, 0);
+    VM_exec_status status = vm.exec();
+    bool ok = status.get_error() == VM_error::DIVISION_BY_ZERO && status.get_ticks() == 3;
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Divide By Zero Code\n";
+    return ok;
 }
 
 void math_suite(Runner & runner)
@@ -151,6 +182,7 @@ void math_suite(Runner & runner)
     math_tests(runner, &VM::mul, multiplies<int>(), "Mul");
     math_tests(runner, &VM::div, divides<int>(), "Div");
     runner(divide_by_zero);
+    runner(divide_by_zero_code);
 }
 
 template <typename T>
@@ -317,10 +349,8 @@ void conditional_jmp_suite(Runner &runner, void (VM::*op)(unsigned int, unsigned
     });
 }
 
-bool factorial_test(int arg, string const &label, int exp)
+void factorial_program(VM &vm, int arg)
 {
-    VM vm;
-
     // input:  heap 0 contains arg
     // output:  heap 3 contains result initialized to -1 for error result
 
@@ -345,6 +375,12 @@ bool factorial_test(int arg, string const &label, int exp)
     vm.store(2, 3);  // 9 store accumulator in memory 0
 
     vm.cmp(1, 1, 1);  // 10 -- no op end of program target 
+}
+
+bool factorial_test(int arg, string const &label, int exp)
+{
+    VM vm;
+    factorial_program(vm, arg);
 
     return EXPECT_RUN_OK(vm, label, [&vm, exp](bool verbose) -> bool {
         if ( verbose )
@@ -376,10 +412,8 @@ void factorial_suite(Runner &runner)
     });
 }
 
-bool fibonacci_test(int arg, string const &label, int exp)
+void fibonacci_program(VM &vm, int arg)
 {
-    VM vm;
-
     // input:  heap 0 contains arg
     // output:  heap 3 contains result initialized to -1 for error result
 
@@ -410,6 +444,12 @@ ERROR:
 
 END:
     vm.store(2, 3);    // 13 -- return value in heap[3]
+}
+
+bool fibonacci_test(int arg, string const &label, int exp)
+{
+    VM vm;
+    fibonacci_program(vm, arg);
 
     return EXPECT_RUN_OK(vm, label, [&vm, exp](bool verbose) -> bool {
         if ( verbose )
@@ -438,29 +478,2172 @@ void fibonacci_suite(Runner &runner)
     });
 }
 
-int main(void)
+using VM_engine = VM_exec_status (VM::*)(bool, unsigned int);
+
+bool budget_test(string const &label, VM_engine engine)
 {
-    Runner runner;
+    VM vm;
+    factorial_program(vm, 5);
+    const unsigned int needed = vm.exec().get_ticks();
 
-    runner(empty_program);
+    // every budget must behave as if ticks were counted one at a time
+    for (unsigned int budget = 0; budget <= needed + 1; ++budget)
+    {
+        VM_exec_status status = (vm.*engine)(false, budget);
+        bool ok = (budget >= needed) ? status.is_status_ok() && status.get_ticks() == needed
+                                     : status.get_error() == VM_error::MAX_RUNTIME && status.get_ticks() == budget + 1;
+        if (!ok)
+        {
+            cerr << "[FAIL] " << label << ", wrong result with budget " << budget << "\n";
+            return false;
+        }
+    }
 
-    load_suite(runner);
-    math_suite(runner);
-    cmp_suite(runner);
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
 
-    runner(program_too_long);
+bool expect_trusted_matches(VM &vm, string const &label, bool verified)
+{
+    const unsigned int cells = 16;
 
-    jmp_suite(runner);
+    VM_exec_status exp = vm.exec();
+    int exp_heap[cells];
+    for (unsigned int i = 0; i < cells; ++i)
+    {
+        exp_heap[i] = vm.get_heap(i);
+    }
 
-    conditional_jmp_suite(runner, &VM::jeq, "JEQ", false, true, false);
-    conditional_jmp_suite(runner, &VM::jne, "JNE", true, false, true);
-    conditional_jmp_suite(runner, &VM::jlt, "JLT", true, false, false);
-    conditional_jmp_suite(runner, &VM::jle, "JLE", true, true, false);
-    conditional_jmp_suite(runner, &VM::jgt, "JGT", false, false, true);
-    conditional_jmp_suite(runner, &VM::jge, "JGE", false, true, true);
+    VM_exec_status act = vm.exec_trusted();
+    bool ok = vm.verify() == verified &&
+              exp.get_error() == act.get_error() &&
+              exp.get_program_value() == act.get_program_value() &&
+              exp.get_ticks() == act.get_ticks();
+    for (unsigned int i = 0; ok && i < cells; ++i)
+    {
+        ok = exp_heap[i] == vm.get_heap(i);
+    }
 
-    factorial_suite(runner);
-    fibonacci_suite(runner);
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    return ok;
+}
+
+void trusted_test(Runner &runner, string const &label, bool verified, function<void(VM &)> build)
+{
+    runner([label, verified, build]() -> bool {
+        VM vm;
+        build(vm);
+        return expect_trusted_matches(vm, "Trusted " + label, verified);
+    });
+}
+
+void trusted_suite(Runner &runner)
+{
+    trusted_test(runner, "Empty", true, [](VM &vm) {});
+    trusted_test(runner, "Bad Register", false, [](VM &vm) {
+        vm.load(32, 0);
+    });
+    trusted_test(runner, "Branch Beyond End", false, [](VM &vm) {
+        vm.jmp(22);
+    });
+    trusted_test(runner, "Divide By Zero", true, [](VM &vm) {
+        vm.load(0, 0);
+        vm.load(1, 1);
+        vm.div(0, 1, 2);
+        vm.set_heap(0, 1);
+        vm.set_heap(1, 0);
+    });
+    trusted_test(runner, "Run Too Long", true, [](VM &vm) {
+        vm.load(0, 0);
+        vm.add(0, 0, 1);
+        vm.jmp(1);
+        vm.set_heap(0, 1);
+    });
+    for (int arg : {-1, 0, 1, 5})
+    {
+        trusted_test(runner, "Factorial " + to_string(arg), true, [arg](VM &vm) {
+            factorial_program(vm, arg);
+        });
+    }
+    for (int arg : {0, 1, 8})
+    {
+        trusted_test(runner, "Fibonacci " + to_string(arg), true, [arg](VM &vm) {
+            fibonacci_program(vm, arg);
+        });
+    }
+}
+
+// Run the program on the checked interpreter and then natively, from the
+// same heap, and compare everything observable.
+bool expect_jit_matches(VM &vm, string const &label, unsigned int max_ticks = MAX_TICKS)
+{
+    const unsigned int cells = 16;
+    int start[cells];
+    for (unsigned int i = 0; i < cells; ++i)
+    {
+        start[i] = vm.get_heap(i);
+    }
+
+    VM_exec_status exp = vm.exec(false, max_ticks);
+    int exp_heap[cells];
+    for (unsigned int i = 0; i < cells; ++i)
+    {
+        exp_heap[i] = vm.get_heap(i);
+        vm.set_heap(i, start[i]);
+    }
+
+    VM_exec_status act = vm.exec_jit(false, max_ticks);
+    bool ok = exp.get_error() == act.get_error() &&
+              exp.get_program_value() == act.get_program_value() &&
+              exp.get_ticks() == act.get_ticks();
+    for (unsigned int i = 0; ok && i < cells; ++i)
+    {
+        ok = exp_heap[i] == vm.get_heap(i);
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    return ok;
+}
+
+void jit_test(Runner &runner, string const &label, function<void(VM &)> build)
+{
+    runner([label, build]() -> bool {
+        VM vm;
+        build(vm);
+        return expect_jit_matches(vm, "JIT " + label);
+    });
+}
+
+// Straight line code, loops and branches of every kind over a handful
+// of registers and heap cells; every operand is in range so the
+// programs verify.
+void random_program(VM &vm, mt19937 &rng, unsigned int length)
+{
+    auto pick = [&rng](unsigned int n) { return (unsigned int)(rng() % n); };
+
+    for (unsigned int pc = 0; pc < length; ++pc)
+    {
+        unsigned int r1 = pick(6), r2 = pick(6), r3 = pick(6);
+        switch (pick(11))
+        {
+        case 0: vm.load(r1, pick(16)); break;
+        case 1: vm.store(r1, pick(16)); break;
+        case 2: vm.add(r1, r2, r3); break;
+        case 3: vm.sub(r1, r2, r3); break;
+        case 4: vm.div(r1, r2, r3); break;
+        case 5: vm.cmp(r1, r2, r3); break;
+        case 6: vm.jmp(pick(length)); break;
+        case 7: vm.jeq(r1, pick(length)); break;
+        case 8: vm.jne(r1, pick(length)); break;
+        case 9: vm.jlt(r1, pick(length)); break;
+        default: vm.jgt(r1, pick(length)); break;
+        }
+    }
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        vm.set_heap(i, (int)pick(21) - 10);
+    }
+}
+
+bool jit_random_programs()
+{
+    mt19937 rng(2024);
+    for (int i = 0; i < 200; ++i)
+    {
+        VM vm;
+        random_program(vm, rng, 8 + i % 24);
+        if (!vm.verify() || !expect_jit_matches(vm, "JIT Random " + to_string(i), 50 + i * 5))
+        {
+            return false;
+        }
+    }
+
+    cerr << "[PASS] JIT Random Programs\n";
+    return true;
+}
+
+void jit_suite(Runner &runner)
+{
+    jit_test(runner, "Empty", [](VM &vm) {});
+    jit_test(runner, "Bad Register", [](VM &vm) {
+        vm.load(32, 0);
+    });
+    jit_test(runner, "Divide By Zero", [](VM &vm) {
+        vm.load(0, 0);
+        vm.load(1, 1);
+        vm.div(0, 1, 2);
+        vm.store(2, 2);
+        vm.set_heap(0, 1);
+        vm.set_heap(1, 0);
+    });
+    jit_test(runner, "Jump Into Run", [](VM &vm) {
+        vm.load(0, 0);
+        vm.jmp(3);
+        vm.load(0, 1);
+        vm.add(0, 0, 0);
+        vm.store(0, 2);
+        vm.set_heap(0, 21);
+    });
+    jit_test(runner, "Run Too Long", [](VM &vm) {
+        vm.load(0, 0);
+        vm.add(0, 0, 1);
+        vm.jmp(1);
+        vm.set_heap(0, 1);
+    });
+    for (int arg : {-1, 0, 1, 5, 12})
+    {
+        jit_test(runner, "Factorial " + to_string(arg), [arg](VM &vm) {
+            factorial_program(vm, arg);
+        });
+    }
+    for (int arg : {0, 1, 8, 40})
+    {
+        jit_test(runner, "Fibonacci " + to_string(arg), [arg](VM &vm) {
+            fibonacci_program(vm, arg);
+        });
+    }
+    runner(jit_random_programs);
+}
+
+using VM_batch_engine = function<vector<VM_exec_status>(VM &, vector<vector<int>> &)>;
+
+// Factorial over a range of inputs, so runs loop for different lengths.
+bool batch_test(string const &label, VM_batch_engine engine)
+{
+    VM batch;
+    factorial_program(batch, 0);
+
+    vector<vector<int>> heaps;
+    for (int arg = -3; arg <= 12; ++arg)
+    {
+        heaps.push_back({arg, 1, 0, -1});
+    }
+    heaps.push_back({5});   // constants left zero
+
+    vector<VM_exec_status> statuses = engine(batch, heaps);
+
+    for (size_t i = 0; i < heaps.size(); ++i)
+    {
+        VM vm;
+        factorial_program(vm, heaps[i][0]);
+        for (unsigned int addr = 1; addr < 4; ++addr)
+        {
+            vm.set_heap(addr, addr < heaps[i].size() ? heaps[i][addr] : 0);
+        }
+        VM_exec_status exp = vm.exec();
+
+        bool ok = statuses.size() == heaps.size() &&
+                  exp.get_error() == statuses[i].get_error() &&
+                  exp.get_program_value() == statuses[i].get_program_value() &&
+                  exp.get_ticks() == statuses[i].get_ticks();
+        for (unsigned int addr = 0; ok && addr < heaps[i].size(); ++addr)
+        {
+            ok = vm.get_heap(addr) == heaps[i][addr];
+        }
+        if (!ok)
+        {
+            cerr << "[FAIL] " << label << ", run " << i << " differs\n";
+            return false;
+        }
+    }
+
+    // the VM's own heap is left alone
+    if (batch.get_heap(0) != 0 || batch.get_heap(3) != -1)
+    {
+        cerr << "[FAIL] " << label << ", VM heap changed\n";
+        return false;
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+bool batch_isolated()
+{
+    // adds its input to heap 5 and returns it; a run that saw the
+    // previous run's store would return more
+    VM vm;
+    vm.load(0, 5);
+    vm.load(1, 0);
+    vm.add(0, 1, 0);
+    vm.store(0, 5);
+
+    vector<vector<int>> heaps(100, vector<int>{7});
+    vector<VM_exec_status> statuses = vm.exec_batch(heaps, 1);
+    for (VM_exec_status const &status : statuses)
+    {
+        if (!status.is_status_ok() || status.get_program_value() != 7)
+        {
+            cerr << "[FAIL] Batch Isolated\n";
+            return false;
+        }
+    }
+
+    cerr << "[PASS] Batch Isolated\n";
+    return true;
+}
+
+bool batch_invalid()
+{
+    VM vm;
+    vm.load(32, 0);
+
+    vector<vector<int>> heaps(3, vector<int>{1});
+    vector<VM_exec_status> statuses = vm.exec_batch(heaps);
+    bool ok = statuses.size() == 3;
+    for (VM_exec_status const &status : statuses)
+    {
+        ok = ok && status.get_error() == VM_error::INVALID_PROGRAM;
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Batch Invalid Program\n";
+    return ok;
+}
+
+// Random programs run in lockstep over random heaps against exec run on
+// each heap in turn; the runs diverge, divide by zero and run out of
+// budget at different points.
+bool lockstep_random_programs(VM_lockstep_isa isa)
+{
+    const string label = "Lockstep " + to_string(VM_lockstep::lanes(isa)) + " Lanes Random";
+
+    mt19937 rng(7);
+    for (int i = 0; i < 100; ++i)
+    {
+        VM vm;
+        random_program(vm, rng, 8 + i % 24);
+        const unsigned int max_ticks = 50 + i * 5;
+
+        vector<vector<int>> heaps(37, vector<int>(16));
+        for (vector<int> &heap : heaps)
+        {
+            for (int &cell : heap)
+            {
+                cell = (int)(rng() % 7) - 3;
+            }
+        }
+        vector<vector<int>> starts = heaps;
+
+        vector<VM_exec_status> statuses = vm.exec_lockstep(heaps, 2, max_ticks, isa);
+        for (size_t run = 0; run < heaps.size(); ++run)
+        {
+            for (unsigned int addr = 0; addr < 16; ++addr)
+            {
+                vm.set_heap(addr, starts[run][addr]);
+            }
+            VM_exec_status exp = vm.exec(false, max_ticks);
+
+            bool ok = exp.get_error() == statuses[run].get_error() &&
+                      exp.get_program_value() == statuses[run].get_program_value() &&
+                      exp.get_ticks() == statuses[run].get_ticks();
+            for (unsigned int addr = 0; ok && addr < 16; ++addr)
+            {
+                ok = vm.get_heap(addr) == heaps[run][addr];
+            }
+            if (!ok)
+            {
+                cerr << "[FAIL] " << label << ", program " << i << " run " << run << " differs\n";
+                return false;
+            }
+        }
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+// Every lane runs out of budget on the same step.
+bool lockstep_budget(VM_lockstep_isa isa)
+{
+    const string label = "Lockstep " + to_string(VM_lockstep::lanes(isa)) + " Lanes Budget";
+
+    VM vm;
+    vm.load(0, 0);
+    vm.add(0, 0, 1);
+    vm.jmp(1);
+
+    vector<vector<int>> heaps(VM_lockstep::lanes(isa) + 1, vector<int>{1});
+    vector<VM_exec_status> statuses = vm.exec_lockstep(heaps, 1, 100, isa);
+    bool ok = true;
+    for (VM_exec_status const &status : statuses)
+    {
+        ok = ok && status.get_error() == VM_error::MAX_RUNTIME && status.get_ticks() == 101;
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    return ok;
+}
+
+void lockstep_suite(Runner &runner)
+{
+    for (VM_lockstep_isa isa : {VM_lockstep_isa::NONE, VM_lockstep_isa::SSE2,
+                                VM_lockstep_isa::AVX2, VM_lockstep_isa::AVX512})
+    {
+        if (isa > VM_lockstep::best())
+        {
+            continue;
+        }
+
+        const string lanes = to_string(VM_lockstep::lanes(isa));
+        runner([isa, lanes]() -> bool {
+            return batch_test("Lockstep " + lanes + " Lanes", [isa](VM &vm, vector<vector<int>> &heaps) {
+                return vm.exec_lockstep(heaps, 0, MAX_TICKS, isa);
+            });
+        });
+        runner([isa]() -> bool { return lockstep_random_programs(isa); });
+        runner([isa]() -> bool { return lockstep_budget(isa); });
+    }
+}
+
+const char *const IMAGE_PATH = "greendog_image.k9i";
+
+bool image_random_programs()
+{
+    mt19937 rng(2025);
+    for (int i = 0; i < 50; ++i)
+    {
+        VM saved;
+        random_program(saved, rng, 8 + i % 24);
+        VM loaded;
+        bool ok = saved.save(IMAGE_PATH) && loaded.load(IMAGE_PATH);
+        remove(IMAGE_PATH);
+
+        const unsigned int max_ticks = 50 + i * 5;
+        VM_exec_status exp = saved.exec(false, max_ticks);
+        VM_exec_status act = loaded.exec_jit(false, max_ticks);
+        ok = ok && loaded.verify() && exp.get_error() == act.get_error() &&
+             exp.get_program_value() == act.get_program_value() && exp.get_ticks() == act.get_ticks();
+        for (unsigned int addr = 0; ok && addr < 16; ++addr)
+        {
+            ok = saved.get_heap(addr) == loaded.get_heap(addr);
+        }
+        if (!ok)
+        {
+            cerr << "[FAIL] Image Random " << i << "\n";
+            return false;
+        }
+    }
+
+    cerr << "[PASS] Image Random Programs\n";
+    return true;
+}
+
+bool image_extended()
+{
+    VM saved;
+    factorial_program(saved, 5);
+    VM loaded;
+    bool ok = saved.save(IMAGE_PATH) && loaded.load(IMAGE_PATH);
+    remove(IMAGE_PATH);
+
+    // double the result after the loaded program is done
+    loaded.add(2, 2, 2);
+    loaded.store(2, 4);
+    ok = ok && loaded.exec().is_status_ok() && 120 == loaded.get_heap(3) && 240 == loaded.get_heap(4);
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Image Extended\n";
+    return ok;
+}
+
+// Change one byte of a saved image and expect the load to fail.
+bool image_damaged(string const &label, long offset)
+{
+    VM saved;
+    factorial_program(saved, 3);
+    saved.save(IMAGE_PATH);
+
+    vector<char> bytes;
+    {
+        ifstream in(IMAGE_PATH, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    bytes[offset < 0 ? bytes.size() + offset : offset] ^= 1;
+    {
+        ofstream out(IMAGE_PATH, ios::binary | ios::trunc);
+        out.write(bytes.data(), bytes.size());
+    }
+
+    VM vm;
+    vm.set_heap(0, 7);
+    bool ok = !vm.load(IMAGE_PATH) && 7 == vm.get_heap(0);
+    remove(IMAGE_PATH);
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    return ok;
+}
+
+// An intact image whose one record the builder could never have made.
+bool image_bad_record()
+{
+    VM_instruction instr(((unsigned int)ADD << 24) | (1 << 16) | (2 << 8) | 3);
+    instr.r1 = MAX_REGISTERS;
+
+    VM_image_writer writer(VM_image_machine::GREENDOG);
+    writer.add(VM_image_section::CODE, &instr, sizeof(instr));
+    writer.write(IMAGE_PATH);
+
+    VM vm;
+    bool ok = !vm.load(IMAGE_PATH);
+    remove(IMAGE_PATH);
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Image Bad Record\n";
+    return ok;
+}
+
+void image_suite(Runner &runner)
+{
+    runner(image_random_programs);
+    runner(image_extended);
+    runner([]() -> bool { return image_damaged("Image Checksum", -1); });
+    runner([]() -> bool { return image_damaged("Image Version", 4); });
+    runner([]() -> bool { return image_damaged("Image Machine", 12); });
+    runner(image_bad_record);
+}
+
+const char *const FACTORIAL_SOURCE = R"(
+; factorial of heap 0 into heap 3, which is left alone for negative numbers
+    LOAD r1 0
+    JLT r1 10       # negative
+    load r2, 1
+    LOAD R03 1
+    JMP 7
+    MUL r2 r1 r2    ; top of the loop
+    SUB r1 r3 r1
+    JLE r1 9
+    JMP 0x5
+    STORE r2 3
+    CMP r1 r1 r1
+)";
+
+string disassembly(VM const &vm)
+{
+    ostringstream out;
+    vm.disassemble(out);
+    return out.str();
+}
+
+bool assemble_factorial(bool stream)
+{
+    const string label = stream ? "Assemble Stream" : "Assemble Factorial";
+
+    VM vm;
+    VM_assembler assembler;
+    istringstream in(FACTORIAL_SOURCE);
+    if (!(stream ? assembler.assemble(in, vm) : assembler.assemble(FACTORIAL_SOURCE, vm)))
+    {
+        cerr << "[FAIL] " << label << ", " << assembler.error() << "\n";
+        return false;
+    }
+
+    VM built;
+    factorial_program(built, 5);
+    vm.set_heap(0, 5);
+    vm.set_heap(1, 1);
+    vm.set_heap(3, -1);
+    bool ok = disassembly(vm) == disassembly(built) && vm.exec().is_status_ok() && 120 == vm.get_heap(3);
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    return ok;
+}
+
+bool disassemble_random_programs()
+{
+    mt19937 rng(2026);
+    for (int i = 0; i < 50; ++i)
+    {
+        VM vm;
+        random_program(vm, rng, 8 + i % 24);
+
+        VM again;
+        VM_assembler assembler;
+        const string source = disassembly(vm);
+        if (!assembler.assemble(source, again) || disassembly(again) != source)
+        {
+            cerr << "[FAIL] Disassemble Random " << i << "\n" << source << assembler.error() << "\n";
+            return false;
+        }
+    }
+
+    cerr << "[PASS] Disassemble Random Programs\n";
+    return true;
+}
+
+bool assembler_error(string const &label, string const &source, string const &expected)
+{
+    VM vm;
+    VM_assembler assembler;
+    bool ok = !assembler.assemble(source, vm) && assembler.error() == expected;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    if (!ok)
+    {
+        cerr << "\texpected \"" << expected << "\", got \"" << assembler.error() << "\"\n";
+    }
+    return ok;
+}
+
+void assembler_suite(Runner &runner)
+{
+    runner([]() -> bool { return assemble_factorial(false); });
+    runner([]() -> bool { return assemble_factorial(true); });
+    runner(disassemble_random_programs);
+
+    runner([]() -> bool {
+        return assembler_error("Assembler Unknown", "JMP 0\nPUSH r1\n", "line 2: unknown instruction at 'PUSH'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Register", "ADD r1 r2 3", "line 1: expected a register at '3'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler No Register", "ADD r1 r2 r32", "line 1: no such register at 'r32'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Address", "LOAD r1 8192", "line 1: number out of range at '8192'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Location", "JEQ r0 -1", "line 1: number out of range at '-1'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Missing", "JGT r0", "line 1: expected a number at the end of the line");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Trailing", "JMP 1 2", "line 1: expected the end of the line at '2'");
+    });
+}
+
+bool profile_factorial()
+{
+    VM vm;
+    factorial_program(vm, 5);
+
+    VM_profile profile;
+    VM_exec_status exp = vm.exec_trusted();
+    vm.set_heap(3, -1);
+    VM_exec_status act = vm.exec_profiled(profile);
+
+    uint64_t hits = 0;
+    uint64_t time = 0;
+    for (unsigned int pc = 0; pc < profile.hits.size(); ++pc)
+    {
+        hits += profile.hits[pc];
+        time += profile.time[pc];
+    }
+
+    // 7 is the loop test, 5 the multiplication
+    ostringstream report, folded;
+    profile.report(report);
+    profile.folded(folded);
+    bool ok = act.get_ticks() == exp.get_ticks() && 120 == vm.get_heap(3) && 1 == profile.executions &&
+              hits == exp.get_ticks() && 5 == profile.ops[MUL] && 5 == profile.hits[5] &&
+              6 == profile.hits[7] && 1 == profile.taken[7] && profile.listing[7].conditional &&
+              "JLE r1 9" == profile.listing[7].text && !profile.listing[8].conditional && profile.listing[8].jump &&
+              time > 0 && string::npos != report.str().find("JLE r1 9") && string::npos != folded.str().find("vm;");
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Profile Factorial\n";
+    return ok;
+}
+
+bool profile_unverified()
+{
+    // checked interpreter: the jump is out of range
+    VM vm;
+    vm.load(1, 0);
+    vm.jmp(5);
+
+    VM_profile profile;
+    VM_exec_status status = vm.exec_profiled(profile);
+    bool ok = VM_error::BRANCH_OUT_OF_RANGE == status.get_error() && 1 == profile.hits[0] &&
+              1 == profile.hits[1] && 0 == profile.taken[1];
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Profile Unverified\n";
+    return ok;
+}
+
+// what a verbose run writes to cerr
+string verbose_output(VM &vm)
+{
+    ostringstream out;
+    streambuf *saved = cerr.rdbuf(out.rdbuf());
+    vm.exec(true);
+    cerr.rdbuf(saved);
+    return out.str();
+}
+
+string decoded(vector<VM_trace_record> const &records)
+{
+    ostringstream out;
+    for (VM_trace_record const &record : records)
+    {
+        VM_write_trace(out, record);
+    }
+    return out.str();
+}
+
+bool trace_matches_verbose()
+{
+    VM vm;
+    factorial_program(vm, 5);
+
+    VM_trace trace;
+    VM_exec_status status = vm.exec_traced(trace);
+    vector<VM_trace_record> records = trace.last(trace.capacity());
+    const int result = vm.get_heap(3);
+    vm.set_heap(3, -1);
+
+    bool ok = 120 == result && status.get_ticks() == trace.recorded() &&
+              status.get_ticks() == records.size() && 1 == records.front().tick &&
+              string::npos != verbose_output(vm).find(decoded(records));
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Trace Matches Verbose\n";
+    return ok;
+}
+
+bool trace_error()
+{
+    // checked interpreter: the last record is the jump out of range
+    VM vm;
+    vm.load(1, 0);
+    vm.jmp(5);
+
+    VM_trace trace(2);
+    VM_exec_status status = vm.exec_traced(trace);
+    vector<VM_trace_record> records = trace.last(2);
+    ostringstream text;
+    VM_write_trace(text, records.back());
+
+    bool ok = VM_error::BRANCH_OUT_OF_RANGE == status.get_error() && 2 == records.size() &&
+              LOAD == records.front().op && JMP == records.back().op && 5 == records.back().operand &&
+              "---------------------\nPC: 1\nop: " + to_string(JMP) + "\nJMP 5\n" == text.str();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Trace Error\n";
+    return ok;
+}
+
+bool executor_reuse()
+{
+    VM vm;
+    factorial_program(vm, 5);
+    VM_exec_status exp = vm.exec_trusted();
+
+    VM_executor executor;
+    VM_exec_status unbound = executor.exec(false);
+    bool ok = unbound.is_status_ok() && 0 == unbound.get_ticks() && vm.bind(executor);
+    for (int run = 0; run < 3; ++run)
+    {
+        vm.set_heap(3, -1);
+        VM_exec_status act = executor.exec(false);
+        ok = ok && act.is_status_ok() && exp.get_ticks() == act.get_ticks() && 120 == vm.get_heap(3);
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Executor Reuse\n";
+    return ok;
+}
+
+bool executor_reset()
+{
+    // r0 accumulates unless each run starts it at zero again
+    VM vm;
+    vm.set_heap(0, 5);
+    vm.load(1, 0);
+    vm.add(0, 1, 0);
+
+    VM_executor executor;
+    bool ok = vm.bind(executor) && 5 == executor.exec(false).get_program_value() &&
+              5 == executor.exec(false).get_program_value();
+
+    // nor is anything left for the next program, which never writes r0
+    VM other;
+    other.load(2, 0);
+    ok = ok && other.bind(executor) && 0 == executor.exec(false).get_program_value();
+
+    // nor by an unverified program, which may write anything
+    VM unverified;
+    unverified.set_heap(0, 5);
+    unverified.load(0, 0);
+    unverified.jmp(9);
+    ok = ok && unverified.bind(executor) && VM_error::BRANCH_OUT_OF_RANGE == executor.exec(false).get_error() &&
+         other.bind(executor) && 0 == executor.exec(false).get_program_value();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Executor Reset\n";
+    return ok;
+}
+
+// heap 600 = heap 5 + heap 0, over a base with heap 5 = 100
+void overlay_program(VM &vm)
+{
+    vm.set_heap(5, 100);
+    vm.set_heap(7000, 9);
+    vm.load(0, 5);
+    vm.load(1, 0);
+    vm.add(0, 1, 0);
+    vm.store(0, 600);
+}
+
+bool heap_overlay()
+{
+    VM vm;
+    overlay_program(vm);
+    shared_ptr<VM_snapshot const> base = vm.snapshot();
+    shared_ptr<VM_snapshot const> other = make_shared<VM_snapshot const>(vector<int>{0, 0, 0, 0, 0, 50});
+
+    bool ok = true;
+    for (int i = 0; i < 4; ++i)
+    {
+        // alternate snapshots, so the frame has to change over
+        VM_heap heap(i % 2 ? other : base);
+        heap.set_heap(0, i);
+        VM_exec_status status = vm.exec(heap);
+        const int expected = (i % 2 ? 50 : 100) + i;
+        ok = ok && status.is_status_ok() && status.get_program_value() == expected &&
+             heap.get_heap(600) == expected && heap.get_heap(5) == (i % 2 ? 50 : 100) &&
+             heap.get_heap(7000) == (i % 2 ? 0 : 9) && heap.private_pages() == vector<unsigned int>{0, 2};
+    }
+
+    // nothing shared was written, and a cleared overlay reads the base again
+    VM_heap heap(base);
+    ok = ok && base->get_heap(600) == 0 && vm.get_heap(600) == 0 && heap.get_heap(0) == 0 &&
+         vm.exec(heap).get_program_value() == 100 && heap.private_pages() == vector<unsigned int>{2};
+    heap.clear();
+    ok = ok && heap.get_heap(600) == 0 && heap.private_pages().empty() && heap.get_heap(MAX_HEAP_SIZE) == (int)0xdeadbeef;
+
+    // storing what a cell already holds leaves its page shared
+    VM same;
+    same.set_heap(5, 100);
+    same.load(0, 5);
+    same.store(0, 5);
+    VM_heap unchanged(same.snapshot());
+    ok = ok && same.exec(unchanged).get_program_value() == 100 && unchanged.private_pages().empty();
+
+    // a page only the larger snapshot holds reads zero on the smaller one
+    VM far;
+    far.set_heap(7000, 9);
+    far.load(0, 7000);
+    VM_heap wide(far.snapshot()), narrow(make_shared<VM_snapshot const>(vector<int>{}, HEAP_PAGE_SIZE));
+    ok = ok && far.exec(wide).get_program_value() == 9 && far.exec(narrow).get_program_value() == 0 &&
+         far.exec(wide).get_program_value() == 9;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Heap Overlay\n";
+    return ok;
+}
+
+// overlays in a batch against the same runs on whole heaps
+bool heap_overlay_batch()
+{
+    VM vm;
+    overlay_program(vm);
+    shared_ptr<VM_snapshot const> base = vm.snapshot();
+
+    vector<VM_heap> overlays;
+    vector<vector<int>> heaps;
+    for (int i = 0; i < 1000; ++i)
+    {
+        overlays.emplace_back(base);
+        overlays.back().set_heap(0, i);
+        heaps.push_back(vector<int>{i, 0, 0, 0, 0, 100});
+    }
+
+    vector<VM_exec_status> statuses = vm.exec_batch(overlays, 4);
+    vector<VM_exec_status> expected = vm.exec_batch(heaps, 4);
+    bool ok = statuses.size() == expected.size();
+    for (size_t i = 0; ok && i < statuses.size(); ++i)
+    {
+        ok = statuses[i].get_program_value() == expected[i].get_program_value() &&
+             overlays[i].get_heap(600) == 100 + (int)i && overlays[i].private_pages().size() == 2;
+    }
+
+    // the workers' frames are kept from the last call, on the old snapshot
+    shared_ptr<VM_snapshot const> other = make_shared<VM_snapshot const>(vector<int>{0, 0, 0, 0, 0, 50});
+    vector<VM_heap> others(100, VM_heap(other));
+    statuses = vm.exec_batch(others, 4);
+    for (size_t i = 0; ok && i < others.size(); ++i)
+    {
+        ok = statuses[i].get_program_value() == 50 && others[i].get_heap(600) == 50 &&
+             others[i].get_heap(7000) == 0 && others[i].private_pages() == vector<unsigned int>{2};
+    }
+
+    VM invalid;
+    invalid.load(32, 0);
+    ok = ok && VM_error::INVALID_PROGRAM == invalid.exec_batch(overlays)[0].get_error() &&
+         VM_error::INVALID_PROGRAM == invalid.exec(overlays[0]).get_error();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Heap Overlay Batch\n";
+    return ok;
+}
+
+// A million cell heap: addresses past 16 bits run on every engine and in
+// overlays, and are refused by a default sized machine.
+bool wide_heap()
+{
+    const unsigned int size = 1u << 20;
+    VM vm(size);
+    vm.set_heap(1000000, 7);
+    vm.load(0, 1000000);
+    vm.store(0, 70000);
+    vm.store(0, size - 1);
+
+    bool ok = vm.heap_size() == size && vm.verify();
+    for (auto exec : {&VM::exec, &VM::exec_trusted, &VM::exec_jit})
+    {
+        vm.set_heap(70000, 0);
+        ok = ok && 7 == (vm.*exec)(false, MAX_TICKS).get_program_value() && 7 == vm.get_heap(70000);
+    }
+
+    vector<VM_heap> overlays(3, VM_heap(vm.snapshot()));
+    overlays[1].set_heap(1000000, 8);
+    vm.exec_batch(overlays, 2);
+    ok = ok && 7 == overlays[0].get_heap(size - 1) && 8 == overlays[1].get_heap(70000) &&
+         overlays[1].private_pages().size() == 3;
+
+    VM too_far(size);
+    too_far.load(0, size);
+    VM narrow;
+    narrow.load(0, 70000);
+    ok = ok && VM_error::INVALID_PROGRAM == too_far.exec().get_error() &&
+         VM_error::INVALID_PROGRAM == narrow.exec().get_error();
+
+    VM_arena arena(size);
+    ok = ok && arena.size() == size && arena.is_mapped() && 0 == arena.data()[size - 1] &&
+         !VM_arena(MAX_HEAP_SIZE).is_mapped();
+
+    bool refused = false;
+    try
+    {
+        VM_arena unreachable(SIZE_MAX / 2);
+    }
+    catch (bad_alloc const &)
+    {
+        refused = true;
+    }
+    ok = ok && refused;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Wide Heap\n";
+    return ok;
+}
+
+// Small images in a batch on a 16M cell heap: the runs only need the
+// cells the program and the images reach, not a heap each.
+bool wide_heap_batch()
+{
+    VM vm(1u << 24);
+    vm.load(0, 0);
+    vm.load(1, 1);
+    vm.add(0, 1, 0);
+    vm.store(0, 2);
+
+    bool ok = true;
+    for (bool lockstep : {false, true})
+    {
+        vector<vector<int>> heaps;
+        for (int i = 0; i < 100; ++i)
+        {
+            heaps.push_back(i % 2 ? vector<int>{i, 1} : vector<int>{i, 2, 0, 9});
+        }
+        vector<VM_exec_status> statuses = lockstep ? vm.exec_lockstep(heaps, 4) : vm.exec_batch(heaps, 4);
+        for (int i = 0; ok && i < 100; ++i)
+        {
+            const int sum = i + (i % 2 ? 1 : 2);
+            ok = statuses[i].get_program_value() == sum &&
+                 heaps[i] == (i % 2 ? vector<int>{i, 1} : vector<int>{i, 2, sum, 9});
+        }
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Wide Heap Batch\n";
+    return ok;
+}
+
+// A program past 16 bits of locations, jumping over most of itself, built
+// directly, through the assembler and from an image.
+bool wide_program()
+{
+    const unsigned int length = 70002;
+    VM vm(MAX_HEAP_SIZE, 100000);
+    vm.set_heap(1, 9);
+    vm.jmp(length - 1);
+    for (unsigned int pc = 1; pc < length - 1; ++pc)
+    {
+        vm.load(0, 0);
+    }
+    vm.load(0, 1);
+
+    bool ok = vm.program_limit() == 100000 && vm.verify();
+    for (auto exec : {&VM::exec, &VM::exec_trusted, &VM::exec_jit})
+    {
+        VM_exec_status status = (vm.*exec)(false, MAX_TICKS);
+        ok = ok && 9 == status.get_program_value() && 2 == status.get_ticks();
+    }
+
+    ostringstream source;
+    vm.disassemble(source);
+    VM assembled(MAX_HEAP_SIZE, 100000);
+    VM_assembler assembler;
+    assembled.set_heap(1, 9);
+    ok = ok && assembler.assemble(source.str(), assembled) && 9 == assembled.exec().get_program_value();
+
+    VM loaded(MAX_HEAP_SIZE, 100000);
+    VM narrow;
+    ok = ok && vm.save(IMAGE_PATH) && loaded.load(IMAGE_PATH) && !narrow.load(IMAGE_PATH) &&
+         9 == loaded.exec_jit().get_program_value();
+    loaded.load(0, 1);
+    ok = ok && 9 == loaded.exec().get_program_value();
+    remove(IMAGE_PATH);
+
+    // the default limit still holds
+    VM too_long;
+    too_long.jmp(MAX_PROGRAM_SIZE);
+    ok = ok && VM_error::INVALID_PROGRAM == too_long.exec().get_error();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Wide Program\n";
+    return ok;
+}
+
+// Wide operands split into an EXT word and the instruction word and come
+// back whole; EXT on its own is not an instruction.
+bool wide_encoding()
+{
+    VM_instruction load(((unsigned int)LOAD << 24) | (3 << 16) | 0x2345, ((unsigned int)EXT << 24) | 0x1);
+    VM_instruction jump(((unsigned int)JGE << 24) | (4 << 16) | 0x0001, ((unsigned int)EXT << 24) | 0xFF);
+    VM_instruction narrow(((unsigned int)STORE << 24) | (3 << 16) | 0x2345);
+
+    bool ok = load.addr == 0x12345 && load.r1 == 3 && jump.loc == 0xFF0001 && jump.r1 == 4 &&
+              VM_instruction(load.encode(), load.prefix()) == load &&
+              VM_instruction(jump.encode(), jump.prefix()) == jump &&
+              0 == narrow.prefix() && narrow.addr == 0x2345 &&
+              0 == VM_instruction((unsigned int)EXT << 24).op;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Wide Encoding\n";
+    return ok;
+}
+
+// What yellowdog makes of a program that verifies, as plainly as
+// possible: the value on top at the end, or a division by zero, or the
+// run going on too long.
+VM_exec_status stack_run(vector<unsigned char> const &code)
+{
+    vector<int> stack;
+    unsigned int ticks = 0;
+    size_t pc = 0;
+    while (pc < code.size())
+    {
+        if (MAX_TICKS == ticks++)
+        {
+            return VM_exec_status(VM_error::MAX_RUNTIME);
+        }
+
+        const unsigned char op = code[pc];
+        int operand = 0;
+        size_t next = pc + 1;
+        if (1 == op || 4 == op || 18 == op || (op >= JMP && op <= JGE))
+        {
+            memcpy(&operand, &code[pc + 1], sizeof(int));
+            next += sizeof(int);
+        }
+
+        int x = 0;
+        int *y = nullptr;
+        if (op >= ADD && op <= CMP)
+        {
+            x = stack.back();
+            stack.pop_back();
+            y = &stack.back();
+        }
+        switch (op)
+        {
+        case 1:
+            stack.push_back(operand);
+            break;
+        case 2:
+            stack.pop_back();
+            break;
+        case 3:
+            stack.push_back(stack.back());
+            break;
+        case 4:
+            stack.push_back(stack[stack.size() - operand]);
+            break;
+        case 5:
+            swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+            break;
+        case 18:
+            stack.erase(stack.end() - operand);
+            break;
+        case ADD:
+            *y = (int)((unsigned int)*y + (unsigned int)x);
+            break;
+        case SUB:
+            *y = (int)((unsigned int)*y - (unsigned int)x);
+            break;
+        case MUL:
+            *y = (int)((unsigned int)*y * (unsigned int)x);
+            break;
+        case DIV:
+            if (0 == x)
+            {
+                return VM_exec_status(VM_error::DIVISION_BY_ZERO);
+            }
+            *y = *y / x;
+            break;
+        case CMP:
+            *y = *y < x ? -1 : (*y > x ? 1 : 0);
+            break;
+        case JMP:
+            next = (size_t)operand;
+            break;
+        default:
+        {
+            const int test = stack.back();
+            stack.pop_back();
+            const bool taken = (JEQ == op && 0 == test) || (JNE == op && 0 != test) || (JLT == op && test < 0) ||
+                               (JLE == op && test <= 0) || (JGT == op && test > 0) || (JGE == op && test >= 0);
+            next = taken ? (size_t)operand : next;
+        }
+        break;
+        }
+        pc = next;
+    }
+
+    return VM_exec_status(stack.back());
+}
+
+bool same_status(VM_exec_status const &exp, VM_exec_status const &act)
+{
+    return exp.get_error() == act.get_error() && (!exp.is_status_ok() || exp.get_program_value() == act.get_program_value());
+}
+
+// Translate code and run it on every engine, expecting what yellowdog
+// gives, and the result stored where the translator says.
+bool expect_translated(vector<unsigned char> const &code, VM_exec_status const &exp, string const &label,
+                       VM_stack_translator *used = nullptr)
+{
+    VM vm;
+    VM_stack_translator translator;
+    bool ok = translator.translate(code.data(), (unsigned int)code.size(), vm) && vm.verify() &&
+              same_status(exp, stack_run(code));
+    for (auto exec : {&VM::exec, &VM::exec_trusted, &VM::exec_jit})
+    {
+        VM_exec_status act = (vm.*exec)(false, MAX_TICKS);
+        ok = ok && same_status(exp, act) &&
+             (!act.is_status_ok() || act.get_program_value() == vm.get_heap(translator.result_address()));
+    }
+
+    if (nullptr != used)
+    {
+        *used = translator;
+    }
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << " " << translator.error() << "\n";
+    }
+    return ok;
+}
+
+// The yellowdog test programs that verify, with the results its tests
+// expect of them.
+bool translate_stack_tests()
+{
+    struct stack_test
+    {
+        string name;
+        function<void(VM_stack_program &)> build;
+        VM_exec_status expected;
+    };
+
+    auto three = [](VM_stack_program &vm) {
+        vm.push(10);
+        vm.push(20);
+        vm.push(30);
+    };
+    vector<stack_test> tests = {
+        {"Just Push", [](VM_stack_program &vm) { vm.push(1); }, VM_exec_status(1)},
+        {"Pop", [](VM_stack_program &vm) { vm.push(1); vm.push(2); vm.pop(); }, VM_exec_status(1)},
+        {"Dup", [](VM_stack_program &vm) { vm.push(1); vm.dup(); vm.add(); }, VM_exec_status(2)},
+        {"DupN First", [&](VM_stack_program &vm) { three(vm); vm.dupn(1); }, VM_exec_status(30)},
+        {"DupN Middle", [&](VM_stack_program &vm) { three(vm); vm.dupn(2); }, VM_exec_status(20)},
+        {"DupN Last", [&](VM_stack_program &vm) { three(vm); vm.dupn(3); }, VM_exec_status(10)},
+        {"DropN First", [&](VM_stack_program &vm) { three(vm); vm.dropn(1); vm.add(); }, VM_exec_status(30)},
+        {"DropN Middle", [&](VM_stack_program &vm) { three(vm); vm.dropn(2); vm.add(); }, VM_exec_status(40)},
+        {"DropN Last", [&](VM_stack_program &vm) { three(vm); vm.dropn(3); vm.add(); }, VM_exec_status(50)},
+        {"Add", [](VM_stack_program &vm) { vm.push(1); vm.push(33); vm.add(); }, VM_exec_status(34)},
+        {"Sub", [](VM_stack_program &vm) { vm.push(1); vm.push(33); vm.sub(); }, VM_exec_status(-32)},
+        {"Mul", [](VM_stack_program &vm) { vm.push(2); vm.push(3); vm.mul(); }, VM_exec_status(6)},
+        {"Div", [](VM_stack_program &vm) { vm.push(12); vm.push(3); vm.div(); }, VM_exec_status(4)},
+        {"Div by Zero", [](VM_stack_program &vm) { vm.push(1); vm.push(0); vm.div(); },
+         VM_exec_status(VM_error::DIVISION_BY_ZERO)},
+        {"Cmp LT", [](VM_stack_program &vm) { vm.push(1); vm.push(2); vm.cmp(); }, VM_exec_status(-1)},
+        {"Cmp EQ", [](VM_stack_program &vm) { vm.push(2); vm.push(2); vm.cmp(); }, VM_exec_status(0)},
+        {"Cmp GT", [](VM_stack_program &vm) { vm.push(2); vm.push(1); vm.cmp(); }, VM_exec_status(1)},
+        {"Swap", [](VM_stack_program &vm) { vm.push(1); vm.push(2); vm.swap(); }, VM_exec_status(1)},
+        {"Longer Prog",
+         [](VM_stack_program &vm) {
+             vm.push(2);
+             vm.dup();
+             vm.mul();
+             vm.push(5);
+             vm.push(2);
+             vm.add();
+             vm.sub();
+         },
+         VM_exec_status(-3)},
+        {"Forward And Backward Labels",
+         [](VM_stack_program &vm) {
+             vm.push(3);
+             vm.jmp("Test");
+             vm.label("Loop");
+             vm.push(1);
+             vm.sub();
+             vm.label("Test");
+             vm.dup();
+             vm.jgt("Loop");
+             vm.jmp("Done");
+             vm.push(99);
+             vm.label("Done");
+         },
+         VM_exec_status(0)},
+        {"Operand Kept Apart",
+         [](VM_stack_program &vm) {
+             // after the branch 1 is in a register, and -3 must not be
+             // loaded over it
+             vm.push(4);
+             vm.push(1);
+             vm.jne("L");
+             vm.label("L");
+             vm.push(-3);
+             vm.swap();
+             vm.sub();
+         },
+         VM_exec_status(-7)},
+        {"Run Too Long",
+         [](VM_stack_program &vm) {
+             vm.push(0);
+             vm.label("X");
+             vm.push(1);
+             vm.add();
+             vm.jmp("X");
+         },
+         VM_exec_status(VM_error::MAX_RUNTIME)},
+    };
+
+    // each jump on -1, 0 and 1, which the translation works out as it goes
+    const struct
+    {
+        const char *name;
+        void (VM_stack_program::*op)(string const &);
+        bool lt, eq, gt;
+    } jumps[] = {
+        {"JEQ", &VM_stack_program::jeq, false, true, false}, {"JNE", &VM_stack_program::jne, true, false, true},
+        {"JLT", &VM_stack_program::jlt, true, false, false}, {"JLE", &VM_stack_program::jle, true, true, false},
+        {"JGT", &VM_stack_program::jgt, false, false, true}, {"JGE", &VM_stack_program::jge, false, true, true},
+    };
+    for (auto const &jump : jumps)
+    {
+        for (int test : {-1, 0, 1})
+        {
+            const bool taken = test < 0 ? jump.lt : (0 == test ? jump.eq : jump.gt);
+            auto op = jump.op;
+            tests.push_back({string(jump.name) + " " + to_string(test),
+                             [op, test](VM_stack_program &vm) {
+                                 vm.push(test);
+                                 (vm.*op)("L00");
+                                 vm.push(0);
+                                 vm.jmp("L02");
+                                 vm.label("L00");
+                                 vm.push(1);
+                                 vm.label("L02");
+                             },
+                             VM_exec_status(taken ? 1 : 0)});
+        }
+    }
+
+    for (auto const &arg_result : vector<pair<int, int>>{{-1, -1}, {0, 1}, {1, 1}, {5, 120}})
+    {
+        const int arg = arg_result.first;
+        tests.push_back({"factorial " + to_string(arg),
+                         [arg](VM_stack_program &vm) { stack_factorial_program(vm, arg); },
+                         VM_exec_status(arg_result.second)});
+    }
+    for (auto const &arg_result : vector<pair<int, int>>{{0, -1}, {1, 1}, {8, 21}})
+    {
+        const int arg = arg_result.first;
+        tests.push_back({"fibonacci " + to_string(arg),
+                         [arg](VM_stack_program &vm) { stack_fibonacci_program(vm, arg); },
+                         VM_exec_status(arg_result.second)});
+    }
+
+    bool ok = true;
+    for (stack_test const &test : tests)
+    {
+        VM_stack_program program;
+        test.build(program);
+        ok = expect_translated(program.bytes(), test.expected, "Translate " + test.name) && ok;
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Stack Tests\n";
+    return ok;
+}
+
+// Once the translation reaches the loop its values are in registers, so
+// how often it goes round is up to the run.
+bool translate_loops()
+{
+    bool ok = true;
+    for (int arg = -2; arg <= 12; ++arg)
+    {
+        int factorial = arg < 0 ? -1 : 1;
+        for (int i = 2; i <= arg; ++i)
+        {
+            factorial *= i;
+        }
+
+        VM_stack_program program;
+        stack_factorial_program(program, arg);
+        VM_stack_translator translator;
+        ok = expect_translated(program.bytes(), VM_exec_status(factorial), "Translate factorial", &translator) &&
+             translator.max_depth() == 3 && 0 == translator.spilled() && ok;
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Loops\n";
+    return ok;
+}
+
+// 40 values on the stack: ten of them live in the heap, and every way of
+// moving a value between registers and cells is taken.
+bool translate_spills()
+{
+    VM_stack_program program;
+    for (int i = 1; i <= 40; ++i)
+    {
+        program.push(i);
+    }
+    // swap the two deepest in the heap and the two either side of the last register
+    program.swap();
+    program.dupn(10);
+    program.dupn(12);
+    program.swap();
+    program.dropn(3);
+    program.dropn(3);
+
+    // count down a loop with its counter in the heap, rotating a value
+    // up from a register each time round
+    program.push(3);
+    program.label("LOOP");
+    program.dupn(20);
+    program.dropn(21);
+    program.swap();
+    program.push(1);
+    program.sub();
+    program.dup();
+    program.jgt("LOOP");
+    program.pop();
+    for (int i = 1; i < 40; ++i)
+    {
+        program.add();
+    }
+
+    vector<unsigned char> code = program.bytes();
+    VM_stack_translator translator;
+    bool ok = expect_translated(code, stack_run(code), "Translate Spills", &translator) &&
+              translator.max_depth() == 42 && translator.spilled() == 13;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Spills\n";
+    return ok;
+}
+
+// Random straight line code, skips and counted loops over stacks of up to
+// 45 values, translated and run against stack_run.
+void random_stack_ops(VM_stack_program &program, mt19937 &rng, int &depth, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        const int choice = (int)(rng() % 9);
+        if (choice < 2 || depth < 2)
+        {
+            if (0 == choice)
+            {
+                program.dupn(1 + (int)(rng() % depth));
+            }
+            else
+            {
+                program.push((int)(rng() % 7) - 3);
+            }
+            ++depth;
+        }
+        else if (2 == choice)
+        {
+            program.pop();
+            --depth;
+        }
+        else if (3 == choice)
+        {
+            program.dropn(1 + (int)(rng() % depth));
+            --depth;
+        }
+        else if (4 == choice)
+        {
+            program.swap();
+        }
+        else if (5 == choice)
+        {
+            // divisors that can neither be 0 nor trap
+            program.push(2 + (int)(rng() % 5));
+            program.div();
+        }
+        else
+        {
+            void (VM_stack_program::*ops[])() = {&VM_stack_program::add, &VM_stack_program::sub,
+                                                 &VM_stack_program::mul, &VM_stack_program::cmp};
+            (program.*ops[rng() % 4])();
+            --depth;
+        }
+    }
+}
+
+bool translate_random()
+{
+    unsigned int spilling = 0;
+    for (unsigned int seed : {24u, 100024u, 200024u, 300024u})
+    {
+        mt19937 rng(seed);
+        for (int i = 0; i < 400; ++i)
+        {
+            VM_stack_program program;
+            int depth = 1 + (int)(rng() % 45);
+            for (int d = 0; d < depth; ++d)
+            {
+                program.push((int)(rng() % 21) - 10);
+            }
+
+            for (int part = 0; part < 6; ++part)
+            {
+                const string label = "L" + to_string(part);
+                switch (rng() % 3)
+                {
+                case 0:
+                    random_stack_ops(program, rng, depth, 1 + (int)(rng() % 8));
+                    break;
+
+                case 1:
+                {
+                    // a test on some value, then ops that leave the depth as
+                    // they found it, or are skipped
+                    void (VM_stack_program::*jumps[])(string const &) = {
+                        &VM_stack_program::jeq, &VM_stack_program::jne, &VM_stack_program::jlt,
+                        &VM_stack_program::jle, &VM_stack_program::jgt, &VM_stack_program::jge};
+                    program.dupn(1 + (int)(rng() % depth));
+                    (program.*jumps[rng() % 6])(label);
+                    program.dupn(1 + (int)(rng() % depth));
+                    program.dupn(1 + (int)(rng() % (depth + 1)));
+                    program.add();
+                    program.dropn(2 + (int)(rng() % depth));
+                    program.label(label);
+                }
+                break;
+
+                case 2:
+                {
+                    // a counter on top, and each time round a value worked
+                    // out of two others takes the place of a third
+                    program.push(1 + (int)(rng() % 4));
+                    ++depth;
+                    program.label(label);
+                    program.dupn(2 + (int)(rng() % (depth - 1)));
+                    program.dupn(1 + (int)(rng() % (depth + 1)));
+                    program.mul();
+                    program.dropn(3 + (int)(rng() % (depth - 1)));
+                    program.swap();
+                    program.push(1);
+                    program.sub();
+                    program.dup();
+                    program.jgt(label);
+                    program.pop();
+                    --depth;
+                }
+                break;
+                }
+            }
+
+            vector<unsigned char> code = program.bytes();
+            VM_stack_translator translator;
+            if (!expect_translated(code, stack_run(code), "Translate Random " + to_string(seed) + " " + to_string(i),
+                                   &translator))
+            {
+                return false;
+            }
+            spilling += translator.spilled() > 0;
+        }
+    }
+
+    const bool ok = spilling > 200;
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Random\n";
+    return ok;
+}
+
+// A yellowdog image, as VM::save writes one.
+bool translate_image()
+{
+    VM_stack_program program;
+    stack_factorial_program(program, 6);
+    vector<unsigned char> code = program.bytes();
+    VM_image_writer writer(VM_image_machine::YELLOWDOG);
+    writer.add(VM_image_section::CODE, code.data(), code.size());
+
+    VM vm;
+    VM ours;
+    VM_stack_translator translator;
+    bool ok = writer.write(IMAGE_PATH) && translator.translate(IMAGE_PATH, vm, 100) &&
+              720 == vm.exec_jit().get_program_value() && 720 == vm.get_heap(translator.result_address()) &&
+              100 == translator.result_address();
+
+    // nor can a greendog image be translated
+    ours.load(0, 0);
+    ok = ok && ours.save(IMAGE_PATH) && !translator.translate(IMAGE_PATH, vm) &&
+         translator.error() == string("Not a yellowdog image: ") + IMAGE_PATH;
+    remove(IMAGE_PATH);
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Image\n";
+    return ok;
+}
+
+bool translate_refused(string const &label, function<void(VM_stack_program &)> build, string const &expected,
+                       unsigned int heap_size = MAX_HEAP_SIZE, unsigned int program_limit = MAX_PROGRAM_SIZE)
+{
+    VM_stack_program program;
+    build(program);
+    vector<unsigned char> code = program.bytes();
+    VM vm(heap_size, program_limit);
+    VM_stack_translator translator;
+    const bool ok = !translator.translate(code.data(), (unsigned int)code.size(), vm) &&
+                    translator.error() == expected && VM_error::OK == vm.exec().get_error() &&
+                    0 == vm.get_heap(0);
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << ", got \"" << translator.error() << "\"\n";
+        return false;
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+void translate_suite(Runner &runner)
+{
+    runner(translate_stack_tests);
+    runner(translate_loops);
+    runner(translate_spills);
+    runner(translate_random);
+    runner(translate_image);
+
+    runner([]() -> bool {
+        return translate_refused("Translate Empty", [](VM_stack_program &) {},
+                                 "Program ends with an empty stack at 0");
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate Pop to Empty", [](VM_stack_program &vm) { vm.push(1); vm.pop(); },
+                                 "Program ends with an empty stack at 5");
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate Add Too Few", [](VM_stack_program &vm) { vm.push(1); vm.add(); },
+                                 "Stack underflow at 5");
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate DupN Too Few", [](VM_stack_program &vm) { vm.push(1); vm.dupn(2); },
+                                 "Stack index out of range at 5");
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate Missing Label", [](VM_stack_program &vm) { vm.push(1); vm.jmp("X"); },
+                                 "Undefined label at 5");
+    });
+    runner([]() -> bool {
+        // the depth grows each time round
+        return translate_refused("Translate Overflow Push",
+                                 [](VM_stack_program &vm) {
+                                     vm.label("Start");
+                                     vm.push(1);
+                                     vm.jmp("Start");
+                                 },
+                                 "Stack depth differs at 0");
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate Deep Stack",
+                                 [](VM_stack_program &vm) {
+                                     for (int i = 0; i <= 1024; ++i)
+                                     {
+                                         vm.push(i);
+                                     }
+                                 },
+                                 "Stack overflow at 5120");
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate Small Heap", [](VM_stack_program &vm) { vm.push(7); },
+                                 "Translation needs 4 heap cells from 0", 3);
+    });
+    runner([]() -> bool {
+        return translate_refused("Translate Long Program",
+                                 [](VM_stack_program &vm) {
+                                     vm.push(1);
+                                     vm.push(0);
+                                     vm.div();
+                                 },
+                                 "Translation of 5 instructions does not fit the program", MAX_HEAP_SIZE, 3);
+    });
+    runner([]() -> bool {
+        VM_stack_program program;
+        program.push(1);
+        vector<unsigned char> code = program.bytes();
+        code.push_back(19);
+        VM vm;
+        VM_stack_translator translator;
+        const bool ok = !translator.translate(code.data(), (unsigned int)code.size(), vm) &&
+                        translator.error() == "Invalid opcode at 5";
+        cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Invalid Opcode\n";
+        return ok;
+    });
+    runner([]() -> bool {
+        VM_stack_program program;
+        program.push(7);
+        vector<unsigned char> code = program.bytes();
+        VM vm;
+        vm.load(0, 1);
+        vm.set_heap(1, 3);
+        VM_stack_translator translator;
+        const bool ok = !translator.translate(code.data(), (unsigned int)code.size(), vm) &&
+                        translator.error() == "Machine already has a program" &&
+                        1 == vm.program_length() && 3 == vm.exec().get_program_value();
+        cerr << (ok ? "[PASS] " : "[FAIL] ") << "Translate Into Program\n";
+        return ok;
+    });
+}
+
+// Greendog instructions as VM_ir_lowering gives them, added to vm, with
+// the cells it keeps constants in.
+void build_lowered(VM &vm, vector<VM_ir_register_instruction> const &code, VM_ir_lowering const &lowering)
+{
+    for (VM_ir_register_instruction const &instr : code)
+    {
+        switch (instr.op)
+        {
+        case LOAD: vm.load(instr.r1, instr.addr); break;
+        case STORE: vm.store(instr.r1, instr.addr); break;
+        case ADD: vm.add(instr.r1, instr.r2, instr.r3); break;
+        case SUB: vm.sub(instr.r1, instr.r2, instr.r3); break;
+        case MUL: vm.mul(instr.r1, instr.r2, instr.r3); break;
+        case DIV: vm.div(instr.r1, instr.r2, instr.r3); break;
+        case CMP: vm.cmp(instr.r1, instr.r2, instr.r3); break;
+        case JMP: vm.jmp(instr.loc); break;
+        case JEQ: vm.jeq(instr.r1, instr.loc); break;
+        case JNE: vm.jne(instr.r1, instr.loc); break;
+        case JLT: vm.jlt(instr.r1, instr.loc); break;
+        case JLE: vm.jle(instr.r1, instr.loc); break;
+        case JGT: vm.jgt(instr.r1, instr.loc); break;
+        default: vm.jge(instr.r1, instr.loc); break;
+        }
+    }
+    for (auto const &cell : lowering.constants())
+    {
+        vm.set_heap(cell.first, cell.second);
+    }
+}
+
+// A stack program read into the IR, as it is and optimized, and lowered
+// to both machines: each must give what yellowdog does.  The optimizer's
+// work is added to stats.
+bool expect_ir_stack(vector<unsigned char> const &code, string const &label, VM_ir_stats *stats = nullptr)
+{
+    const VM_exec_status exp = stack_run(code);
+    VM_ir ir;
+    VM_ir_builder builder;
+    string why;
+    bool ok = builder.build_stack(code.data(), (unsigned int)code.size(), ir) && ir.check(why);
+
+    for (bool optimize : {false, true})
+    {
+        VM_ir program = ir;
+        if (optimize)
+        {
+            VM_ir_stats done;
+            VM_ir_optimizer().optimize(program, &done);
+            ok = ok && program.check(why) && done.instructions_after <= done.instructions_before;
+            if (nullptr != stats)
+            {
+                stats->instructions_before += done.instructions_before;
+                stats->instructions_after += done.instructions_after;
+                stats->dead_values += done.dead_values;
+                stats->dead_blocks += done.dead_blocks;
+                stats->copies += done.copies;
+                stats->common += done.common;
+                stats->hoisted += done.hoisted;
+                stats->reduced += done.reduced;
+            }
+        }
+
+        VM_ir_lowering lowering;
+        vector<unsigned char> stack_code;
+        ok = ok && lowering.lower_stack(program, stack_code) && same_status(exp, stack_run(stack_code));
+
+        vector<VM_ir_register_instruction> register_code;
+        VM vm;
+        ok = ok && lowering.lower_registers(program, register_code, 16);
+        build_lowered(vm, register_code, lowering);
+        ok = ok && vm.verify() && same_status(exp, vm.exec()) && same_status(exp, vm.exec_jit());
+
+        if (!ok)
+        {
+            cerr << "[FAIL] " << label << (optimize ? " optimized " : " ") << builder.error() << why
+                 << lowering.error() << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ir_stack_programs()
+{
+    bool ok = true;
+    VM_ir_stats stats;
+    for (int arg = -1; arg <= 7; ++arg)
+    {
+        VM_stack_program factorial;
+        stack_factorial_program(factorial, arg);
+        VM_stack_program fibonacci;
+        stack_fibonacci_program(fibonacci, arg);
+        ok = expect_ir_stack(factorial.bytes(), "IR factorial " + to_string(arg), &stats) &&
+             expect_ir_stack(fibonacci.bytes(), "IR fibonacci " + to_string(arg), &stats) && ok;
+    }
+
+    // the constant arguments fold away the tests on them, and the loops
+    // shed copies and phis
+    ok = ok && stats.instructions_after < stats.instructions_before && stats.copies > 0 && stats.dead_blocks > 0;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Stack Programs\n";
+    return ok;
+}
+
+bool ir_random_stack_programs()
+{
+    mt19937 rng(25);
+    VM_ir_stats stats;
+    for (int i = 0; i < 300; ++i)
+    {
+        VM_stack_program program;
+        int depth = 1 + (int)(rng() % 40);
+        for (int d = 0; d < depth; ++d)
+        {
+            program.push((int)(rng() % 21) - 10);
+        }
+
+        for (int part = 0; part < 5; ++part)
+        {
+            const string label = "L" + to_string(part);
+            if (0 == rng() % 2)
+            {
+                random_stack_ops(program, rng, depth, 1 + (int)(rng() % 10));
+                continue;
+            }
+            // a counted loop with a value worked out each time round
+            program.push(1 + (int)(rng() % 4));
+            ++depth;
+            program.label(label);
+            program.dupn(2 + (int)(rng() % (depth - 1)));
+            program.dupn(1 + (int)(rng() % (depth + 1)));
+            program.add();
+            program.dropn(3 + (int)(rng() % (depth - 1)));
+            program.swap();
+            program.push(1);
+            program.sub();
+            program.dup();
+            program.jgt(label);
+            program.pop();
+            --depth;
+        }
+
+        if (!expect_ir_stack(program.bytes(), "IR Random Stack " + to_string(i), &stats))
+        {
+            return false;
+        }
+    }
+
+    const bool ok = stats.instructions_after < stats.instructions_before && stats.common > 0 && stats.hoisted > 0 &&
+                    stats.reduced > 0 && stats.dead_values > 0;
+    if (!ok)
+    {
+        stats.report(cerr);
+    }
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Random Stack Programs\n";
+    return ok;
+}
+
+// Greendog programs through images: saved, read into the IR, optimized
+// and written back below the cells they use.  Those that finish in the
+// budget must finish the same way, heap and all.
+bool ir_register_programs()
+{
+    mt19937 rng(2026);
+    unsigned int finished = 0;
+    for (int i = 0; i < 200; ++i)
+    {
+        VM saved;
+        random_program(saved, rng, 8 + i % 24);
+        const unsigned int max_ticks = 50 + i * 5;
+
+        VM_ir ir;
+        VM_ir_builder builder;
+        VM_ir_lowering lowering;
+        bool ok = saved.save(IMAGE_PATH) && builder.build(IMAGE_PATH, ir);
+        if (i % 2)
+        {
+            VM_ir_optimizer().optimize(ir);
+        }
+        VM loaded;
+        ok = ok && lowering.write(ir, VM_image_machine::GREENDOG, IMAGE_PATH, 16) && loaded.load(IMAGE_PATH);
+        remove(IMAGE_PATH);
+
+        VM_exec_status exp = saved.exec(false, max_ticks);
+        if (ok && VM_error::MAX_RUNTIME != exp.get_error())
+        {
+            ++finished;
+            VM_exec_status act = loaded.exec_jit();
+            ok = loaded.verify() && same_status(exp, act);
+            for (unsigned int addr = 0; ok && addr < 16; ++addr)
+            {
+                ok = saved.get_heap(addr) == loaded.get_heap(addr);
+            }
+        }
+        if (!ok)
+        {
+            cerr << "[FAIL] IR Register Random " << i << " " << builder.error() << lowering.error() << "\n";
+            return false;
+        }
+    }
+
+    const bool ok = finished > 100;
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Register Programs\n";
+    return ok;
+}
+
+// factorial and fibonacci, optimized, keep all their values in registers
+// and their constants in cells from 4.
+bool ir_register_kernels()
+{
+    bool ok = true;
+    for (int arg : {-1, 0, 1, 5, 8})
+    {
+        for (auto build : {&factorial_program, &fibonacci_program})
+        {
+            VM saved;
+            build(saved, arg);
+            VM_ir ir;
+            VM_ir_builder builder;
+            VM_ir_lowering lowering;
+            VM_ir_stats stats;
+            VM loaded;
+            ok = ok && saved.save(IMAGE_PATH) && builder.build(IMAGE_PATH, ir);
+            VM_ir_optimizer().optimize(ir, &stats);
+            ok = ok && lowering.write(ir, VM_image_machine::GREENDOG, IMAGE_PATH, 4) && loaded.load(IMAGE_PATH) &&
+                 0 == lowering.spilled() && stats.instructions_after < stats.instructions_before;
+            remove(IMAGE_PATH);
+
+            VM_exec_status exp = saved.exec();
+            VM_exec_status act = loaded.exec();
+            ok = ok && same_status(exp, act) && saved.get_heap(3) == loaded.get_heap(3);
+        }
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Register Kernels\n";
+    return ok;
+}
+
+// A program built by hand for each pass to find its work in: a loop
+// adding x * 2 + heap[1] + x * 1 into heap[0] three times over.
+bool ir_passes()
+{
+    VM_ir ir;
+    const unsigned int entry = ir.add_block();
+    const unsigned int loop = ir.add_block();
+    const unsigned int done = ir.add_block();
+    auto value = [&ir](unsigned int block, VM_ir_op op, int operand, vector<unsigned int> const &args) {
+        const unsigned int v = ir.add_value(block, op, operand, args);
+        ir.blocks[block].code.push_back(v);
+        return v;
+    };
+
+    const unsigned int x = value(entry, VM_ir_op::LOAD, 2, {});
+    const unsigned int count = value(entry, VM_ir_op::CONST, 3, {});
+    ir.blocks[entry].exit = VM_ir_block::JUMP;
+    ir.blocks[entry].next[0] = loop;
+
+    const unsigned int i = value(loop, VM_ir_op::PHI, 0, {});
+    const unsigned int two = value(loop, VM_ir_op::CONST, 2, {});
+    const unsigned int one = value(loop, VM_ir_op::CONST, 1, {});
+    const unsigned int cell = value(loop, VM_ir_op::LOAD, 1, {});
+    const unsigned int twice = value(loop, VM_ir_op::MUL, 0, {x, two});
+    const unsigned int again = value(loop, VM_ir_op::MUL, 0, {x, two});
+    const unsigned int a = value(loop, VM_ir_op::ADD, 0, {twice, cell});
+    const unsigned int c = value(loop, VM_ir_op::ADD, 0, {cell, again});
+    const unsigned int once = value(loop, VM_ir_op::MUL, 0, {x, one});
+    const unsigned int b = value(loop, VM_ir_op::ADD, 0, {c, once});
+    value(loop, VM_ir_op::ADD, 0, {a, b});    // nothing needs it
+    const unsigned int total = value(loop, VM_ir_op::LOAD, 0, {});
+    const unsigned int sum = value(loop, VM_ir_op::ADD, 0, {total, b});
+    value(loop, VM_ir_op::STORE, 0, {sum});
+    const unsigned int left = value(loop, VM_ir_op::SUB, 0, {i, one});
+    ir.values[i].args = {count, left};
+    ir.blocks[loop].preds = {entry, loop};
+    ir.blocks[loop].exit = VM_ir_block::BRANCH;
+    ir.blocks[loop].test = VM_ir_test::GT;
+    ir.blocks[loop].value = left;
+    ir.blocks[loop].next[0] = loop;
+    ir.blocks[loop].next[1] = done;
+
+    ir.blocks[done].preds = {loop};
+    ir.blocks[done].value = value(done, VM_ir_op::LOAD, 0, {});
+    ir.heap = {0, 10, 5};
+
+    auto run = [](VM_ir const &program, int &heap0) {
+        VM_ir_lowering lowering;
+        VM vm;
+        const bool ok = lowering.write(program, VM_image_machine::GREENDOG, IMAGE_PATH, 8) && vm.load(IMAGE_PATH);
+        remove(IMAGE_PATH);
+        VM_exec_status status = ok ? vm.exec() : VM_exec_status(VM_error::MAX_RUNTIME);
+        heap0 = vm.get_heap(0);
+        return status;
+    };
+
+    string why;
+    int before = 0;
+    int after = 0;
+    const VM_exec_status plain = run(ir, before);
+    bool ok = ir.check(why) && 75 == plain.get_program_value() && 75 == before;
+
+    VM_ir_optimizer optimizer;
+    VM_ir_stats stats;
+    VM_ir program = ir;
+    optimizer.optimize(program, &stats);
+    const VM_exec_status optimized = run(program, after);
+    ok = ok && program.check(why) && same_status(plain, optimized) && 75 == after &&
+         optimized.get_ticks() < plain.get_ticks();
+
+    // both x * 2 become x + x and x * 1 becomes x; the second x + x, and
+    // heap[1] + x * 2 after x * 2 + heap[1], are found again; a + b goes;
+    // and x + x, a and b leave the loop, which keeps only heap[0]'s LOAD,
+    // ADD and STORE and the count
+    ok = ok && stats.reduced >= 3 && stats.common >= 2 && stats.dead_values >= 1 && stats.hoisted >= 3;
+    unsigned int muls = 0;
+    for (VM_ir_block const &block : program.blocks)
+    {
+        for (unsigned int v : block.code)
+        {
+            muls += VM_ir_op::MUL == program.values[v].op;
+        }
+    }
+    ok = ok && 0 == muls;
+
+    // and each pass on its own finds nothing more to do
+    ok = ok && !optimizer.reduce_strength(program) && !optimizer.propagate_copies(program) &&
+         !optimizer.eliminate_common_subexpressions(program) && !optimizer.eliminate_dead_code(program) &&
+         !optimizer.hoist_loop_invariants(program);
+
+    if (!ok)
+    {
+        program.print(cerr);
+        stats.report(cerr);
+    }
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Passes\n";
+    return ok;
+}
+
+// Forty values worked out from a loop's counter and live at once: some
+// live in cells from the base given, and r31 is never written.
+bool ir_register_spills()
+{
+    VM_stack_program program;
+    program.push(0);
+    program.push(3);
+    program.label("LOOP");
+    for (int k = 1; k <= 40; ++k)
+    {
+        program.dupn(k);
+        program.push(k + 2);
+        program.mul();
+    }
+    for (int k = 1; k < 40; ++k)
+    {
+        program.add();
+    }
+    program.dupn(3);
+    program.add();
+    program.dropn(3);
+    program.swap();
+    program.push(1);
+    program.sub();
+    program.dup();
+    program.jgt("LOOP");
+    program.pop();
+
+    vector<unsigned char> code = program.bytes();
+    VM_ir ir;
+    VM_ir_builder builder;
+    VM_ir_lowering lowering;
+    vector<VM_ir_register_instruction> lowered;
+    bool ok = expect_ir_stack(code, "IR Spills") && builder.build_stack(code.data(), (unsigned int)code.size(), ir);
+    VM_ir_optimizer().optimize(ir);
+    ok = ok && lowering.lower_registers(ir, lowered, 100) && lowering.spilled() > 0 &&
+         lowering.cells() >= lowering.spilled();
+    for (VM_ir_register_instruction const &instr : lowered)
+    {
+        if ((LOAD == instr.op && 31 == instr.r1) || (instr.op >= ADD && instr.op <= CMP && 31 == instr.r3))
+        {
+            ok = false;
+        }
+        if (LOAD == instr.op || STORE == instr.op)
+        {
+            ok = ok && instr.addr >= 100 && instr.addr < 100 + lowering.cells();
+        }
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Register Spills\n";
+    return ok;
+}
+
+bool ir_refused(string const &label, bool ok, string const &error, string const &expected)
+{
+    ok = ok && error == expected;
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << ", got \"" << error << "\"\n";
+        return false;
+    }
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+void ir_suite(Runner &runner)
+{
+    runner(ir_stack_programs);
+    runner(ir_random_stack_programs);
+    runner(ir_register_programs);
+    runner(ir_register_kernels);
+    runner(ir_passes);
+    runner(ir_register_spills);
+
+    runner([]() -> bool {
+        VM_ir_register_instruction instr = {ADD, 32, 0, 0, 0, 0};
+        VM_ir ir;
+        VM_ir_builder builder;
+        return ir_refused("IR Bad Register", !builder.build_registers(&instr, 1, ir) && ir.blocks.empty(),
+                          builder.error(), "Invalid register at 0");
+    });
+    runner([]() -> bool {
+        VM_ir_register_instruction instr = {JMP, 0, 0, 0, 0, 1};
+        VM_ir ir;
+        VM_ir_builder builder;
+        return ir_refused("IR Jump Out", !builder.build_registers(&instr, 1, ir), builder.error(),
+                          "Jump out of the program at 0");
+    });
+    runner([]() -> bool {
+        VM_stack_program program;
+        program.push(1);
+        program.add();
+        vector<unsigned char> code = program.bytes();
+        VM_ir ir;
+        VM_ir_builder builder;
+        return ir_refused("IR Stack Underflow", !builder.build_stack(code.data(), (unsigned int)code.size(), ir),
+                          builder.error(), "Stack underflow at 5");
+    });
+    runner([]() -> bool {
+        VM vm;
+        fibonacci_program(vm, 3);
+        VM_ir ir;
+        VM_ir_builder builder;
+        VM_ir_lowering lowering;
+        vector<unsigned char> code;
+        const bool ok = vm.save(IMAGE_PATH) && builder.build(IMAGE_PATH, ir) && !lowering.lower_stack(ir, code);
+        remove(IMAGE_PATH);
+        return ir_refused("IR Heap on Yellowdog", ok, lowering.error(), "Yellowdog has no heap");
+    });
+    runner([]() -> bool {
+        VM_ir ir;
+        VM_ir_builder builder;
+        return ir_refused("IR Not an Image", !builder.build(IMAGE_PATH, ir), builder.error(),
+                          string("Not a yellowdog or greendog image: ") + IMAGE_PATH);
+    });
+    runner([]() -> bool {
+        VM_stack_program program;
+        program.push(1);
+        vector<unsigned char> code = program.bytes();
+        VM_ir ir;
+        VM_ir_builder builder;
+        VM_ir_lowering lowering;
+        const bool ok = builder.build_stack(code.data(), (unsigned int)code.size(), ir) &&
+                        !lowering.write(ir, VM_image_machine::WHITEDOG, IMAGE_PATH);
+        return ir_refused("IR Whitedog", ok, lowering.error(), "Cannot lower to that machine");
+    });
+}
+
+int main(void)
+{
+    Runner runner;
+
+    runner(empty_program);
+
+    load_suite(runner);
+    math_suite(runner);
+    cmp_suite(runner);
+
+    runner(program_too_long);
+
+    jmp_suite(runner);
+
+    conditional_jmp_suite(runner, &VM::jeq, "JEQ", false, true, false);
+    conditional_jmp_suite(runner, &VM::jne, "JNE", true, false, true);
+    conditional_jmp_suite(runner, &VM::jlt, "JLT", true, false, false);
+    conditional_jmp_suite(runner, &VM::jle, "JLE", true, true, false);
+    conditional_jmp_suite(runner, &VM::jgt, "JGT", false, false, true);
+    conditional_jmp_suite(runner, &VM::jge, "JGE", false, true, true);
+
+    factorial_suite(runner);
+    fibonacci_suite(runner);
+
+    trusted_suite(runner);
+
+    runner([]() -> bool { return budget_test("Budget", &VM::exec); });
+    runner([]() -> bool { return budget_test("Budget Trusted", &VM::exec_trusted); });
+    runner([]() -> bool { return budget_test("Budget JIT", &VM::exec_jit); });
+
+    jit_suite(runner);
+
+    for (unsigned int threads : {1, 4, 0})
+    {
+        runner([threads]() -> bool {
+            return batch_test("Batch " + to_string(threads) + " Threads", [threads](VM &vm, vector<vector<int>> &heaps) {
+                return vm.exec_batch(heaps, threads);
+            });
+        });
+    }
+    runner(batch_isolated);
+    runner(batch_invalid);
+
+    lockstep_suite(runner);
+
+    image_suite(runner);
+    assembler_suite(runner);
+
+    runner(profile_factorial);
+    runner(profile_unverified);
+
+    runner(trace_matches_verbose);
+    runner(trace_error);
+
+    runner(executor_reuse);
+    runner(executor_reset);
+
+    runner(heap_overlay);
+    runner(heap_overlay_batch);
+
+    runner(wide_heap);
+    runner(wide_heap_batch);
+    runner(wide_program);
+    runner(wide_encoding);
+
+    translate_suite(runner);
+    ir_suite(runner);
 
     return runner.report();
 }
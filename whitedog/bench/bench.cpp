@@ -0,0 +1,178 @@
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "VM_bench.hpp"
+#include "vm.hpp"
+
+using namespace std;
+
+// White dog has no jumps, so there are no loop kernels: each case is a
+// straight line program, and exec does not count what it ran, so the
+// cases count the instructions as they build them.  exec only reads back
+// the result worked out while building, so the opcode cases interpret.
+
+// Enough repetitions of an opcode, with whatever keeps the stack level
+// around it, that the cost of starting to interpret disappears.
+constexpr int REPEATS = 64;
+
+void opcode(VM_bench &bench, const char *name, int per_step, function<void(VM &)> step)
+{
+    VM vm;
+    vm.push(1);
+    for (int i = 0; i < REPEATS; ++i)
+    {
+        step(vm);
+    }
+
+    const int instructions = 1 + per_step * REPEATS;
+    bench.run(string("op/") + name, [&vm, instructions]() {
+        vm.interpret();
+        return instructions;
+    });
+}
+
+void opcodes(VM_bench &bench)
+{
+    opcode(bench, "PUSH", 2, [](VM &vm) { vm.push(1); vm.pop(); });
+    opcode(bench, "DUP", 2, [](VM &vm) { vm.dup(); vm.pop(); });
+    opcode(bench, "ADD", 2, [](VM &vm) { vm.push(1); vm.add(); });
+    opcode(bench, "SUB", 2, [](VM &vm) { vm.push(1); vm.sub(); });
+    opcode(bench, "MUL", 2, [](VM &vm) { vm.push(1); vm.mul(); });
+    opcode(bench, "DIV", 2, [](VM &vm) { vm.push(1); vm.div(); });
+}
+
+// A program built into a fresh machine; instructions per second counts
+// the instructions built.
+void builds(VM_bench &bench)
+{
+    for (bool fold : {false, true})
+    {
+        bench.run(fold ? "build/arithmetic_folded" : "build/arithmetic", [fold]() {
+            VM vm(fold);
+            vm.push(0);
+            for (int i = 0; i < REPEATS; ++i)
+            {
+                vm.push(i);
+                vm.add();
+            }
+            return 1 + 2 * REPEATS;
+        });
+    }
+}
+
+// What exec and interpret cost around a one instruction program, and exec
+// around a long one.
+void setup(VM_bench &bench)
+{
+    VM vm;
+    vm.push(1);
+    bench.run("setup/exec", [&vm]() {
+        vm.exec();
+        return 1;
+    });
+    bench.run("setup/interpret", [&vm]() {
+        vm.interpret();
+        return 1;
+    });
+
+    VM sum;
+    sum.push(0);
+    for (int i = 0; i < REPEATS; ++i)
+    {
+        sum.push(i);
+        sum.add();
+    }
+    bench.run("setup/exec_long", [&sum]() {
+        sum.exec();
+        return 1 + 2 * REPEATS;
+    });
+}
+
+// (price * quantity - discount) / units over a table of rows: rebuilt
+// with the row's values for every row, as before PUSHARG, run a row at a
+// time with exec, and run by exec_batch in each SIMD form.  Instructions
+// per second counts the formula's instructions once per row.
+constexpr size_t ROWS = 4096;
+
+void batches(VM_bench &bench)
+{
+    vector<int> args;
+    for (size_t r = 0; r < ROWS; ++r)
+    {
+        args.insert(args.end(), {int(r % 1000), int(r % 13), int(r % 100), int(r % 7 + 1)});
+    }
+    vector<int> values(ROWS);
+    const int instructions = 7 * ROWS;
+
+    bench.run("batch/formula/rebuild", [&args, &values, instructions]() {
+        for (size_t r = 0; r < ROWS; ++r)
+        {
+            int const *row = &args[r * 4];
+            VM vm;
+            vm.push(row[0]);
+            vm.push(row[1]);
+            vm.mul();
+            vm.push(row[2]);
+            vm.sub();
+            vm.push(row[3]);
+            vm.div();
+            values[r] = vm.exec().get_program_value();
+        }
+        return instructions;
+    });
+
+    VM formula;
+    formula.pusharg(0);
+    formula.pusharg(1);
+    formula.mul();
+    formula.pusharg(2);
+    formula.sub();
+    formula.pusharg(3);
+    formula.div();
+
+    bench.run("batch/formula/exec", [&formula, &args, &values, instructions]() {
+        for (size_t r = 0; r < ROWS; ++r)
+        {
+            values[r] = formula.exec(&args[r * 4], 4).get_program_value();
+        }
+        return instructions;
+    });
+
+    const struct
+    {
+        const char *name;
+        VM_batch_isa isa;
+    } forms[] = {
+        {"scalar", VM_batch_isa::NONE},
+        {"sse2", VM_batch_isa::SSE2},
+        {"avx2", VM_batch_isa::AVX2},
+        {"avx512", VM_batch_isa::AVX512},
+    };
+    for (auto const &form : forms)
+    {
+        // forms the host lacks would only run a narrower one again
+        if (form.isa > VM_batch::best())
+        {
+            continue;
+        }
+
+        const VM_batch_isa isa = form.isa;
+        bench.run(string("batch/formula/") + form.name, [&formula, &args, &values, instructions, isa]() {
+            formula.exec_batch(args.data(), ROWS, values.data(), nullptr, isa);
+            return instructions;
+        });
+    }
+}
+
+int main(int argc, char **argv)
+{
+    VM_bench bench("whitedog", argc, argv);
+
+    opcodes(bench);
+    builds(bench);
+    setup(bench);
+    batches(bench);
+
+    return bench.finish();
+}
@@ -0,0 +1,40 @@
+#if !defined(VM_ASSEMBLER_HPP)
+#define VM_ASSEMBLER_HPP
+
+#include <istream>
+#include <string>
+#include <string_view>
+
+#include "VM_lexer.hpp"
+
+class VM;
+
+// Assembly source, one instruction per line, as in the README:
+//
+//     PUSH 6      ; a comment
+//     PUSHARG 0   ; the first argument
+//     DIV
+//
+// Mnemonics may be written in any case.  Each line is handed to the VM's
+// builder calls as it is read.
+class VM_assembler
+{
+public:
+    // Append the program in source to vm.  false at the first line that
+    // does not parse, which error() describes; vm keeps what came before.
+    bool assemble(std::string_view source, VM &vm);
+
+    // the same, reading a line at a time
+    bool assemble(std::istream &in, VM &vm);
+
+    const std::string &error() const;
+
+private:
+    std::string message;
+    std::string line;
+
+    bool statements(VM_lexer &lexer, VM &vm);
+    bool fail(const VM_token &token, const char *what);
+};
+
+#endif
@@ -0,0 +1,94 @@
+#if !defined(VM_BATCH_HPP)
+#define VM_BATCH_HPP
+
+#include <cstddef>
+#include <vector>
+
+// The batch engine is written with GCC vector extensions.  The 128 bit
+// form is plain SSE2 on x86-64 and is lowered to whatever the target has
+// elsewhere; the wider forms are only built for x86-64.
+#if defined(__GNUC__) && !defined(__clang__)
+#define VM_BATCH_VECTORS 1
+#else
+#define VM_BATCH_VECTORS 0
+#endif
+
+#if VM_BATCH_VECTORS && defined(__x86_64__)
+#define VM_BATCH_X86_64 1
+#else
+#define VM_BATCH_X86_64 0
+#endif
+
+enum class VM_batch_isa
+{
+    NONE,      // no vector build: one row at a time
+    SSE2,      // 4 lanes
+    AVX2,      // 8 lanes
+    AVX512,    // 16 lanes
+};
+
+// A program run over many rows of arguments at once.  White dog programs
+// do not branch, so every row runs the same instructions and the stack
+// is as deep for each of them: the rows are taken BATCH_ROWS at a time,
+// one row per SIMD lane, and each stack slot is a run of vectors holding
+// that value for every row.  Only DIV can fail one row and not another;
+// the rows it fails are marked and the rest carry on.
+class VM_batch
+{
+public:
+    static const unsigned int BATCH_ROWS = 64u;
+
+    // in the order of VM's own opcodes
+    enum class opcode : unsigned char
+    {
+        PUSH,       // operand is the value
+        POP,
+        DUP,
+        ADD,
+        SUB,
+        MUL,
+        DIV,
+        PUSHARG,    // operand is the argument index
+    };
+
+    struct step
+    {
+        opcode op;
+        int operand;
+    };
+
+    // steps must never take more from the stack than it holds and must
+    // leave a value on it (VM::exec_batch checks), and no PUSHARG may
+    // index past width
+    VM_batch(std::vector<step> steps, unsigned int width, VM_batch_isa isa = best());
+
+    // the widest form this build and host CPU both support
+    static VM_batch_isa best();
+    static unsigned int lanes(VM_batch_isa isa);
+    unsigned int lanes() const;
+
+    // Run rows rows of width arguments each, back to back in args, and
+    // write row r's result to values[r], or -1 if it divided by zero.
+    // failed, unless nullptr, gets whether each row did.  Returns the
+    // number of rows that failed.
+    size_t exec(int const *args, size_t rows, int *values, bool *failed = nullptr);
+
+private:
+    using entry_point = size_t (VM_batch::*)(int const *, size_t, int *, bool *);
+
+    std::vector<step> steps;
+    unsigned int width;
+    VM_batch_isa isa;
+    entry_point entry;
+    size_t depth;    // deepest the stack gets
+
+    // BATCH_ROWS cells per stack slot, aligned for the widest vector
+    std::vector<int> buffer;
+    int *cells;
+
+    size_t exec_sse2(int const *args, size_t rows, int *values, bool *failed);
+    size_t exec_avx2(int const *args, size_t rows, int *values, bool *failed);
+    size_t exec_avx512(int const *args, size_t rows, int *values, bool *failed);
+};
+
+#endif
@@ -1,8 +1,14 @@
 #if !defined(VM_HPP)
 #define VM_HPP
 
+#include <cstddef>
+#include <memory>
+#include <ostream>
 #include <string>
 
+#include "VM_batch.hpp"
+#include "VM_image.hpp"
+
 class VM_exec_status
 {
 public:
@@ -33,11 +39,21 @@ private:
     static const OPCODE SUB = 5;
     static const OPCODE MUL = 6;
     static const OPCODE DIV = 7;
+    static const OPCODE PUSHARG = 8;
 
 public:
-    VM();
+    static const unsigned int MAX_ARGUMENTS = 256u;
+
+    // With fold_constants, an ADD, SUB, MUL or DIV whose operands are
+    // both pushed constants replaces their PUSHes with one of its result
+    // as it is built, so the program shrinks as it grows.  A DIV by zero
+    // is left in to fail when the program runs.
+    explicit VM(bool fold_constants = false);
 
     void push(int val);
+    // push argument index of the row being run; index must be below
+    // MAX_ARGUMENTS or the program is invalid
+    void pusharg(unsigned int index);
     void pop();
     void dup();
     void add();
@@ -45,15 +61,82 @@ public:
     void mul();
     void div();
 
+    // The program has no inputs, so its result is known once it is
+    // built: the builder calls work it out instruction by instruction,
+    // and load when it reads a program, and exec only hands it back.
+    // A program that reads arguments has been built without them, so exec
+    // gives what running it with none does: a failure at the first
+    // PUSHARG unless something fails before.
     VM_exec_status exec() const;
 
+    // how many arguments the program reads: one past the highest PUSHARG
+    // index, 0 if it has none
+    unsigned int arguments() const;
+
+    // Run the program with args[0 .. count) as its arguments, by
+    // interpreting it unless it reads none.
+    VM_exec_status exec(int const *args, unsigned int count) const;
+
+    // Run the bytecode instead, which always gives what exec does.
+    VM_exec_status interpret(int const *args = nullptr, unsigned int count = 0) const;
+
+    // Run the program once per row of args, rows of arguments() ints back
+    // to back, in SIMD lanes (see VM_batch).  values[r] gets row r's
+    // result, or -1 if it failed, and failed, unless nullptr, whether it
+    // did; exec on the row says why.  Returns the number of rows that
+    // failed, which is all of them if the program fails whatever its
+    // arguments.
+    size_t exec_batch(int const *args, size_t rows, int *values, bool *failed = nullptr,
+                      VM_batch_isa isa = VM_batch::best()) const;
+
+    // Write the program to an image file, or replace it with one read
+    // from an image.  A loaded program runs from the mapped file until
+    // more instructions are added to it.
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+    // Write the program as source VM_assembler reads back; nothing if
+    // the program is invalid.
+    void disassemble(std::ostream &out) const;
+
 private:
+    // what running a program up to some point leaves: its stack, and the
+    // error that stopped it, nullptr while there is none
+    struct state
+    {
+        // every value was pushed or duplicated by an instruction of its own
+        int stack[MAX_PROGRAM_SIZE];
+        size_t depth = 0;
+        char const *failure = nullptr;
+
+        void step(OPCODE op, int val);
+        VM_exec_status result() const;
+    };
+
     OPCODE program[MAX_PROGRAM_SIZE];
     unsigned int program_size;
     bool valid_program;
 
+    unsigned int argument_count;
+
+    bool fold_constants;
+    state evaluated;
+    // where the PUSHes that end the program start, while folding
+    unsigned int constants[MAX_PROGRAM_SIZE / (1 + sizeof(int)) + 1];
+    unsigned int constant_count;
+
+    std::shared_ptr<VM_image const> image;
+    OPCODE const *image_code;
+
+    OPCODE const *code() const;
+    void detach();
+
     bool maybe_add_op(OPCODE op);
+    void arithmetic(OPCODE op);
     void program_too_big();
+
+    // two's complement, wrapping as the README promises; x is not 0 for DIV
+    static int apply(OPCODE op, int y, int x);
 };
 
 #endif
@@ -0,0 +1,146 @@
+#include <climits>
+
+#include "../include/VM_assembler.hpp"
+#include "../include/vm.hpp"
+
+using namespace std;
+
+namespace
+{
+
+struct mnemonic
+{
+    uint64_t key;
+    void (VM::*op)();
+};
+
+const mnemonic mnemonics[] = {
+    {VM_word_key("POP"), &VM::pop},
+    {VM_word_key("DUP"), &VM::dup},
+    {VM_word_key("ADD"), &VM::add},
+    {VM_word_key("SUB"), &VM::sub},
+    {VM_word_key("MUL"), &VM::mul},
+    {VM_word_key("DIV"), &VM::div},
+};
+
+} // namespace
+
+bool VM_assembler::assemble(std::string_view source, VM &vm)
+{
+    message.clear();
+    VM_lexer lexer(source);
+    return statements(lexer, vm);
+}
+
+bool VM_assembler::assemble(std::istream &in, VM &vm)
+{
+    message.clear();
+    for (unsigned int number = 1; getline(in, line); ++number)
+    {
+        VM_lexer lexer(line, number);
+        if (!statements(lexer, vm))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const std::string &VM_assembler::error() const
+{
+    return message;
+}
+
+bool VM_assembler::statements(VM_lexer &lexer, VM &vm)
+{
+    for (VM_token token = lexer.next(); VM_token_kind::END != token.kind; token = lexer.next())
+    {
+        if (VM_token_kind::NEWLINE == token.kind)
+        {
+            continue;
+        }
+        if (VM_token_kind::WORD != token.kind)
+        {
+            return fail(token, "expected an instruction");
+        }
+
+        VM_token after = lexer.next();
+        if (VM_word_key("PUSH") == token.key)
+        {
+            if (VM_token_kind::NUMBER != after.kind)
+            {
+                return fail(after, "expected a number");
+            }
+            if (after.number < INT_MIN || after.number > INT_MAX)
+            {
+                return fail(after, "number out of range");
+            }
+            const int value = (int)after.number;
+            after = lexer.next();
+            if (VM_token_kind::NEWLINE != after.kind && VM_token_kind::END != after.kind)
+            {
+                return fail(after, "expected the end of the line");
+            }
+            vm.push(value);
+        }
+        else if (VM_word_key("PUSHARG") == token.key)
+        {
+            if (VM_token_kind::NUMBER != after.kind)
+            {
+                return fail(after, "expected a number");
+            }
+            if (after.number < 0 || after.number >= VM::MAX_ARGUMENTS)
+            {
+                return fail(after, "argument out of range");
+            }
+            const unsigned int index = (unsigned int)after.number;
+            after = lexer.next();
+            if (VM_token_kind::NEWLINE != after.kind && VM_token_kind::END != after.kind)
+            {
+                return fail(after, "expected the end of the line");
+            }
+            vm.pusharg(index);
+        }
+        else
+        {
+            const mnemonic *found = nullptr;
+            for (const mnemonic &candidate : mnemonics)
+            {
+                if (candidate.key == token.key)
+                {
+                    found = &candidate;
+                    break;
+                }
+            }
+            if (nullptr == found)
+            {
+                return fail(token, "unknown instruction");
+            }
+            if (VM_token_kind::NEWLINE != after.kind && VM_token_kind::END != after.kind)
+            {
+                return fail(after, "expected the end of the line");
+            }
+            (vm.*found->op)();
+        }
+
+        if (VM_token_kind::END == after.kind)
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+bool VM_assembler::fail(const VM_token &token, const char *what)
+{
+    message = "line " + to_string(token.line) + ": " + what;
+    if (VM_token_kind::NEWLINE == token.kind || VM_token_kind::END == token.kind)
+    {
+        message += " at the end of the line";
+    }
+    else
+    {
+        message += " at '" + string(token.text) + "'";
+    }
+    return false;
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "../include/VM_batch.hpp"
+
+using namespace std;
+
+VM_batch::VM_batch(vector<step> steps, unsigned int width, VM_batch_isa isa)
+    : steps(move(steps)), width(width), isa(min(isa, best())), entry(nullptr), depth(0), cells(nullptr)
+{
+    switch (this->isa)
+    {
+#if VM_BATCH_X86_64
+    case VM_batch_isa::AVX512:
+        entry = &VM_batch::exec_avx512;
+        break;
+
+    case VM_batch_isa::AVX2:
+        entry = &VM_batch::exec_avx2;
+        break;
+#endif
+#if VM_BATCH_VECTORS
+    case VM_batch_isa::SSE2:
+        entry = &VM_batch::exec_sse2;
+        break;
+#endif
+    default:
+        this->isa = VM_batch_isa::NONE;
+        break;
+    }
+
+    size_t height = 0;
+    for (step const &s : this->steps)
+    {
+        switch (s.op)
+        {
+        case opcode::PUSH:
+        case opcode::PUSHARG:
+        case opcode::DUP:
+            ++height;
+            break;
+
+        default:
+            --height;
+            break;
+        }
+        depth = height > depth ? height : depth;
+    }
+
+    // a slot of rows per value, plus room to start on a 64 byte boundary
+    buffer.assign(depth * BATCH_ROWS + 16, 0);
+    const size_t misaligned = (reinterpret_cast<uintptr_t>(buffer.data()) % 64) / sizeof(int);
+    cells = buffer.data() + (16 - misaligned) % 16;
+}
+
+VM_batch_isa VM_batch::best()
+{
+#if VM_BATCH_X86_64
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return VM_batch_isa::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return VM_batch_isa::AVX2;
+    }
+#endif
+#if VM_BATCH_VECTORS
+    return VM_batch_isa::SSE2;
+#else
+    return VM_batch_isa::NONE;
+#endif
+}
+
+unsigned int VM_batch::lanes(VM_batch_isa isa)
+{
+    switch (isa)
+    {
+    case VM_batch_isa::AVX512: return 16;
+    case VM_batch_isa::AVX2:   return 8;
+    case VM_batch_isa::SSE2:   return 4;
+    default:                   return 1;
+    }
+}
+
+unsigned int VM_batch::lanes() const
+{
+    return lanes(isa);
+}
+
+size_t VM_batch::exec(int const *args, size_t rows, int *values, bool *failed)
+{
+    if (entry)
+    {
+        return (this->*entry)(args, rows, values, failed);
+    }
+
+    // one row at a time, on the first slot of each
+    size_t failures = 0;
+    for (size_t r = 0; r < rows; ++r)
+    {
+        int const *row = args + r * width;
+        int *top = cells;
+        bool lost = false;
+        for (step const &s : steps)
+        {
+            switch (s.op)
+            {
+            case opcode::PUSH:
+                *top++ = s.operand;
+                break;
+
+            case opcode::PUSHARG:
+                *top++ = row[s.operand];
+                break;
+
+            case opcode::POP:
+                --top;
+                break;
+
+            case opcode::DUP:
+                *top = top[-1];
+                ++top;
+                break;
+
+            case opcode::ADD:
+                --top;
+                top[-1] = (int)((unsigned int)top[-1] + (unsigned int)*top);
+                break;
+
+            case opcode::SUB:
+                --top;
+                top[-1] = (int)((unsigned int)top[-1] - (unsigned int)*top);
+                break;
+
+            case opcode::MUL:
+                --top;
+                top[-1] = (int)((unsigned int)top[-1] * (unsigned int)*top);
+                break;
+
+            case opcode::DIV:
+                --top;
+                lost = lost || 0 == *top;
+                top[-1] = 0 == *top ? 0 : -1 == *top ? (int)(0u - (unsigned int)top[-1]) : top[-1] / *top;
+                break;
+            }
+        }
+
+        values[r] = lost ? -1 : top[-1];
+        failures += lost;
+        if (nullptr != failed)
+        {
+            failed[r] = lost;
+        }
+    }
+
+    return failures;
+}
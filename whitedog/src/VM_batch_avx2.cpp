@@ -0,0 +1,22 @@
+#include <cstddef>
+
+#include "../include/VM_batch.hpp"
+
+#if VM_BATCH_X86_64
+#pragma GCC target("avx2")
+
+#include "VM_batch_impl.hpp"
+
+namespace
+{
+typedef int lanes_8 __attribute__((vector_size(32)));
+typedef unsigned int ulanes_8 __attribute__((vector_size(32)));
+typedef double dlanes_8 __attribute__((vector_size(64)));
+}
+
+size_t VM_batch::exec_avx2(int const *args, size_t rows, int *values, bool *failed)
+{
+    return evaluate<lanes_8, ulanes_8, dlanes_8, 8>(steps.data(), steps.size(), reinterpret_cast<lanes_8 *>(cells),
+                                                    width, args, rows, values, failed);
+}
+#endif
@@ -0,0 +1,22 @@
+#include <cstddef>
+
+#include "../include/VM_batch.hpp"
+
+#if VM_BATCH_X86_64
+#pragma GCC target("avx512f")
+
+#include "VM_batch_impl.hpp"
+
+namespace
+{
+typedef int lanes_16 __attribute__((vector_size(64)));
+typedef unsigned int ulanes_16 __attribute__((vector_size(64)));
+typedef double dlanes_16 __attribute__((vector_size(128)));
+}
+
+size_t VM_batch::exec_avx512(int const *args, size_t rows, int *values, bool *failed)
+{
+    return evaluate<lanes_16, ulanes_16, dlanes_16, 16>(steps.data(), steps.size(), reinterpret_cast<lanes_16 *>(cells),
+                                                        width, args, rows, values, failed);
+}
+#endif
@@ -0,0 +1,185 @@
+#if !defined(VM_BATCH_IMPL_HPP)
+#define VM_BATCH_IMPL_HPP
+
+#include <cstddef>
+
+#include "../include/VM_batch.hpp"
+
+// The batch evaluator, written once over a vector type and built once
+// per instruction set.  Each VM_batch_<isa>.cpp includes this after its
+// `#pragma GCC target`, so everything here has internal linkage and is
+// compiled for that target only; the headers above must already have
+// been included before the pragma.
+
+namespace
+{
+
+template <typename T, typename M>
+inline T select(M mask, T a, T b)
+{
+    const T m = (T)mask;
+    return (a & m) | (b & ~m);
+}
+
+// y / x a lane at a time, x not 0 or -1 in any lane.  There is no vector
+// integer divide, but a quotient of 32 bit ints is exact in double and
+// truncating it is what / does.  The conversions are written lane by
+// lane, which the optimiser turns into whole vector ones anyway:
+// __builtin_convertvector to 16 doubles breaks GCC 12 at -O0.
+template <typename V, typename D, unsigned int W>
+inline V quotient(V y, V x)
+{
+    D dividend;
+    D divisor;
+    for (unsigned int lane = 0; lane < W; ++lane)
+    {
+        dividend[lane] = y[lane];
+        divisor[lane] = x[lane];
+    }
+
+    const D exact = dividend / divisor;
+    V result;
+    for (unsigned int lane = 0; lane < W; ++lane)
+    {
+        result[lane] = (int)exact[lane];
+    }
+    return result;
+}
+
+// V is a vector of W ints, U the matching vector of unsigned ints and D
+// of doubles.  stack holds a slot of BATCH_ROWS / W vectors for every
+// value the program ever has on its stack at once.
+template <typename V, typename U, typename D, unsigned int W>
+size_t evaluate(VM_batch::step const *steps, size_t count, V *stack, unsigned int width, int const *args,
+                size_t rows, int *values, bool *failed)
+{
+    using opcode = VM_batch::opcode;
+    const unsigned int N = VM_batch::BATCH_ROWS / W;
+
+    size_t failures = 0;
+    for (size_t first = 0; first < rows; first += VM_batch::BATCH_ROWS)
+    {
+        const size_t here = rows - first < VM_batch::BATCH_ROWS ? rows - first : VM_batch::BATCH_ROWS;
+        int const *row = args + first * width;
+
+        V bad[N] = {};
+        V *top = stack;    // the first free slot
+        for (size_t i = 0; i < count; ++i)
+        {
+            const VM_batch::step &s = steps[i];
+            switch (s.op)
+            {
+            case opcode::PUSH:
+                for (unsigned int n = 0; n < N; ++n)
+                {
+                    top[n] = V{} + s.operand;
+                }
+                top += N;
+                break;
+
+            case opcode::PUSHARG:
+            {
+                // a column of the rows, written as ints (vectors alias
+                // their elements); rows past the last are zero and come
+                // to nothing
+                int *column = reinterpret_cast<int *>(top);
+                int const *arg = row + s.operand;
+                for (unsigned int r = 0; r < here; ++r, arg += width)
+                {
+                    column[r] = *arg;
+                }
+                for (unsigned int r = here; r < VM_batch::BATCH_ROWS; ++r)
+                {
+                    column[r] = 0;
+                }
+                top += N;
+            }
+            break;
+
+            case opcode::POP:
+                top -= N;
+                break;
+
+            case opcode::DUP:
+                for (unsigned int n = 0; n < N; ++n)
+                {
+                    top[n] = (top - N)[n];
+                }
+                top += N;
+                break;
+
+            // arithmetic wraps, so do it unsigned; x is the top slot and
+            // y the one under it, which takes the result
+            case opcode::ADD:
+            {
+                top -= N;
+                V *const y = top - N;
+                for (unsigned int n = 0; n < N; ++n)
+                {
+                    y[n] = (V)((U)y[n] + (U)top[n]);
+                }
+            }
+            break;
+
+            case opcode::SUB:
+            {
+                top -= N;
+                V *const y = top - N;
+                for (unsigned int n = 0; n < N; ++n)
+                {
+                    y[n] = (V)((U)y[n] - (U)top[n]);
+                }
+            }
+            break;
+
+            case opcode::MUL:
+            {
+                top -= N;
+                V *const y = top - N;
+                for (unsigned int n = 0; n < N; ++n)
+                {
+                    y[n] = (V)((U)y[n] * (U)top[n]);
+                }
+            }
+            break;
+
+            case opcode::DIV:
+            {
+                // lanes dividing by 0 fail, and by -1 negate so INT_MIN
+                // wraps
+                top -= N;
+                V *const y = top - N;
+                for (unsigned int n = 0; n < N; ++n)
+                {
+                    const V x = top[n];
+                    const V zero = x == 0;
+                    const V minus = x == -1;
+                    bad[n] |= zero;
+
+                    const V divisor = select(zero | minus, V{} + 1, x);
+                    y[n] = select(minus, (V)(U{} - (U)y[n]), quotient<V, D, W>(y[n], divisor));
+                }
+            }
+            break;
+            }
+        }
+
+        top -= N;
+        for (unsigned int r = 0; r < here; ++r)
+        {
+            const bool lost = 0 != bad[r / W][r % W];
+            values[first + r] = lost ? -1 : top[r / W][r % W];
+            failures += lost;
+            if (nullptr != failed)
+            {
+                failed[first + r] = lost;
+            }
+        }
+    }
+
+    return failures;
+}
+
+} // namespace
+
+#endif
@@ -0,0 +1,23 @@
+#include <cstddef>
+
+#include "../include/VM_batch.hpp"
+
+#if VM_BATCH_VECTORS
+// SSE2 is part of x86-64 itself, so no target is needed; other hosts get
+// whatever their compiler makes of 128 bit vectors.
+
+#include "VM_batch_impl.hpp"
+
+namespace
+{
+typedef int lanes_4 __attribute__((vector_size(16)));
+typedef unsigned int ulanes_4 __attribute__((vector_size(16)));
+typedef double dlanes_4 __attribute__((vector_size(32)));
+}
+
+size_t VM_batch::exec_sse2(int const *args, size_t rows, int *values, bool *failed)
+{
+    return evaluate<lanes_4, ulanes_4, dlanes_4, 4>(steps.data(), steps.size(), reinterpret_cast<lanes_4 *>(cells),
+                                                    width, args, rows, values, failed);
+}
+#endif
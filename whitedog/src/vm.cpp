@@ -1,4 +1,5 @@
 #include <cstring>
+#include <vector>
 
 #include "../include/vm.hpp"
 
@@ -29,19 +30,23 @@ const std::string &VM_exec_status::get_message() const
     return msg;
 }
 
-VM::VM()
-    : program_size(0u), valid_program(true)
+VM::VM(bool fold_constants)
+    : program_size(0u), valid_program(true), argument_count(0u), fold_constants(fold_constants), constant_count(0),
+      image_code(nullptr)
 {
 }
 
 void VM::push(int val)
 {
+    const unsigned int at = program_size;
     if (maybe_add_op(PUSH))
     {
         if ((program_size + sizeof(int)) <= MAX_PROGRAM_SIZE)
         {
             memcpy((void *)&program[program_size], (void *)&val, sizeof(int));
             program_size += sizeof(int);
+            evaluated.step(PUSH, val);
+            constants[constant_count++] = at;
         }
         else
         {
@@ -50,34 +55,66 @@ void VM::push(int val)
     };
 }
 
+void VM::pusharg(unsigned int index)
+{
+    if (index >= MAX_ARGUMENTS)
+    {
+        valid_program = false;
+        return;
+    }
+
+    if (maybe_add_op(PUSHARG))
+    {
+        if (program_size < MAX_PROGRAM_SIZE)
+        {
+            program[program_size++] = (OPCODE)index;
+            argument_count = index >= argument_count ? index + 1 : argument_count;
+            evaluated.step(PUSHARG, 0);
+            constant_count = 0;
+        }
+        else
+        {
+            program_too_big();
+        }
+    }
+}
+
 void VM::pop()
 {
-    maybe_add_op(POP);
+    if (maybe_add_op(POP))
+    {
+        evaluated.step(POP, 0);
+        constant_count = 0;
+    }
 }
 
 void VM::dup()
 {
-    maybe_add_op(DUP);
+    if (maybe_add_op(DUP))
+    {
+        evaluated.step(DUP, 0);
+        constant_count = 0;
+    }
 }
 
 void VM::add()
 {
-    maybe_add_op(ADD);
+    arithmetic(ADD);
 }
 
 void VM::sub()
 {
-    maybe_add_op(SUB);
+    arithmetic(SUB);
 }
 
 void VM::mul()
 {
-    maybe_add_op(MUL);
+    arithmetic(MUL);
 }
 
 void VM::div()
 {
-    maybe_add_op(DIV);
+    arithmetic(DIV);
 }
 
 VM_exec_status VM::exec() const
@@ -87,24 +124,61 @@ VM_exec_status VM::exec() const
         return VM_exec_status("Cannot execute invalid program");
     }
 
-    int stack[1024];
+    return evaluated.result();
+}
+
+unsigned int VM::arguments() const
+{
+    return argument_count;
+}
+
+VM_exec_status VM::exec(int const *args, unsigned int count) const
+{
+    if (0 == argument_count)
+    {
+        return exec();
+    }
+
+    return interpret(args, count);
+}
+
+VM_exec_status VM::interpret(int const *args, unsigned int count) const
+{
+    if (!valid_program)
+    {
+        return VM_exec_status("Cannot execute invalid program");
+    }
+
+    OPCODE const *instructions = code();
+    int stack[MAX_PROGRAM_SIZE];
     unsigned int sp = 0;
     unsigned int pc = 0;
 
     while (pc < program_size)
     {
-        OPCODE op = program[pc++];
+        OPCODE op = instructions[pc++];
         switch (op)
         {
         case PUSH:
         {
             int val;
-            memcpy((void *)&val, (void *)&program[pc], sizeof(int));
+            memcpy((void *)&val, (void *)&instructions[pc], sizeof(int));
             pc += sizeof(int);
             stack[sp++] = val;
         }
         break;
 
+        case PUSHARG:
+        {
+            const unsigned int index = instructions[pc++];
+            if (index >= count)
+            {
+                return VM_exec_status("Missing argument for PUSHARG");
+            }
+            stack[sp++] = args[index];
+        }
+        break;
+
         case POP:
         {
             if (0 == sp)
@@ -133,7 +207,7 @@ VM_exec_status VM::exec() const
                 return VM_exec_status("Too few items on stack to ADD");
             }
 
-            stack[sp - 2] = stack[sp - 2] + stack[sp - 1];
+            stack[sp - 2] = apply(ADD, stack[sp - 2], stack[sp - 1]);
             --sp;
         }
         break;
@@ -145,7 +219,7 @@ VM_exec_status VM::exec() const
                 return VM_exec_status("Too few items on stack to SUB");
             }
 
-            stack[sp - 2] = stack[sp - 2] - stack[sp - 1];
+            stack[sp - 2] = apply(SUB, stack[sp - 2], stack[sp - 1]);
             --sp;
         }
         break;
@@ -157,7 +231,7 @@ VM_exec_status VM::exec() const
                 return VM_exec_status("Too few items on stack to MUL");
             }
 
-            stack[sp - 2] = stack[sp - 2] * stack[sp - 1];
+            stack[sp - 2] = apply(MUL, stack[sp - 2], stack[sp - 1]);
             --sp;
         }
         break;
@@ -173,7 +247,7 @@ VM_exec_status VM::exec() const
                 return VM_exec_status("Division by zero not allowed");
             }
 
-            stack[sp - 2] = stack[sp - 2] / stack[sp - 1];
+            stack[sp - 2] = apply(DIV, stack[sp - 2], stack[sp - 1]);
             --sp;
         }
         break;
@@ -191,8 +265,336 @@ VM_exec_status VM::exec() const
     return VM_exec_status(int(stack[sp - 1]));
 }
 
+size_t VM::exec_batch(int const *args, size_t rows, int *values, bool *failed, VM_batch_isa isa) const
+{
+    // the stack is as deep for every row, so only DIV can fail some rows
+    // and not others; anything else fails them all
+    vector<VM_batch::step> steps;
+    bool runs = valid_program;
+    size_t depth = 0;
+    OPCODE const *instructions = code();
+    for (unsigned int pc = 0; runs && pc < program_size; ++pc)
+    {
+        VM_batch::step s = {VM_batch::opcode(instructions[pc] - PUSH), 0};
+        if (PUSH == instructions[pc])
+        {
+            memcpy((void *)&s.operand, (void *)&instructions[pc + 1], sizeof(int));
+            pc += sizeof(int);
+        }
+        else if (PUSHARG == instructions[pc])
+        {
+            s.operand = instructions[++pc];
+        }
+
+        switch (s.op)
+        {
+        case VM_batch::opcode::PUSH:
+        case VM_batch::opcode::PUSHARG:
+            ++depth;
+            break;
+
+        case VM_batch::opcode::POP:
+            runs = depth > 0;
+            --depth;
+            break;
+
+        case VM_batch::opcode::DUP:
+            runs = depth > 0;
+            ++depth;
+            break;
+
+        default:
+            runs = depth >= 2;
+            --depth;
+            break;
+        }
+        steps.push_back(s);
+    }
+
+    if (!runs || 0 == depth)
+    {
+        for (size_t r = 0; r < rows; ++r)
+        {
+            values[r] = -1;
+            if (nullptr != failed)
+            {
+                failed[r] = true;
+            }
+        }
+        return rows;
+    }
+
+    VM_batch batch(move(steps), argument_count, isa);
+    return batch.exec(args, rows, values, failed);
+}
+
+void VM::state::step(OPCODE op, int val)
+{
+    if (nullptr != failure)
+    {
+        return;
+    }
+
+    switch (op)
+    {
+    case PUSH:
+        stack[depth++] = val;
+        break;
+
+    case PUSHARG:
+        // built without arguments, as exec runs it
+        failure = "Missing argument for PUSHARG";
+        break;
+
+    case POP:
+        if (0 == depth)
+        {
+            failure = "Cannot POP empty stack";
+            break;
+        }
+        --depth;
+        break;
+
+    case DUP:
+        if (0 == depth)
+        {
+            failure = "Cannot DUP empty stack";
+            break;
+        }
+        stack[depth] = stack[depth - 1];
+        ++depth;
+        break;
+
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+        if (depth < 2)
+        {
+            const char *const too_few[] = {"Too few items on stack to ADD", "Too few items on stack to SUB",
+                                           "Too few items on stack to MUL", "Too few items on stack to DIV"};
+            failure = too_few[op - ADD];
+            break;
+        }
+        if (DIV == op && 0 == stack[depth - 1])
+        {
+            failure = "Division by zero not allowed";
+            break;
+        }
+
+        stack[depth - 2] = apply(op, stack[depth - 2], stack[depth - 1]);
+        --depth;
+        break;
+
+    default:
+        failure = "Internal Error: Invalid OPCODE detected";
+        break;
+    }
+}
+
+VM_exec_status VM::state::result() const
+{
+    if (nullptr != failure)
+    {
+        return VM_exec_status(failure);
+    }
+    if (0 == depth)
+    {
+        return VM_exec_status("Program produced no value");
+    }
+
+    return VM_exec_status(stack[depth - 1]);
+}
+
+int VM::apply(OPCODE op, int y, int x)
+{
+    const unsigned int a = (unsigned int)y;
+    const unsigned int b = (unsigned int)x;
+    switch (op)
+    {
+    case ADD:
+        return (int)(a + b);
+
+    case SUB:
+        return (int)(a - b);
+
+    case MUL:
+        return (int)(a * b);
+
+    default:
+        // the one quotient that does not fit wraps like the rest
+        return -1 == x ? (int)(0u - a) : y / x;
+    }
+}
+
+void VM::disassemble(std::ostream &out) const
+{
+    if (!valid_program)
+    {
+        return;
+    }
+
+    OPCODE const *instructions = code();
+    unsigned int pc = 0;
+    while (pc < program_size)
+    {
+        switch (instructions[pc++])
+        {
+        case PUSH:
+        {
+            int val;
+            memcpy((void *)&val, (void *)&instructions[pc], sizeof(int));
+            pc += sizeof(int);
+            out << "PUSH " << val << "\n";
+        }
+        break;
+
+        case PUSHARG:
+            out << "PUSHARG " << (unsigned int)instructions[pc++] << "\n";
+            break;
+
+        case POP:
+            out << "POP\n";
+            break;
+
+        case DUP:
+            out << "DUP\n";
+            break;
+
+        case ADD:
+            out << "ADD\n";
+            break;
+
+        case SUB:
+            out << "SUB\n";
+            break;
+
+        case MUL:
+            out << "MUL\n";
+            break;
+
+        case DIV:
+            out << "DIV\n";
+            break;
+        }
+    }
+}
+
+bool VM::save(const std::string &path) const
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    VM_image_writer writer(VM_image_machine::WHITEDOG);
+    writer.add(VM_image_section::CODE, code(), program_size);
+    return writer.write(path);
+}
+
+bool VM::load(const std::string &path)
+{
+    shared_ptr<VM_image> loaded(new VM_image);
+    if (!loaded->open(path, VM_image_machine::WHITEDOG))
+    {
+        return false;
+    }
+
+    size_t size;
+    OPCODE const *loaded_code = static_cast<OPCODE const *>(loaded->section(VM_image_section::CODE, size));
+    if (nullptr == loaded_code || size > MAX_PROGRAM_SIZE)
+    {
+        return false;
+    }
+
+    // only what the builder could have produced: exec trusts operands
+    for (size_t pc = 0; pc < size; ++pc)
+    {
+        if (loaded_code[pc] < PUSH || loaded_code[pc] > PUSHARG)
+        {
+            return false;
+        }
+        const size_t operand = PUSH == loaded_code[pc] ? sizeof(int) : PUSHARG == loaded_code[pc] ? 1 : 0;
+        if (size - pc - 1 < operand)
+        {
+            return false;
+        }
+        pc += operand;
+    }
+
+    image = loaded;
+    image_code = loaded_code;
+    program_size = (unsigned int)size;
+    valid_program = true;
+    // work out the result as the builder calls would have
+    evaluated.depth = 0;
+    evaluated.failure = nullptr;
+    argument_count = 0;
+    for (unsigned int pc = 0; pc < program_size; ++pc)
+    {
+        const OPCODE op = image_code[pc];
+        int val = 0;
+        if (PUSH == op)
+        {
+            memcpy((void *)&val, (void *)&image_code[pc + 1], sizeof(int));
+            pc += sizeof(int);
+        }
+        else if (PUSHARG == op)
+        {
+            const unsigned int index = image_code[++pc];
+            argument_count = index >= argument_count ? index + 1 : argument_count;
+        }
+        evaluated.step(op, val);
+    }
+    constant_count = 0;
+    return true;
+}
+
+VM::OPCODE const *VM::code() const
+{
+    return image ? image_code : program;
+}
+
+void VM::detach()
+{
+    // copy a loaded program out of its image before changing it
+    if (image)
+    {
+        memcpy(program, image_code, program_size);
+        image.reset();
+        image_code = nullptr;
+    }
+}
+
+void VM::arithmetic(OPCODE op)
+{
+    // both operands pushed just before: one PUSH of the result instead
+    if (fold_constants && valid_program && constant_count >= 2)
+    {
+        int y, x;
+        memcpy((void *)&y, (void *)&program[constants[constant_count - 2] + 1], sizeof(int));
+        memcpy((void *)&x, (void *)&program[constants[constant_count - 1] + 1], sizeof(int));
+        if (DIV != op || 0 != x)
+        {
+            const int val = apply(op, y, x);
+            program_size = constants[--constant_count - 1] + 1;
+            memcpy((void *)&program[program_size], (void *)&val, sizeof(int));
+            program_size += sizeof(int);
+            evaluated.step(op, 0);
+            return;
+        }
+    }
+
+    if (maybe_add_op(op))
+    {
+        evaluated.step(op, 0);
+        constant_count = 0;
+    }
+}
+
 bool VM::maybe_add_op(OPCODE op)
 {
+    detach();
     if (valid_program)
     {
         if (program_size < MAX_PROGRAM_SIZE)
@@ -1,5 +1,13 @@
+#include <climits>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <vector>
 
+#include "../include/VM_assembler.hpp"
 #include "../include/vm.hpp"
 
 using namespace std;
@@ -228,6 +236,406 @@ bool too_long()
     return EXPECT_ERROR(vm, "Too Long");
 }
 
+// 2 * 2 - 5
+void image_program(VM &vm)
+{
+    vm.push(2);
+    vm.dup();
+    vm.mul();
+    vm.push(5);
+    vm.sub();
+}
+
+bool image_round_trip()
+{
+    const char *path = "whitedog_image.k9i";
+    VM saved;
+    image_program(saved);
+    VM loaded;
+    bool ok = saved.save(path) && loaded.load(path);
+    remove(path);
+    if (!ok)
+    {
+        cerr << "[FAIL] Image Round Trip, could not save and load\n";
+        return false;
+    }
+
+    return EXPECT_VALUE(loaded, "Image Round Trip", -1);
+}
+
+bool image_extended()
+{
+    const char *path = "whitedog_image.k9i";
+    VM saved;
+    image_program(saved);
+    VM loaded;
+    bool ok = saved.save(path) && loaded.load(path);
+    remove(path);
+    if (!ok)
+    {
+        cerr << "[FAIL] Image Extended, could not save and load\n";
+        return false;
+    }
+
+    loaded.push(4);
+    loaded.add();
+    return EXPECT_VALUE(loaded, "Image Extended", 3);
+}
+
+bool image_corrupt()
+{
+    const char *path = "whitedog_image.k9i";
+    VM saved;
+    image_program(saved);
+    saved.save(path);
+
+    vector<char> bytes;
+    {
+        ifstream in(path, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    bytes.back() ^= 1;
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(bytes.data(), bytes.size());
+    }
+
+    // a failed load leaves the program alone
+    VM vm;
+    vm.push(7);
+    bool ok = !vm.load(path) && !vm.load("no_such_image.k9i");
+    remove(path);
+    if (!ok)
+    {
+        cerr << "[FAIL] Image Corrupt, loaded a damaged image\n";
+        return false;
+    }
+
+    return EXPECT_VALUE(vm, "Image Corrupt", 7);
+}
+
+bool assemble()
+{
+    VM vm;
+    VM_assembler assembler;
+    istringstream in("; 2 * 2 - 5\n  push 2\n  DUP\n  Mul  # square it\n  PUSH 0x5\n  SUB\n");
+    if (!assembler.assemble(in, vm))
+    {
+        cerr << "[FAIL] Assemble, " << assembler.error() << "\n";
+        return false;
+    }
+
+    // and back again
+    ostringstream source;
+    vm.disassemble(source);
+    if (source.str() != "PUSH 2\nDUP\nMUL\nPUSH 5\nSUB\n")
+    {
+        cerr << "[FAIL] Assemble, disassembled as\n" << source.str();
+        return false;
+    }
+    return EXPECT_VALUE(vm, "Assemble", -1);
+}
+
+bool assemble_errors()
+{
+    const char *sources[] = {"PUSH 1\nSWAP\n", "PUSH", "PUSH 1 2", "DUP 1", "PUSH 4294967296", "7", "PUSHARG 256"};
+    const char *errors[] = {
+        "line 2: unknown instruction at 'SWAP'",
+        "line 1: expected a number at the end of the line",
+        "line 1: expected the end of the line at '2'",
+        "line 1: expected the end of the line at '1'",
+        "line 1: number out of range at '4294967296'",
+        "line 1: expected an instruction at '7'",
+        "line 1: argument out of range at '256'",
+    };
+
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); ++i)
+    {
+        VM vm;
+        VM_assembler assembler;
+        if (assembler.assemble(sources[i], vm) || assembler.error() != errors[i])
+        {
+            cerr << "[FAIL] Assemble Errors, got \"" << assembler.error() << "\" for \"" << sources[i] << "\"\n";
+            return false;
+        }
+    }
+
+    cerr << "[PASS] Assemble Errors\n";
+    return true;
+}
+
+bool same(VM_exec_status const &a, VM_exec_status const &b)
+{
+    return a.is_status_ok() == b.is_status_ok() && a.get_program_value() == b.get_program_value() &&
+           a.get_message() == b.get_message();
+}
+
+string disassembled(VM const &vm)
+{
+    ostringstream source;
+    vm.disassemble(source);
+    return source.str();
+}
+
+bool fold_constants()
+{
+    VM vm(true);
+    vm.push(2);
+    vm.push(3);
+    vm.add();
+    vm.push(4);
+    vm.mul();
+    bool ok = disassembled(vm) == "PUSH 20\n";
+
+    // a DUP is not a constant, so the ADD after it stays
+    vm.dup();
+    vm.push(1);
+    vm.add();
+    ok = ok && disassembled(vm) == "PUSH 20\nDUP\nPUSH 1\nADD\n";
+    if (!ok)
+    {
+        cerr << "[FAIL] Fold Constants, folded to\n" << disassembled(vm);
+        return false;
+    }
+
+    return EXPECT_VALUE(vm, "Fold Constants", 21);
+}
+
+bool fold_division_by_zero()
+{
+    VM vm(true);
+    vm.push(1);
+    vm.push(0);
+    vm.div();
+    if (disassembled(vm) != "PUSH 1\nPUSH 0\nDIV\n" || vm.exec().get_message() != "Division by zero not allowed")
+    {
+        cerr << "[FAIL] Fold Division by Zero\n";
+        return false;
+    }
+
+    cerr << "[PASS] Fold Division by Zero\n";
+    return true;
+}
+
+// Folded, a running sum fits in one PUSH where it would not fit at all
+bool fold_fits()
+{
+    VM folding(true);
+    VM plain;
+    folding.push(0);
+    plain.push(0);
+    for (int i = 1; i <= 300; ++i)
+    {
+        folding.push(i);
+        folding.add();
+        plain.push(i);
+        plain.add();
+    }
+
+    return EXPECT_ERROR(plain, "Fold Fits, unfolded") && EXPECT_VALUE(folding, "Fold Fits", 300 * 301 / 2);
+}
+
+// Overflow wraps, INT_MIN / -1 included, whether folded, worked out as
+// built or interpreted.
+bool wrap_around()
+{
+    bool ok = true;
+    for (bool fold : {false, true})
+    {
+        VM vm(fold);
+        vm.push(INT_MIN);
+        vm.push(-1);
+        vm.div();
+        vm.push(INT_MAX);
+        vm.add();
+        ok = ok && -1 == vm.exec().get_program_value() && -1 == vm.interpret().get_program_value();
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Wrap Around\n";
+    return ok;
+}
+
+// Random programs, errors and all: exec gives what interpreting gives,
+// and folding changes nothing but the bytecode.
+bool exec_matches_interpret()
+{
+    mt19937 random(1234);
+    const int values[] = {0, 1, -1, 2, 7, -13, INT_MAX, INT_MIN};
+    for (int i = 0; i < 2000; ++i)
+    {
+        VM plain;
+        VM folding(true);
+        const int length = random() % 40;
+        for (int j = 0; j < length; ++j)
+        {
+            const unsigned int choice = random() % 10;
+            for (VM *vm : {&plain, &folding})
+            {
+                switch (choice)
+                {
+                case 0: vm->pop(); break;
+                case 1: vm->dup(); break;
+                case 2: vm->add(); break;
+                case 3: vm->sub(); break;
+                case 4: vm->mul(); break;
+                case 5: vm->div(); break;
+                default: vm->push(values[(i + j) % 8]); break;
+                }
+            }
+        }
+
+        if (!same(plain.exec(), plain.interpret()) || !same(folding.exec(), folding.interpret()) ||
+            !same(plain.exec(), folding.exec()) || disassembled(folding).size() > disassembled(plain).size())
+        {
+            cerr << "[FAIL] Exec Matches Interpret, program\n" << disassembled(plain);
+            return false;
+        }
+    }
+
+    cerr << "[PASS] Exec Matches Interpret\n";
+    return true;
+}
+
+// (price * quantity - discount) / units, as the pricing rows are written
+void formula(VM &vm)
+{
+    vm.pusharg(0);
+    vm.pusharg(1);
+    vm.mul();
+    vm.pusharg(2);
+    vm.sub();
+    vm.pusharg(3);
+    vm.div();
+}
+
+bool pusharg()
+{
+    VM vm;
+    formula(vm);
+    const int args[] = {30, 7, 10, 4};
+    VM_exec_status status = vm.exec(args, 4);
+    bool ok = 4 == vm.arguments() && status.is_status_ok() && 50 == status.get_program_value() &&
+              same(status, vm.interpret(args, 4));
+
+    // built without arguments, exec runs without them
+    ok = ok && vm.exec().get_message() == "Missing argument for PUSHARG" &&
+         vm.exec(args, 3).get_message() == "Missing argument for PUSHARG" &&
+         vm.interpret().get_message() == "Missing argument for PUSHARG";
+
+    VM too_far;
+    too_far.pusharg(VM::MAX_ARGUMENTS);
+    ok = ok && too_far.exec(args, 4).get_message() == "Cannot execute invalid program";
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "PUSHARG\n";
+    return ok;
+}
+
+bool pusharg_image()
+{
+    const char *path = "whitedog_image.k9i";
+    VM saved;
+    VM_assembler assembler;
+    VM loaded;
+    bool ok = assembler.assemble("PUSHARG 0\nPUSHARG 200\nSUB\n", saved) && saved.save(path) && loaded.load(path);
+    remove(path);
+
+    const vector<int> args(201, 5);
+    ok = ok && 201 == loaded.arguments() && disassembled(loaded) == "PUSHARG 0\nPUSHARG 200\nSUB\n" &&
+         0 == loaded.exec(args.data(), 201).get_program_value();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "PUSHARG Image\n";
+    return ok;
+}
+
+const VM_batch_isa isas[] = {VM_batch_isa::NONE, VM_batch_isa::SSE2, VM_batch_isa::AVX2, VM_batch_isa::AVX512};
+
+// Random programs over random rows, some of which divide by zero or wrap:
+// every form of exec_batch gives each row what exec does.  Forms the host
+// lacks fall back to narrower ones.
+bool batch_matches_exec()
+{
+    mt19937 random(4321);
+    const int values[] = {0, 1, -1, 2, 7, -13, INT_MAX, INT_MIN};
+    const size_t rows = 2 * VM_batch::BATCH_ROWS + 3;
+    for (int i = 0; i < 300; ++i)
+    {
+        VM vm;
+        const int length = 1 + random() % 30;
+        for (int j = 0; j < length; ++j)
+        {
+            switch (random() % 9)
+            {
+            case 0: vm.dup(); break;
+            case 1: vm.add(); break;
+            case 2: vm.sub(); break;
+            case 3: vm.mul(); break;
+            case 4: vm.div(); break;
+            case 5: vm.push(values[random() % 8]); break;
+            default: vm.pusharg(random() % 3); break;
+            }
+        }
+
+        const unsigned int width = vm.arguments();
+        vector<int> args(rows * width);
+        for (int &arg : args)
+        {
+            arg = values[random() % 8];
+        }
+
+        for (VM_batch_isa isa : isas)
+        {
+            vector<int> results(rows);
+            bool failed[rows];
+            size_t failures = vm.exec_batch(args.data(), rows, results.data(), failed, isa);
+            for (size_t r = 0; r < rows; ++r)
+            {
+                VM_exec_status status = vm.exec(args.data() + r * width, width);
+                failures -= failed[r];
+                if (status.is_status_ok() == failed[r] || status.get_program_value() != results[r])
+                {
+                    cerr << "[FAIL] Batch Matches Exec, row " << r << " in " << VM_batch::lanes(isa)
+                         << " lanes, program\n" << disassembled(vm);
+                    return false;
+                }
+            }
+            if (0 != failures)
+            {
+                cerr << "[FAIL] Batch Matches Exec, miscounted failures\n";
+                return false;
+            }
+        }
+    }
+
+    cerr << "[PASS] Batch Matches Exec\n";
+    return true;
+}
+
+bool batch_formula()
+{
+    VM vm;
+    formula(vm);
+    vector<int> args;
+    vector<int> expected;
+    for (int r = 0; r < 1000; ++r)
+    {
+        const int units = r % 7 - 1;
+        args.insert(args.end(), {r, r % 13, r / 3, units});
+        expected.push_back(0 == units ? -1 : (r * (r % 13) - r / 3) / units);
+    }
+
+    vector<int> results(1000);
+    bool ok = vm.exec_batch(args.data(), 1000, results.data()) == 1000 / 7 + 1 && results == expected;
+
+    // fails whatever the arguments: every row goes
+    VM short_stack;
+    short_stack.pusharg(0);
+    short_stack.add();
+    ok = ok && 1000 == short_stack.exec_batch(args.data(), 1000, results.data()) && -1 == results[999];
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Batch Formula\n";
+    return ok;
+}
+
 } // namespace
 
 int main(void)
@@ -252,6 +660,20 @@ int main(void)
     runner(div);
     runner(longer_prog);
     runner(too_long);
+    runner(image_round_trip);
+    runner(image_extended);
+    runner(image_corrupt);
+    runner(assemble);
+    runner(assemble_errors);
+    runner(fold_constants);
+    runner(fold_division_by_zero);
+    runner(fold_fits);
+    runner(wrap_around);
+    runner(exec_matches_interpret);
+    runner(pusharg);
+    runner(pusharg_image);
+    runner(batch_matches_exec);
+    runner(batch_formula);
 
     return runner.report();
 }
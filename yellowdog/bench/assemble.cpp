@@ -0,0 +1,61 @@
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <sstream>
+#include <string>
+
+#include "vm.hpp"
+#include "VM_assembler.hpp"
+#include "programs.hpp"
+
+using namespace std;
+
+// Assembling a program from source against building it with the builder
+// calls the source stands for.
+void assemble(char const *name, function<void(VM &)> build, unsigned int iterations)
+{
+    VM original;
+    build(original);
+    ostringstream text;
+    original.disassemble(text);
+    const string source = text.str();
+
+    unsigned int lines = 0;
+    for (char c : source)
+    {
+        lines += '\n' == c;
+    }
+
+    VM_assembler assembler;
+    auto start = chrono::steady_clock::now();
+    for (unsigned int n = 0; n < iterations; ++n)
+    {
+        VM vm;
+        if (!assembler.assemble(source, vm))
+        {
+            printf("%s: %s\n", name, assembler.error().c_str());
+            return;
+        }
+    }
+    auto middle = chrono::steady_clock::now();
+    for (unsigned int n = 0; n < iterations; ++n)
+    {
+        VM vm;
+        build(vm);
+    }
+    auto stop = chrono::steady_clock::now();
+
+    double assembled = chrono::duration<double, nano>(middle - start).count() / iterations;
+    double built = chrono::duration<double, nano>(stop - middle).count() / iterations;
+    printf("%-12s %10.1f ns/line %8.1f MB/s %10.1f ns/build\n",
+           name, assembled / lines, source.size() / assembled * 1000, built);
+}
+
+int main(void)
+{
+    assemble("factorial", [](VM &vm) { factorial_program(vm, 10); }, 100000);
+    assemble("fibonacci", [](VM &vm) { fibonacci_program(vm, 10); }, 100000);
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <functional>
+#include <string>
+
+#include "VM_bench.hpp"
+#include "programs.hpp"
+
+using namespace std;
+
+// Enough repetitions of an opcode, with whatever keeps the stack level
+// around it, that the cost of starting exec disappears.
+constexpr int REPEATS = 64;
+
+void opcode(VM_bench &bench, const char *name, function<void(VM &)> prelude, function<void(VM &, int)> step)
+{
+    VM vm;
+    prelude(vm);
+    for (int i = 0; i < REPEATS; ++i)
+    {
+        step(vm, i);
+    }
+
+    bench.run(string("op/") + name, [&vm]() { return vm.exec().get_ticks(); });
+}
+
+void opcodes(VM_bench &bench)
+{
+    auto one = [](VM &vm) { vm.push(1); };
+    auto two = [](VM &vm) { vm.push(1); vm.push(2); };
+
+    opcode(bench, "PUSH", one, [](VM &vm, int) { vm.push(1); vm.pop(); });
+    opcode(bench, "DUP", one, [](VM &vm, int) { vm.dup(); vm.pop(); });
+    opcode(bench, "DUPN", two, [](VM &vm, int) { vm.dupn(2); vm.pop(); });
+    opcode(bench, "DROPN", two, [](VM &vm, int) { vm.push(3); vm.dropn(2); });
+    opcode(bench, "SWAP", two, [](VM &vm, int) { vm.swap(); });
+    opcode(bench, "ADD", one, [](VM &vm, int) { vm.push(1); vm.add(); });
+    opcode(bench, "SUB", one, [](VM &vm, int) { vm.push(1); vm.sub(); });
+    opcode(bench, "MUL", one, [](VM &vm, int) { vm.push(1); vm.mul(); });
+    opcode(bench, "DIV", one, [](VM &vm, int) { vm.push(1); vm.div(); });
+    opcode(bench, "CMP", one, [](VM &vm, int) { vm.push(1); vm.cmp(); });
+
+    // every jump lands on the next instruction
+    opcode(bench, "JMP", one, [](VM &vm, int i) {
+        vm.jmp("L" + to_string(i));
+        vm.label("L" + to_string(i));
+    });
+    opcode(bench, "JEQ", one, [](VM &vm, int i) {
+        vm.push(0);
+        vm.jeq("L" + to_string(i));
+        vm.label("L" + to_string(i));
+    });
+}
+
+void kernel(VM_bench &bench, const char *name, function<void(VM &)> build)
+{
+    VM vm;
+    build(vm);
+
+    const string prefix = string("kernel/") + name + "/";
+    bench.run(prefix + "switch", [&vm]() { return vm.exec().get_ticks(); });
+    VM_executor executor;
+    vm.bind(executor);
+    bench.run(prefix + "bound", [&executor]() { return executor.exec(false).get_ticks(); });
+    VM_profile profile;
+    bench.run(prefix + "profiled", [&vm, &profile]() { return vm.exec_profiled(profile).get_ticks(); });
+    VM_trace trace;
+    bench.run(prefix + "traced", [&vm, &trace]() { return vm.exec_traced(trace).get_ticks(); });
+    bench.run(prefix + "threaded", [&vm]() { return vm.exec_threaded().get_ticks(); });
+}
+
+// Programs after VM::optimize, on the switch engine, next to the same
+// cases above: the redundant opcode programs, which mostly disappear, and
+// the kernels.  Ticks count what is left to run.
+void optimized(VM_bench &bench, const char *name, function<void(VM &)> build)
+{
+    VM vm;
+    build(vm);
+    vm.optimize();
+    bench.run(string("optimized/") + name, [&vm]() { return vm.exec().get_ticks(); });
+}
+
+void optimizations(VM_bench &bench)
+{
+    optimized(bench, "PUSH", [](VM &vm) {
+        vm.push(1);
+        for (int i = 0; i < REPEATS; ++i)
+        {
+            vm.push(1);
+            vm.pop();
+        }
+    });
+    optimized(bench, "ADD", [](VM &vm) {
+        vm.push(1);
+        for (int i = 0; i < REPEATS; ++i)
+        {
+            vm.push(1);
+            vm.add();
+        }
+    });
+    optimized(bench, "JMP", [](VM &vm) {
+        vm.push(1);
+        for (int i = 0; i < REPEATS; ++i)
+        {
+            vm.jmp("L" + to_string(i));
+            vm.label("L" + to_string(i));
+        }
+    });
+    optimized(bench, "factorial", [](VM &vm) { factorial_program(vm, 12); });
+    optimized(bench, "fibonacci", [](VM &vm) { fibonacci_program(vm, 40); });
+    optimized(bench, "nested_loops", [](VM &vm) { nested_loops_program(vm, 30, 30); });
+}
+
+// Programs built into a fresh machine; instructions per second counts
+// the instructions built.
+void builds(VM_bench &bench)
+{
+    bench.run("build/arithmetic", []() {
+        VM vm;
+        vm.push(0);
+        for (int i = 0; i < REPEATS; ++i)
+        {
+            vm.push(i);
+            vm.add();
+        }
+        return 1 + 2 * REPEATS;
+    });
+
+    // each label defined after the jump to it, so that it is patched
+    bench.run("build/labels", []() {
+        VM vm;
+        vm.push(0);
+        for (int i = 0; i < REPEATS; ++i)
+        {
+            vm.jmp("L" + to_string(i));
+            vm.label("L" + to_string(i));
+        }
+        return 1 + REPEATS;
+    });
+}
+
+// What exec costs around a one instruction program.
+void setup(VM_bench &bench)
+{
+    VM vm;
+    vm.push(1);
+    bench.run("setup/exec", [&vm]() { return vm.exec().get_ticks(); });
+    bench.run("setup/threaded", [&vm]() { return vm.exec_threaded().get_ticks(); });
+    VM_executor executor;
+    vm.bind(executor);
+    bench.run("setup/bound", [&executor]() { return executor.exec(false).get_ticks(); });
+}
+
+int main(int argc, char **argv)
+{
+    VM_bench bench("yellowdog", argc, argv);
+
+    opcodes(bench);
+    kernel(bench, "factorial", [](VM &vm) { factorial_program(vm, 12); });
+    kernel(bench, "fibonacci", [](VM &vm) { fibonacci_program(vm, 40); });
+    kernel(bench, "summation", [](VM &vm) { summation_program(vm, 1000); });
+    kernel(bench, "nested_loops", [](VM &vm) { nested_loops_program(vm, 30, 30); });
+    optimizations(bench);
+    builds(bench);
+    setup(bench);
+
+    return bench.finish();
+}
@@ -0,0 +1,56 @@
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "vm.hpp"
+
+using namespace std;
+
+// Build time of programs with many labels.  Labels take no space in the
+// program, so a few hundred jumps are spread over thousands of labels,
+// half of them to labels that are only defined later.
+void build(unsigned int count, unsigned int iterations)
+{
+    vector<string> names;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        names.push_back("label_" + to_string(i));
+    }
+
+    const unsigned int every = count / 150;
+    auto start = chrono::steady_clock::now();
+    for (unsigned int n = 0; n < iterations; ++n)
+    {
+        VM vm;
+        vm.push(0);
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            if (0 == i % every)
+            {
+                vm.jmp(names[(i + (i / every % 2) * count / 2) % count]);
+            }
+            vm.label(names[i]);
+        }
+        if (!vm.verify())
+        {
+            printf("labels %u: program does not verify\n", count);
+            return;
+        }
+    }
+    auto stop = chrono::steady_clock::now();
+
+    double ns = chrono::duration<double, nano>(stop - start).count();
+    printf("%-12s %-10u %10.1f us/build %8.2f ns/label\n",
+           "labels", count, ns / iterations / 1000, ns / iterations / count);
+}
+
+int main(void)
+{
+    build(1000, 2000);
+    build(10000, 200);
+    build(100000, 20);
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+#if !defined(PROGRAMS_HPP)
+#define PROGRAMS_HPP 1
+
+#include "vm.hpp"
+
+// Loop kernels taken from the test suite, scaled up so the runs are long
+// enough to time.
+
+inline void factorial_program(VM &vm, int arg)
+{
+    vm.push(arg);
+    vm.dup();
+    vm.jlt("ERROR_CASE");
+
+    vm.push(1);
+
+    vm.label("LOOP");
+    vm.dupn(2);
+    vm.jle("LOOP_EXIT");
+
+    vm.dupn(2);
+    vm.mul();
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("LOOP");
+
+    vm.label("LOOP_EXIT");
+    vm.swap();
+    vm.pop();
+    vm.jmp("EXIT");
+
+    vm.label("ERROR_CASE");
+    vm.push(-1);
+    vm.jmp("EXIT");
+
+    vm.label("EXIT");
+}
+
+inline void fibonacci_program(VM &vm, int arg)
+{
+    vm.push(arg);
+
+    vm.dup();
+    vm.push(0);
+    vm.cmp();
+    vm.jle("ERROR");
+
+    vm.push(1);
+    vm.push(1);
+    vm.jmp("LOOP_TEST");
+
+    vm.label("TOP_OF_LOOP");
+    vm.dupn(3);
+    vm.dupn(3);
+    vm.dupn(2);
+    vm.add();
+    vm.swap();
+    vm.dropn(5);
+    vm.dropn(4);
+
+    vm.label("LOOP_TEST");
+    vm.dupn(3);
+    vm.push(1);
+    vm.sub();
+    vm.dup();
+    vm.jeq("DONE");
+    vm.dropn(4);
+    vm.jmp("TOP_OF_LOOP");
+
+    vm.label("ERROR");
+    vm.push(-1);
+    vm.jmp("EXIT");
+
+    vm.label("DONE");
+    vm.pop();
+
+    vm.label("EXIT");
+}
+
+// 1 + 2 + ... + arg
+inline void summation_program(VM &vm, int arg)
+{
+    vm.push(arg);
+    vm.push(0);
+
+    vm.label("LOOP");
+    vm.dupn(2);
+    vm.jle("DONE");
+
+    vm.dupn(2);
+    vm.add();
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("LOOP");
+
+    vm.label("DONE");
+    vm.swap();
+    vm.pop();
+}
+
+// counts outer * inner trips through the inner loop, keeping the count on
+// top of the stack and the loop counters under it
+inline void nested_loops_program(VM &vm, int outer, int inner)
+{
+    vm.push(outer);
+    vm.push(0);
+
+    vm.label("OUTER");
+    vm.dupn(2);
+    vm.jle("DONE");
+    vm.push(inner);
+    vm.swap();
+
+    vm.label("INNER");
+    vm.dupn(2);
+    vm.jle("INNER_DONE");
+    vm.push(1);
+    vm.add();
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("INNER");
+
+    vm.label("INNER_DONE");
+    vm.dropn(2);
+    vm.swap();
+    vm.push(1);
+    vm.sub();
+    vm.swap();
+    vm.jmp("OUTER");
+
+    vm.label("DONE");
+}
+
+#endif
@@ -0,0 +1,47 @@
+#if !defined(VM_ASSEMBLER_HPP)
+#define VM_ASSEMBLER_HPP 1
+
+#include <istream>
+#include <string>
+#include <string_view>
+
+#include "VM_lexer.hpp"
+
+class VM;
+
+// Assembly source, one label or instruction per line:
+//
+//     Loop:   DUP
+//             JLE Done        ; a comment
+//             PUSH -1
+//             ADD
+//             JMP Loop
+//     Done:
+//
+// Mnemonics are those of the README in any case; label names are words
+// and case sensitive.  Each line is handed to the VM's builder calls as
+// it is read, with no tree or symbol table in between, so the builder's
+// rules still apply: a jump may come before its label, a label defined
+// twice makes the program invalid.
+
+class VM_assembler
+{
+public:
+    // Append the program in source to vm.  false at the first line that
+    // does not parse, which error() describes; vm keeps what came before.
+    bool assemble(std::string_view source, VM &vm);
+
+    // the same, reading a line at a time
+    bool assemble(std::istream &in, VM &vm);
+
+    std::string const &error() const;
+
+private:
+    std::string message;
+    std::string line;
+
+    bool statements(VM_lexer &lexer, VM &vm);
+    bool fail(VM_token const &token, char const *what);
+};
+
+#endif
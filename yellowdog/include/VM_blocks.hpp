@@ -0,0 +1,26 @@
+#if !defined(VM_BLOCKS_HPP)
+#define VM_BLOCKS_HPP 1
+
+#include <vector>
+
+#include "VM_defs.hpp"
+
+// Straight line run lengths used to charge the tick budget once per block
+// instead of once per instruction.  runs()[pc] is the number of
+// instructions executed when control arrives at byte pc: everything up to
+// and including the next jump (or the end of the program, which has a run
+// of nothing).
+
+class VM_blocks
+{
+public:
+    VM_blocks();
+
+    void analyse(OPCODE const *program, unsigned int length);
+    unsigned int const *runs() const;
+
+private:
+    std::vector<unsigned int> run_at;
+};
+
+#endif
@@ -1,6 +1,9 @@
 #if !defined(VM_DEFS_HPP)
 #define VM_DEFS_HPP 1
 
+constexpr unsigned int MAX_STACK_SIZE = 1024;
+constexpr unsigned int MAX_TICKS = 102400;
+
 using OPCODE = unsigned char;
 
 constexpr OPCODE PUSH = 1;
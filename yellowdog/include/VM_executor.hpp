@@ -1,46 +1,84 @@
 #if !defined(VM_EXECUTOR_HPP)
 #define VM_EXECUTOR_HPP 1
 
-#include <functional>
 #include <string>
 
 #include "VM_defs.hpp"
-#include "VM_labels.hpp"
 #include "VM_exec_status.hpp"
+#include "VM_profile.hpp"
+#include "VM_trace.hpp"
 
 class VM_executor
 {
-private:
-    static constexpr unsigned int MAX_STACK_SIZE = 1024;
-    static constexpr unsigned int MAX_TICKS = 102400;
-
 public:
-    VM_executor(OPCODE const *program, unsigned int length, VM_labels const &labels);
-    VM_exec_status exec(bool verbose);
+    // An executor can be bound to one program after another and run any
+    // number of times in between; each run resets only the stack pointer
+    // and counters, never the stack itself.  Unbound, an executor runs the
+    // empty program.
+    VM_executor();
+    VM_executor(OPCODE const *program, unsigned int length, unsigned int const *runs, bool verified = false);
+    void bind(OPCODE const *program, unsigned int length, unsigned int const *runs, bool verified = false);
+
+    VM_exec_status exec(bool verbose, unsigned int max_ticks = MAX_TICKS);
+
+    // exec without tracing, adding to profile, which must be prepared
+    // for this program
+    VM_exec_status exec_profiled(VM_profile &profile, unsigned int max_ticks = MAX_TICKS);
+
+    // exec without tracing to cerr, recording every instruction in trace
+    VM_exec_status exec_traced(VM_trace &trace, unsigned int max_ticks = MAX_TICKS);
 
 private:
     OPCODE const *program;
     unsigned int program_size;
-    VM_labels const &labels;
+    unsigned int const *runs;
+    bool verified;
 
     int stack[MAX_STACK_SIZE];
     unsigned int sp;
     unsigned int pc;
     unsigned ticks;
+    unsigned int max_ticks;
+    bool precise;
+
+    VM_error status;
+    const char *status_detail;
+
+    // while profiling: the run being timed, when it started and how many
+    // runs it stands for
+    VM_profile *profile;
+    bool timing;
+    unsigned int run_start;
+    uint64_t run_clock;
+    unsigned int run_weight;
 
-    std::string status;
+    // while recording into a VM_trace
+    VM_trace *tracer;
 
     void reset();
+    VM_exec_status result();
+    void fail(VM_error error, const char *detail = nullptr);
 
     void is_stack_available(const char *name);
     void is_arg_available(size_t count, const char *name);
+    template <bool CHECKED>
     int get_jump_target();
 
-    void do_instructions(std::function<void(void)> instr, size_t argcount, size_t stackneeded, const char *name);
-    void do_jump(std::function<bool(void)> check, size_t argcount, const char *name);
+    // CHECKED is false only for programs VM_verifier has proven cannot
+    // misuse the stack or jump to an undefined label.  PROFILE builds the
+    // interpreter that fills in profile; the one without it has no
+    // profiling code at all.
+    template <bool CHECKED, bool PROFILE = false>
+    void run(bool verbose);
+    template <bool PROFILE = false>
+    void enter();
+    template <bool CHECKED, typename F>
+    void do_instructions(F instr, size_t argcount, size_t stackneeded, const char *name);
+    template <bool CHECKED, bool PROFILE, typename F>
+    void do_jump(F check, size_t argcount, const char *name);
 
-    void trace(unsigned int pc, int *stack, unsigned int sp) const;
-    void trace_jmp(std::string const &op, unsigned int pc) const;
+    // the instruction at pc, about to run
+    void capture(VM_trace_record &record) const;
 };
 
 #endif
\ No newline at end of file
@@ -2,12 +2,22 @@
 #define VM_LABELS_HPP 1
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "VM_defs.hpp"
+
+// Label names are interned in a hash table that maps each to its index.
+// Jump operands hold the pc of their label, or -1 while it is undefined;
+// such operands are remembered as fixups and patched by link() once the
+// label is defined, so a finished program needs no label lookups to run.
+
 class VM_labels
 {
 public:
     VM_labels();
+    VM_labels(VM_labels const &other);
+    VM_labels &operator=(VM_labels const &other);
 
     size_t size() const;
     int find(std::string const& name) const;
@@ -16,10 +26,39 @@ public:
     int pc_at(int index) const;
     std::string const & name_at(int index) const;
 
+    // The jump operand at program[offset] refers to label index; it is
+    // patched when the label is linked.
+    void refer(int index, unsigned int offset);
+    void link(int index, OPCODE *program);
+
+    // the label the jump operand at program[offset] is waiting for, or -1
+    int pending_at(unsigned int offset) const;
+
+    // The program has been rewritten and what was at pc is now at
+    // moved[pc]: move the labels, and the fixups with their jumps.
+    void relocate(std::vector<int> const &moved);
+
+    // The table as stored in a program image: for each label in index
+    // order its pc, name length and fixup count (32 bits each), the name
+    // padded to 4 bytes and the fixups.  Tables whose pcs or fixups lie
+    // outside a program of length bytes are refused.
+    std::vector<unsigned char> serialize() const;
+    bool deserialize(void const *data, size_t size, unsigned int length);
+
     void dump() const;
 
 private:
-    std::vector<std::pair<std::string, int>> labels;
+    struct label
+    {
+        std::string const *name;   // the key in indices
+        int pc;
+        std::vector<unsigned int> fixups;
+    };
+
+    std::unordered_map<std::string, int> indices;
+    std::vector<label> labels;
+
+    void intern();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#if !defined(VM_MNEMONICS_HPP)
+#define VM_MNEMONICS_HPP 1
+
+#include <cstdint>
+#include <ostream>
+
+#include "VM_defs.hpp"
+#include "VM_trace.hpp"
+
+// The assembly language names of the opcodes and what follows each in
+// the bytecode.  The assembler, VM::disassemble and the executor's trace
+// all work from this one table.
+
+enum class VM_operand
+{
+    NONE,
+    VALUE,    // an int
+    LABEL,    // an int: the target pc, or -1 while the label is undefined
+};
+
+struct VM_mnemonic
+{
+    OPCODE op;
+    char const *name;
+    VM_operand operand;
+    uint64_t key;    // VM_word_key(name)
+};
+
+// nullptr when there is no such opcode or name
+VM_mnemonic const *VM_mnemonic_of(OPCODE op);
+VM_mnemonic const *VM_find_mnemonic(uint64_t key);
+
+// record as the verbose trace writes it: the top of the stack, the pc,
+// the opcode and the instruction
+void VM_write_trace(std::ostream &out, VM_trace_record const &record);
+
+#endif
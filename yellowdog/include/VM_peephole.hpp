@@ -0,0 +1,74 @@
+#if !defined(VM_PEEPHOLE_HPP)
+#define VM_PEEPHOLE_HPP 1
+
+#include <ostream>
+#include <vector>
+
+#include "VM_defs.hpp"
+
+// What one VM::optimize pass did to a program.
+
+struct VM_peephole_stats
+{
+    unsigned int bytes_before = 0;
+    unsigned int bytes_after = 0;
+    unsigned int instructions_before = 0;
+    unsigned int instructions_after = 0;
+
+    unsigned int dead_values = 0;     // PUSH x; POP and DUP; POP
+    unsigned int swaps = 0;           // SWAP; SWAP
+    unsigned int folds = 0;           // PUSH a; PUSH b; arithmetic or CMP
+    unsigned int threaded = 0;        // jumps sent straight past a JMP
+    unsigned int fallthroughs = 0;    // jumps to the next instruction
+
+    void report(std::ostream &out) const;
+};
+
+// Peephole optimizer over finished bytecode.  Repeats until nothing
+// changes:
+//
+// - a jump whose target is a JMP goes to that JMP's target instead
+// - a JMP to the next instruction is dropped, and a conditional jump
+//   there becomes a POP
+// - PUSH x; POP, DUP; POP and SWAP; SWAP are dropped
+// - PUSH a; PUSH b; ADD (SUB, MUL, DIV or CMP) becomes one PUSH of the
+//   result, wrapping as the executors do; a DIV by 0 or of INT_MIN by -1
+//   is left to run
+//
+// Rewrites only change how many ticks a run takes, as long as no stack
+// error can happen, so all but jump threading and dropping JMPs are only
+// made on programs that verify.  No instruction a jump or label lands on
+// is merged into the one before it, and jumps to undefined labels are
+// left as they are.
+
+class VM_peephole
+{
+public:
+    // Rewrite program[0 .. length) in place and return its new length.
+    // labelled[pc] says a label is defined at pc (length + 1 entries).
+    // moved gets, for each old pc up to length, where it is now: an
+    // instruction that went is where whatever followed it is.
+    unsigned int optimize(OPCODE *program, unsigned int length, std::vector<bool> const &labelled, bool verified,
+                          std::vector<int> &moved, VM_peephole_stats *stats = nullptr);
+
+private:
+    struct instruction
+    {
+        OPCODE op;
+        int operand;    // jumps: an instruction index, or -1
+        unsigned int pc;
+        bool live;
+    };
+
+    // with the end of the program as instruction code.size()
+    std::vector<instruction> code;
+    std::vector<unsigned int> labels;    // the instructions labels are at
+    std::vector<bool> target;
+
+    bool decode(OPCODE const *program, unsigned int length, std::vector<int> &index);
+    bool pass(bool verified, VM_peephole_stats &stats);
+    // the first live instruction at or after index
+    unsigned int resolve(unsigned int index) const;
+};
+
+#endif
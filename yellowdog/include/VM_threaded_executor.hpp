@@ -0,0 +1,114 @@
+#if !defined(VM_THREADED_EXECUTOR_HPP)
+#define VM_THREADED_EXECUTOR_HPP 1
+
+#include <vector>
+
+#include "VM_defs.hpp"
+#include "VM_exec_status.hpp"
+
+// Internal opcodes that only appear in translated programs.
+constexpr OPCODE THREADED_INVALID = 0;
+constexpr OPCODE THREADED_END = DROPN + 1;
+
+// Superinstructions, each standing for a common sequence of ordinary
+// instructions.  The fused conditional jumps follow the JEQ .. JGE order.
+constexpr OPCODE THREADED_PUSH_ADD = DROPN + 2;          // PUSH k; ADD
+constexpr OPCODE THREADED_PUSH_SUB = DROPN + 3;          // PUSH k; SUB
+constexpr OPCODE THREADED_CMP_JEQ = DROPN + 4;           // CMP; Jxx
+constexpr OPCODE THREADED_CMP_JNE = DROPN + 5;
+constexpr OPCODE THREADED_CMP_JLT = DROPN + 6;
+constexpr OPCODE THREADED_CMP_JLE = DROPN + 7;
+constexpr OPCODE THREADED_CMP_JGT = DROPN + 8;
+constexpr OPCODE THREADED_CMP_JGE = DROPN + 9;
+constexpr OPCODE THREADED_DUP_JEQ = DROPN + 10;          // DUP; Jxx
+constexpr OPCODE THREADED_DUP_JNE = DROPN + 11;
+constexpr OPCODE THREADED_DUP_JLT = DROPN + 12;
+constexpr OPCODE THREADED_DUP_JLE = DROPN + 13;
+constexpr OPCODE THREADED_DUP_JGT = DROPN + 14;
+constexpr OPCODE THREADED_DUP_JGE = DROPN + 15;
+constexpr OPCODE THREADED_DUPN_JEQ = DROPN + 16;         // DUPN k; Jxx
+constexpr OPCODE THREADED_DUPN_JNE = DROPN + 17;
+constexpr OPCODE THREADED_DUPN_JLT = DROPN + 18;
+constexpr OPCODE THREADED_DUPN_JLE = DROPN + 19;
+constexpr OPCODE THREADED_DUPN_JGT = DROPN + 20;
+constexpr OPCODE THREADED_DUPN_JGE = DROPN + 21;
+constexpr OPCODE THREADED_PUSH_SUB_DUP_JEQ = DROPN + 22; // PUSH k; SUB; DUP; Jxx
+constexpr OPCODE THREADED_PUSH_SUB_DUP_JNE = DROPN + 23;
+constexpr OPCODE THREADED_PUSH_SUB_DUP_JLT = DROPN + 24;
+constexpr OPCODE THREADED_PUSH_SUB_DUP_JLE = DROPN + 25;
+constexpr OPCODE THREADED_PUSH_SUB_DUP_JGT = DROPN + 26;
+constexpr OPCODE THREADED_PUSH_SUB_DUP_JGE = DROPN + 27;
+
+struct VM_threaded_instruction
+{
+    void const *handler;
+    OPCODE op;
+    int arg;   // PUSH value, DUPN/DROPN index or jump target (-1 if undefined)
+    int arg2;  // the constant of a fused jump (PUSH value or DUPN index)
+    unsigned int run;   // instructions from here to the end of the straight line run
+};
+
+// A program translated into fixed size records.  Jump targets are
+// mapped from pcs to record indices and the last record is always THREADED_END,
+// so the executor never has to decode bytes.  Each
+// record also carries its run length so the tick budget can be charged
+// once per block.  Common sequences that no jump lands inside are then
+// fused into superinstructions, each dispatched once.  Each record is
+// pointed at its handler as it is translated, so running a program only
+// reads it, and may do so on several threads at once.
+
+class VM_threaded_program
+{
+public:
+    VM_threaded_program();
+
+    void translate(OPCODE const *program, unsigned int length);
+
+    std::vector<VM_threaded_instruction> code;
+
+#if defined(VM_THREADED_STATS)
+    // added to by each run; for measuring on one thread
+    mutable unsigned long long dispatches;
+#endif
+
+private:
+    void fuse();
+};
+
+class VM_threaded_executor
+{
+public:
+    VM_threaded_executor(VM_threaded_program const &program);
+    VM_exec_status exec(unsigned int max_ticks = MAX_TICKS);
+
+private:
+    friend class VM_threaded_program;
+
+    VM_threaded_program const &program;
+
+    int stack[MAX_STACK_SIZE];
+    unsigned int sp;
+    unsigned ticks;
+    unsigned int max_ticks;
+
+    VM_error status;
+    const char *status_detail;
+
+    // run's handler addresses by opcode, which only it can name
+    void const *const *handler_table;
+#if defined(VM_THREADED_STATS)
+    unsigned long long dispatches;
+#endif
+
+    // point each record of program at its handler
+    static void thread(VM_threaded_program &program);
+
+    // The fast form ticks once per run and returns the record it stopped
+    // at when the budget runs short; the precise form then finishes one
+    // instruction at a time.  Both return nullptr once execution is over.
+    // The fast form given nullptr only sets handler_table.
+    template <bool PRECISE>
+    VM_threaded_instruction const *run(VM_threaded_instruction const *ip);
+};
+
+#endif
@@ -0,0 +1,36 @@
+#if !defined(VM_VERIFIER_HPP)
+#define VM_VERIFIER_HPP 1
+
+#include <vector>
+
+#include "VM_defs.hpp"
+
+// Load time bytecode verifier.  Follows every path through the program
+// (jump operands are already resolved to pcs) tracking the lowest and highest
+// stack depth each instruction can be reached with.  A program is
+// verified when no reachable instruction can underflow or overflow the
+// stack, index outside it with DUPN/DROPN, or jump to an undefined label.
+// Verified programs can run without those checks.
+
+class VM_verifier
+{
+public:
+    VM_verifier();
+
+    bool verify(OPCODE const *program, unsigned int length);
+
+    bool is_verified() const;
+    unsigned int max_depth() const;
+    int min_depth_at(unsigned int pc) const;
+    int max_depth_at(unsigned int pc) const;
+
+private:
+    bool verified;
+    unsigned int max_stack;
+    std::vector<int> low;
+    std::vector<int> high;
+
+    void visit(unsigned int pc, int lo, int hi, std::vector<unsigned int> &work);
+};
+
+#endif
@@ -1,12 +1,24 @@
 #if !defined(VM_HPP)
 #define VM_HPP
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <string>
 #include <vector>
 
+#include "VM_blocks.hpp"
 #include "VM_defs.hpp"
 #include "VM_exec_status.hpp"
+#include "VM_executor.hpp"
+#include "VM_image.hpp"
 #include "VM_labels.hpp"
+#include "VM_peephole.hpp"
+#include "VM_profile.hpp"
+#include "VM_trace.hpp"
+#include "VM_threaded_executor.hpp"
+#include "VM_verifier.hpp"
 
 class VM
 {
@@ -36,7 +48,51 @@ public:
     void jge(const std::string &target);
     void label(const std::string &target);
 
-    VM_exec_status exec(bool verbose = false) const;
+    VM_exec_status exec(bool verbose = false, unsigned int max_ticks = MAX_TICKS) const;
+    VM_exec_status exec_threaded(bool verbose = false, unsigned int max_ticks = MAX_TICKS) const;
+
+    // exec on an interpreter that also counts into profile (see
+    // VM_profile).  A profile that is not yet for this program is set up
+    // for it first; otherwise the run is added to what it holds.
+    VM_exec_status exec_profiled(VM_profile &profile, unsigned int max_ticks = MAX_TICKS) const;
+
+    // exec, recording each instruction in trace as it is about to run (see
+    // VM_trace).  VM_write_trace turns the records into the text a verbose
+    // run writes, say for the last few thousand after an error.
+    VM_exec_status exec_traced(VM_trace &trace, unsigned int max_ticks = MAX_TICKS) const;
+
+    // Bind executor to the program, unchecked if it verifies, to run it as
+    // often as needed without the setup exec does on every call (see
+    // VM_executor).  False, leaving executor alone, if the program is
+    // invalid.  Bind again after changing or loading the program.
+    bool bind(VM_executor &executor) const;
+
+    bool verify() const;
+    int max_stack_depth() const;
+
+    // Finish the program: run the peephole optimizer over it (see
+    // VM_peephole) and move its labels to match.  stats, unless nullptr,
+    // gets what was done.  False if the program is invalid.  More can be
+    // added afterwards, but the rewrites that need the program to verify
+    // were made on it as it was.
+    bool optimize(VM_peephole_stats *stats = nullptr);
+
+    // Write the program and its labels to an image file, or replace them
+    // with those of an image.  A loaded program runs from the mapped file
+    // until more is added to it; an image whose labels do not fit its
+    // program is refused.
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+    // Write the program as source VM_assembler turns back into the same
+    // program, or nothing if the program is invalid.  Jump targets
+    // without a label of their own get one named .L<pc>.
+    void disassemble(std::ostream &out) const;
+
+#if defined(VM_THREADED_STATS)
+    // handler dispatches made by exec_threaded so far
+    unsigned long long threaded_dispatches() const;
+#endif
 
 private:
     OPCODE program[MAX_PROGRAM_SIZE];
@@ -45,6 +101,33 @@ private:
 
     VM_labels labels;
 
+    std::shared_ptr<VM_image const> image;
+    OPCODE const *image_code;
+
+    // What running the program needs from it, worked out by the first
+    // const method to want it after the program changes.  That happens
+    // under lock, so the const methods may run on several threads at once;
+    // whether it is done is checked without.  A copy works it out afresh.
+    struct preparation
+    {
+        std::mutex lock;
+        std::atomic<bool> done;
+
+        preparation();
+        preparation(preparation const &);
+        preparation &operator=(preparation const &);
+    };
+
+    mutable preparation prepared;
+    mutable VM_verifier verifier;
+    mutable VM_blocks blocks;
+    mutable VM_threaded_program threaded;
+
+    void invalidate();
+    void prepare() const;
+    OPCODE const *code() const;
+    void detach();
+
     void maybe_add_jmp(OPCODE op, std::string const & target);
     bool maybe_add_op(OPCODE op);
     bool maybe_add_arg(int arg);
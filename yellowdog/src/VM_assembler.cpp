@@ -0,0 +1,147 @@
+#include "VM_assembler.hpp"
+
+#include <climits>
+
+#include "vm.hpp"
+#include "VM_mnemonics.hpp"
+
+using namespace std;
+
+namespace
+{
+
+bool ends_statement(VM_token const &token)
+{
+    return VM_token_kind::NEWLINE == token.kind || VM_token_kind::END == token.kind;
+}
+
+} // namespace
+
+bool VM_assembler::assemble(std::string_view source, VM &vm)
+{
+    message.clear();
+    VM_lexer lexer(source);
+    return statements(lexer, vm);
+}
+
+bool VM_assembler::assemble(std::istream &in, VM &vm)
+{
+    message.clear();
+    for (unsigned int number = 1; getline(in, line); ++number)
+    {
+        VM_lexer lexer(line, number);
+        if (!statements(lexer, vm))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string const &VM_assembler::error() const
+{
+    return message;
+}
+
+bool VM_assembler::statements(VM_lexer &lexer, VM &vm)
+{
+    for (VM_token token = lexer.next(); VM_token_kind::END != token.kind; token = lexer.next())
+    {
+        if (VM_token_kind::NEWLINE == token.kind)
+        {
+            continue;
+        }
+        if (VM_token_kind::WORD != token.kind)
+        {
+            return fail(token, "expected an instruction or a label");
+        }
+
+        VM_token operand = lexer.next();
+        if (VM_token_kind::COLON == operand.kind)
+        {
+            // an instruction may follow on the same line
+            vm.label(string(token.text));
+            continue;
+        }
+
+        VM_mnemonic const *mnemonic = VM_find_mnemonic(token.key);
+        if (nullptr == mnemonic)
+        {
+            return fail(token, "unknown instruction");
+        }
+
+        VM_token after = operand;
+        switch (mnemonic->operand)
+        {
+        case VM_operand::NONE:
+            break;
+
+        case VM_operand::VALUE:
+            if (VM_token_kind::NUMBER != operand.kind)
+            {
+                return fail(operand, "expected a number");
+            }
+            if (operand.number < INT_MIN || operand.number > INT_MAX)
+            {
+                return fail(operand, "number out of range");
+            }
+            after = lexer.next();
+            break;
+
+        case VM_operand::LABEL:
+            if (VM_token_kind::WORD != operand.kind)
+            {
+                return fail(operand, "expected a label");
+            }
+            after = lexer.next();
+            break;
+        }
+        if (!ends_statement(after))
+        {
+            return fail(after, "expected the end of the line");
+        }
+
+        const int value = (int)operand.number;
+        switch (mnemonic->op)
+        {
+        case PUSH:  vm.push(value); break;
+        case POP:   vm.pop(); break;
+        case DUP:   vm.dup(); break;
+        case DUPN:  vm.dupn(value); break;
+        case DROPN: vm.dropn(value); break;
+        case SWAP:  vm.swap(); break;
+        case ADD:   vm.add(); break;
+        case SUB:   vm.sub(); break;
+        case MUL:   vm.mul(); break;
+        case DIV:   vm.div(); break;
+        case CMP:   vm.cmp(); break;
+        case JMP:   vm.jmp(string(operand.text)); break;
+        case JEQ:   vm.jeq(string(operand.text)); break;
+        case JNE:   vm.jne(string(operand.text)); break;
+        case JLT:   vm.jlt(string(operand.text)); break;
+        case JLE:   vm.jle(string(operand.text)); break;
+        case JGT:   vm.jgt(string(operand.text)); break;
+        case JGE:   vm.jge(string(operand.text)); break;
+        }
+
+        if (VM_token_kind::END == after.kind)
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+bool VM_assembler::fail(VM_token const &token, char const *what)
+{
+    message = "line " + to_string(token.line) + ": " + what;
+    if (VM_token_kind::NEWLINE == token.kind || VM_token_kind::END == token.kind)
+    {
+        message += " at the end of the line";
+    }
+    else
+    {
+        message += " at '" + string(token.text) + "'";
+    }
+    return false;
+}
@@ -0,0 +1,54 @@
+
+#include "VM_blocks.hpp"
+
+using namespace std;
+
+VM_blocks::VM_blocks()
+{
+}
+
+void VM_blocks::analyse(OPCODE const *program, unsigned int length)
+{
+    // anything that is not the start of an instruction is never a block
+    // entry, but give it a run of one so a stray pc cannot stall the loop
+    run_at.assign(length + 1, 1);
+    run_at[length] = 0;
+
+    vector<unsigned int> starts;
+    unsigned int pc = 0;
+    while (pc < length)
+    {
+        starts.push_back(pc);
+        switch (program[pc++])
+        {
+        case PUSH:
+        case DUPN:
+        case DROPN:
+        case JMP:
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JLE:
+        case JGT:
+        case JGE:
+            pc += sizeof(int);
+            break;
+        }
+    }
+
+    unsigned int run = 0;
+    for (size_t i = starts.size(); i-- > 0;)
+    {
+        OPCODE op = program[starts[i]];
+        if ((op >= JMP && op <= JGE) || op < PUSH || op > DROPN)
+        {
+            run = 0;
+        }
+        run_at[starts[i]] = ++run;
+    }
+}
+
+unsigned int const *VM_blocks::runs() const
+{
+    return run_at.data();
+}
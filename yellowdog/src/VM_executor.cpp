@@ -4,40 +4,220 @@
 #include <cstring>
 #include <iostream>
 
+#include "VM_mnemonics.hpp"
+
 using namespace std;
 
-VM_executor::VM_executor(OPCODE const *program, unsigned int length, VM_labels const &labels)
-    : program(program), program_size(length), labels(labels)
+namespace
 {
+
+// the runs of the empty program
+const unsigned int no_runs[1] = {0};
+
+} // namespace
+
+VM_executor::VM_executor()
+{
+    bind(nullptr, 0, no_runs);
+}
+
+VM_executor::VM_executor(OPCODE const *program, unsigned int length, unsigned int const *runs, bool verified)
+{
+    bind(program, length, runs, verified);
+}
+
+void VM_executor::bind(OPCODE const *program, unsigned int length, unsigned int const *runs, bool verified)
+{
+    this->program = program;
+    program_size = length;
+    this->runs = runs;
+    this->verified = verified;
     reset();
 }
 
-VM_exec_status VM_executor::exec(bool verbose)
+template <bool CHECKED>
+int VM_executor::get_jump_target()
+{
+    // labels are resolved into the operand as the program is built
+    int target;
+    memcpy((void *)&target, (void *)&program[pc], sizeof(int));
+    if (CHECKED && target < 0)
+    {
+        fail(VM_error::UNDEFINED_LABEL);
+    }
+    return target;
+}
+
+template <bool CHECKED, typename F>
+inline void VM_executor::do_instructions(F instr, size_t argcount, size_t stackneeded, const char *name)
+{
+    if (CHECKED && argcount > 0 && VM_error::OK == status)
+    {
+        is_arg_available(argcount, name);
+    }
+    if (CHECKED && stackneeded > 0 && VM_error::OK == status)
+    {
+        is_stack_available(name);
+    }
+    if (VM_error::OK == status)
+    {
+        instr();
+    }
+}
+
+template <bool CHECKED, bool PROFILE, typename F>
+inline void VM_executor::do_jump(F check, size_t argcount, const char *name)
+{
+    do_instructions<CHECKED>(
+        [this, check]() {
+            int target = get_jump_target<CHECKED>();
+            if (target < 0)
+            {
+                return;
+            }
+
+            bool jumping = check();
+            if (jumping)
+            {
+                if (PROFILE)
+                {
+                    ++profile->taken[pc - 1];
+                }
+                pc = (unsigned int)target;
+            }
+            else
+            {
+                pc += sizeof(int);
+            }
+        },
+        argcount, 0, name);
+
+    if (VM_error::OK == status)
+    {
+        enter<PROFILE>();
+    }
+}
+
+VM_exec_status VM_executor::exec(bool verbose, unsigned int max_ticks)
 {
     reset();
+    this->max_ticks = max_ticks;
 
-    while (status.empty() && pc < program_size)
+    if (verified)
     {
-        if (verbose && (ticks % 1000) == 0)
-        {
-            cerr << ticks << " ticks\n";
-        }
-        if (++ticks > MAX_TICKS)
-        {
-            status = "Max Runtime Exceeded";
-            break;
-        }
+        run<false>(verbose);
+    }
+    else
+    {
+        run<true>(verbose);
+    }
+
+    return result();
+}
+
+VM_exec_status VM_executor::exec_profiled(VM_profile &profile, unsigned int max_ticks)
+{
+    reset();
+    this->max_ticks = max_ticks;
+    this->profile = &profile;
+
+    if (verified)
+    {
+        run<false, true>(false);
+    }
+    else
+    {
+        run<true, true>(false);
+    }
+
+    ++profile.executions;
+    this->profile = nullptr;
+    return result();
+}
+
+VM_exec_status VM_executor::exec_traced(VM_trace &trace, unsigned int max_ticks)
+{
+    reset();
+    this->max_ticks = max_ticks;
+    tracer = &trace;
 
-        if (verbose)
+    if (verified)
+    {
+        run<false>(false);
+    }
+    else
+    {
+        run<true>(false);
+    }
+
+    tracer = nullptr;
+    return result();
+}
+
+VM_exec_status VM_executor::result()
+{
+    if (VM_error::OK == status && 0 == sp)
+    {
+        fail(VM_error::NO_VALUE);
+    }
+    if (VM_error::OK != status)
+    {
+        return VM_exec_status(status, status_detail, ticks);
+    }
+
+    return VM_exec_status(int(stack[sp - 1]), ticks);
+}
+
+template <bool CHECKED, bool PROFILE>
+void VM_executor::run(bool verbose)
+{
+    // Tracing counts every instruction, so start out precise.
+    precise = verbose || nullptr != tracer;
+    if (PROFILE)
+    {
+        timing = false;
+    }
+    enter<PROFILE>();
+
+    unsigned int at = pc;
+    while (VM_error::OK == status && pc < program_size)
+    {
+        if (precise)
         {
-            trace(pc, stack, sp);
+            if (verbose && (ticks % 1000) == 0)
+            {
+                cerr << ticks << " ticks\n";
+            }
+            if (++ticks > max_ticks)
+            {
+                fail(VM_error::MAX_RUNTIME);
+                break;
+            }
+
+            if (nullptr != tracer)
+            {
+                capture(tracer->claim());
+                tracer->publish();
+            }
+            if (verbose)
+            {
+                VM_trace_record record;
+                capture(record);
+                VM_write_trace(cerr, record);
+            }
         }
 
+        at = pc;
         OPCODE op = program[pc++];
+        if (PROFILE)
+        {
+            ++profile->hits[at];
+            ++profile->ops[op];
+        }
         switch (op)
         {
         case PUSH:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     int val;
                     memcpy((void *)&val, (void *)&program[pc], sizeof(int));
@@ -48,7 +228,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case POP:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     --sp;
                 },
@@ -56,45 +236,51 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case DUP:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     stack[sp] = stack[sp - 1];
                     ++sp;
                 },
                 1, 1, "DUP");
-            is_stack_available("DUP");
+            if (CHECKED)
+            {
+                is_stack_available("DUP");
+            }
             break;
 
         case DUPN:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     int target;
                     memcpy((void *)&target, (void *)&program[pc], sizeof(int));
                     pc += sizeof(int);
-                    if (target <= 0 || target > (int)sp)
+                    if (CHECKED && (target <= 0 || target > (int)sp))
                     {
-                        status = "DUPN index out of range";
+                        fail(VM_error::INDEX_OUT_OF_RANGE, "DUPN");
                         return;
                     }
                     stack[sp] = stack[sp - target];
                     ++sp;
                 },
                 1, 1, "DUPN");
-            is_stack_available("DUPN");
+            if (CHECKED)
+            {
+                is_stack_available("DUPN");
+            }
             break;
 
         case DROPN:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     int target;
                     memcpy((void *)&target, (void *)&program[pc], sizeof(int));
                     pc += sizeof(int);
-                    if (target <= 0 || target > (int)sp)
+                    if (CHECKED && (target <= 0 || target > (int)sp))
                     {
-                        status = "DROPN index out of range";
+                        fail(VM_error::INDEX_OUT_OF_RANGE, "DROPN");
                         return;
                     }
-                    for (unsigned int i = sp-target ; i < sp ; ++i)
+                    for (unsigned int i = sp-target ; i + 1 < sp ; ++i)
                     {
                         stack[i] = stack[i+1];
                     }
@@ -104,7 +290,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case SWAP:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     std::swap(stack[sp - 2], stack[sp - 1]);
                 },
@@ -112,7 +298,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case ADD:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     stack[sp - 2] = stack[sp - 2] + stack[sp - 1];
                     --sp;
@@ -121,7 +307,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case SUB:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     stack[sp - 2] = stack[sp - 2] - stack[sp - 1];
                     --sp;
@@ -130,7 +316,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case MUL:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     stack[sp - 2] = stack[sp - 2] * stack[sp - 1];
                     --sp;
@@ -139,11 +325,11 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case DIV:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     if (0 == stack[sp - 1])
                     {
-                        status = "Division by zero not allowed";
+                        fail(VM_error::DIVISION_BY_ZERO);
                         return;
                     }
 
@@ -154,7 +340,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case CMP:
-            do_instructions(
+            do_instructions<CHECKED>(
                 [this]() {
                     int lhs = stack[sp - 2];
                     int rhs = stack[sp - 1];
@@ -166,7 +352,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JMP:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return true;
                 },
@@ -174,7 +360,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JEQ:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return stack[--sp] == 0;
                 },
@@ -182,7 +368,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JNE:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return stack[--sp] != 0;
                 },
@@ -190,7 +376,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JLT:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return stack[--sp] < 0;
                 },
@@ -198,7 +384,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JLE:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return stack[--sp] <= 0;
                 },
@@ -206,7 +392,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JGT:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return stack[--sp] > 0;
                 },
@@ -214,7 +400,7 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         case JGE:
-            do_jump(
+            do_jump<CHECKED, PROFILE>(
                 [this]() -> bool {
                     return stack[--sp] >= 0;
                 },
@@ -222,221 +408,108 @@ VM_exec_status VM_executor::exec(bool verbose)
             break;
 
         default:
-            status = "Internal Error: Invalid OPCODE detected";
+            fail(VM_error::INVALID_OPCODE);
             break;
         }
     }
 
-    if (status.empty() && 0 == sp)
-    {
-        status = "Program produced no value";
-    }
-    if (!status.empty())
+    // the whole run was charged on entry, only count what actually ran
+    if (VM_error::OK != status && !precise)
     {
-        return VM_exec_status(status);
+        ticks -= runs[at] - 1;
     }
 
-    return VM_exec_status(int(stack[sp - 1]));
-}
-
-void VM_executor::reset()
-{
-    pc = sp = ticks = 0;
-    status = "";
-}
-
-void VM_executor::is_stack_available(const char *name)
-{
-    if (MAX_STACK_SIZE == sp)
+    // charge the last run
+    if (PROFILE && timing)
     {
-        status = "Stack overflow on ";
-        status += name;
+        profile->time[run_start] += (VM_profile::clock() - run_clock) * run_weight;
     }
 }
 
-void VM_executor::is_arg_available(size_t count, const char *name)
+// Charge the straight line run starting at pc in one go.  Once the budget
+// will not cover it, drop to counting one instruction at a time so the
+// limit is hit on the same instruction as always.
+template <bool PROFILE>
+inline void VM_executor::enter()
 {
-    if (sp < count)
+    if (PROFILE)
     {
-        status = "Not enough arguments on stack for ";
-        status += name;
+        if (timing)
+        {
+            profile->time[run_start] += (VM_profile::clock() - run_clock) * run_weight;
+            timing = false;
+        }
+        if (0 == --profile->countdown)
+        {
+            run_weight = profile->countdown = profile->next_interval();
+            if (pc < program_size)
+            {
+                timing = true;
+                run_start = pc;
+                run_clock = VM_profile::clock();
+            }
+        }
     }
-}
 
-int VM_executor::get_jump_target()
-{
-    int index;
-    memcpy((void *)&index, (void *)&program[pc], sizeof(int));
-    int target = labels.pc_at(index);
-    if (target < 0)
+    if (!precise)
     {
-        status = "Label was never defined";
+        unsigned int length = runs[pc];
+        if (max_ticks - ticks < length)
+        {
+            precise = true;
+        }
+        else
+        {
+            ticks += length;
+        }
     }
-    return target;
 }
 
-void VM_executor::do_instructions(std::function<void(void)> instr, size_t argcount, size_t stackneeded, const char *name)
+void VM_executor::reset()
 {
-    if (argcount > 0 && status.empty())
-    {
-        is_arg_available(argcount, name);
-    }
-    if (stackneeded > 0 && status.empty())
-    {
-        is_stack_available(name);
-    }
-    if (status.empty())
-    {
-        instr();
-    }
+    pc = sp = ticks = 0;
+    precise = false;
+    status = VM_error::OK;
+    status_detail = nullptr;
+    profile = nullptr;
+    tracer = nullptr;
 }
 
-void VM_executor::do_jump(std::function<bool(void)> check, size_t argcount, const char *name)
+void VM_executor::fail(VM_error error, const char *detail)
 {
-    do_instructions(
-        [this, check]() {
-            int target = get_jump_target();
-            if (target < 0)
-            {
-                return;
-            }
-
-            bool jumping = check();
-            if (jumping)
-            {
-                pc = (unsigned int)target;
-            }
-            else
-            {
-                pc += sizeof(int);
-            }
-        },
-        argcount, 0, name);
+    status = error;
+    status_detail = detail;
 }
 
-void VM_executor::trace(unsigned int pc, int *stack, unsigned int sp) const
+void VM_executor::is_stack_available(const char *name)
 {
-    cerr << "---------------------\n";
-
-    cerr << "STACK[" << sp << "]: ";
-    for (unsigned int i = 3; i > 0 && sp > 0; --i)
-    {
-        cerr << stack[--sp] << " ";
-    }
-    cerr << "\n";
-
-    cerr << "PC: " << pc << "\n";
-
-    OPCODE op = program[pc++];
-    cerr << "op: " << (unsigned int)op << "\n";
-    switch (op)
-    {
-    case PUSH:
-    {
-        int val;
-        memcpy((void *)&val, (void *)&program[pc], sizeof(int));
-        cerr << "PUSH " << val << "\n";
-    }
-    break;
-
-    case POP:
-        cerr << "POP\n";
-        break;
-
-    case DUP:
-        cerr << "DUP\n";
-        break;
-
-    case DUPN:
+    if (MAX_STACK_SIZE == sp)
     {
-        int val;
-        memcpy((void *)&val, (void *)&program[pc], sizeof(int));
-        cerr << "DUPN " << val << "\n";
-        break;
+        fail(VM_error::STACK_OVERFLOW, name);
     }
+}
 
-    case DROPN:
+void VM_executor::is_arg_available(size_t count, const char *name)
+{
+    if (sp < count)
     {
-        int val;
-        memcpy((void *)&val, (void *)&program[pc], sizeof(int));
-        cerr << "DROPN " << val << "\n";
-        break;
-    }
-
-    case ADD:
-        cerr << "ADD\n";
-        break;
-
-    case SUB:
-        cerr << "SUB\n";
-        break;
-
-    case MUL:
-        cerr << "MUL\n";
-        break;
-
-    case DIV:
-        cerr << "DIV\n";
-        break;
-
-    case CMP:
-        cerr << "CMP\n";
-        break;
-
-    case JMP:
-        cerr << "trace jmp\n";
-        trace_jmp("JMP", pc);
-        break;
-
-    case JEQ:
-        trace_jmp("JEQ", pc);
-        break;
-
-    case JNE:
-        trace_jmp("JNE", pc);
-        break;
-
-    case JLT:
-        trace_jmp("JLT", pc);
-        break;
-
-    case JLE:
-        trace_jmp("JLE", pc);
-        break;
-
-    case JGT:
-        trace_jmp("JGT", pc);
-        break;
-
-    case JGE:
-        trace_jmp("JGE", pc);
-        break;
-
-    default:
-        cerr << "unknown op code: " << op << "\n";
+        fail(VM_error::STACK_UNDERFLOW, name);
     }
 }
 
-void VM_executor::trace_jmp(string const &op, unsigned int pc) const
+void VM_executor::capture(VM_trace_record &record) const
 {
-    int index;
-    memcpy((void *)&index, (void *)&program[pc], sizeof(int));
-    cerr << "Jump Index = " << index << "\n";
-
-    string const &name = labels.name_at(index);
-    if (name.empty())
+    record = VM_trace_record();
+    record.pc = pc;
+    record.tick = ticks;
+    record.op = program[pc];
+    if (pc + sizeof(int) < program_size)
     {
-        cerr << op << " ???";
+        memcpy((void *)&record.operand, (void *)&program[pc + 1], sizeof(int));
     }
-    else
+    record.depth = sp;
+    for (unsigned int i = 0; i < 3 && i < sp; ++i)
     {
-        cerr << op << " " << name;
-        int target = labels.pc_at(index);
-        if (target < 0)
-        {
-            cerr << " (never defined)";
-        }
+        record.values[i] = stack[sp - 1 - i];
     }
-
-    cerr << "\n";
 }
@@ -1,5 +1,6 @@
 #include "VM_labels.hpp"
 
+#include <cstring>
 #include <iostream>
 
 using namespace std;
@@ -9,6 +10,29 @@ VM_labels::VM_labels()
     labels.reserve(20);
 }
 
+VM_labels::VM_labels(VM_labels const &other)
+    : indices(other.indices), labels(other.labels)
+{
+    intern();
+}
+
+VM_labels &VM_labels::operator=(VM_labels const &other)
+{
+    indices = other.indices;
+    labels = other.labels;
+    intern();
+    return *this;
+}
+
+void VM_labels::intern()
+{
+    // names point into this table's own keys
+    for (auto const &entry : indices)
+    {
+        labels[entry.second].name = &entry.first;
+    }
+}
+
 size_t VM_labels::size() const
 {
     return labels.size();
@@ -16,16 +40,13 @@ size_t VM_labels::size() const
 
 int VM_labels::find(std::string const &name) const
 {
-    int sz = (int)size();
-    for (int i = 0; i < sz; ++i)
+    auto found = indices.find(name);
+    if (found == indices.end())
     {
-        if (name == labels[i].first)
-        {
-            return i;
-        }
+        return -1;
     }
 
-    return -1;
+    return found->second;
 }
 
 int VM_labels::new_label(std::string const &name, int location)
@@ -42,22 +63,22 @@ int VM_labels::new_label(std::string const &name, int location)
 int VM_labels::add_or_update(std::string const &name, int location)
 {
     // cerr << "add_or_update: " << name << " " << location << "\n";
-    int index = find(name);
-    if (index < 0)
+    auto inserted = indices.emplace(name, (int)size());
+    int index = inserted.first->second;
+    if (inserted.second)
     {
-        index = size();
-        labels.push_back(pair<string, int>(name, location));
+        labels.push_back({&inserted.first->first, location, {}});
         // cerr << "\tbrand new at index " << index << "\n";
         return index;
     }
 
-    if (labels[index].second < 0 && location >= 0)
+    if (labels[index].pc < 0 && location >= 0)
     {
         // cerr << "\tupdated\n";
-        labels[index].second = location;
+        labels[index].pc = location;
         return index;
     }
-    else if (labels[index].second >= 0 && location >= 0)
+    else if (labels[index].pc >= 0 && location >= 0)
     {
         // cerr << "\tduplicate entry; returning index -1\n";
         return -1;
@@ -68,9 +89,9 @@ int VM_labels::add_or_update(std::string const &name, int location)
 
 int VM_labels::pc_at(int index) const
 {
-    if (index < (int)size())
+    if (index >= 0 && index < (int)size())
     {
-        return labels[index].second;
+        return labels[index].pc;
     }
     return -1;
 }
@@ -80,18 +101,149 @@ std::string const &VM_labels::name_at(int index) const
 
     if (index >= 0 && index < (int)size())
     {
-        return labels[index].first;
+        return *labels[index].name;
     }
     static const string empty("");
     return empty;
 }
 
+void VM_labels::refer(int index, unsigned int offset)
+{
+    if (index >= 0 && index < (int)size())
+    {
+        labels[index].fixups.push_back(offset);
+    }
+}
+
+void VM_labels::link(int index, OPCODE *program)
+{
+    if (index < 0 || index >= (int)size() || labels[index].pc < 0)
+    {
+        return;
+    }
+
+    label &target = labels[index];
+    for (unsigned int offset : target.fixups)
+    {
+        memcpy((void *)&program[offset], (void *)&target.pc, sizeof(int));
+    }
+    target.fixups.clear();
+}
+
+int VM_labels::pending_at(unsigned int offset) const
+{
+    for (size_t index = 0; index < labels.size(); ++index)
+    {
+        for (unsigned int fixup : labels[index].fixups)
+        {
+            if (fixup == offset)
+            {
+                return (int)index;
+            }
+        }
+    }
+    return -1;
+}
+
+void VM_labels::relocate(std::vector<int> const &moved)
+{
+    for (label &entry : labels)
+    {
+        if (entry.pc >= 0)
+        {
+            entry.pc = moved[entry.pc];
+        }
+        // an operand moves with the jump it belongs to
+        for (unsigned int &offset : entry.fixups)
+        {
+            offset = (unsigned int)moved[offset - 1] + 1;
+        }
+    }
+}
+
+std::vector<unsigned char> VM_labels::serialize() const
+{
+    vector<unsigned char> out;
+    auto word = [&out](unsigned int value) {
+        out.insert(out.end(), (unsigned char const *)&value, (unsigned char const *)&value + sizeof(value));
+    };
+
+    for (label const &entry : labels)
+    {
+        word((unsigned int)entry.pc);
+        word((unsigned int)entry.name->size());
+        word((unsigned int)entry.fixups.size());
+        out.insert(out.end(), entry.name->begin(), entry.name->end());
+        out.resize((out.size() + 3) / 4 * 4, 0);
+        for (unsigned int offset : entry.fixups)
+        {
+            word(offset);
+        }
+    }
+    return out;
+}
+
+bool VM_labels::deserialize(void const *data, size_t size, unsigned int length)
+{
+    unsigned char const *in = static_cast<unsigned char const *>(data);
+    size_t at = 0;
+    auto word = [in, size, &at](unsigned int &value) {
+        if (size - at < sizeof(value))
+        {
+            return false;
+        }
+        memcpy(&value, in + at, sizeof(value));
+        at += sizeof(value);
+        return true;
+    };
+
+    VM_labels table;
+    while (at < size)
+    {
+        // the name is checked before it is padded, which could wrap
+        unsigned int pc, chars, fixups;
+        if (!word(pc) || !word(chars) || !word(fixups) || chars > size - at)
+        {
+            return false;
+        }
+        const size_t padded = ((size_t)chars + 3) / 4 * 4;
+        if (padded > size - at)
+        {
+            return false;
+        }
+        string name((char const *)in + at, chars);
+        at += padded;
+
+        // -1 is an undefined label
+        if ((int)pc < -1 || (int)pc > (int)length)
+        {
+            return false;
+        }
+        int index = table.add_or_update(name, (int)pc);
+        if (index != (int)table.size() - 1)
+        {
+            return false;
+        }
+        for (unsigned int i = 0; i < fixups; ++i)
+        {
+            unsigned int offset;
+            if (!word(offset) || length < sizeof(int) || offset > length - sizeof(int))
+            {
+                return false;
+            }
+            table.refer(index, offset);
+        }
+    }
+
+    *this = table;
+    return true;
+}
+
 void VM_labels::dump() const
 {
     cerr << "Labels [" << size() << "]\n";
     for (size_t i = 0; i < size(); ++i)
     {
-        cerr << "\t" << labels[i].first << ": " << labels[i].second << "\n";
+        cerr << "\t" << *labels[i].name << ": " << labels[i].pc << "\n";
     }
 }
-
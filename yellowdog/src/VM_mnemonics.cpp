@@ -0,0 +1,105 @@
+#include "VM_mnemonics.hpp"
+
+#include "VM_lexer.hpp"
+
+namespace
+{
+
+constexpr VM_mnemonic mnemonic(OPCODE op, char const *name, VM_operand operand)
+{
+    return VM_mnemonic{op, name, operand, VM_word_key(name)};
+}
+
+// in opcode order, so that an opcode indexes its entry
+constexpr VM_mnemonic mnemonics[] = {
+    mnemonic(0, "", VM_operand::NONE),
+    mnemonic(PUSH, "PUSH", VM_operand::VALUE),
+    mnemonic(POP, "POP", VM_operand::NONE),
+    mnemonic(DUP, "DUP", VM_operand::NONE),
+    mnemonic(DUPN, "DUPN", VM_operand::VALUE),
+    mnemonic(SWAP, "SWAP", VM_operand::NONE),
+    mnemonic(ADD, "ADD", VM_operand::NONE),
+    mnemonic(SUB, "SUB", VM_operand::NONE),
+    mnemonic(MUL, "MUL", VM_operand::NONE),
+    mnemonic(DIV, "DIV", VM_operand::NONE),
+    mnemonic(CMP, "CMP", VM_operand::NONE),
+    mnemonic(JMP, "JMP", VM_operand::LABEL),
+    mnemonic(JEQ, "JEQ", VM_operand::LABEL),
+    mnemonic(JNE, "JNE", VM_operand::LABEL),
+    mnemonic(JLT, "JLT", VM_operand::LABEL),
+    mnemonic(JLE, "JLE", VM_operand::LABEL),
+    mnemonic(JGT, "JGT", VM_operand::LABEL),
+    mnemonic(JGE, "JGE", VM_operand::LABEL),
+    mnemonic(DROPN, "DROPN", VM_operand::VALUE),
+};
+
+constexpr unsigned int count = sizeof(mnemonics) / sizeof(mnemonics[0]);
+
+constexpr bool in_opcode_order()
+{
+    for (unsigned int op = 0; op < count; ++op)
+    {
+        if (mnemonics[op].op != op)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(in_opcode_order(), "mnemonics must be indexed by opcode");
+
+} // namespace
+
+VM_mnemonic const *VM_mnemonic_of(OPCODE op)
+{
+    if (op > 0 && op < count)
+    {
+        return &mnemonics[op];
+    }
+    return nullptr;
+}
+
+VM_mnemonic const *VM_find_mnemonic(uint64_t key)
+{
+    for (unsigned int op = 1; op < count; ++op)
+    {
+        if (mnemonics[op].key == key)
+        {
+            return &mnemonics[op];
+        }
+    }
+    return nullptr;
+}
+
+void VM_write_trace(std::ostream &out, VM_trace_record const &record)
+{
+    out << "---------------------\n";
+
+    out << "STACK[" << record.depth << "]: ";
+    for (unsigned int i = 0; i < 3 && i < record.depth; ++i)
+    {
+        out << record.values[i] << " ";
+    }
+    out << "\n";
+
+    out << "PC: " << record.pc << "\n";
+    out << "op: " << (unsigned int)record.op << "\n";
+
+    VM_mnemonic const *mnemonic = VM_mnemonic_of(record.op);
+    if (nullptr == mnemonic)
+    {
+        out << "unknown op code: " << (unsigned int)record.op << "\n";
+        return;
+    }
+
+    out << mnemonic->name;
+    if (VM_operand::LABEL == mnemonic->operand && record.operand < 0)
+    {
+        out << " (never defined)";
+    }
+    else if (VM_operand::NONE != mnemonic->operand)
+    {
+        out << " " << record.operand;
+    }
+    out << "\n";
+}
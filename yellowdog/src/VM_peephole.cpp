@@ -0,0 +1,314 @@
+#include "VM_peephole.hpp"
+
+#include <climits>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+
+bool is_jump(OPCODE op)
+{
+    return op >= JMP && op <= JGE;
+}
+
+bool has_operand(OPCODE op)
+{
+    return PUSH == op || DUPN == op || DROPN == op || is_jump(op);
+}
+
+unsigned int size_of(OPCODE op)
+{
+    return has_operand(op) ? 1 + sizeof(int) : 1;
+}
+
+// what PUSH y; PUSH x; op leaves, or false where the op must be left to
+// run (and fail, or trap)
+bool fold(OPCODE op, int y, int x, int &result)
+{
+    const unsigned int a = (unsigned int)y;
+    const unsigned int b = (unsigned int)x;
+    switch (op)
+    {
+    case ADD:
+        result = (int)(a + b);
+        return true;
+
+    case SUB:
+        result = (int)(a - b);
+        return true;
+
+    case MUL:
+        result = (int)(a * b);
+        return true;
+
+    case DIV:
+        if (0 == x || (INT_MIN == y && -1 == x))
+        {
+            return false;
+        }
+        result = y / x;
+        return true;
+
+    case CMP:
+        result = (y < x) ? -1 : ((y > x) ? +1 : 0);
+        return true;
+    }
+
+    return false;
+}
+
+} // namespace
+
+void VM_peephole_stats::report(std::ostream &out) const
+{
+    out << "Peephole: " << instructions_before << " -> " << instructions_after << " instructions, " << bytes_before
+        << " -> " << bytes_after << " bytes\n";
+    out << "\tdead values\t" << dead_values << "\n";
+    out << "\tswaps\t\t" << swaps << "\n";
+    out << "\tfolds\t\t" << folds << "\n";
+    out << "\tthreaded\t" << threaded << "\n";
+    out << "\tfallthroughs\t" << fallthroughs << "\n";
+}
+
+unsigned int VM_peephole::optimize(OPCODE *program, unsigned int length, std::vector<bool> const &labelled,
+                                   bool verified, std::vector<int> &moved, VM_peephole_stats *stats)
+{
+    VM_peephole_stats counted;
+    VM_peephole_stats &counts = nullptr == stats ? counted : *stats;
+    counts = VM_peephole_stats();
+    counts.bytes_before = counts.bytes_after = length;
+
+    moved.resize(length + 1);
+    for (unsigned int pc = 0; pc <= length; ++pc)
+    {
+        moved[pc] = (int)pc;
+    }
+
+    // bytecode the builder could not have produced is left alone
+    vector<int> index;
+    if (!decode(program, length, index))
+    {
+        return length;
+    }
+    for (unsigned int pc = 0; pc <= length; ++pc)
+    {
+        if (labelled[pc] && index[pc] < 0)
+        {
+            return length;
+        }
+    }
+
+    const unsigned int count = (unsigned int)code.size();
+    counts.instructions_before = counts.instructions_after = count;
+
+    labels.clear();
+    for (unsigned int pc = 0; pc <= length; ++pc)
+    {
+        if (labelled[pc])
+        {
+            labels.push_back((unsigned int)index[pc]);
+        }
+    }
+
+    while (pass(verified, counts))
+    {
+    }
+
+    // where each instruction goes, then each byte of the old program
+    vector<unsigned int> at(count + 1);
+    unsigned int pc = 0;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        at[i] = pc;
+        pc += code[i].live ? size_of(code[i].op) : 0;
+    }
+    at[count] = pc;
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        instruction const &instr = code[i];
+        const unsigned int to = at[resolve(i)];
+        for (unsigned int byte = 0; byte < size_of(instr.op); ++byte)
+        {
+            moved[instr.pc + byte] = (int)(to + (instr.live ? byte : 0));
+        }
+    }
+    moved[length] = (int)at[count];
+
+    // every instruction only ever moves down, so this can be done in place
+    counts.instructions_after = 0;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        instruction const &instr = code[i];
+        if (!instr.live)
+        {
+            continue;
+        }
+
+        ++counts.instructions_after;
+        program[at[i]] = instr.op;
+        if (has_operand(instr.op))
+        {
+            const int operand = is_jump(instr.op) && instr.operand >= 0 ? (int)at[resolve(instr.operand)] : instr.operand;
+            memcpy((void *)&program[at[i] + 1], (void *)&operand, sizeof(int));
+        }
+    }
+
+    counts.bytes_after = at[count];
+    return at[count];
+}
+
+bool VM_peephole::decode(OPCODE const *program, unsigned int length, std::vector<int> &index)
+{
+    code.clear();
+    index.assign(length + 1, -1);
+    for (unsigned int pc = 0; pc < length; pc += size_of(program[pc]))
+    {
+        instruction instr = {program[pc], 0, pc, true};
+        if (instr.op < PUSH || instr.op > DROPN)
+        {
+            return false;
+        }
+        if (has_operand(instr.op))
+        {
+            if (length - pc - 1 < sizeof(int))
+            {
+                return false;
+            }
+            memcpy((void *)&instr.operand, (void *)&program[pc + 1], sizeof(int));
+        }
+        index[pc] = (int)code.size();
+        code.push_back(instr);
+    }
+    index[length] = (int)code.size();
+
+    // jumps hold instruction indices from here on
+    for (instruction &instr : code)
+    {
+        if (is_jump(instr.op) && instr.operand >= 0)
+        {
+            if (instr.operand > (int)length || index[instr.operand] < 0)
+            {
+                return false;
+            }
+            instr.operand = index[instr.operand];
+        }
+        else if (is_jump(instr.op) && instr.operand < -1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VM_peephole::pass(bool verified, VM_peephole_stats &stats)
+{
+    const unsigned int count = (unsigned int)code.size();
+
+    // what labels and jumps land on
+    target.assign(count + 1, false);
+    for (unsigned int label : labels)
+    {
+        target[resolve(label)] = true;
+    }
+    for (instruction const &instr : code)
+    {
+        if (instr.live && is_jump(instr.op) && instr.operand >= 0)
+        {
+            target[resolve(instr.operand)] = true;
+        }
+    }
+
+    bool changed = false;
+    for (unsigned int i = resolve(0); i < count; i = resolve(i + 1))
+    {
+        instruction &first = code[i];
+        const unsigned int next = resolve(i + 1);
+
+        if (is_jump(first.op))
+        {
+            if (first.operand < 0)
+            {
+                continue;
+            }
+
+            // follow JMPs, unless they go round in a loop
+            unsigned int to = resolve(first.operand);
+            unsigned int hops = 0;
+            while (to < count && JMP == code[to].op && code[to].operand >= 0 && hops <= count)
+            {
+                to = resolve(code[to].operand);
+                ++hops;
+            }
+            if (hops > 0 && hops <= count && to != resolve(first.operand))
+            {
+                first.operand = (int)to;
+                ++stats.threaded;
+                changed = true;
+            }
+
+            if (resolve(first.operand) == next)
+            {
+                if (JMP == first.op)
+                {
+                    first.live = false;
+                    ++stats.fallthroughs;
+                    changed = true;
+                }
+                else if (verified)
+                {
+                    first.op = POP;
+                    first.operand = 0;
+                    ++stats.fallthroughs;
+                    changed = true;
+                }
+            }
+            continue;
+        }
+
+        // the rest drop values or stack checks with them
+        if (!verified || next >= count || target[next])
+        {
+            continue;
+        }
+
+        instruction &second = code[next];
+        if ((PUSH == first.op || DUP == first.op) && POP == second.op)
+        {
+            first.live = second.live = false;
+            ++stats.dead_values;
+            changed = true;
+        }
+        else if (SWAP == first.op && SWAP == second.op)
+        {
+            first.live = second.live = false;
+            ++stats.swaps;
+            changed = true;
+        }
+        else if (PUSH == first.op && PUSH == second.op)
+        {
+            const unsigned int third = resolve(next + 1);
+            int result;
+            if (third < count && !target[third] && fold(code[third].op, first.operand, second.operand, result))
+            {
+                first.operand = result;
+                second.live = code[third].live = false;
+                ++stats.folds;
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+unsigned int VM_peephole::resolve(unsigned int index) const
+{
+    while (index < code.size() && !code[index].live)
+    {
+        ++index;
+    }
+    return index;
+}
@@ -0,0 +1,658 @@
+
+#include "VM_threaded_executor.hpp"
+
+#include <cstring>
+
+using namespace std;
+
+// Use labels-as-values where the compiler supports them, otherwise fall
+// back to a switch.  The handler bodies are shared by both forms.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+#if defined(VM_THREADED_STATS)
+#define COUNT_DISPATCH() ++dispatches
+#else
+#define COUNT_DISPATCH()
+#endif
+
+#if VM_COMPUTED_GOTO
+#define HANDLER(op) op_##op:
+#define DISPATCH()       \
+    COUNT_DISPATCH();    \
+    goto *(PRECISE ? handlers[ip->op] : ip->handler)
+#else
+#define HANDLER(op) case op:
+#define DISPATCH()       \
+    COUNT_DISPATCH();    \
+    goto dispatch
+#endif
+
+// The fast path has charged the rest of the run already, so a failure
+// hands back the ticks for the instructions after this one.  A
+// superinstruction failing in its nth part (counting from 0) has already
+// run n more.
+#define FAIL_AT(n, error, detail)          \
+    {                                      \
+        if (!PRECISE)                      \
+        {                                  \
+            ticks -= ip->run - 1 - (n);    \
+        }                                  \
+        status = error;                    \
+        status_detail = detail;            \
+        goto done;                         \
+    }
+
+#define FAIL(error, detail) FAIL_AT(0, error, detail)
+
+#define TICK()                                   \
+    if (PRECISE && ++ticks > max_ticks)          \
+    FAIL(VM_error::MAX_RUNTIME, nullptr)
+
+// Charge a whole run on arrival at its first instruction, or hand over
+// to the precise loop when the budget will not cover it.
+#define ENTER()                                  \
+    if (!PRECISE)                                \
+    {                                            \
+        if (max_ticks - ticks < ip->run)         \
+        {                                        \
+            return ip;                           \
+        }                                        \
+        ticks += ip->run;                        \
+    }
+
+#define NEED_ARGS(count, name) \
+    if (sp < count)            \
+    FAIL(VM_error::STACK_UNDERFLOW, name)
+
+#define NEED_STACK(name)      \
+    if (MAX_STACK_SIZE == sp) \
+    FAIL(VM_error::STACK_OVERFLOW, name)
+
+#define NEED_TARGET()  \
+    if (ip->arg < 0)   \
+    FAIL(VM_error::UNDEFINED_LABEL, nullptr)
+
+#define NEED_TARGET_AT(n) \
+    if (ip->arg < 0)      \
+    FAIL_AT(n, VM_error::UNDEFINED_LABEL, nullptr)
+
+static bool is_conditional_jump(OPCODE op)
+{
+    return op >= JEQ && op <= JGE;
+}
+
+static bool is_jump(OPCODE op)
+{
+    return (op >= JMP && op <= JGE) || (op >= THREADED_CMP_JEQ && op <= THREADED_PUSH_SUB_DUP_JGE);
+}
+
+VM_threaded_program::VM_threaded_program()
+{
+#if defined(VM_THREADED_STATS)
+    dispatches = 0;
+#endif
+}
+
+void VM_threaded_program::translate(OPCODE const *program, unsigned int length)
+{
+    code.clear();
+
+    vector<int> index_at(length + 1, -1);
+
+    unsigned int pc = 0;
+    while (pc < length)
+    {
+        index_at[pc] = (int)code.size();
+
+        VM_threaded_instruction instr = {nullptr, program[pc++], 0, 0, 0};
+        switch (instr.op)
+        {
+        case PUSH:
+        case DUPN:
+        case DROPN:
+        case JMP:
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JLE:
+        case JGT:
+        case JGE:
+            memcpy((void *)&instr.arg, (void *)&program[pc], sizeof(int));
+            pc += sizeof(int);
+            break;
+
+        case POP:
+        case DUP:
+        case SWAP:
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case CMP:
+            break;
+
+        default:
+            instr.op = THREADED_INVALID;
+            break;
+        }
+        code.push_back(instr);
+    }
+
+    index_at[length] = (int)code.size();
+    code.push_back({nullptr, THREADED_END, 0, 0, 0});
+
+    for (VM_threaded_instruction &instr : code)
+    {
+        if (instr.op >= JMP && instr.op <= JGE)
+        {
+            int target = instr.arg;
+            instr.arg = (target >= 0 && target <= (int)length) ? index_at[target] : -1;
+        }
+    }
+
+    unsigned int run = 0;
+    for (size_t i = code.size() - 1; i-- > 0;)
+    {
+        VM_threaded_instruction &instr = code[i];
+        if ((instr.op >= JMP && instr.op <= JGE) || THREADED_INVALID == instr.op)
+        {
+            run = 0;
+        }
+        instr.run = ++run;
+    }
+
+    fuse();
+    VM_threaded_executor::thread(*this);
+}
+
+void VM_threaded_program::fuse()
+{
+    // nothing may be folded into the record before it if a jump lands on it
+    vector<bool> landing(code.size(), false);
+    for (VM_threaded_instruction const &instr : code)
+    {
+        if (is_jump(instr.op) && instr.arg >= 0)
+        {
+            landing[instr.arg] = true;
+        }
+    }
+
+    // the opcode i records on from at, or THREADED_INVALID if it cannot be
+    // folded into the record at at
+    auto foldable = [this, &landing](size_t at, size_t i) -> OPCODE {
+        return (at + i < code.size() && !landing[at + i]) ? code[at + i].op : THREADED_INVALID;
+    };
+
+    vector<int> index_at(code.size(), -1);
+    vector<VM_threaded_instruction> fused;
+    fused.reserve(code.size());
+
+    size_t at = 0;
+    while (at < code.size())
+    {
+        index_at[at] = (int)fused.size();
+        VM_threaded_instruction instr = code[at];
+        size_t count = 1;
+
+        OPCODE next = foldable(at, 1);
+        if (PUSH == instr.op && SUB == next && DUP == foldable(at, 2) && is_conditional_jump(foldable(at, 3)))
+        {
+            instr.op = THREADED_PUSH_SUB_DUP_JEQ + (code[at + 3].op - JEQ);
+            instr.arg2 = instr.arg;
+            instr.arg = code[at + 3].arg;
+            count = 4;
+        }
+        else if (PUSH == instr.op && (ADD == next || SUB == next))
+        {
+            instr.op = (ADD == next) ? THREADED_PUSH_ADD : THREADED_PUSH_SUB;
+            count = 2;
+        }
+        else if ((CMP == instr.op || DUP == instr.op || DUPN == instr.op) && is_conditional_jump(next))
+        {
+            OPCODE first = (CMP == instr.op) ? THREADED_CMP_JEQ : (DUP == instr.op) ? THREADED_DUP_JEQ : THREADED_DUPN_JEQ;
+            instr.op = first + (next - JEQ);
+            instr.arg2 = instr.arg;
+            instr.arg = code[at + 1].arg;
+            count = 2;
+        }
+
+        fused.push_back(instr);
+        at += count;
+    }
+
+    for (VM_threaded_instruction &instr : fused)
+    {
+        if (is_jump(instr.op) && instr.arg >= 0)
+        {
+            instr.arg = index_at[instr.arg];
+        }
+    }
+
+    code.swap(fused);
+}
+
+VM_threaded_executor::VM_threaded_executor(VM_threaded_program const &program)
+    : program(program), sp(0), ticks(0), max_ticks(MAX_TICKS), handler_table(nullptr)
+{
+#if defined(VM_THREADED_STATS)
+    dispatches = 0;
+#endif
+}
+
+void VM_threaded_executor::thread(VM_threaded_program &program)
+{
+#if VM_COMPUTED_GOTO
+    VM_threaded_executor executor(program);
+    executor.run<false>(nullptr);
+    for (VM_threaded_instruction &instr : program.code)
+    {
+        instr.handler = executor.handler_table[instr.op];
+    }
+#else
+    (void)program;
+#endif
+}
+
+VM_exec_status VM_threaded_executor::exec(unsigned int max_ticks)
+{
+    sp = ticks = 0;
+    this->max_ticks = max_ticks;
+    status = VM_error::OK;
+    status_detail = nullptr;
+
+    VM_threaded_instruction const *ip = run<false>(program.code.data());
+    if (ip)
+    {
+        run<true>(ip);
+    }
+#if defined(VM_THREADED_STATS)
+    program.dispatches += dispatches;
+#endif
+
+    if (VM_error::OK == status && 0 == sp)
+    {
+        status = VM_error::NO_VALUE;
+    }
+    if (VM_error::OK != status)
+    {
+        return VM_exec_status(status, status_detail, ticks);
+    }
+
+    return VM_exec_status(int(stack[sp - 1]), ticks);
+}
+
+template <bool PRECISE>
+VM_threaded_instruction const *VM_threaded_executor::run(VM_threaded_instruction const *ip)
+{
+#if VM_COMPUTED_GOTO
+    static void const *const handlers[] = {
+        &&op_THREADED_INVALID,
+        &&op_PUSH, &&op_POP, &&op_DUP, &&op_DUPN, &&op_SWAP,
+        &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_CMP,
+        &&op_JMP, &&op_JEQ, &&op_JNE, &&op_JLT, &&op_JLE, &&op_JGT, &&op_JGE,
+        &&op_DROPN,
+        &&op_THREADED_END,
+        &&op_THREADED_PUSH_ADD, &&op_THREADED_PUSH_SUB,
+        &&op_THREADED_CMP_JEQ, &&op_THREADED_CMP_JNE, &&op_THREADED_CMP_JLT,
+        &&op_THREADED_CMP_JLE, &&op_THREADED_CMP_JGT, &&op_THREADED_CMP_JGE,
+        &&op_THREADED_DUP_JEQ, &&op_THREADED_DUP_JNE, &&op_THREADED_DUP_JLT,
+        &&op_THREADED_DUP_JLE, &&op_THREADED_DUP_JGT, &&op_THREADED_DUP_JGE,
+        &&op_THREADED_DUPN_JEQ, &&op_THREADED_DUPN_JNE, &&op_THREADED_DUPN_JLT,
+        &&op_THREADED_DUPN_JLE, &&op_THREADED_DUPN_JGT, &&op_THREADED_DUPN_JGE,
+        &&op_THREADED_PUSH_SUB_DUP_JEQ, &&op_THREADED_PUSH_SUB_DUP_JNE, &&op_THREADED_PUSH_SUB_DUP_JLT,
+        &&op_THREADED_PUSH_SUB_DUP_JLE, &&op_THREADED_PUSH_SUB_DUP_JGT, &&op_THREADED_PUSH_SUB_DUP_JGE};
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == THREADED_PUSH_SUB_DUP_JGE + 1,
+                  "one handler per opcode");
+
+    if (!PRECISE && nullptr == ip)
+    {
+        handler_table = handlers;
+        return nullptr;
+    }
+#endif
+
+    VM_threaded_instruction const *const base = program.code.data();
+    int target;
+
+    ENTER();
+
+#if VM_COMPUTED_GOTO
+    DISPATCH();
+#else
+dispatch:
+    switch (ip->op)
+    {
+#endif
+
+    HANDLER(PUSH)
+    {
+        TICK();
+        NEED_STACK("PUSH");
+        stack[sp++] = ip->arg;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(POP)
+    {
+        TICK();
+        NEED_ARGS(1, "POP");
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(DUP)
+    {
+        TICK();
+        NEED_ARGS(1, "DUP");
+        NEED_STACK("DUP");
+        stack[sp] = stack[sp - 1];
+        ++sp;
+        NEED_STACK("DUP");
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(DUPN)
+    {
+        TICK();
+        NEED_ARGS(1, "DUPN");
+        NEED_STACK("DUPN");
+        target = ip->arg;
+        if (target <= 0 || target > (int)sp)
+        {
+            FAIL(VM_error::INDEX_OUT_OF_RANGE, "DUPN");
+        }
+        stack[sp] = stack[sp - target];
+        ++sp;
+        NEED_STACK("DUPN");
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(DROPN)
+    {
+        TICK();
+        NEED_ARGS(1, "DROPN");
+        target = ip->arg;
+        if (target <= 0 || target > (int)sp)
+        {
+            FAIL(VM_error::INDEX_OUT_OF_RANGE, "DROPN");
+        }
+        for (unsigned int i = sp - target; i < sp - 1; ++i)
+        {
+            stack[i] = stack[i + 1];
+        }
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(SWAP)
+    {
+        TICK();
+        NEED_ARGS(2, "SWAP");
+        std::swap(stack[sp - 2], stack[sp - 1]);
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(ADD)
+    {
+        TICK();
+        NEED_ARGS(2, "ADD");
+        stack[sp - 2] = stack[sp - 2] + stack[sp - 1];
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(SUB)
+    {
+        TICK();
+        NEED_ARGS(2, "SUB");
+        stack[sp - 2] = stack[sp - 2] - stack[sp - 1];
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(MUL)
+    {
+        TICK();
+        NEED_ARGS(2, "MUL");
+        stack[sp - 2] = stack[sp - 2] * stack[sp - 1];
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(DIV)
+    {
+        TICK();
+        NEED_ARGS(2, "DIV");
+        if (0 == stack[sp - 1])
+        {
+            FAIL(VM_error::DIVISION_BY_ZERO, nullptr);
+        }
+        stack[sp - 2] = stack[sp - 2] / stack[sp - 1];
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(CMP)
+    {
+        TICK();
+        NEED_ARGS(2, "CMP");
+        int lhs = stack[sp - 2];
+        int rhs = stack[sp - 1];
+        stack[sp - 2] = (lhs < rhs) ? -1 : ((lhs > rhs) ? +1 : 0);
+        --sp;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(JMP)
+    {
+        TICK();
+        NEED_TARGET();
+        ip = base + ip->arg;
+        ENTER();
+        DISPATCH();
+    }
+
+    HANDLER(JEQ)
+    {
+        TICK();
+        NEED_ARGS(1, "JEQ");
+        NEED_TARGET();
+        ip = (stack[--sp] == 0) ? base + ip->arg : ip + 1;
+        ENTER();
+        DISPATCH();
+    }
+
+    HANDLER(JNE)
+    {
+        TICK();
+        NEED_ARGS(1, "JNE");
+        NEED_TARGET();
+        ip = (stack[--sp] != 0) ? base + ip->arg : ip + 1;
+        ENTER();
+        DISPATCH();
+    }
+
+    HANDLER(JLT)
+    {
+        TICK();
+        NEED_ARGS(1, "JLT");
+        NEED_TARGET();
+        ip = (stack[--sp] < 0) ? base + ip->arg : ip + 1;
+        ENTER();
+        DISPATCH();
+    }
+
+    HANDLER(JLE)
+    {
+        TICK();
+        NEED_ARGS(1, "JLE");
+        NEED_TARGET();
+        ip = (stack[--sp] <= 0) ? base + ip->arg : ip + 1;
+        ENTER();
+        DISPATCH();
+    }
+
+    HANDLER(JGT)
+    {
+        TICK();
+        NEED_ARGS(1, "JGT");
+        NEED_TARGET();
+        ip = (stack[--sp] > 0) ? base + ip->arg : ip + 1;
+        ENTER();
+        DISPATCH();
+    }
+
+    HANDLER(JGE)
+    {
+        TICK();
+        NEED_ARGS(1, "JGE");
+        NEED_TARGET();
+        ip = (stack[--sp] >= 0) ? base + ip->arg : ip + 1;
+        ENTER();
+        DISPATCH();
+    }
+
+    // Superinstructions.  Each part ticks and fails exactly where the
+    // ordinary instruction would have.
+
+    HANDLER(THREADED_PUSH_ADD)
+    {
+        TICK();
+        NEED_STACK("PUSH");
+        TICK();
+        if (sp < 1)
+        {
+            FAIL_AT(1, VM_error::STACK_UNDERFLOW, "ADD");
+        }
+        stack[sp - 1] = stack[sp - 1] + ip->arg;
+        ++ip;
+        DISPATCH();
+    }
+
+    HANDLER(THREADED_PUSH_SUB)
+    {
+        TICK();
+        NEED_STACK("PUSH");
+        TICK();
+        if (sp < 1)
+        {
+            FAIL_AT(1, VM_error::STACK_UNDERFLOW, "SUB");
+        }
+        stack[sp - 1] = stack[sp - 1] - ip->arg;
+        ++ip;
+        DISPATCH();
+    }
+
+#define FUSED_JUMPS(jxx, test)                                          \
+    HANDLER(THREADED_CMP_##jxx)                                         \
+    {                                                                   \
+        TICK();                                                         \
+        NEED_ARGS(2, "CMP");                                            \
+        TICK();                                                         \
+        NEED_TARGET_AT(1);                                              \
+        sp -= 2;                                                        \
+        ip = (stack[sp] test stack[sp + 1]) ? base + ip->arg : ip + 1;  \
+        ENTER();                                                        \
+        DISPATCH();                                                     \
+    }                                                                   \
+                                                                        \
+    HANDLER(THREADED_DUP_##jxx)                                         \
+    {                                                                   \
+        TICK();                                                         \
+        NEED_ARGS(1, "DUP");                                            \
+        if (sp + 1 >= MAX_STACK_SIZE)                                   \
+        {                                                               \
+            FAIL(VM_error::STACK_OVERFLOW, "DUP");                      \
+        }                                                               \
+        TICK();                                                         \
+        NEED_TARGET_AT(1);                                              \
+        ip = (stack[sp - 1] test 0) ? base + ip->arg : ip + 1;          \
+        ENTER();                                                        \
+        DISPATCH();                                                     \
+    }                                                                   \
+                                                                        \
+    HANDLER(THREADED_DUPN_##jxx)                                        \
+    {                                                                   \
+        TICK();                                                         \
+        NEED_ARGS(1, "DUPN");                                           \
+        NEED_STACK("DUPN");                                             \
+        target = ip->arg2;                                              \
+        if (target <= 0 || target > (int)sp)                            \
+        {                                                               \
+            FAIL(VM_error::INDEX_OUT_OF_RANGE, "DUPN");                 \
+        }                                                               \
+        if (sp + 1 == MAX_STACK_SIZE)                                   \
+        {                                                               \
+            FAIL(VM_error::STACK_OVERFLOW, "DUPN");                     \
+        }                                                               \
+        TICK();                                                         \
+        NEED_TARGET_AT(1);                                              \
+        ip = (stack[sp - target] test 0) ? base + ip->arg : ip + 1;     \
+        ENTER();                                                        \
+        DISPATCH();                                                     \
+    }                                                                   \
+                                                                        \
+    HANDLER(THREADED_PUSH_SUB_DUP_##jxx)                                \
+    {                                                                   \
+        TICK();                                                         \
+        NEED_STACK("PUSH");                                             \
+        TICK();                                                         \
+        if (sp < 1)                                                     \
+        {                                                               \
+            FAIL_AT(1, VM_error::STACK_UNDERFLOW, "SUB");               \
+        }                                                               \
+        stack[sp - 1] = stack[sp - 1] - ip->arg2;                       \
+        TICK();                                                         \
+        if (sp + 1 == MAX_STACK_SIZE)                                   \
+        {                                                               \
+            FAIL_AT(2, VM_error::STACK_OVERFLOW, "DUP");                \
+        }                                                               \
+        TICK();                                                         \
+        NEED_TARGET_AT(3);                                              \
+        ip = (stack[sp - 1] test 0) ? base + ip->arg : ip + 1;          \
+        ENTER();                                                        \
+        DISPATCH();                                                     \
+    }
+
+    FUSED_JUMPS(JEQ, ==)
+    FUSED_JUMPS(JNE, !=)
+    FUSED_JUMPS(JLT, <)
+    FUSED_JUMPS(JLE, <=)
+    FUSED_JUMPS(JGT, >)
+    FUSED_JUMPS(JGE, >=)
+
+#undef FUSED_JUMPS
+
+    HANDLER(THREADED_INVALID)
+    {
+        TICK();
+        FAIL(VM_error::INVALID_OPCODE, nullptr);
+    }
+
+    HANDLER(THREADED_END)
+    {
+        goto done;
+    }
+
+#if !VM_COMPUTED_GOTO
+    }
+#endif
+
+done:
+    return nullptr;
+}
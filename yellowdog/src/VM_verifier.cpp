@@ -0,0 +1,209 @@
+
+#include "VM_verifier.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+VM_verifier::VM_verifier()
+    : verified(false), max_stack(0)
+{
+}
+
+bool VM_verifier::verify(OPCODE const *program, unsigned int length)
+{
+    verified = false;
+    max_stack = 0;
+    low.assign(length + 1, -1);
+    high.assign(length + 1, -1);
+
+    vector<unsigned int> work;
+    visit(0, 0, 0, work);
+
+    while (!work.empty())
+    {
+        unsigned int pc = work.back();
+        work.pop_back();
+
+        const int lo = low[pc];
+        const int hi = high[pc];
+        if (pc == length)
+        {
+            continue; // falling off the end is checked at run time
+        }
+
+        OPCODE op = program[pc++];
+
+        int arg = 0;
+        switch (op)
+        {
+        case PUSH:
+        case DUPN:
+        case DROPN:
+        case JMP:
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JLE:
+        case JGT:
+        case JGE:
+            if (pc + sizeof(int) > length)
+            {
+                return false;
+            }
+            memcpy((void *)&arg, (void *)&program[pc], sizeof(int));
+            pc += sizeof(int);
+            break;
+        }
+
+        // args needed, net effect on the stack, and the deepest the stack
+        // may be afterwards (DUP and DUPN also fail when they fill it)
+        int needed = 0;
+        int effect = 0;
+        int limit = MAX_STACK_SIZE;
+
+        switch (op)
+        {
+        case PUSH:
+            effect = 1;
+            break;
+
+        case POP:
+            needed = 1;
+            effect = -1;
+            break;
+
+        case DUP:
+            needed = 1;
+            effect = 1;
+            limit = MAX_STACK_SIZE - 1;
+            break;
+
+        case DUPN:
+            needed = 1;
+            effect = 1;
+            limit = MAX_STACK_SIZE - 1;
+            if (arg <= 0 || arg > lo)
+            {
+                return false;
+            }
+            break;
+
+        case DROPN:
+            needed = 1;
+            effect = -1;
+            if (arg <= 0 || arg > lo)
+            {
+                return false;
+            }
+            break;
+
+        case SWAP:
+            needed = 2;
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case CMP:
+            needed = 2;
+            effect = -1;
+            break;
+
+        case JMP:
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JLE:
+        case JGT:
+        case JGE:
+            needed = (JMP == op) ? 0 : 1;
+            effect = -needed;
+            break;
+
+        default:
+            return false;
+        }
+
+        if (lo < needed || hi + effect > limit)
+        {
+            return false;
+        }
+
+        if ((unsigned int)(hi + effect) > max_stack)
+        {
+            max_stack = hi + effect;
+        }
+
+        if (op >= JMP && op <= JGE)
+        {
+            if (arg < 0 || arg > (int)length)
+            {
+                return false;
+            }
+            visit(arg, lo + effect, hi + effect, work);
+            if (JMP == op)
+            {
+                continue;
+            }
+        }
+
+        visit(pc, lo + effect, hi + effect, work);
+    }
+
+    verified = true;
+    return verified;
+}
+
+void VM_verifier::visit(unsigned int pc, int lo, int hi, vector<unsigned int> &work)
+{
+    // widen the range already recorded for pc, and look at it again if it
+    // changed.  Ranges only ever grow and are bounded by the stack size, so
+    // this terminates even for loops that keep pushing.
+    if (low[pc] < 0)
+    {
+        low[pc] = lo;
+        high[pc] = hi;
+    }
+    else if (lo < low[pc] || hi > high[pc])
+    {
+        low[pc] = min(low[pc], lo);
+        high[pc] = max(high[pc], hi);
+    }
+    else
+    {
+        return;
+    }
+
+    work.push_back(pc);
+}
+
+bool VM_verifier::is_verified() const
+{
+    return verified;
+}
+
+unsigned int VM_verifier::max_depth() const
+{
+    return max_stack;
+}
+
+int VM_verifier::min_depth_at(unsigned int pc) const
+{
+    if (pc < low.size())
+    {
+        return low[pc];
+    }
+    return -1;
+}
+
+int VM_verifier::max_depth_at(unsigned int pc) const
+{
+    if (pc < high.size())
+    {
+        return high[pc];
+    }
+    return -1;
+}
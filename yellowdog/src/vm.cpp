@@ -3,11 +3,12 @@
 
 #include "vm.hpp"
 #include "VM_executor.hpp"
+#include "VM_mnemonics.hpp"
 
 using namespace std;
 
 VM::VM()
-    : program_size(0u), valid_program(true)
+    : program_size(0u), valid_program(true), image_code(nullptr)
 {
 }
 
@@ -118,42 +119,431 @@ void VM::label(const std::string &target)
         return;
     }
 
-    if (labels.add_or_update(target, program_size) < 0)
+    detach();
+    invalidate();
+    int index = labels.add_or_update(target, program_size);
+    if (index < 0)
     {
         // cerr << "becoming invalid because of bad return code from labels.add_or_update\n";
         valid_program = false;
+        return;
     }
+
+    // patch the jumps that were waiting for this label
+    labels.link(index, program);
 }
 
-VM_exec_status VM::exec(bool verbose) const
+VM_exec_status VM::exec(bool verbose, unsigned int max_ticks) const
 {
     if (!valid_program)
     {
-        return VM_exec_status("Cannot execute invalid program");
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
     }
 
     if (verbose)
     {
         cerr << "Starting program execution\n";
-        labels.dump();
+        if (!image)
+        {
+            labels.dump();
+        }
         cerr << "program_size = " << program_size << "\n";
     }
 
-    VM_executor executor(program, program_size, labels);
-    return executor.exec(verbose);
+    prepare();
+    VM_executor executor(code(), program_size, blocks.runs(), verify());
+    return executor.exec(verbose, max_ticks);
+}
+
+VM_exec_status VM::exec_profiled(VM_profile &profile, unsigned int max_ticks) const
+{
+    if (!valid_program)
+    {
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
+    }
+
+    OPCODE const *program = code();
+    if (!profile.fits(program_size))
+    {
+        profile.prepare(program_size);
+        for (unsigned int op = 0; op < 256; ++op)
+        {
+            VM_mnemonic const *mnemonic = VM_mnemonic_of(op);
+            if (nullptr != mnemonic)
+            {
+                profile.names[op] = mnemonic->name;
+            }
+        }
+        for (unsigned int pc = 0; pc < program_size; )
+        {
+            VM_mnemonic const *mnemonic = VM_mnemonic_of(program[pc]);
+            string text = mnemonic->name;
+            if (VM_operand::NONE != mnemonic->operand)
+            {
+                int val;
+                memcpy((void *)&val, (void *)&program[pc + 1], sizeof(int));
+                text += " " + to_string(val);
+            }
+            const bool jump = VM_operand::LABEL == mnemonic->operand;
+            profile.listing[pc] = {text, jump, jump && JMP != mnemonic->op};
+            pc += VM_operand::NONE == mnemonic->operand ? 1 : 1 + sizeof(int);
+        }
+    }
+
+    prepare();
+    VM_executor executor(program, program_size, blocks.runs(), verify());
+    return executor.exec_profiled(profile, max_ticks);
+}
+
+VM_exec_status VM::exec_traced(VM_trace &trace, unsigned int max_ticks) const
+{
+    if (!valid_program)
+    {
+        return VM_exec_status(VM_error::INVALID_PROGRAM);
+    }
+
+    prepare();
+    VM_executor executor(code(), program_size, blocks.runs(), verify());
+    return executor.exec_traced(trace, max_ticks);
+}
+
+bool VM::bind(VM_executor &executor) const
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    prepare();
+    executor.bind(code(), program_size, blocks.runs(), verify());
+    return true;
+}
+
+VM_exec_status VM::exec_threaded(bool verbose, unsigned int max_ticks) const
+{
+    // only the switch engine knows how to trace
+    if (!valid_program || verbose)
+    {
+        return exec(verbose, max_ticks);
+    }
+
+    prepare();
+    VM_threaded_executor executor(threaded);
+    return executor.exec(max_ticks);
+}
+
+bool VM::verify() const
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    prepare();
+    return verifier.is_verified();
+}
+
+int VM::max_stack_depth() const
+{
+    if (!verify())
+    {
+        return -1;
+    }
+
+    return (int)verifier.max_depth();
+}
+
+bool VM::optimize(VM_peephole_stats *stats)
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    const bool verified = verify();
+    detach();
+    if (!valid_program)
+    {
+        return false;
+    }
+    invalidate();
+
+    vector<bool> labelled(program_size + 1, false);
+    for (int index = 0; index < (int)labels.size(); ++index)
+    {
+        if (labels.pc_at(index) >= 0)
+        {
+            labelled[labels.pc_at(index)] = true;
+        }
+    }
+
+    VM_peephole peephole;
+    vector<int> moved;
+    program_size = peephole.optimize(program, program_size, labelled, verified, moved, stats);
+    labels.relocate(moved);
+    return true;
+}
+
+#if defined(VM_THREADED_STATS)
+unsigned long long VM::threaded_dispatches() const
+{
+    return threaded.dispatches;
+}
+#endif
+
+bool VM::save(const std::string &path) const
+{
+    if (!valid_program)
+    {
+        return false;
+    }
+
+    VM_image_writer writer(VM_image_machine::YELLOWDOG);
+    writer.add(VM_image_section::CODE, code(), program_size);
+    if (image)
+    {
+        // still as loaded
+        size_t size;
+        void const *names = image->section(VM_image_section::LABELS, size);
+        writer.add(VM_image_section::LABELS, names, size);
+    }
+    else
+    {
+        vector<unsigned char> names = labels.serialize();
+        writer.add(VM_image_section::LABELS, names.data(), names.size());
+    }
+    return writer.write(path);
+}
+
+bool VM::load(const std::string &path)
+{
+    shared_ptr<VM_image> loaded(new VM_image);
+    if (!loaded->open(path, VM_image_machine::YELLOWDOG))
+    {
+        return false;
+    }
+
+    size_t size;
+    OPCODE const *loaded_code = static_cast<OPCODE const *>(loaded->section(VM_image_section::CODE, size));
+    if (nullptr == loaded_code || size > MAX_PROGRAM_SIZE)
+    {
+        return false;
+    }
+
+    // Only what the builder could have produced: the engines read
+    // operands without checking that they fit, and jump where they are
+    // told, so a jump goes to the start of an instruction, to the end or,
+    // for a label never defined, to -1.
+    vector<bool> starts(size + 1, false);
+    vector<int> jumps;
+    for (size_t pc = 0; pc < size; ++pc)
+    {
+        starts[pc] = true;
+        OPCODE op = loaded_code[pc];
+        if (op < PUSH || op > DROPN)
+        {
+            return false;
+        }
+        if (PUSH == op || DUPN == op || DROPN == op || (op >= JMP && op <= JGE))
+        {
+            if (size - pc - 1 < sizeof(int))
+            {
+                return false;
+            }
+            if (op >= JMP && op <= JGE)
+            {
+                int to;
+                memcpy((void *)&to, (void *)&loaded_code[pc + 1], sizeof(int));
+                jumps.push_back(to);
+            }
+            pc += sizeof(int);
+        }
+    }
+    starts[size] = true;
+    for (int to : jumps)
+    {
+        if (-1 != to && (to < 0 || (size_t)to > size || !starts[to]))
+        {
+            return false;
+        }
+    }
+
+    // and labels that fit it, read now rather than when the program is
+    // next changed
+    VM_labels table;
+    size_t names_size;
+    void const *names = loaded->section(VM_image_section::LABELS, names_size);
+    if (!table.deserialize(names, names_size, (unsigned int)size))
+    {
+        return false;
+    }
+
+    image = loaded;
+    image_code = loaded_code;
+    program_size = (unsigned int)size;
+    valid_program = true;
+    labels = table;
+    invalidate();
+    return true;
+}
+
+void VM::disassemble(std::ostream &out) const
+{
+    if (!valid_program)
+    {
+        return;
+    }
+
+    OPCODE const *program = code();
+
+    vector<vector<int>> names(program_size + 1);
+    for (int index = 0; index < (int)labels.size(); ++index)
+    {
+        if (labels.pc_at(index) >= 0)
+        {
+            names[labels.pc_at(index)].push_back(index);
+        }
+    }
+
+    auto operand_of = [program](unsigned int pc) {
+        int target;
+        memcpy((void *)&target, (void *)&program[pc + 1], sizeof(int));
+        return target;
+    };
+    auto is_jump = [](VM_mnemonic const *mnemonic) {
+        return VM_operand::LABEL == mnemonic->operand;
+    };
+    auto step = [](VM_mnemonic const *mnemonic) {
+        return VM_operand::NONE == mnemonic->operand ? 1u : 1u + sizeof(int);
+    };
+
+    // jump targets with no label of their own
+    vector<bool> unnamed(program_size + 1, false);
+    for (unsigned int pc = 0; pc < program_size; pc += step(VM_mnemonic_of(program[pc])))
+    {
+        const int target = operand_of(pc);
+        if (is_jump(VM_mnemonic_of(program[pc])) && target >= 0 && names[target].empty())
+        {
+            unnamed[target] = true;
+        }
+    }
+
+    for (unsigned int pc = 0; pc <= program_size; )
+    {
+        for (int index : names[pc])
+        {
+            out << labels.name_at(index) << ":\n";
+        }
+        if (unnamed[pc])
+        {
+            out << ".L" << pc << ":\n";
+        }
+        if (pc == program_size)
+        {
+            break;
+        }
+
+        VM_mnemonic const *mnemonic = VM_mnemonic_of(program[pc]);
+        out << "    " << mnemonic->name;
+        if (is_jump(mnemonic))
+        {
+            const int target = operand_of(pc);
+            if (target < 0)
+            {
+                out << " " << labels.name_at(labels.pending_at(pc + 1));
+            }
+            else if (names[target].empty())
+            {
+                out << " .L" << target;
+            }
+            else
+            {
+                out << " " << labels.name_at(names[target].front());
+            }
+        }
+        else if (VM_operand::VALUE == mnemonic->operand)
+        {
+            out << " " << operand_of(pc);
+        }
+        out << "\n";
+        pc += step(mnemonic);
+    }
+}
+
+void VM::invalidate()
+{
+    prepared.done.store(false, memory_order_relaxed);
+}
+
+VM::preparation::preparation()
+    : done(false)
+{
+}
+
+VM::preparation::preparation(preparation const &)
+    : done(false)
+{
+}
+
+VM::preparation &VM::preparation::operator=(preparation const &)
+{
+    done.store(false, memory_order_relaxed);
+    return *this;
+}
+
+void VM::prepare() const
+{
+    if (prepared.done.load(memory_order_acquire))
+    {
+        return;
+    }
+
+    lock_guard<mutex> hold(prepared.lock);
+    if (!prepared.done.load(memory_order_relaxed))
+    {
+        verifier.verify(code(), program_size);
+        blocks.analyse(code(), program_size);
+        threaded.translate(code(), program_size);
+        prepared.done.store(true, memory_order_release);
+    }
+}
+
+OPCODE const *VM::code() const
+{
+    return image ? image_code : program;
+}
+
+void VM::detach()
+{
+    // copy a loaded program out of the image before changing it; its
+    // labels were read when it was loaded
+    if (image)
+    {
+        memcpy(program, image_code, program_size);
+        image.reset();
+        image_code = nullptr;
+    }
 }
 
 void VM::maybe_add_jmp(OPCODE op, string const &target)
 {
     if (maybe_add_op(op))
     {
+        // the operand is the target pc, or -1 until the label is defined
         int index = labels.add_or_update(target, -1);
-        maybe_add_arg(index);
+        int pc = labels.pc_at(index);
+        unsigned int operand = program_size;
+        if (maybe_add_arg(pc) && pc < 0)
+        {
+            labels.refer(index, operand);
+        }
     }
 }
 
 bool VM::maybe_add_op(OPCODE op)
 {
+    detach();
+    invalidate();
     if (valid_program)
     {
         if (program_size < MAX_PROGRAM_SIZE)
@@ -1,8 +1,22 @@
 
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include "../include/vm.hpp"
+#include "VM_assembler.hpp"
+#include "VM_image.hpp"
+#include "VM_ir_builder.hpp"
+#include "VM_ir_lowering.hpp"
+#include "VM_ir_optimizer.hpp"
+#include "VM_mnemonics.hpp"
 #include "Runner.hpp"
 
 using namespace std;
@@ -342,6 +356,42 @@ bool duplicate_label()
     return EXPECT_ERROR(vm, "Duplicate Label");
 }
 
+bool forward_and_backward_labels()
+{
+    // Test and Done are used before they are defined and patched later;
+    // Loop is already defined when its jump is added
+    VM vm;
+    vm.push(3);
+    vm.jmp("Test");
+    vm.label("Loop");
+    vm.push(1);
+    vm.sub();
+    vm.label("Test");
+    vm.dup();
+    vm.jgt("Loop");
+    vm.jmp("Done");
+    vm.push(99);
+    vm.label("Done");
+
+    return EXPECT_VALUE(vm, "Forward And Backward Labels", 0);
+}
+
+bool many_labels()
+{
+    VM vm;
+    vm.push(7);
+    vm.jmp("L2999");
+    vm.jmp("L0");
+    vm.push(100);
+    vm.add();
+    for (int i = 0; i < 3000; ++i)
+    {
+        vm.label("L" + to_string(i));
+    }
+
+    return EXPECT_VALUE(vm, "Many Labels", 7);
+}
+
 bool run_too_long()
 {
     VM vm;
@@ -468,9 +518,8 @@ void jmp_suite(Runner &runner, void (VM::*op)(const std::string &), const char *
     });
 }
 
-bool factorial_test(int arg, string const &label, int res)
+void factorial_program(VM &vm, int arg)
 {
-    VM vm;
     vm.push(arg);
     vm.dup();
     vm.jlt("ERROR_CASE");
@@ -499,7 +548,12 @@ bool factorial_test(int arg, string const &label, int res)
     vm.jmp("EXIT");
 
     vm.label("EXIT");
+}
 
+bool factorial_test(int arg, string const &label, int res)
+{
+    VM vm;
+    factorial_program(vm, arg);
     return EXPECT_VALUE(vm, label, res);
 }
 
@@ -519,11 +573,9 @@ void factorial_suite(Runner &runner)
     });
 }
 
-bool fibonacci_test(int arg, string const &label, int res)
+void fibonacci_program(VM &vm, int arg)
 {
     /* TODO:  This program does not leave the stack clean.  VM help is needed */
-    
-    VM vm;
 
     // init the stack
     vm.push(arg);
@@ -574,7 +626,12 @@ bool fibonacci_test(int arg, string const &label, int res)
     vm.pop();
 
     vm.label("EXIT");
+}
 
+bool fibonacci_test(int arg, string const &label, int res)
+{
+    VM vm;
+    fibonacci_program(vm, arg);
     return EXPECT_VALUE(vm, label, res);
 }
 
@@ -591,6 +648,1198 @@ void fibonacci_suite(Runner &runner)
     });
 }
 
+bool expect_error_code(VM const &vm, string const &label, VM_error error, string const &message)
+{
+    VM_exec_status status = vm.exec();
+    if (status.get_error() != error || status.get_message() != message)
+    {
+        cerr << "[FAIL] " << label << ", expected \"" << message << "\", got \"" << status.get_message() << "\"\n";
+        return false;
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+void error_code_suite(Runner &runner)
+{
+    runner([]() -> bool {
+        VM vm;
+        vm.push(1);
+        vm.add();
+        return expect_error_code(vm, "Error Code Underflow", VM_error::STACK_UNDERFLOW,
+                                 "Not enough arguments on stack for ADD");
+    });
+    runner([]() -> bool {
+        VM vm;
+        vm.push(0);
+        vm.dropn(5);
+        return expect_error_code(vm, "Error Code DropN", VM_error::INDEX_OUT_OF_RANGE, "DROPN index out of range");
+    });
+    runner([]() -> bool {
+        VM vm;
+        vm.push(1);
+        vm.label("Start");
+        vm.dup();
+        vm.jmp("Start");
+        return expect_error_code(vm, "Error Code Overflow", VM_error::STACK_OVERFLOW, "Stack overflow on DUP");
+    });
+    runner([]() -> bool {
+        VM vm;
+        return expect_error_code(vm, "Error Code No Value", VM_error::NO_VALUE, "Program produced no value");
+    });
+}
+
+bool expect_verified(VM const &vm, string const &label, bool verified, int depth)
+{
+    if (vm.verify() != verified || vm.max_stack_depth() != depth)
+    {
+        cerr << "[FAIL] " << label << ", expected " << (verified ? "verified" : "unverified") << " with depth "
+             << depth << ", got " << vm.max_stack_depth() << "\n";
+        return false;
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+void verify_test(Runner &runner, string const &label, bool verified, int depth, function<void(VM &)> build)
+{
+    runner([label, verified, depth, build]() -> bool {
+        VM vm;
+        build(vm);
+        return expect_verified(vm, "Verify " + label, verified, depth);
+    });
+}
+
+void verify_suite(Runner &runner)
+{
+    verify_test(runner, "Empty", true, 0, [](VM &vm) {});
+    verify_test(runner, "Longer Prog", true, 3, [](VM &vm) {
+        vm.push(2);
+        vm.dup();
+        vm.mul();
+        vm.push(5);
+        vm.push(2);
+        vm.add();
+        vm.sub();
+    });
+    verify_test(runner, "Pop from Empty", false, -1, [](VM &vm) {
+        vm.pop();
+    });
+    verify_test(runner, "DupN Too Few", false, -1, [](VM &vm) {
+        vm.push(0);
+        vm.dupn(5);
+    });
+    verify_test(runner, "Missing Label", false, -1, [](VM &vm) {
+        vm.push(0);
+        vm.jeq("L00");
+    });
+    verify_test(runner, "Overflow Push", false, -1, [](VM &vm) {
+        vm.label("Start");
+        vm.push(1);
+        vm.jmp("Start");
+    });
+    verify_test(runner, "Unreachable Pop", true, 1, [](VM &vm) {
+        vm.push(1);
+        vm.jmp("L00");
+        vm.pop();
+        vm.pop();
+        vm.label("L00");
+    });
+    verify_test(runner, "factorial", true, 3, [](VM &vm) {
+        factorial_program(vm, 5);
+    });
+    verify_test(runner, "fibonacci", true, 6, [](VM &vm) {
+        fibonacci_program(vm, 8);
+    });
+    runner([]() -> bool {
+        VM vm;
+        factorial_program(vm, 5);
+        vm.verify();
+        vm.pop();
+        vm.pop();
+        return expect_verified(vm, "Verify After Change", false, -1);
+    });
+}
+
+bool expect_same_as_switch(VM const &vm, string const &label)
+{
+    VM_exec_status exp = vm.exec();
+    VM_exec_status act = vm.exec_threaded();
+
+    if (exp.get_error() != act.get_error() ||
+        exp.get_program_value() != act.get_program_value() ||
+        exp.get_message() != act.get_message() ||
+        exp.get_ticks() != act.get_ticks())
+    {
+        cerr << "[FAIL] " << label << ", expected " << exp.get_program_value() << " (" << exp.get_message()
+             << "), got " << act.get_program_value() << " (" << act.get_message() << ")\n";
+        return false;
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+void threaded_test(Runner &runner, string const &label, function<void(VM &)> build)
+{
+    runner([label, build]() -> bool {
+        VM vm;
+        build(vm);
+        return expect_same_as_switch(vm, "Threaded " + label);
+    });
+}
+
+void threaded_suite(Runner &runner)
+{
+    threaded_test(runner, "Empty", [](VM &vm) {});
+    threaded_test(runner, "Longer Prog", [](VM &vm) {
+        vm.push(2);
+        vm.dup();
+        vm.mul();
+        vm.push(5);
+        vm.push(2);
+        vm.add();
+        vm.sub();
+    });
+    threaded_test(runner, "Div by Zero", [](VM &vm) {
+        vm.push(1);
+        vm.push(0);
+        vm.div();
+    });
+    threaded_test(runner, "Add Too Few", [](VM &vm) {
+        vm.push(1);
+        vm.add();
+    });
+    threaded_test(runner, "DupN Too Few", [](VM &vm) {
+        vm.push(0);
+        vm.dupn(5);
+    });
+    threaded_test(runner, "DropN Middle", [](VM &vm) {
+        vm.push(10);
+        vm.push(20);
+        vm.push(30);
+        vm.dropn(2);
+        vm.add();
+    });
+    threaded_test(runner, "Overflow Push", [](VM &vm) {
+        vm.label("Start");
+        vm.push(1);
+        vm.jmp("Start");
+    });
+    threaded_test(runner, "Overflow Dup", [](VM &vm) {
+        vm.push(1);
+        vm.label("Start");
+        vm.dup();
+        vm.jmp("Start");
+    });
+    threaded_test(runner, "Run Too Long", [](VM &vm) {
+        vm.push(0);
+        vm.label("X");
+        vm.push(1);
+        vm.add();
+        vm.jmp("X");
+    });
+    threaded_test(runner, "Missing Label", [](VM &vm) {
+        vm.push(0);
+        vm.jeq("L00");
+    });
+    threaded_test(runner, "Cmp Jump", [](VM &vm) {
+        vm.push(3);
+        vm.push(2);
+        vm.cmp();
+        vm.jgt("L00");
+        vm.push(0);
+        vm.jmp("L01");
+        vm.label("L00");
+        vm.push(1);
+        vm.label("L01");
+    });
+
+    // sequences the translation fuses into superinstructions
+    threaded_test(runner, "Fused Countdown", [](VM &vm) {
+        vm.push(5);
+        vm.label("L00");
+        vm.push(1);
+        vm.sub();
+        vm.dup();
+        vm.jgt("L00");
+    });
+    threaded_test(runner, "Fused Push Add", [](VM &vm) {
+        vm.push(2);
+        vm.push(3);
+        vm.add();
+        vm.push(4);
+        vm.sub();
+    });
+    threaded_test(runner, "Fused Missing Label", [](VM &vm) {
+        vm.push(1);
+        vm.push(2);
+        vm.cmp();
+        vm.jlt("L00");
+    });
+    threaded_test(runner, "Fused Countdown Missing Label", [](VM &vm) {
+        vm.push(5);
+        vm.push(1);
+        vm.sub();
+        vm.dup();
+        vm.jgt("L00");
+    });
+    threaded_test(runner, "Fused Sub Too Few", [](VM &vm) {
+        vm.push(1);
+        vm.sub();
+        vm.dup();
+        vm.jgt("L00");
+    });
+    threaded_test(runner, "Fused DupN Out of Range", [](VM &vm) {
+        vm.push(1);
+        vm.dupn(3);
+        vm.jeq("L00");
+        vm.label("L00");
+    });
+    threaded_test(runner, "Fused Overflow", [](VM &vm) {
+        vm.label("L00");
+        vm.push(1);
+        vm.dup();
+        vm.jne("L00");
+    });
+    threaded_test(runner, "Fused DupN Overflow", [](VM &vm) {
+        vm.label("L00");
+        vm.push(1);
+        vm.dupn(1);
+        vm.jne("L00");
+    });
+    threaded_test(runner, "Jump Into Sequence", [](VM &vm) {
+        vm.push(2);
+        vm.push(3);
+        vm.jmp("L01");
+        vm.label("L00");
+        vm.push(4);
+        vm.label("L01");
+        vm.add();
+    });
+
+    for (int arg : {-1, 0, 1, 5})
+    {
+        threaded_test(runner, "factorial " + to_string(arg), [arg](VM &vm) {
+            factorial_program(vm, arg);
+        });
+    }
+    for (int arg : {0, 1, 8})
+    {
+        threaded_test(runner, "fibonacci " + to_string(arg), [arg](VM &vm) {
+            fibonacci_program(vm, arg);
+        });
+    }
+}
+
+bool budget_test(bool threaded)
+{
+    const string label = threaded ? "Budget Threaded" : "Budget";
+
+    VM factorial;
+    factorial_program(factorial, 5);
+    VM fibonacci;
+    fibonacci_program(fibonacci, 8);
+
+    for (VM *vm : {&factorial, &fibonacci})
+    {
+        const unsigned int needed = vm->exec().get_ticks();
+
+        // every budget must behave as if ticks were counted one at a time
+        for (unsigned int budget = 0; budget <= needed + 1; ++budget)
+        {
+            VM_exec_status status = threaded ? vm->exec_threaded(false, budget) : vm->exec(false, budget);
+            bool ok = (budget >= needed) ? status.is_status_ok() && status.get_ticks() == needed
+                                         : status.get_error() == VM_error::MAX_RUNTIME && status.get_ticks() == budget + 1;
+            if (!ok)
+            {
+                cerr << "[FAIL] " << label << ", wrong result with budget " << budget << "\n";
+                return false;
+            }
+        }
+    }
+
+    // a failure part way through a run only counts what actually ran
+    VM broken;
+    broken.push(1);
+    broken.push(0);
+    broken.div();
+    broken.push(2);
+    broken.push(3);
+    VM_exec_status status = threaded ? broken.exec_threaded() : broken.exec();
+    if (status.get_error() != VM_error::DIVISION_BY_ZERO || status.get_ticks() != 3)
+    {
+        cerr << "[FAIL] " << label << ", expected 3 ticks, got " << status.get_ticks() << "\n";
+        return false;
+    }
+
+    cerr << "[PASS] " << label << "\n";
+    return true;
+}
+
+bool save_and_load(VM const &saved, VM &loaded)
+{
+    const char *path = "yellowdog_image.k9i";
+    bool ok = saved.save(path) && loaded.load(path);
+    remove(path);
+    return ok;
+}
+
+bool image_round_trip(int arg)
+{
+    const string label = "Image Factorial " + to_string(arg);
+
+    VM saved;
+    factorial_program(saved, arg);
+    VM loaded;
+    if (!save_and_load(saved, loaded))
+    {
+        cerr << "[FAIL] " << label << ", could not save and load\n";
+        return false;
+    }
+
+    VM_exec_status exp = saved.exec();
+    VM_exec_status act = loaded.exec();
+    VM_exec_status threaded = loaded.exec_threaded();
+    bool ok = loaded.verify() && loaded.max_stack_depth() == saved.max_stack_depth() &&
+              exp.get_error() == act.get_error() && exp.get_program_value() == act.get_program_value() &&
+              exp.get_ticks() == act.get_ticks() && act.get_program_value() == threaded.get_program_value();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    return ok;
+}
+
+bool image_extended()
+{
+    // the jump to Done is still waiting for its label when saved
+    VM saved;
+    saved.push(5);
+    saved.jmp("Done");
+    saved.label("Back");
+    saved.push(1);
+    VM loaded;
+    if (!save_and_load(saved, loaded))
+    {
+        cerr << "[FAIL] Image Extended, could not save and load\n";
+        return false;
+    }
+
+    loaded.push(2);
+    loaded.label("Done");
+    loaded.push(3);
+    loaded.add();
+    return EXPECT_VALUE(loaded, "Image Extended", 8);
+}
+
+// Change one byte of a saved image and expect the load to fail.
+bool image_damaged(string const &label, long offset)
+{
+    const char *path = "yellowdog_image.k9i";
+    VM saved;
+    factorial_program(saved, 3);
+    saved.save(path);
+
+    vector<char> bytes;
+    {
+        ifstream in(path, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    bytes[offset < 0 ? bytes.size() + offset : offset] ^= 1;
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(bytes.data(), bytes.size());
+    }
+
+    VM vm;
+    vm.push(7);
+    bool ok = !vm.load(path);
+    remove(path);
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << ", loaded a damaged image\n";
+        return false;
+    }
+
+    // a failed load leaves the program alone
+    return EXPECT_VALUE(vm, label, 7);
+}
+
+// An image, checksummed as it should be, of PUSH 1 then a jump to to.
+bool image_jump(string const &label, int to, bool loads)
+{
+    const char *path = "yellowdog_image.k9i";
+    vector<unsigned char> code = {PUSH, 1, 0, 0, 0, JMP, 0, 0, 0, 0};
+    memcpy((void *)&code[6], (void *)&to, sizeof(int));
+    VM_image_writer writer(VM_image_machine::YELLOWDOG);
+    writer.add(VM_image_section::CODE, code.data(), code.size());
+
+    VM vm;
+    vm.push(7);
+    bool ok = writer.write(path) && loads == vm.load(path);
+    remove(path);
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << (loads ? ", did not load\n" : ", loaded a jump out of place\n");
+        return false;
+    }
+    return loads ? EXPECT_VALUE(vm, label, 1) : EXPECT_VALUE(vm, label, 7);
+}
+
+// An image of PUSH 1 with a label table of the words given, which does
+// not fit it.
+bool image_bad_labels(string const &label, vector<unsigned int> const &words)
+{
+    const char *path = "yellowdog_image.k9i";
+    vector<unsigned char> code = {PUSH, 1, 0, 0, 0};
+    VM_image_writer writer(VM_image_machine::YELLOWDOG);
+    writer.add(VM_image_section::CODE, code.data(), code.size());
+    writer.add(VM_image_section::LABELS, words.data(), words.size() * sizeof(unsigned int));
+
+    VM vm;
+    vm.push(7);
+    bool ok = writer.write(path) && !vm.load(path);
+    remove(path);
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << ", loaded labels that do not fit\n";
+        return false;
+    }
+    return EXPECT_VALUE(vm, label, 7);
+}
+
+void image_suite(Runner &runner)
+{
+    for (int arg : {-1, 0, 5})
+    {
+        runner([arg]() -> bool { return image_round_trip(arg); });
+    }
+    runner(image_extended);
+    runner([]() -> bool { return image_damaged("Image Checksum", -1); });
+    runner([]() -> bool { return image_damaged("Image Version", 4); });
+    runner([]() -> bool { return image_damaged("Image Machine", 12); });
+    runner([]() -> bool { return image_jump("Image Jump To End", 10, true); });
+    runner([]() -> bool { return image_jump("Image Jump Far", 100000000, false); });
+    runner([]() -> bool { return image_jump("Image Jump Into Operand", 2, false); });
+    runner([]() -> bool { return image_jump("Image Jump Back", -5, false); });
+    runner([]() -> bool { return image_bad_labels("Image Label Name Wraps", {0, 0xFFFFFFFD, 0, 0}); });
+    runner([]() -> bool { return image_bad_labels("Image Label Name Long", {0, 100, 0, 0}); });
+    runner([]() -> bool { return image_bad_labels("Image Label Past End", {6, 1, 0, 'A'}); });
+}
+
+const char *const FACTORIAL_SOURCE = R"(
+; factorial of the number pushed first, -1 for negative numbers
+        push 5
+        DUP
+        JLT ERROR_CASE
+        PUSH 1              # the accumulator
+LOOP:   DUPN 2
+        JLE LOOP_EXIT
+        DUPN 2
+        MUL
+        SWAP
+        PUSH 0x1
+        SUB
+        SWAP
+        JMP LOOP
+LOOP_EXIT:
+        SWAP
+        POP
+        JMP EXIT
+ERROR_CASE: PUSH -1
+        JMP EXIT
+EXIT:
+)";
+
+string disassembly(VM const &vm)
+{
+    ostringstream out;
+    vm.disassemble(out);
+    return out.str();
+}
+
+bool assemble_factorial()
+{
+    VM vm;
+    VM_assembler assembler;
+    if (!assembler.assemble(FACTORIAL_SOURCE, vm))
+    {
+        cerr << "[FAIL] Assemble Factorial, " << assembler.error() << "\n";
+        return false;
+    }
+
+    VM built;
+    factorial_program(built, 5);
+    if (disassembly(vm) != disassembly(built))
+    {
+        cerr << "[FAIL] Assemble Factorial, differs from the built program\n";
+        return false;
+    }
+    return EXPECT_VALUE(vm, "Assemble Factorial", 120);
+}
+
+bool assemble_stream()
+{
+    VM vm;
+    VM_assembler assembler;
+    istringstream in(FACTORIAL_SOURCE);
+    if (!assembler.assemble(in, vm))
+    {
+        cerr << "[FAIL] Assemble Stream, " << assembler.error() << "\n";
+        return false;
+    }
+    return EXPECT_VALUE(vm, "Assemble Stream", 120);
+}
+
+// Disassembling and assembling again gives the same program.
+bool disassemble_round_trip(string const &label, VM const &vm)
+{
+    VM again;
+    VM_assembler assembler;
+    const string source = disassembly(vm);
+    bool ok = assembler.assemble(source, again) && disassembly(again) == source;
+    if (ok)
+    {
+        VM_exec_status exp = vm.exec();
+        VM_exec_status act = again.exec();
+        ok = exp.get_error() == act.get_error() && exp.get_program_value() == act.get_program_value();
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    if (!ok)
+    {
+        cerr << source << assembler.error() << "\n";
+    }
+    return ok;
+}
+
+bool disassemble_pending_label()
+{
+    // the jump to Done has no target yet; it must still refer to Done
+    VM vm;
+    vm.push(1);
+    vm.jmp("Done");
+    vm.label("Back");
+    vm.push(2);
+    vm.jgt("Back");
+
+    VM_assembler assembler;
+    VM again;
+    bool ok = assembler.assemble(disassembly(vm), again) &&
+              assembler.assemble("PUSH 3\nDone:\n", again);
+    if (!ok)
+    {
+        cerr << "[FAIL] Disassemble Pending Label, " << assembler.error() << "\n";
+        return false;
+    }
+    return EXPECT_VALUE(again, "Disassemble Pending Label", 1);
+}
+
+bool assembler_error(string const &label, string const &source, string const &expected)
+{
+    VM vm;
+    VM_assembler assembler;
+    bool ok = !assembler.assemble(source, vm) && assembler.error() == expected;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << label << "\n";
+    if (!ok)
+    {
+        cerr << "\texpected \"" << expected << "\", got \"" << assembler.error() << "\"\n";
+    }
+    return ok;
+}
+
+void assembler_suite(Runner &runner)
+{
+    runner(assemble_factorial);
+    runner(assemble_stream);
+    runner([]() -> bool {
+        VM vm;
+        factorial_program(vm, 4);
+        return disassemble_round_trip("Disassemble Factorial", vm);
+    });
+    runner([]() -> bool {
+        VM saved;
+        factorial_program(saved, 4);
+        saved.save("yellowdog_image.k9i");
+        VM vm;
+        vm.load("yellowdog_image.k9i");
+        remove("yellowdog_image.k9i");
+        return disassemble_round_trip("Disassemble Image", vm);
+    });
+    runner([]() -> bool {
+        // jumps name the first of the labels at their target
+        VM vm;
+        vm.push(0);
+        vm.label("L");
+        vm.label("M");
+        vm.push(1);
+        vm.add();
+        vm.dup();
+        vm.push(3);
+        vm.cmp();
+        vm.jlt("M");
+        return disassemble_round_trip("Disassemble Two Labels", vm);
+    });
+    runner(disassemble_pending_label);
+
+    runner([]() -> bool {
+        return assembler_error("Assembler Unknown", "PUSH 1\n\n  FROB\n", "line 3: unknown instruction at 'FROB'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler No Number", "PUSH\n", "line 1: expected a number at the end of the line");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Range", "PUSH 2147483648", "line 1: number out of range at '2147483648'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Trailing", "DUP 1", "line 1: expected the end of the line at '1'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Label", "JMP 12", "line 1: expected a label at '12'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Junk", "PUSH 1 ; fine\n@", "line 2: expected an instruction or a label at '@'");
+    });
+    runner([]() -> bool {
+        return assembler_error("Assembler Bad Number", "PUSH 12ab", "line 1: expected a number at '12ab'");
+    });
+}
+
+// pc of the first instruction whose listing starts with text
+unsigned int profiled_pc(VM_profile const &profile, string const &text)
+{
+    for (unsigned int pc = 0; pc < profile.listing.size(); ++pc)
+    {
+        if (0 == profile.listing[pc].text.compare(0, text.size(), text))
+        {
+            return pc;
+        }
+    }
+    return 0;
+}
+
+bool profile_factorial()
+{
+    VM vm;
+    factorial_program(vm, 5);
+
+    VM_profile profile;
+    VM_exec_status exp = vm.exec();
+    VM_exec_status first = vm.exec_profiled(profile);
+    VM_exec_status second = vm.exec_profiled(profile);
+
+    uint64_t hits = 0;
+    uint64_t ops = 0;
+    uint64_t time = 0;
+    for (unsigned int pc = 0; pc < profile.hits.size(); ++pc)
+    {
+        hits += profile.hits[pc];
+        time += profile.time[pc];
+    }
+    for (uint64_t count : profile.ops)
+    {
+        ops += count;
+    }
+
+    // the loop test runs once per multiplication and once more to leave
+    const unsigned int loop_test = profiled_pc(profile, "JLE");
+    ostringstream report, folded;
+    profile.report(report);
+    profile.folded(folded);
+
+    bool ok = first.get_program_value() == exp.get_program_value() && first.get_ticks() == exp.get_ticks() &&
+              second.get_program_value() == exp.get_program_value() && 2 == profile.executions &&
+              hits == 2 * exp.get_ticks() && ops == hits && 10 == profile.ops[MUL] &&
+              12 == profile.hits[loop_test] && 2 == profile.taken[loop_test] &&
+              profile.listing[loop_test].conditional && !profile.listing[profiled_pc(profile, "JMP")].conditional &&
+              time > 0 && string::npos != report.str().find("JLE") && string::npos != folded.str().find("vm;");
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Profile Factorial\n";
+    return ok;
+}
+
+bool profile_error()
+{
+    // stops on the division, which is counted
+    VM vm;
+    vm.push(1);
+    vm.push(0);
+    vm.div();
+    vm.push(2);
+
+    VM_profile profile;
+    VM_exec_status status = vm.exec_profiled(profile);
+    bool ok = VM_error::DIVISION_BY_ZERO == status.get_error() && 3 == status.get_ticks() &&
+              1 == profile.ops[DIV] && 2 == profile.ops[PUSH] && 1 == profile.executions;
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Profile Error\n";
+    return ok;
+}
+
+// what a verbose run writes to cerr
+string verbose_output(VM &vm)
+{
+    ostringstream out;
+    streambuf *saved = cerr.rdbuf(out.rdbuf());
+    vm.exec(true);
+    cerr.rdbuf(saved);
+    return out.str();
+}
+
+string decoded(vector<VM_trace_record> const &records)
+{
+    ostringstream out;
+    for (VM_trace_record const &record : records)
+    {
+        VM_write_trace(out, record);
+    }
+    return out.str();
+}
+
+bool trace_matches_verbose()
+{
+    VM vm;
+    factorial_program(vm, 5);
+
+    VM_trace trace;
+    VM_exec_status status = vm.exec_traced(trace);
+    vector<VM_trace_record> records = trace.last(trace.capacity());
+
+    bool ok = 120 == status.get_program_value() && status.get_ticks() == trace.recorded() &&
+              status.get_ticks() == records.size() && 1 == records.front().tick &&
+              string::npos != verbose_output(vm).find(decoded(records));
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Trace Matches Verbose\n";
+    return ok;
+}
+
+bool trace_keeps_last()
+{
+    VM vm;
+    factorial_program(vm, 5);
+
+    // a ring of 8 keeps 7
+    VM_trace trace(5);
+    VM_exec_status status = vm.exec_traced(trace);
+    vector<VM_trace_record> records = trace.last(100);
+
+    bool ok = 7 == trace.capacity() && status.get_ticks() == trace.recorded() && 7 == records.size() &&
+              status.get_ticks() == records.back().tick && records.back().tick - 6 == records.front().tick &&
+              3 == trace.last(3).size() && records.back().pc == trace.last(1).front().pc;
+
+    trace.clear();
+    ok = ok && 0 == trace.recorded() && trace.last(7).empty();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Trace Keeps Last\n";
+    return ok;
+}
+
+bool trace_error()
+{
+    // the last record is the division, with the stack it failed on
+    VM vm;
+    vm.push(1);
+    vm.push(0);
+    vm.div();
+
+    VM_trace trace;
+    VM_exec_status status = vm.exec_traced(trace);
+    vector<VM_trace_record> records = trace.last(1);
+    ostringstream text;
+    VM_write_trace(text, records.back());
+
+    bool ok = VM_error::DIVISION_BY_ZERO == status.get_error() && 1 == records.size() &&
+              DIV == records.back().op && 2 == records.back().depth && 0 == records.back().values[0] &&
+              1 == records.back().values[1] && "---------------------\nSTACK[2]: 0 1 \nPC: 10\nop: " +
+              to_string(DIV) + "\nDIV\n" == text.str();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Trace Error\n";
+    return ok;
+}
+
+bool executor_reuse()
+{
+    VM vm;
+    factorial_program(vm, 5);
+    VM_exec_status exp = vm.exec();
+
+    VM_executor executor;
+    bool ok = VM_error::NO_VALUE == executor.exec(false).get_error() && vm.bind(executor);
+    for (int run = 0; run < 3; ++run)
+    {
+        VM_exec_status act = executor.exec(false);
+        ok = ok && act.is_status_ok() && exp.get_program_value() == act.get_program_value() &&
+             exp.get_ticks() == act.get_ticks();
+    }
+
+    // a failed run leaves nothing behind for the next program
+    VM bad;
+    bad.push(1);
+    bad.push(0);
+    bad.div();
+    VM good;
+    good.push(7);
+    VM invalid;
+    for (int i = 0; i < 1009; ++i)
+    {
+        invalid.push(i);
+    }
+    ok = ok && bad.bind(executor) && VM_error::DIVISION_BY_ZERO == executor.exec(false).get_error() &&
+         good.bind(executor) && 7 == executor.exec(false).get_program_value() && 1 == executor.exec(false).get_ticks() &&
+         !invalid.bind(executor) && 7 == executor.exec(false).get_program_value();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Executor Reuse\n";
+    return ok;
+}
+
+// source assembled, optimized and disassembled again
+bool peephole_test(string const &label, string const &source, string const &expected, int value,
+                   function<bool(VM_peephole_stats const &)> check)
+{
+    VM vm;
+    VM_assembler assembler;
+    VM_peephole_stats stats;
+    bool ok = assembler.assemble(source, vm) && vm.optimize(&stats);
+    const string optimized = disassembly(vm);
+    VM_exec_status status = vm.exec();
+    ok = ok && optimized == expected && check(stats) && status.is_status_ok() && value == status.get_program_value();
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Peephole " << label << "\n";
+    if (!ok)
+    {
+        cerr << optimized;
+        stats.report(cerr);
+    }
+    return ok;
+}
+
+// The same results, errors and all, in no more ticks, optimized or not,
+// on either engine.
+bool expect_same_optimized(VM const &vm, string const &label)
+{
+    VM optimized = vm;
+    optimized.optimize();
+
+    VM_exec_status exp = vm.exec();
+    bool ok = true;
+    for (VM_exec_status act : {optimized.exec(), optimized.exec_threaded()})
+    {
+        // a budget runs out where it runs out
+        if (VM_error::MAX_RUNTIME == exp.get_error())
+        {
+            continue;
+        }
+        ok = ok && exp.get_error() == act.get_error() && exp.get_program_value() == act.get_program_value() &&
+             act.get_ticks() <= exp.get_ticks();
+    }
+
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << ", from\n" << disassembly(vm) << "to\n" << disassembly(optimized);
+    }
+    return ok;
+}
+
+void peephole_suite(Runner &runner)
+{
+    runner([]() -> bool {
+        // and what is left folds
+        return peephole_test("Dead Values", "PUSH 1\nPUSH 2\nPOP\nDUP\nPOP\nPUSH 3\nSWAP\nSWAP\nSUB\n",
+                             "    PUSH -2\n", -2, [](VM_peephole_stats const &stats) {
+                                 return 2 == stats.dead_values && 1 == stats.swaps && 1 == stats.folds &&
+                                        9 == stats.instructions_before && 1 == stats.instructions_after &&
+                                        5 == stats.bytes_after;
+                             });
+    });
+    runner([]() -> bool {
+        // (2 + 3) * 4 compared with 7, all folded; DIV by 0 is left alone
+        return peephole_test("Folds",
+                             "PUSH 2\nPUSH 3\nADD\nPUSH 4\nMUL\nPUSH 7\nCMP\nPUSH 0\nJEQ Skip\n"
+                             "PUSH 1\nPUSH 0\nDIV\nSkip:\n",
+                             "    PUSH 1\n    PUSH 0\n    JEQ Skip\n    PUSH 1\n    PUSH 0\n    DIV\nSkip:\n", 1,
+                             [](VM_peephole_stats const &stats) { return 3 == stats.folds; });
+    });
+    runner([]() -> bool {
+        // Mid: can be jumped to, so PUSH 5 and SUB stay apart from PUSH 9
+        return peephole_test("Labels Split", "PUSH 8\nPUSH 0\nJEQ Mid\nPUSH 9\nMid:\nPUSH 5\nSUB\n",
+                             "    PUSH 8\n    PUSH 0\n    JEQ Mid\n    PUSH 9\nMid:\n    PUSH 5\n    SUB\n", 3,
+                             [](VM_peephole_stats const &stats) { return 0 == stats.folds; });
+    });
+    runner([]() -> bool {
+        return peephole_test("Jumps", "PUSH 1\nJMP A\nB:\nJMP C\nA:\nJMP B\nPUSH 2\nC:\nJMP D\nD:\nDUP\nJGT E\nE:\n",
+                             "    PUSH 1\n    JMP C\nB:\n    JMP C\nA:\n    JMP C\n    PUSH 2\nC:\nD:\nE:\n",
+                             1, [](VM_peephole_stats const &stats) {
+                                 // DUP; JGT E becomes DUP; POP, then goes
+                                 return 3 == stats.threaded && 2 == stats.fallthroughs && 1 == stats.dead_values;
+                             });
+    });
+    runner([]() -> bool {
+        // without verifying nothing that might fail is dropped
+        return peephole_test("Unverified", "PUSH 1\nDUP\nJGT A\nPOP\nPOP\nA:\nPUSH 2\nPOP\nJMP B\nB:\n",
+                             "    PUSH 1\n    DUP\n    JGT A\n    POP\n    POP\nA:\n    PUSH 2\n    POP\nB:\n", 1,
+                             [](VM_peephole_stats const &stats) {
+                                 return 0 == stats.dead_values && 1 == stats.fallthroughs;
+                             });
+    });
+    runner([]() -> bool {
+        // a jump round in a loop is left to run out of ticks
+        VM vm;
+        VM_assembler assembler;
+        bool ok = assembler.assemble("PUSH 1\nA:\nJMP B\nB:\nJMP A\n", vm) && vm.optimize() &&
+                  VM_error::MAX_RUNTIME == vm.exec().get_error();
+        cerr << (ok ? "[PASS] " : "[FAIL] ") << "Peephole Loop\n";
+        return ok;
+    });
+    runner([]() -> bool {
+        bool ok = true;
+        for (int arg : {-1, 0, 1, 5, 10})
+        {
+            VM factorial;
+            factorial_program(factorial, arg);
+            VM fibonacci;
+            fibonacci_program(fibonacci, arg);
+            ok = ok && expect_same_optimized(factorial, "Peephole Factorial") &&
+                 expect_same_optimized(fibonacci, "Peephole Fibonacci");
+        }
+        cerr << (ok ? "[PASS] " : "[FAIL] ") << "Peephole Kernels\n";
+        return ok;
+    });
+    runner([]() -> bool {
+        // labels and a jump still waiting for one move with the code
+        VM vm;
+        VM_assembler assembler;
+        bool ok = assembler.assemble("PUSH 4\nPUSH 1\nPOP\nJMP Done\nTop:\nPUSH 1\nSUB\nDUP\nJGT Top\n", vm) &&
+                  vm.optimize() && assembler.assemble("JMP End\nDone:\nJMP Top\nEnd:\n", vm);
+        ok = ok && 0 == vm.exec().get_program_value();
+
+        const char *path = "yellowdog_peephole.k9i";
+        VM loaded;
+        ok = ok && vm.optimize() && vm.save(path) && loaded.load(path) && 0 == loaded.exec().get_program_value() &&
+             loaded.optimize() && disassembly(loaded) == disassembly(vm);
+        remove(path);
+        cerr << (ok ? "[PASS] " : "[FAIL] ") << "Peephole Relocates Labels\n";
+        return ok;
+    });
+    runner([]() -> bool {
+        // Random programs with jumps forward, errors and all.  Every kind
+        // of instruction turns up, pushes of a few values most often, and
+        // only what is jumped to is labelled.  Most start deep enough to
+        // verify.
+        mt19937 random(99);
+        const int values[] = {0, 1, -1, 2, 3};
+        for (int i = 0; i < 2000; ++i)
+        {
+            VM vm;
+            for (int j = random() % 8; j > 0; --j)
+            {
+                vm.push(values[random() % 5]);
+            }
+            const int length = random() % 30;
+            vector<bool> wanted(length + 5, false);
+            for (int j = 0; j < length; ++j)
+            {
+                const int to = j + 1 + random() % 4;
+                const string ahead = "L" + to_string(to);
+                switch (random() % 16)
+                {
+                case 0: vm.pop(); break;
+                case 1: vm.dup(); break;
+                case 2: vm.swap(); break;
+                case 3: vm.add(); break;
+                case 4: vm.sub(); break;
+                case 5: vm.mul(); break;
+                case 6: vm.div(); break;
+                case 7: vm.cmp(); break;
+                case 8: vm.dupn(1 + random() % 2); break;
+                case 9: vm.jmp(ahead); wanted[to] = true; break;
+                case 10: vm.jgt(ahead); wanted[to] = true; break;
+                case 11: vm.jeq(ahead); wanted[to] = true; break;
+                default: vm.push(values[random() % 5]); break;
+                }
+                if (wanted[j + 1])
+                {
+                    vm.label("L" + to_string(j + 1));
+                }
+            }
+            for (int j = length + 1; j <= length + 4; ++j)
+            {
+                if (wanted[j])
+                {
+                    vm.label("L" + to_string(j));
+                }
+            }
+
+            if (!expect_same_optimized(vm, "Peephole Random"))
+            {
+                return false;
+            }
+        }
+        cerr << "[PASS] Peephole Random\n";
+        return true;
+    });
+}
+
+// A program read from its image into the IR, optimized and written back
+// as an image, which must verify and give the same result.
+bool expect_ir_round_trip(VM const &vm, string const &label, VM_exec_status *result = nullptr)
+{
+    const char *path = "yellowdog_ir.k9i";
+    VM_ir ir;
+    VM_ir_builder builder;
+    VM_ir_lowering lowering;
+    VM loaded;
+    bool ok = vm.save(path) && builder.build(path, ir);
+    VM_ir_optimizer().optimize(ir);
+    ok = ok && lowering.write(ir, VM_image_machine::YELLOWDOG, path) && loaded.load(path) && loaded.verify();
+    remove(path);
+
+    VM_exec_status exp = vm.exec();
+    VM_exec_status act = loaded.exec();
+    ok = ok && exp.get_error() == act.get_error() &&
+         (VM_error::OK != exp.get_error() || exp.get_program_value() == act.get_program_value());
+    if (nullptr != result)
+    {
+        *result = act;
+    }
+
+    if (!ok)
+    {
+        cerr << "[FAIL] " << label << " " << builder.error() << lowering.error() << ", from\n" << disassembly(vm)
+             << "to\n" << disassembly(loaded);
+    }
+    return ok;
+}
+
+// The loops keep their values on the stack in the order they were
+// entered with, and the constant arguments fold away the tests on them.
+bool ir_kernels()
+{
+    bool ok = true;
+    for (int arg = -1; arg <= 10; ++arg)
+    {
+        for (auto build : {&factorial_program, &fibonacci_program})
+        {
+            VM vm;
+            build(vm, arg);
+            VM_exec_status act(0);
+            ok = expect_ir_round_trip(vm, "IR Kernel " + to_string(arg), &act) &&
+                 act.get_ticks() <= vm.exec().get_ticks() && ok;
+        }
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Kernels\n";
+    return ok;
+}
+
+bool ir_random()
+{
+    // as for Peephole Random, with only the programs the IR can hold:
+    // those that verify and reach each instruction with one stack depth
+    mt19937 random(25);
+    const int values[] = {0, 1, -1, 2, 3};
+    int tried = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        VM vm;
+        for (int j = 1 + random() % 8; j > 0; --j)
+        {
+            vm.push(values[random() % 5]);
+        }
+        const int length = random() % 30;
+        vector<bool> wanted(length + 5, false);
+        for (int j = 0; j < length; ++j)
+        {
+            const int to = j + 1 + random() % 4;
+            const string ahead = "L" + to_string(to);
+            switch (random() % 15)
+            {
+            case 0: vm.pop(); break;
+            case 1: vm.dup(); break;
+            case 2: vm.swap(); break;
+            case 3: vm.add(); break;
+            case 4: vm.sub(); break;
+            case 5: vm.mul(); break;
+            case 6: vm.div(); break;
+            case 7: vm.cmp(); break;
+            case 8: vm.dupn(1 + random() % 2); break;
+            case 9: vm.dropn(1 + random() % 2); break;
+            case 10: vm.jgt(ahead); wanted[to] = true; break;
+            case 11: vm.jeq(ahead); wanted[to] = true; break;
+            default: vm.push(values[random() % 5]); break;
+            }
+            if (wanted[j + 1])
+            {
+                vm.label("L" + to_string(j + 1));
+            }
+        }
+        for (int j = length + 1; j <= length + 4; ++j)
+        {
+            if (wanted[j])
+            {
+                vm.label("L" + to_string(j));
+            }
+        }
+
+        VM_ir ir;
+        const bool held = vm.verify() && vm.save("yellowdog_ir.k9i") && VM_ir_builder().build("yellowdog_ir.k9i", ir);
+        remove("yellowdog_ir.k9i");
+        if (!held)
+        {
+            continue;
+        }
+        ++tried;
+        if (!expect_ir_round_trip(vm, "IR Random " + to_string(i)))
+        {
+            return false;
+        }
+    }
+
+    const bool ok = tried > 200;
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "IR Random\n";
+    return ok;
+}
+
+void ir_suite(Runner &runner)
+{
+    runner(ir_kernels);
+    runner(ir_random);
+}
+
+// The const methods on one machine, from several threads at once and
+// first of all after the program changed.
+bool shared_exec()
+{
+    VM vm;
+    factorial_program(vm, 6);
+    bool ok = true;
+    for (int round = 0; round < 20; ++round)
+    {
+        vector<int> results(4, 0);
+        vector<thread> threads;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            threads.emplace_back([&vm, &results, i]() {
+                VM_exec_status status = i % 2 ? vm.exec_threaded() : vm.exec();
+                results[i] = vm.verify() ? status.get_program_value() : 0;
+            });
+        }
+        for (thread &t : threads)
+        {
+            t.join();
+        }
+        for (int result : results)
+        {
+            ok = 720 == result && ok;
+        }
+        vm.label("END" + to_string(round));
+    }
+
+    cerr << (ok ? "[PASS] " : "[FAIL] ") << "Shared Exec\n";
+    return ok;
+}
+
 int main(void)
 {
     Runner runner;
@@ -625,6 +1874,8 @@ int main(void)
     runner(xswap);
 
     runner(duplicate_label);
+    runner(forward_and_backward_labels);
+    runner(many_labels);
 
     jmp_suite(runner, &VM::jmp, "JMP", true, true, true, false);
     jmp_suite(runner, &VM::jeq, "JEQ", false, true, false, true);
@@ -637,5 +1888,28 @@ int main(void)
     factorial_suite(runner);
     fibonacci_suite(runner);
 
+    error_code_suite(runner);
+    verify_suite(runner);
+    threaded_suite(runner);
+
+    runner([]() -> bool { return budget_test(false); });
+    runner([]() -> bool { return budget_test(true); });
+    runner(shared_exec);
+
+    image_suite(runner);
+    assembler_suite(runner);
+
+    runner(profile_factorial);
+    runner(profile_error);
+
+    runner(trace_matches_verbose);
+    runner(trace_keeps_last);
+    runner(trace_error);
+
+    runner(executor_reuse);
+
+    peephole_suite(runner);
+    ir_suite(runner);
+
     return runner.report();
 }